@@ -675,6 +675,95 @@ QVariantMap CancelOrder::extraQueryParams()
 void CancelOrder::showSuccess() const
 {
 
+}
+
+TradeBatch& TradeBatch::add(BtcObjects::Order::Type type, double rate, double amount)
+{
+    Order order;
+    order.type = type;
+    order.rate = rate;
+    order.amount = amount;
+    order.received = 0;
+    order.remains = 0;
+    order.order_id = 0;
+    orders.append(order);
+    return *this;
+}
+
+QString TradeBatch::methodName() const
+{
+    return "TradeBatch";
+}
+
+bool TradeBatch::parseSuccess(const QVariantMap& returnMap)
+{
+    QVariantList created = read_list(returnMap, "orders");
+    if (created.size() != orders.size())
+        throw BadFieldValue("orders", created.size());
+    for (int i = 0; i < orders.size(); i++)
+    {
+        QVariantMap item = created[i].toMap();
+        orders[i].received = read_double(item, "received");
+        orders[i].remains = read_double(item, "remains");
+        orders[i].order_id = read_ulong(item, "order_id");
+    }
+    funds.parse(read_map(returnMap, "funds"));
+    return true;
+}
+
+QVariantMap TradeBatch::extraQueryParams()
+{
+    QVariantMap params = Api::extraQueryParams();
+    QStringList items;
+    for (const Order& order: orders)
+        items << QString("%1:%2:%3")
+                 .arg((order.type==BtcObjects::Order::Type::Sell)?"sell":"buy")
+                 .arg(QString::number(order.rate, 'f', BtcObjects::Pairs::ref(pair).decimal_places))
+                 .arg(QString::number(order.amount, 'f', 8));
+    params["pair"] = pair;
+    params["orders"] = items.join(',');
+    return params;
+}
+
+void TradeBatch::showSuccess() const
+{
+
+}
+
+QString CancelOrderBatch::methodName() const
+{
+    return "CancelOrderBatch";
+}
+
+bool CancelOrderBatch::parseSuccess(const QVariantMap& returnMap)
+{
+    cancelled.clear();
+    for (const QVariant& id: read_list(returnMap, "cancelled"))
+        cancelled.append(id.toULongLong());
+
+    errors.clear();
+    QVariantMap errorsMap = read_map(returnMap, "errors");
+    for (const QString& sId: errorsMap.keys())
+        if (sId != key_field)
+            errors[sId.toULongLong()] = errorsMap[sId].toString();
+
+    funds.parse(read_map(returnMap, "funds"));
+    return true;
+}
+
+QVariantMap CancelOrderBatch::extraQueryParams()
+{
+    QVariantMap params = Api::extraQueryParams();
+    QStringList ids;
+    for (BtcObjects::Order::Id order_id: order_ids)
+        ids << QString::number(order_id);
+    params["order_ids"] = ids.join(',');
+    return params;
+}
+
+void CancelOrderBatch::showSuccess() const
+{
+
 }
 }
 
@@ -341,6 +341,60 @@ protected:
     virtual void showSuccess() const override;
 };
 
+/// emulator only: orders of one pair placed in one request, all of them
+/// or none if one is rejected
+class TradeBatch : public Api
+{
+public:
+    struct Order
+    {
+        BtcObjects::Order::Type type;
+        double rate;
+        double amount;
+        double received;
+        double remains;
+        BtcObjects::Order::Id order_id;
+    };
+
+private:
+    QString pair;
+protected:
+    virtual QString methodName() const override;
+    virtual bool parseSuccess(const QVariantMap& returnMap) override;
+    virtual QVariantMap extraQueryParams() override;
+    virtual void showSuccess() const override;
+
+public:
+    QList<Order> orders;
+    BtcObjects::Funds& funds;
+
+    TradeBatch(IKeyStorage& storage, BtcObjects::Funds& funds, const QString& pair)
+        :Api(storage), pair(pair), funds(funds)
+    {}
+    TradeBatch& add(BtcObjects::Order::Type type, double rate, double amount);
+};
+
+/// emulator only: orders cancelled in one request, ones which cannot be
+/// cancelled are listed in errors
+class CancelOrderBatch : public Api
+{
+    QList<BtcObjects::Order::Id> order_ids;
+
+public:
+    CancelOrderBatch(IKeyStorage& storage, BtcObjects::Funds& funds, const QList<BtcObjects::Order::Id>& order_ids)
+        :Api(storage), order_ids(order_ids), funds(funds)
+    {}
+
+    BtcObjects::Funds& funds;
+    QList<BtcObjects::Order::Id> cancelled;
+    QMap<BtcObjects::Order::Id, QString> errors;
+protected:
+    virtual QString methodName() const override;
+    virtual bool parseSuccess(const QVariantMap& returnMap) override;
+    virtual QVariantMap extraQueryParams() override;
+    virtual void showSuccess() const override;
+};
+
 class ActiveOrders : public Api
 {
     virtual bool parseSuccess(const QVariantMap& returnMap) override;
@@ -50,6 +50,13 @@ bool prepareSql(QSqlQuery& query, const QString& sql)
     return true;
 }
 
+static thread_local quint64 sqlNsecs = 0;
+
+quint64 sqlTimeSpent()
+{
+    return sqlNsecs;
+}
+
 bool performSql(const QString& message, QSqlQuery& query, const QString& sql, bool silent)
 {
     QElapsedTimer executeTimer;
@@ -62,7 +69,9 @@ bool performSql(const QString& message, QSqlQuery& query, const QString& sql, bo
         ok = query.exec();
     else
         ok = query.exec(sql);
-    elapsed = executeTimer.elapsed();
+    quint64 nsecs = static_cast<quint64>(executeTimer.nsecsElapsed());
+    sqlNsecs += nsecs;
+    elapsed = nsecs / 1000000;
     if (!silent)
         std::clog << query.lastQuery() << std::endl;
     if (ok)
@@ -47,6 +47,8 @@ class QSqlQuery;
 bool performSql(QString message, QSqlQuery& query, const QVariantMap& binds = QVariantMap(), bool silent=false);
 bool performSql(const QString& message, QSqlQuery& query, const QString& sql, bool silent=false);
 bool prepareSql(QSqlQuery& query, const QString& sql);
+/// nanoseconds spent by calling thread in performSql
+quint64 sqlTimeSpent();
 
 
 #endif // UTILS_H
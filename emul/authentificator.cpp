@@ -1,4 +1,5 @@
 #include "authentificator.h"
+#include "changestream.h"
 #include "sql_database.h"
 #include "utils.h"
 
@@ -108,9 +109,17 @@ quint32 Authentificator::nonceOnKey(const QString& key)
 
 bool Authentificator::checkNonce(const QString& key, quint32 nonce)
 {
+    // replica rejects nonces streamed from primary without asking the
+    // database, a nonce it accepts is persisted to the shared database by
+    // updateNonce() so a replayed key is rejected on primary too
+    if (ChangeStream::isReplica() && nonce <= ChangeStream::nonce(key))
+        return false;
     if (nonce <= nonceOnKey(key))
         return false;
-    return updateNonce(key, nonce);
+    if (!updateNonce(key, nonce))
+        return false;
+    ChangeStream::recordNonce(key, nonce);
+    return true;
 }
 
 QByteArray Authentificator::getSecret(const QString& key)
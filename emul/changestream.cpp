@@ -0,0 +1,373 @@
+#include "changestream.h"
+#include "tickerquotes.h"
+
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QThread>
+#include <QWaitCondition>
+#include <QtEndian>
+
+#include <iostream>
+
+ChangeStream* ChangeStream::instance = nullptr;
+QList<ChangeStream::Record> ChangeStream::queue;
+QMutex ChangeStream::queueAccess;
+quint64 ChangeStream::sequence = 0;
+QHash<ApiKey, quint32> ChangeStream::nonces;
+QMutex ChangeStream::noncesAccess;
+QMutex ChangeStream::snapshotAccess;
+bool ChangeStream::snapshotApplied = false;
+
+static QWaitCondition snapshotReady;
+
+ChangeStream::ChangeStream(const QString& address, quint16 port, bool replica)
+    :address(address), port(port), replica(replica), server(nullptr), primary(nullptr), reconnectTimer(this)
+{
+}
+
+void ChangeStream::startPrimary(const QString& address, quint16 port)
+{
+    QThread* thread = new QThread;
+    instance = new ChangeStream(address, port, false);
+    instance->moveToThread(thread);
+    connect(thread, &QThread::started, instance, &ChangeStream::listen);
+    thread->start();
+
+    OrderBook::addListener(&ChangeStream::recordBook);
+}
+
+void ChangeStream::startReplica(const QString& host, quint16 port)
+{
+    QThread* thread = new QThread;
+    instance = new ChangeStream(host, port, true);
+    instance->moveToThread(thread);
+    connect(thread, &QThread::started, instance, &ChangeStream::listen);
+    thread->start();
+}
+
+bool ChangeStream::isReplica()
+{
+    return instance && instance->replica;
+}
+
+void ChangeStream::waitForSnapshot()
+{
+    QMutexLocker lock(&snapshotAccess);
+    while (!snapshotApplied)
+        snapshotReady.wait(&snapshotAccess);
+}
+
+void ChangeStream::record(RecordType type, const QByteArray& data)
+{
+    bool wasEmpty;
+    {
+        QMutexLocker lock(&queueAccess);
+        wasEmpty = queue.isEmpty();
+        queue.append(Record{++sequence, type, data});
+    }
+    if (wasEmpty)
+        QMetaObject::invokeMethod(instance, "flush", Qt::QueuedConnection);
+}
+
+void ChangeStream::recordCommit(const UserIndex::Batch& batch)
+{
+    if (!instance || instance->replica || batch.isEmpty())
+        return;
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    batch.write(stream);
+    record(RecordType::Commit, data);
+}
+
+void ChangeStream::recordUserLoaded(UserId user_id)
+{
+    if (!instance || instance->replica)
+        return;
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    if (UserIndex::saveUser(stream, user_id))
+        record(RecordType::UserLoaded, data);
+}
+
+void ChangeStream::recordBook(const PairName& pair, const OrderBook::Updates& updates)
+{
+    if (!instance || instance->replica)
+        return;
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << pair;
+    OrderBook::writeUpdates(stream, updates);
+    record(RecordType::Book, data);
+}
+
+void ChangeStream::recordTrades(const PairName& pair, const QList<RecentTrades::Trade>& trades)
+{
+    if (!instance || instance->replica || trades.isEmpty())
+        return;
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << pair << static_cast<quint32>(trades.size());
+    for (const RecentTrades::Trade& trade: trades)
+        RecentTrades::writeTrade(stream, trade);
+    record(RecordType::Trades, data);
+}
+
+void ChangeStream::recordQuote(const PairName& pair, OrderInfo::Type type, const Rate& rate, const QDateTime& updated)
+{
+    if (!instance || instance->replica)
+        return;
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << pair << static_cast<quint8>(type) << rate << updated;
+    record(RecordType::Quote, data);
+}
+
+void ChangeStream::recordNonce(const ApiKey& key, quint32 nonce)
+{
+    if (!instance)
+        return;
+    {
+        QMutexLocker lock(&noncesAccess);
+        quint32& last = nonces[key];
+        last = qMax(last, nonce);
+    }
+    if (instance->replica)
+        return;
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << key << nonce;
+    record(RecordType::Nonce, data);
+}
+
+quint32 ChangeStream::nonce(const ApiKey& key)
+{
+    QMutexLocker lock(&noncesAccess);
+    return nonces.value(key, 0);
+}
+
+void ChangeStream::sendFrame(QTcpSocket* socket, quint64 sequence, RecordType type, const QByteArray& data)
+{
+    QByteArray payload;
+    {
+        QDataStream stream(&payload, QIODevice::WriteOnly);
+        stream << sequence << static_cast<quint8>(type);
+    }
+    payload.append(data);
+    QByteArray size(sizeof(quint32), 0);
+    qToBigEndian<quint32>(static_cast<quint32>(payload.size()), reinterpret_cast<uchar*>(size.data()));
+    socket->write(size);
+    socket->write(payload);
+}
+
+void ChangeStream::listen()
+{
+    if (replica)
+    {
+        primary = new QTcpSocket(this);
+        connect(primary, &QTcpSocket::readyRead, this, &ChangeStream::onReadyRead);
+        connect(primary, &QTcpSocket::stateChanged, [this](QAbstractSocket::SocketState state)
+        {
+            if (state == QAbstractSocket::UnconnectedState && !reconnectTimer.isActive())
+                reconnectTimer.start();
+        });
+        reconnectTimer.setSingleShot(true);
+        reconnectTimer.setInterval(1000);
+        connect(&reconnectTimer, &QTimer::timeout, this, &ChangeStream::connectToPrimary);
+        connectToPrimary();
+        return;
+    }
+
+    server = new QTcpServer(this);
+    connect(server, &QTcpServer::newConnection, this, &ChangeStream::onNewConnection);
+    if (!server->listen(QHostAddress(address), port))
+        std::cerr << "[changes] fail to listen on " << address.toStdString() << ':' << port << ": "
+                  << server->errorString().toStdString() << std::endl;
+    else
+        std::clog << "[changes] listening on " << address.toStdString() << ':' << port << std::endl;
+}
+
+QByteArray ChangeStream::snapshot(quint64& snapshotSequence)
+{
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+
+    // no commit is applied meanwhile, so records up to the sequence are in
+    // the snapshot and later ones are not
+    QWriteLocker lock(&UserIndex::commitLock());
+    {
+        QMutexLocker queueLock(&queueAccess);
+        snapshotSequence = sequence;
+    }
+    UserIndex::save(stream);
+    RecentTrades::save(stream);
+    OrderBook::save(stream);
+    TickerQuotes::save(stream);
+    QMutexLocker noncesLock(&noncesAccess);
+    stream << nonces;
+    return data;
+}
+
+void ChangeStream::onNewConnection()
+{
+    while (server->hasPendingConnections())
+    {
+        QTcpSocket* socket = server->nextPendingConnection();
+        connect(socket, &QTcpSocket::disconnected, this, &ChangeStream::onDisconnected);
+
+        Follower follower;
+        follower.socket = socket;
+        QByteArray data = snapshot(follower.snapshotSequence);
+        sendFrame(socket, follower.snapshotSequence, RecordType::Snapshot, data);
+        followers.append(follower);
+        std::clog << "[changes] replica " << socket->peerAddress().toString().toStdString()
+                  << " follows from " << follower.snapshotSequence << std::endl;
+    }
+}
+
+void ChangeStream::onDisconnected()
+{
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(sender());
+    if (!socket)
+        return;
+    for (auto follower = followers.begin(); follower != followers.end();)
+    {
+        if (follower->socket == socket)
+            follower = followers.erase(follower);
+        else
+            follower++;
+    }
+    socket->deleteLater();
+}
+
+void ChangeStream::flush()
+{
+    QList<Record> records;
+    {
+        QMutexLocker lock(&queueAccess);
+        records.swap(queue);
+    }
+    for (const Record& record: records)
+        for (const Follower& follower: followers)
+            if (record.sequence > follower.snapshotSequence)
+                sendFrame(follower.socket, record.sequence, record.type, record.data);
+}
+
+void ChangeStream::connectToPrimary()
+{
+    buffer.clear();
+    primary->connectToHost(address, port);
+}
+
+void ChangeStream::onReadyRead()
+{
+    buffer += primary->readAll();
+    while (buffer.size() >= static_cast<int>(sizeof(quint32)))
+    {
+        quint32 size = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(buffer.constData()));
+        if (static_cast<quint32>(buffer.size()) < sizeof(quint32) + size)
+            break;
+        QByteArray payload = buffer.mid(sizeof(quint32), static_cast<int>(size));
+        buffer.remove(0, static_cast<int>(sizeof(quint32) + size));
+
+        QDataStream stream(payload);
+        quint64 recordSequence;
+        quint8 type;
+        stream >> recordSequence >> type;
+        if (static_cast<RecordType>(type) == RecordType::Snapshot)
+            applySnapshot(stream);
+        else if (recordSequence != sequence + 1)
+        {
+            // stream is ordered, a gap means the connection is broken
+            std::cerr << "[changes] expected record " << sequence + 1 << ", got " << recordSequence << ", resync" << std::endl;
+            primary->abort();
+            return;
+        }
+        else
+            applyRecord(static_cast<RecordType>(type), stream);
+        sequence = recordSequence;
+    }
+}
+
+void ChangeStream::applySnapshot(QDataStream& stream)
+{
+    UserIndex::restore(stream);
+    RecentTrades::restore(stream);
+    OrderBook::restore(stream);
+    TickerQuotes::restore(stream);
+    {
+        QMutexLocker lock(&noncesAccess);
+        stream >> nonces;
+    }
+    if (stream.status() != QDataStream::Ok)
+        std::cerr << "[changes] broken snapshot" << std::endl;
+
+    QMutexLocker lock(&snapshotAccess);
+    snapshotApplied = true;
+    snapshotReady.wakeAll();
+}
+
+void ChangeStream::applyRecord(RecordType type, QDataStream& stream)
+{
+    switch (type)
+    {
+        case RecordType::Commit:
+        {
+            UserIndex::Batch batch;
+            batch.read(stream);
+            UserIndex::apply(batch);
+            break;
+        }
+        case RecordType::UserLoaded:
+            UserIndex::restoreUser(stream);
+            break;
+        case RecordType::Book:
+        {
+            PairName pair;
+            OrderBook::Updates updates;
+            stream >> pair;
+            OrderBook::readUpdates(stream, updates);
+            OrderBook::applyUpdates(pair, updates);
+            break;
+        }
+        case RecordType::Trades:
+        {
+            PairName pair;
+            quint32 count;
+            QList<RecentTrades::Trade> trades;
+            stream >> pair >> count;
+            for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++)
+            {
+                RecentTrades::Trade trade;
+                RecentTrades::readTrade(stream, trade);
+                trades.append(trade);
+            }
+            RecentTrades::add(pair, trades);
+            break;
+        }
+        case RecordType::Quote:
+        {
+            PairName pair;
+            quint8 orderType;
+            Rate rate;
+            QDateTime updated;
+            stream >> pair >> orderType >> rate >> updated;
+            // quote may be recorded before snapshot and sent after it
+            TickerQuotes::Quote current;
+            if (!TickerQuotes::quote(pair, current) || current.updated <= updated)
+                TickerQuotes::publish(pair, static_cast<OrderInfo::Type>(orderType), rate, updated);
+            break;
+        }
+        case RecordType::Nonce:
+        {
+            ApiKey key;
+            quint32 nonce;
+            stream >> key >> nonce;
+            QMutexLocker lock(&noncesAccess);
+            quint32& last = nonces[key];
+            last = qMax(last, nonce);
+            break;
+        }
+        case RecordType::Snapshot:
+            break;
+    }
+}
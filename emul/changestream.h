@@ -0,0 +1,113 @@
+#ifndef CHANGESTREAM_H
+#define CHANGESTREAM_H
+
+#include "orderbook.h"
+#include "recenttrades.h"
+#include "types.h"
+#include "userindex.h"
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QTimer>
+
+class QTcpServer;
+class QTcpSocket;
+
+/// Ordered stream of engine changes from primary emulator to read-only
+/// replicas: user index batches (balance deltas, order created, reduced and
+/// closed), loaded users, order book updates, trades, ticker quotes and
+/// nonces. Every record gets a sequence number at the moment it is produced.
+///
+/// A replica connects over TCP and gets a snapshot of the whole in-memory
+/// state first, taken under UserIndex commit lock, and then records newer
+/// than the snapshot. Book updates carry book versions and quotes their
+/// time, so the few records produced outside of that lock are applied only
+/// if they are newer than the snapshot.
+///
+/// Every frame is quint32 size followed by QDataStream payload.
+/// Runs in its own thread with event loop, as MarketFeed does.
+class ChangeStream : public QObject
+{
+    Q_OBJECT
+public:
+    /// primary: serve replicas on address:port
+    static void startPrimary(const QString& address, quint16 port);
+    /// replica: follow primary at host:port, reconnects if connection is lost
+    static void startReplica(const QString& host, quint16 port);
+    static bool isReplica();
+    /// blocks till replica has applied first snapshot
+    static void waitForSnapshot();
+
+    /// record* should be called where the change is applied to in-memory
+    /// state, commits and trades under UserIndex commit lock
+    static void recordCommit(const UserIndex::Batch& batch);
+    static void recordUserLoaded(UserId user_id);
+    static void recordTrades(const PairName& pair, const QList<RecentTrades::Trade>& trades);
+    static void recordQuote(const PairName& pair, OrderInfo::Type type, const Rate& rate, const QDateTime& updated);
+    static void recordNonce(const ApiKey& key, quint32 nonce);
+
+    /// last nonce on key seen by replica, 0 if unknown
+    static quint32 nonce(const ApiKey& key);
+
+private slots:
+    void listen();
+    void onNewConnection();
+    void onDisconnected();
+    void connectToPrimary();
+    void onReadyRead();
+    void flush();
+
+private:
+    enum class RecordType : quint8 {Snapshot = 0, Commit, UserLoaded, Book, Trades, Quote, Nonce};
+
+    ChangeStream(const QString& address, quint16 port, bool replica);
+
+    static void recordBook(const PairName& pair, const OrderBook::Updates& updates);
+    static void record(RecordType type, const QByteArray& data);
+    static void sendFrame(QTcpSocket* socket, quint64 sequence, RecordType type, const QByteArray& data);
+
+    QByteArray snapshot(quint64& sequence);
+    void applySnapshot(QDataStream& stream);
+    void applyRecord(RecordType type, QDataStream& stream);
+
+    struct Record
+    {
+        quint64 sequence;
+        RecordType type;
+        QByteArray data;
+    };
+
+    struct Follower
+    {
+        QTcpSocket* socket;
+        quint64 snapshotSequence;
+    };
+
+    QString address;
+    quint16 port;
+    bool replica;
+
+    // primary
+    QTcpServer* server;
+    QList<Follower> followers;
+
+    // replica
+    QTcpSocket* primary;
+    QByteArray buffer;
+    QTimer reconnectTimer;
+
+    static ChangeStream* instance;
+    static QList<Record> queue;
+    static QMutex queueAccess;
+    static quint64 sequence;
+
+    static QHash<ApiKey, quint32> nonces;
+    static QMutex noncesAccess;
+    static QMutex snapshotAccess;
+    static bool snapshotApplied;
+};
+
+#endif // CHANGESTREAM_H
@@ -1,6 +1,22 @@
 #include "btce.h"
+#include "changestream.h"
+#include "engineclock.h"
+#include "enginestate.h"
 #include "fcgi_request.h"
+#include "idallocator.h"
+#include "inmemorydataaccessor.h"
+#include "invariantmonitor.h"
+#include "lmdbdataaccessor.h"
+#include "marketfeed.h"
+#include "metrics.h"
+#include "orderarchiver.h"
+#include "loadbots.h"
 #include "query_parser.h"
+#include "ratelimiter.h"
+#include "registry.h"
+#include "requestcapture.h"
+#include "responsecache.h"
+#include "shardconfig.h"
 #include "sql_database.h"
 #include "tablefield.h"
 #include "unit_tests.h"
@@ -8,7 +24,10 @@
 
 #include <iostream>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <memory>
+#include <csignal>
+#include <chrono>
 
 #include <QtConcurrent>
 #include <QCoreApplication>
@@ -88,6 +107,10 @@ void prepareDatabase(QSqlDatabase& db)
             << TableField("created", TableField::Datetime).notNull()
             << "FOREIGN KEY(pair_id) REFERENCES pairs(pair_id)"
             << "FOREIGN KEY(user_id) REFERENCES users(user_id)"
+            // hot table: matching reads book of a pair side from this index only
+            << "INDEX book (pair_id, type, status, rate, order_id)"
+            << "INDEX user_orders (user_id, status)"
+            << "INDEX finished (status, order_id)"
                ;
 
     createSqls["trades"]
@@ -98,6 +121,35 @@ void prepareDatabase(QSqlDatabase& db)
             << TableField("created", TableField::Datetime).notNull()
             << "FOREIGN KEY(order_id) REFERENCES orders(order_id)"
             << "FOREIGN KEY(user_id) REFERENCES users(user_id)"
+            << "INDEX order_trades (order_id)"
+            << "INDEX user_trades (user_id, trade_id)"
+            << "INDEX recent (created)"
+               ;
+
+    // cold tables, OrderArchiver moves finished orders and their trades here;
+    // columns go in the same order as in hot ones
+    createSqls["orders_history"]
+            << TableField("order_id").primaryKey(false)
+            << TableField("pair_id")
+            << TableField("user_id")
+            << "type enum ('sell', 'buy') not null"
+            << TableField("rate", TableField::Decimal, 14, 6).notNull()
+            << TableField("start_amount", TableField::Decimal, 14, 6).notNull()
+            << TableField("amount", TableField::Decimal, 14, 6).notNull()
+            << "status enum ('active', 'done', 'cancelled', 'part_done') not null"
+            << TableField("created", TableField::Datetime).notNull()
+            << "INDEX user_orders (user_id)"
+               ;
+
+    createSqls["trades_history"]
+            << TableField("trade_id").primaryKey(false)
+            << TableField("order_id")
+            << TableField("user_id")
+            << TableField("amount", TableField::Decimal, 14, 6).notNull()
+            << TableField("created", TableField::Datetime).notNull()
+            << "INDEX order_trades (order_id)"
+            << "INDEX user_trades (user_id, trade_id)"
+            << "INDEX recent (created)"
                ;
 
     createSqls["ticker"]
@@ -306,7 +358,7 @@ void buildOrdersFromDepth(const BtcObjects::Depth::Position& position, const Btc
         orderParams[":start_amount"] = usersPropotions[i];
         orderParams[":amount"] = orderParams[":start_amount"];
         orderParams[":status"] = "active";
-        orderParams[":created"] = QDateTime::currentDateTime();
+        orderParams[":created"] = EngineClock::now();
 
         performSql("insert order", ordersInsertQuery, orderParams, true);
     }
@@ -608,6 +660,14 @@ struct FcgiThreadData
 
 static pthread_mutex_t acceptAccessMutex = PTHREAD_MUTEX_INITIALIZER;
 
+static volatile sig_atomic_t stopRequested = 0;
+
+static void stopSignalHandler(int)
+{
+    stopRequested = 1;
+    FCGX_ShutdownPending();
+}
+
 QAtomicInt processed_total = 0;
 
 static void* fcgiThread(void* data)
@@ -621,41 +681,135 @@ static void* fcgiThread(void* data)
     std::unique_ptr<QSqlDatabase> db = std::make_unique<QSqlDatabase>(QSqlDatabase::cloneDatabase(*pData->pDb, dbConnectionName));
     db->open();
     std::unique_ptr<Responce> responce = std::make_unique<Responce>(*db);
+    bool capture = RequestCapture::isOpen();
 
     delete pData;
 
     while(true)
     {
+        // accept stage includes idle wait for the next request
+        QElapsedTimer acceptTimer;
+        acceptTimer.start();
         pthread_mutex_lock(&acceptAccessMutex);
         int rc = request.accept();
         pthread_mutex_unlock(&acceptAccessMutex);
 
         if (rc < 0)
             break;
+        Metrics::beginRequest();
+        Metrics::addStage(Metrics::Stage::Accept, acceptTimer.nsecsElapsed());
 
 
 //        std::clog << "[FastCGI " << threadName << "] New request accepted. Processing" << std::endl;
 
+        qint64 arrival = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        // replay tells simulated clock when the request arrived originally
+        if (EngineClock::isSimulated())
+        {
+            const char* simTime = request.rawParam("HTTP_SIM_TIME");
+            if (simTime)
+                EngineClock::advanceTo(QByteArray(simTime).toLongLong());
+        }
+        QElapsedTimer requestTimer;
+        requestTimer.start();
+
+        Metrics::StageTimer parseTimer(Metrics::Stage::Parse);
         QueryParser httpQuery(request);
+        parseTimer.stop();
+
+        // throttled before signature check or any SQL
+        const char* remoteAddr = request.rawParam("REMOTE_ADDR");
+        bool admitted = RateLimiter::admit(RateLimiter::Limit::Address, QByteArray(remoteAddr ? remoteAddr : ""))
+                && (httpQuery.apiScope() != QueryParser::Scope::Private
+                    || RateLimiter::admit(RateLimiter::Limit::Key, httpQuery.key().toUtf8()));
 
-        QString json;
         QVariantMap var;
         Method method;
         QElapsedTimer timer;
         timer.start();
-        var = responce->getResponce(httpQuery, method);
-        QJsonDocument doc = QJsonDocument::fromVariant(var);
-        json = doc.toJson().constData();
-        quint32 elapsed = timer.elapsed();
+        if (!admitted)
+        {
+            Metrics::StageTimer writeTimer(Metrics::Stage::Write);
+            request.put ( "Status: 429 Too Many Requests\r\n");
+            request.put ( "Content-type: application/json\r\n");
+            request.put ( "XXX-Emulator: true\r\n");
+            request.put ("\r\n");
+            request.put ( "{\"success\":0,\"error\":\"too many requests, try again later\"}");
+        }
+        else if (ResponseCache::isCacheable(httpQuery))
+        {
+            Metrics::StageTimer cacheTimer(Metrics::Stage::Cache);
+            QByteArray etag = ResponseCache::etag(httpQuery);
+            QByteArray key = QByteArray(request.rawParam("DOCUMENT_URI")) + '?' + request.rawParam("QUERY_STRING");
+            ResponseCache::EntryPtr entry = ResponseCache::find(key, etag);
+            cacheTimer.stop();
+            Metrics::cacheLookup(Metrics::Cache::Response, entry != nullptr);
+            if (!entry)
+            {
+                var = responce->getResponce(httpQuery, method);
+                Metrics::StageTimer serializeTimer(Metrics::Stage::Serialize);
+                entry = ResponseCache::store(key, etag, QJsonDocument::fromVariant(var).toJson());
+            }
+            quint32 elapsed = timer.elapsed();
 
-        request.put ( "Content-type: application/json\r\n");
-        request.put ( "XXX-Emulator: true\r\n");
-        request.put ( QString("XXX-Emulator-DbTime: %1\r\n").arg(elapsed));
-        request.put ("\r\n");
-        request.put ( json);
+            Metrics::StageTimer writeTimer(Metrics::Stage::Write);
+
+            request.put ( QString("XXX-Emulator-DbTime: %1\r\n").arg(elapsed));
+            request.put ( "XXX-Emulator: true\r\n");
+            request.put ( "ETag: " + etag + "\r\n");
+            request.put ( "Vary: Accept-Encoding\r\n");
+            if (ResponseCache::matches(request.rawParam("HTTP_IF_NONE_MATCH"), etag))
+            {
+                request.put ( "Status: 304 Not Modified\r\n");
+                request.put ("\r\n");
+            }
+            else
+            {
+                ResponseCache::Encoding encoding = ResponseCache::encoding(request.rawParam("HTTP_ACCEPT_ENCODING"), *entry);
+                request.put ( "Content-type: application/json\r\n");
+                if (encoding != ResponseCache::Encoding::Identity)
+                    request.put ( QString("Content-Encoding: %1\r\n").arg(ResponseCache::encodingName(encoding)));
+                request.put ("\r\n");
+                request.put ( entry->body(encoding));
+            }
+        }
+        else
+        {
+            var = responce->getResponce(httpQuery, method);
+            Metrics::StageTimer serializeTimer(Metrics::Stage::Serialize);
+            QJsonDocument doc = QJsonDocument::fromVariant(var);
+            QString json = doc.toJson().constData();
+            serializeTimer.stop();
+            quint32 elapsed = timer.elapsed();
+
+            Metrics::StageTimer writeTimer(Metrics::Stage::Write);
+
+            request.put ( "Content-type: application/json\r\n");
+            request.put ( "XXX-Emulator: true\r\n");
+            request.put ( QString("XXX-Emulator-DbTime: %1\r\n").arg(elapsed));
+            request.put ("\r\n");
+            request.put ( json);
+        }
 
         processed_total ++;
-        request.finish();
+
+        if (capture)
+        {
+            RequestCapture::Record record;
+            record.arrival = arrival;
+            record.latency = static_cast<quint32>(requestTimer.nsecsElapsed() / 1000);
+            record.documentUri = request.rawParam("DOCUMENT_URI");
+            record.queryString = request.rawParam("QUERY_STRING");
+            record.key = request.rawParam("KEY");
+            record.sign = request.rawParam("SIGN");
+            record.postData = httpQuery.signedData();
+            RequestCapture::write(record);
+        }
+        {
+            Metrics::StageTimer writeTimer(Metrics::Stage::Write);
+            request.finish();
+        }
+        Metrics::endRequest(httpQuery.methodId(), requestTimer.nsecsElapsed());
 //        std::clog << "[FastCGI " << threadName << "] Request finished" << std::endl;
     }
 
@@ -668,6 +822,95 @@ static void* fcgiThread(void* data)
     return NULL;
 }
 
+struct AuditThreadData
+{
+    QSqlDatabase* pDb;
+    QVariantMap initialBalance;
+    quint32 interval;
+};
+
+/// Full audit of exchange balance and order amounts through the data
+/// accessor. Invariants are checked online on every transaction, this is
+/// only a cross-check: it runs rarely and reads a consistent snapshot on
+/// its own connection, so live traffic waits only while it is taken.
+static void* auditThread(void* data)
+{
+    AuditThreadData* pData = static_cast<AuditThreadData*>(data);
+    QString dbConnectionName = "audit-db";
+    std::unique_ptr<QSqlDatabase> db = std::make_unique<QSqlDatabase>(QSqlDatabase::cloneDatabase(*pData->pDb, dbConnectionName));
+    db->open();
+    std::unique_ptr<Responce> responce = std::make_unique<Responce>(*db);
+    QVariantMap initialBalance = pData->initialBalance;
+    quint32 interval = pData->interval;
+    delete pData;
+
+    while (!stopRequested)
+    {
+        for (quint32 i = 0; i < interval && !stopRequested; i++)
+            sleep(1);
+        if (stopRequested)
+            break;
+
+        QVariantMap balance = responce->exchangeBalance();
+        if (balance != initialBalance)
+            InvariantMonitor::reportViolation("audit: exchange balance mismatch");
+        else
+            std::clog << "audit: balance ok" << std::endl;
+
+        OrderInfo::List lst = responce->negativeAmountOrders();
+        for (const OrderInfo::Ptr& order: lst)
+            InvariantMonitor::reportViolation(QString("audit: order %1 has negative amount").arg(order->order_id));
+    }
+
+    responce.reset();
+    db->close();
+    db.reset();
+    QSqlDatabase::removeDatabase(dbConnectionName);
+    return NULL;
+}
+
+struct ArchiverThreadData
+{
+    QSqlDatabase* pDb;
+    quint32 interval;
+    int batchSize;
+};
+
+/// Moves finished orders to history tables on its own connection; full
+/// batches go one after another, so a backlog is drained before sleeping.
+static void* archiverThread(void* data)
+{
+    ArchiverThreadData* pData = static_cast<ArchiverThreadData*>(data);
+    QString dbConnectionName = "archiver-db";
+    std::unique_ptr<QSqlDatabase> db = std::make_unique<QSqlDatabase>(QSqlDatabase::cloneDatabase(*pData->pDb, dbConnectionName));
+    db->open();
+    quint32 interval = pData->interval;
+    int batchSize = pData->batchSize;
+    delete pData;
+
+    while (!stopRequested)
+    {
+        int moved = 0;
+        try
+        {
+            moved = OrderArchiver::archiveBatch(*db, batchSize);
+        }
+        catch (const QSqlQuery& e)
+        {
+            std::cerr << "archiver: " << e.lastError().text().toStdString() << std::endl;
+        }
+        if (moved == batchSize)
+            continue;
+        for (quint32 i = 0; i < interval && !stopRequested; i++)
+            sleep(1);
+    }
+
+    db->close();
+    db.reset();
+    QSqlDatabase::removeDatabase(dbConnectionName);
+    return nullptr;
+}
+
 int main(int argc, char *argv[])
 {
     bool recreateDatabase = false;
@@ -691,11 +934,37 @@ int main(int argc, char *argv[])
     justTests = settings.value("debug/just_tests", false).toBool();
     depth_limit = settings.value("btce/depth_limit", 150).toInt();
     trades_limit = settings.value("btce/trades_limit", 150).toInt();
+    ShardConfig::load(settings);
+    EngineClock::load(settings);
+
+    // replica serves reads from state streamed by primary, it never touches
+    // schema, engine state or fees on its own
+    QString primaryHost = settings.value("replica/primary_host").toString();
+    quint16 primaryPort = settings.value("replica/primary_port", 0).toUInt();
+    bool replica = !primaryHost.isEmpty() && primaryPort;
 
     BtcPublicApi::Api::setServer("https://btc-e.com");
     BtcTradeApi::Api::setServer("https://btc-e.com");
 
+    QString stateDirectory = settings.value("state/directory").toString();
+    quint32 checkpointInterval = settings.value("state/checkpoint_interval", 300).toUInt();
+    int stateSyncInterval = settings.value("state/sync_interval", 10).toInt();
+    if (replica)
+    {
+        recreateDatabase = runTests = justTests = false;
+        stateDirectory.clear();
+    }
+
     QSqlDatabase db;
+    // suite on generated in-memory tables needs no database at all
+    if (runTests && justTests && settings.value("debug/seed_memory", false).toBool())
+    {
+        InMemoryDataAccessor::seed(settings.value("debug/seed_users", 100).toInt(), EXCHNAGE_USER_ID);
+        Responce::useDataAccessor("memory");
+        BtceEmulator_Test test(db, true);
+        int testReturnCode = QTest::qExec(&test, argc, argv);
+        return failTestExit ? testReturnCode : 0;
+    }
     connectDatabase(db, settings);
     if (recreateDatabase)
     {
@@ -704,11 +973,32 @@ int main(int argc, char *argv[])
 
         settings.setValue("debug/recreate_database", false);
         settings.sync();
+
+        if (!stateDirectory.isEmpty())
+            EngineState::discard(stateDirectory);
+    }
+
+    // state files and requests refer to interned currencies and pairs
+    Registry::load(db);
+
+    if (!stateDirectory.isEmpty())
+    {
+        QElapsedTimer restoreTimer;
+        restoreTimer.start();
+        if (EngineState::restore(stateDirectory))
+            std::clog << "engine state restored in " << restoreTimer.elapsed() << " ms" << std::endl;
+        else
+            EngineState::discard(stateDirectory);
+        EngineState::open(stateDirectory, stateSyncInterval);
+        EngineState::checkpoint();
     }
 
+    if (!replica)
+        IdAllocator::prepare(db);
+
     if (runTests)
     {
-        BtceEmulator_Test test(db);
+        BtceEmulator_Test test(db, false);
         int testReturnCode = QTest::qExec(&test, argc, argv);
 
         if (failTestExit && testReturnCode)
@@ -716,6 +1006,19 @@ int main(int argc, char *argv[])
     }
     if (justTests)
         return 0;
+    IdAllocator::setBlockSize(settings.value("ids/block_size", 1000).toUInt());
+    QString dataAccessor = settings.value("emulator/data_accessor", "memcached").toString();
+    // shards trade balances of one schema, these accessors keep them in process
+    if (ShardConfig::count() > 1 && (dataAccessor == "memory" || dataAccessor == "lmdb"))
+    {
+        std::cerr << "*** " << dataAccessor.toStdString() << " data accessor cannot be shared by shards" << std::endl;
+        return 3;
+    }
+    if (dataAccessor == "lmdb" && !LmdbDataAccessor::open(settings.value("lmdb/directory", "lmdb").toString(),
+                                                         settings.value("lmdb/map_size", Q_UINT64_C(1) << 32).toULongLong(),
+                                                         settings.value("lmdb/sync_interval", 10).toInt(), db))
+        return 3;
+    Responce::useDataAccessor(dataAccessor, db);
 
     int ret;
     int sock;
@@ -727,7 +1030,8 @@ int main(int argc, char *argv[])
     }
     std::clog << "[FastCGI] Initilization done" << std::endl;
 
-    sock = FCGX_OpenSocket(":5123", 10);
+    // shards on one host listen on different sockets
+    sock = FCGX_OpenSocket(settings.value("emulator/socket", ":5123").toString().toUtf8().constData(), 10);
     if (sock < 1)
     {
         std::cerr << "[FastCGI] Fail to open socket" << std::endl;
@@ -735,6 +1039,48 @@ int main(int argc, char *argv[])
     }
     std::clog << "[FastCGI]  Socket opened" << std::endl;
 
+    OrderBook::setMaxTicks(settings.value("orderbook/max_ticks", 65536).toInt());
+    if (replica)
+    {
+        Responce(db).useBookTicks();
+        ChangeStream::startReplica(primaryHost, primaryPort);
+        std::clog << "waiting for snapshot from " << primaryHost.toStdString() << ':' << primaryPort << std::endl;
+        ChangeStream::waitForSnapshot();
+    }
+    else
+    {
+        Responce loader(db);
+        loader.loadOrderBooks();
+        if (!stateDirectory.isEmpty())
+        {
+            // restored state may miss records of the last moments before
+            // a crash, journal is written after SQL commit
+            loader.reconcileState();
+            EngineState::checkpoint();
+        }
+        quint16 changesPort = settings.value("changes/port", 0).toUInt();
+        if (changesPort)
+        {
+            loader.loadAllUsers();
+            loader.loadRecentTrades();
+            ChangeStream::startPrimary(settings.value("changes/address", "127.0.0.1").toString(), changesPort);
+        }
+    }
+    quint16 feedPort = settings.value("feed/port", 0).toUInt();
+    if (feedPort)
+        MarketFeed::start(settings.value("feed/address", "127.0.0.1").toString(), feedPort);
+
+    RateLimiter::load(settings);
+
+    quint16 metricsPort = settings.value("metrics/port", 0).toUInt();
+    if (metricsPort)
+        Metrics::startServer(settings.value("metrics/address", "127.0.0.1").toString(), metricsPort);
+    QString metricsFileName = settings.value("metrics/json_file").toString();
+
+    QString captureFileName = settings.value("capture/file").toString();
+    if (!captureFileName.isEmpty() && RequestCapture::open(captureFileName))
+        std::clog << "capturing requests to " << captureFileName << std::endl;
+
     const quint32 THREAD_COUNT = settings.value("emulator/threads_count", 8).toUInt();
     std::vector<pthread_t> id(THREAD_COUNT);
 
@@ -748,30 +1094,66 @@ int main(int argc, char *argv[])
     }
 
 
+    signal(SIGINT, stopSignalHandler);
+    signal(SIGTERM, stopSignalHandler);
+
     Responce r(db);
     QVariantMap initialBalance = r.exchangeBalance();
+
+    // background jobs use stores closed at exit, they are joined before
+    std::vector<pthread_t> jobs;
+    if (!replica && settings.value("audit/enabled", false).toBool())
+    {
+        AuditThreadData* pData = new AuditThreadData;
+        pData->pDb = &db;
+        pData->initialBalance = initialBalance;
+        pData->interval = settings.value("audit/interval", 600).toUInt();
+        pthread_t auditId;
+        pthread_create(&auditId, nullptr, auditThread, pData);
+        jobs.push_back(auditId);
+    }
+
+    if (!replica && settings.value("archive/enabled", false).toBool())
+    {
+        ArchiverThreadData* pData = new ArchiverThreadData;
+        pData->pDb = &db;
+        pData->interval = settings.value("archive/interval", 60).toUInt();
+        pData->batchSize = qMax(settings.value("archive/batch_size", 1000).toInt(), 1);
+        pthread_t archiverId;
+        pthread_create(&archiverId, nullptr, archiverThread, pData);
+        jobs.push_back(archiverId);
+    }
+
+    if (!replica)
+        LoadBots::start(settings, db);
+
     QElapsedTimer timer;
+    QElapsedTimer checkpointTimer;
     timer.start();
-    while (true)
+    checkpointTimer.start();
+    while (!stopRequested)
     {
-        QVariantMap balance = r.exchangeBalance();
+        if (!replica)
+            r.foldExchangeFees();
 
-        if (balance != initialBalance)
+        if (!stateDirectory.isEmpty() && checkpointTimer.elapsed() >= checkpointInterval * 1000)
         {
-            std::cerr << "***** ERROR **** : balance mismatch " << std::endl;
-            throw 1;
+            EngineState::checkpoint();
+            checkpointTimer.restart();
         }
-        else
-            std::clog << "Balance ok" << std::endl;
 
-        OrderInfo::List lst = r.negativeAmountOrders();
-        if (lst.size() > 0)
+        if (InvariantMonitor::violations() > 0)
         {
-            std::cerr << "Broken database: orders with negative amount!" << std::endl;
-            throw 2;
+            std::cerr << "***** ERROR **** : " << InvariantMonitor::violations() << " invariant violations, last: "
+                      << InvariantMonitor::lastViolations().join("; ") << std::endl;
+            throw 1;
         }
 
-        r.updateTicker();
+        if (!replica)
+            r.updateTicker();
+        RequestCapture::flush();
+        if (!metricsFileName.isEmpty() && !Metrics::dumpJson(metricsFileName))
+            std::cerr << "fail to write metrics to " << metricsFileName.toStdString() << std::endl;
 
         sleep(30);
 
@@ -780,8 +1162,26 @@ int main(int argc, char *argv[])
         std::clog << "processed " << proc << " in " << elaps << " ms (" << proc / (elaps / 1000) << " rps)"<< std::endl;
     }
 
-    for (size_t i=0; i<THREAD_COUNT; i++)
-        pthread_join(id[i], nullptr);
+    // nothing may commit after the final fold nor use stores closed below:
+    // shut listening socket down to wake workers blocked in accept, then
+    // wait for them to finish their requests
+    std::clog << "shutting down, stopping workers" << std::endl;
+    shutdown(sock, SHUT_RDWR);
+    for (pthread_t thread: id)
+        pthread_join(thread, nullptr);
+    for (pthread_t thread: jobs)
+        pthread_join(thread, nullptr);
+    LoadBots::stop();
+    std::clog << "folding exchange fees" << std::endl;
+    if (!replica)
+        r.foldExchangeFees();
+    if (!stateDirectory.isEmpty())
+    {
+        EngineState::checkpoint();
+        EngineState::close();
+    }
+    RequestCapture::close();
+    LmdbDataAccessor::close();
 
     return 0;
 }
@@ -1,4 +1,4 @@
-QT += core sql testlib concurrent
+QT += core sql testlib concurrent network websockets
 QT -= gui
 
 #CONFIG += c++1z
@@ -8,9 +8,9 @@ TARGET = emul
 CONFIG += console
 CONFIG -= app_bundle
 
-LIBS += -lfcgi
+LIBS += -lfcgi -lz
 INCLUDEPATH += ../common ../database ../btce ../decimal_for_cpp/include
-LIBS += -L../lib -lcommon -ldatabase -lbtce -lmemcached
+LIBS += -L../lib -lcommon -ldatabase -lbtce -lmemcached -llmdb
 
 LIBS += -lgcov
 QMAKE_CXXFLAGS += -fprofile-arcs -ftest-coverage
@@ -25,7 +25,29 @@ SOURCES += \
     unit_tests.cpp \
     sqlclient.cpp \
     memcachedsqldataaccessor.cpp \
-    types.cpp
+    types.cpp \
+    methodtable.cpp \
+    userindex.cpp \
+    feeaccumulator.cpp \
+    tickerquotes.cpp \
+    invariantmonitor.cpp \
+    enginestate.cpp \
+    requestcapture.cpp \
+    orderbook.cpp \
+    marketfeed.cpp \
+    responsecache.cpp \
+    shardconfig.cpp \
+    recenttrades.cpp \
+    changestream.cpp \
+    metrics.cpp \
+    ratelimiter.cpp \
+    idallocator.cpp \
+    inmemorydataaccessor.cpp \
+    lmdbdataaccessor.cpp \
+    orderarchiver.cpp \
+    loadbots.cpp \
+    engineclock.cpp \
+    registry.cpp
 
 HEADERS += \
     query_parser.h \
@@ -35,7 +57,31 @@ HEADERS += \
     authentificator.h \
     sqlclient.h \
     types.h \
-    memcachedsqldataaccessor.h
+    memcachedsqldataaccessor.h \
+    methodtable.h \
+    userindex.h \
+    feeaccumulator.h \
+    tickerquotes.h \
+    invariantmonitor.h \
+    enginestate.h \
+    requestcapture.h \
+    orderbook.h \
+    marketfeed.h \
+    responsecache.h \
+    shardconfig.h \
+    recenttrades.h \
+    changestream.h \
+    metrics.h \
+    ratelimiter.h \
+    idallocator.h \
+    inmemorydataaccessor.h \
+    lmdbdataaccessor.h \
+    orderarchiver.h \
+    loadbots.h \
+    engineclock.h \
+    entitypool.h \
+    tickladder.h \
+    registry.h
 
 DEFINES += DEC_NAMESPACE=cppdec
 
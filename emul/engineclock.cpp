@@ -0,0 +1,81 @@
+#include "engineclock.h"
+
+#include <QSettings>
+
+#include <chrono>
+#include <iostream>
+
+std::atomic<bool> EngineClock::simulated {false};
+std::atomic<qint64> EngineClock::origin {0};
+double EngineClock::speed = 1;
+
+void EngineClock::load(QSettings& settings)
+{
+    QString mode = settings.value("clock/mode", "real").toString();
+    if (mode == "real")
+    {
+        useReal();
+        return;
+    }
+    if (mode != "simulated")
+        std::cerr << "unknown clock mode " << mode.toStdString() << ", simulated one is used" << std::endl;
+
+    QString startValue = settings.value("clock/start").toString();
+    QDateTime start = startValue.isEmpty() ? QDateTime::currentDateTime() : QDateTime::fromString(startValue, Qt::ISODate);
+    if (!start.isValid())
+    {
+        std::cerr << "bad clock start " << startValue.toStdString() << ", current time is used" << std::endl;
+        start = QDateTime::currentDateTime();
+    }
+    useSimulated(start, qMax(settings.value("clock/speed", 1).toDouble(), 0.0));
+    std::clog << "simulated clock starts at " << start.toString(Qt::ISODate).toStdString() << ", speed " << speed << std::endl;
+}
+
+void EngineClock::useReal()
+{
+    simulated = false;
+}
+
+void EngineClock::useSimulated(const QDateTime& start, double speed)
+{
+    EngineClock::speed = speed;
+    origin = start.toMSecsSinceEpoch() - static_cast<qint64>(steadyMSecs() * speed);
+    simulated = true;
+}
+
+bool EngineClock::isSimulated()
+{
+    return simulated;
+}
+
+QDateTime EngineClock::now()
+{
+    if (!simulated)
+        return QDateTime::currentDateTime();
+    return QDateTime::fromMSecsSinceEpoch(nowMSecs());
+}
+
+qint64 EngineClock::nowMSecs()
+{
+    if (!simulated)
+        return QDateTime::currentMSecsSinceEpoch();
+    return origin + static_cast<qint64>(steadyMSecs() * speed);
+}
+
+void EngineClock::advanceTo(qint64 msecs)
+{
+    if (!simulated)
+        return;
+    // origin is moved rather than added to, so concurrent advances settle
+    // on the latest time instead of summing up
+    qint64 current = origin;
+    qint64 running = static_cast<qint64>(steadyMSecs() * speed);
+    while (current + running < msecs && !origin.compare_exchange_weak(current, msecs - running))
+        ;
+}
+
+qint64 EngineClock::steadyMSecs()
+{
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
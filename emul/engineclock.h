@@ -0,0 +1,41 @@
+#ifndef ENGINECLOCK_H
+#define ENGINECLOCK_H
+
+#include <QDateTime>
+
+#include <atomic>
+
+class QSettings;
+
+/// Time stamping orders, trades, ticker and quotes.
+/// Real clock by default. Simulated clock starts at configured time and
+/// runs speed times faster than steady clock, speed 0 stops it between
+/// events; replayed requests carry their recorded arrival in Sim-Time
+/// header and move simulated time forward to it, so days of captured
+/// activity are processed in minutes with original stamps.
+/// Simulated time never goes back. Logs and metrics keep wall clock.
+class EngineClock
+{
+public:
+    /// [clock] mode (real or simulated), start (ISO date, now if empty),
+    /// speed; called before any order is created
+    static void load(QSettings& settings);
+    static void useReal();
+    static void useSimulated(const QDateTime& start, double speed);
+    static bool isSimulated();
+
+    static QDateTime now();
+    static qint64 nowMSecs();
+    /// moves simulated time to msecs since epoch if it is ahead, ignored by real clock
+    static void advanceTo(qint64 msecs);
+
+private:
+    static qint64 steadyMSecs();
+
+    static std::atomic<bool> simulated;
+    /// simulated msecs since epoch at zero steady time
+    static std::atomic<qint64> origin;
+    static double speed;
+};
+
+#endif // ENGINECLOCK_H
@@ -0,0 +1,404 @@
+#include "enginestate.h"
+#include "feeaccumulator.h"
+#include "tickerquotes.h"
+#include "utils.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QThread>
+#include <QTimer>
+
+#include <cstring>
+#include <iostream>
+
+#include <unistd.h>
+
+static const char snapshotMagic[8] = {'E', 'M', 'U', 'L', 'S', 'T', 'A', 'T'};
+static const quint32 snapshotVersion = 2;
+static const QDataStream::Version streamVersion = QDataStream::Qt_5_6;
+
+QString EngineState::stateDirectory;
+std::unique_ptr<QFile> EngineState::journal;
+std::atomic<bool> EngineState::journaling {false};
+std::atomic<bool> EngineState::dirty {false};
+int EngineState::syncInterval = 0;
+QThread* EngineState::syncThread = nullptr;
+Funds EngineState::foldedDeposits;
+quint64 EngineState::sequence = 0;
+QMutex EngineState::journalAccess;
+
+QString EngineState::snapshotFileName()
+{
+    return QDir(stateDirectory).filePath("state.snapshot");
+}
+
+QString EngineState::journalFileName(quint64 firstSequence)
+{
+    return QDir(stateDirectory).filePath(QString("journal.%1").arg(firstSequence, 16, 16, QChar('0')));
+}
+
+bool EngineState::restore(const QString& directory)
+{
+    stateDirectory = directory;
+
+    QFile file(snapshotFileName());
+    if (!file.open(QIODevice::ReadOnly) || file.size() < static_cast<qint64>(sizeof(SnapshotHeader)))
+        return false;
+    uchar* data = file.map(0, file.size());
+    if (!data)
+        return false;
+
+    SnapshotHeader header;
+    memcpy(&header, data, sizeof(header));
+    const char* payload = reinterpret_cast<const char*>(data + sizeof(header));
+    if (   memcmp(header.magic, snapshotMagic, sizeof(snapshotMagic)) != 0
+        || header.version != snapshotVersion
+        || header.size > static_cast<quint64>(file.size()) - sizeof(header)
+        || qChecksum(payload, static_cast<uint>(header.size)) != header.checksum)
+    {
+        std::cerr << "state snapshot " << file.fileName() << " is broken or has other version, ignored" << std::endl;
+        return false;
+    }
+
+    QByteArray raw = QByteArray::fromRawData(payload, static_cast<int>(header.size));
+    QDataStream stream(raw);
+    stream.setVersion(streamVersion);
+    UserIndex::restore(stream);
+    FeeAccumulator::restore(stream);
+    TickerQuotes::restore(stream);
+    stream >> foldedDeposits;
+    file.unmap(data);
+
+    sequence = header.sequence;
+    quint64 snapshotSequence = sequence;
+
+    QStringList journals = QDir(stateDirectory).entryList(QStringList() << "journal.*", QDir::Files, QDir::Name);
+    for (const QString& name: journals)
+        if (!replay(QDir(stateDirectory).filePath(name), snapshotSequence))
+            break;
+
+    std::clog << "state restored: snapshot at " << snapshotSequence << ", replayed "
+              << sequence - snapshotSequence << " journal records" << std::endl;
+    return true;
+}
+
+bool EngineState::replay(const QString& fileName, quint64 fromSequence)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    if (file.size() == 0)
+        return true;
+    uchar* data = file.map(0, file.size());
+    if (!data)
+        return false;
+
+    qint64 pos = 0;
+    bool ok = true;
+    while (pos < file.size())
+    {
+        RecordHeader header;
+        if (file.size() - pos < static_cast<qint64>(sizeof(header)))
+        {
+            ok = false;
+            break;
+        }
+        memcpy(&header, data + pos, sizeof(header));
+        pos += sizeof(header);
+        const char* body = reinterpret_cast<const char*>(data + pos);
+        if (   header.size == 0
+            || file.size() - pos < header.size
+            || qChecksum(body, header.size) != header.checksum)
+        {
+            ok = false;
+            break;
+        }
+        pos += header.size;
+
+        if (header.sequence <= fromSequence)
+            continue;
+
+        QByteArray raw = QByteArray::fromRawData(body + 1, header.size - 1);
+        QDataStream stream(raw);
+        stream.setVersion(streamVersion);
+        apply(static_cast<RecordType>(body[0]), stream);
+        sequence = header.sequence;
+    }
+    file.unmap(data);
+
+    if (!ok)
+        std::cerr << "journal " << fileName << " has torn record, replay stopped" << std::endl;
+    return ok;
+}
+
+void EngineState::apply(RecordType type, QDataStream& stream)
+{
+    switch (type)
+    {
+        case RecordType::Commit:
+        {
+            UserIndex::Batch batch;
+            PairName pair;
+            Funds fees;
+            batch.read(stream);
+            stream >> pair >> fees;
+            UserIndex::apply(batch);
+            FeeAccumulator::add(pair, fees);
+            break;
+        }
+        case RecordType::Fold:
+        {
+            UserIndex::Batch batch;
+            Funds folded;
+            Funds deposits;
+            batch.read(stream);
+            stream >> folded >> deposits;
+            UserIndex::apply(batch);
+            FeeAccumulator::subtract(folded);
+            for (auto deposit = deposits.constBegin(); deposit != deposits.constEnd(); deposit++)
+                foldedDeposits[deposit.key()] = deposit.value();
+            break;
+        }
+        case RecordType::Quote:
+        {
+            PairName pair;
+            quint8 orderType;
+            Rate rate;
+            QDateTime updated;
+            stream >> pair >> orderType >> rate >> updated;
+            TickerQuotes::publish(pair, static_cast<OrderInfo::Type>(orderType), rate, updated);
+            break;
+        }
+    }
+}
+
+void EngineState::discard(const QString& directory)
+{
+    QDir dir(directory);
+    dir.remove("state.snapshot");
+    for (const QString& name: dir.entryList(QStringList() << "journal.*", QDir::Files))
+        dir.remove(name);
+}
+
+bool EngineState::open(const QString& directory, int syncIntervalMsecs)
+{
+    stateDirectory = directory;
+    syncInterval = syncIntervalMsecs;
+    QDir().mkpath(directory);
+
+    {
+        QMutexLocker lock(&journalAccess);
+        if (!switchJournal())
+            return false;
+        journaling = true;
+    }
+
+    if (syncIntervalMsecs > 0)
+    {
+        syncThread = new QThread;
+        QObject* context = new QObject;
+        context->moveToThread(syncThread);
+        QObject::connect(syncThread, &QThread::started, context, [context, syncIntervalMsecs]()
+        {
+            QTimer* timer = new QTimer(context);
+            QObject::connect(timer, &QTimer::timeout, context, &EngineState::sync);
+            timer->start(syncIntervalMsecs);
+        });
+        QObject::connect(syncThread, &QThread::finished, context, &QObject::deleteLater);
+        syncThread->start();
+    }
+    return true;
+}
+
+void EngineState::close()
+{
+    journaling = false;
+    if (syncThread)
+    {
+        syncThread->quit();
+        syncThread->wait();
+        delete syncThread;
+        syncThread = nullptr;
+    }
+    QMutexLocker lock(&journalAccess);
+    syncJournal();
+    journal.reset();
+}
+
+void EngineState::sync()
+{
+    if (!dirty)
+        return;
+    // flush a duplicate handle, so appends do not wait for the disk
+    int fd = -1;
+    {
+        QMutexLocker lock(&journalAccess);
+        if (!journal)
+            return;
+        dirty = false;
+        fd = dup(journal->handle());
+    }
+    if (fd < 0)
+        return;
+    if (fdatasync(fd) != 0)
+        std::cerr << "cannot sync journal" << std::endl;
+    ::close(fd);
+}
+
+void EngineState::syncJournal()
+{
+    if (journal && fdatasync(journal->handle()) != 0)
+        std::cerr << "cannot sync journal " << journal->fileName() << std::endl;
+    dirty = false;
+}
+
+bool EngineState::switchJournal()
+{
+    syncJournal();
+    journal.reset(new QFile(journalFileName(sequence + 1)));
+    if (!journal->open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Unbuffered))
+    {
+        std::cerr << "cannot open journal " << journal->fileName() << ": " << journal->errorString() << std::endl;
+        journal.reset();
+        return false;
+    }
+    return true;
+}
+
+void EngineState::append(RecordType type, const QByteArray& payload)
+{
+    RecordHeader header;
+    header.size = static_cast<quint32>(payload.size() + 1);
+
+    QByteArray record(static_cast<int>(sizeof(header)) + payload.size() + 1, Qt::Uninitialized);
+    char* body = record.data() + sizeof(header);
+    body[0] = static_cast<char>(type);
+    memcpy(body + 1, payload.constData(), payload.size());
+    header.checksum = qChecksum(body, header.size);
+
+    QMutexLocker lock(&journalAccess);
+    if (!journal)
+        return;
+    header.sequence = ++sequence;
+    memcpy(record.data(), &header, sizeof(header));
+    // one write per record, torn tail is detected by checksum on replay
+    if (journal->write(record) != record.size())
+        std::cerr << "journal write failed: " << journal->errorString() << std::endl;
+    if (syncInterval > 0)
+        dirty = true;
+    else
+        syncJournal();
+}
+
+void EngineState::recordCommit(const UserIndex::Batch& batch, const PairName& pair, const Funds& fees)
+{
+    if (!journaling || (batch.isEmpty() && fees.isEmpty()))
+        return;
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(streamVersion);
+    batch.write(stream);
+    stream << pair << fees;
+    append(RecordType::Commit, payload);
+}
+
+void EngineState::recordFold(const UserIndex::Batch& batch, const Funds& folded, const Funds& deposits)
+{
+    // called under FeeAccumulator commit lock, as is checkpoint
+    for (auto deposit = deposits.constBegin(); deposit != deposits.constEnd(); deposit++)
+        foldedDeposits[deposit.key()] = deposit.value();
+    if (!journaling)
+        return;
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(streamVersion);
+    batch.write(stream);
+    stream << folded << deposits;
+    append(RecordType::Fold, payload);
+}
+
+Funds EngineState::exchangeDeposits()
+{
+    return foldedDeposits;
+}
+
+void EngineState::setExchangeDeposits(const Funds& deposits)
+{
+    foldedDeposits = deposits;
+}
+
+void EngineState::recordQuote(const PairName& pair, OrderInfo::Type type, const Rate& rate, const QDateTime& updated)
+{
+    if (!journaling)
+        return;
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(streamVersion);
+    stream << pair << static_cast<quint8>(type) << rate << updated;
+    append(RecordType::Quote, payload);
+}
+
+bool EngineState::checkpoint()
+{
+    if (stateDirectory.isEmpty())
+        return false;
+
+    // index is the bulk of snapshot: only its copy is taken under locks,
+    // small tables are serialized right there
+    std::shared_ptr<const UserIndex::Copy> users;
+    QByteArray rest;
+    SnapshotHeader header;
+    QString currentJournal;
+    {
+        QWriteLocker indexLock(&UserIndex::commitLock());
+        QWriteLocker feeLock(&FeeAccumulator::commitLock());
+        QMutexLocker lock(&journalAccess);
+
+        users = UserIndex::copy();
+        QDataStream stream(&rest, QIODevice::WriteOnly);
+        stream.setVersion(streamVersion);
+        FeeAccumulator::save(stream);
+        TickerQuotes::save(stream);
+        stream << foldedDeposits;
+
+        header.sequence = sequence;
+        if (journal)
+        {
+            switchJournal();
+            if (journal)
+                currentJournal = QFileInfo(journal->fileName()).fileName();
+        }
+    }
+
+    QByteArray payload;
+    {
+        QDataStream stream(&payload, QIODevice::WriteOnly);
+        stream.setVersion(streamVersion);
+        UserIndex::save(stream, *users);
+    }
+    users.reset();
+    payload.append(rest);
+
+    memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+    header.version = snapshotVersion;
+    header.size = static_cast<quint64>(payload.size());
+    header.checksum = qChecksum(payload.constData(), static_cast<uint>(payload.size()));
+
+    QSaveFile file(snapshotFileName());
+    if (   !file.open(QIODevice::WriteOnly)
+        || file.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header)
+        || file.write(payload) != payload.size()
+        || !file.commit())
+    {
+        std::cerr << "cannot write state snapshot: " << file.errorString() << std::endl;
+        return false;
+    }
+
+    // records of older journals are all in the new snapshot
+    QDir dir(stateDirectory);
+    for (const QString& name: dir.entryList(QStringList() << "journal.*", QDir::Files))
+        if (name != currentJournal)
+            dir.remove(name);
+    return true;
+}
@@ -0,0 +1,104 @@
+#ifndef ENGINESTATE_H
+#define ENGINESTATE_H
+
+#include "types.h"
+#include "userindex.h"
+
+#include <QFile>
+#include <QMutex>
+
+class QThread;
+
+#include <atomic>
+#include <memory>
+
+/// Checkpoint and journal of in-memory engine state: user index, pending
+/// exchange fees and live ticker quotes. SQL stays the store of record,
+/// this only lets a restarted emulator skip warming its caches up.
+///
+/// Directory holds a versioned snapshot file and journal files named by
+/// sequence number of their first record. Every committed change is
+/// appended to the current journal; a checkpoint writes a new snapshot and
+/// switches to a new journal file, so restore maps the snapshot and replays
+/// only records written after it.
+///
+/// A journal record is written after SQL commit, so if the process dies
+/// between the two the change is lost from restored state; restore stops at
+/// the first torn record. Restored state is therefore checked against SQL
+/// before use, see Responce::reconcileState(): snapshot and fold records
+/// carry exchange deposits after the last fold, so a fold lost from the
+/// journal is found and its fees are not folded twice.
+/// Records are flushed to disk by a timer every sync interval, or one by
+/// one with zero interval.
+class EngineState
+{
+public:
+    /// maps snapshot and replays journals from directory, false if there
+    /// was no usable snapshot
+    static bool restore(const QString& directory);
+    /// removes snapshot and journals, state of recreated database differs
+    static void discard(const QString& directory);
+
+    /// starts journaling into directory
+    static bool open(const QString& directory, int syncIntervalMsecs);
+    static void close();
+    /// flushes records written since last call to disk
+    static void sync();
+
+    /// should be called under UserIndex commit lock, and FeeAccumulator
+    /// one when fees are passed, right after the change is applied
+    static void recordCommit(const UserIndex::Batch& batch, const PairName& pair, const Funds& fees);
+    /// deposits are those of exchange user right after the fold
+    static void recordFold(const UserIndex::Batch& batch, const Funds& folded, const Funds& deposits);
+    static void recordQuote(const PairName& pair, OrderInfo::Type type, const Rate& rate, const QDateTime& updated);
+
+    /// takes UserIndex and FeeAccumulator commit locks for write while
+    /// state is copied, copy is serialized and written without locks
+    static bool checkpoint();
+
+    /// exchange user deposits as of last fold known to state, empty if
+    /// state was not restored and no fold was made since; reconciliation
+    /// resets them to deposits found in SQL
+    static Funds exchangeDeposits();
+    static void setExchangeDeposits(const Funds& deposits);
+
+private:
+    enum class RecordType : quint8 {Commit = 1, Fold, Quote};
+
+    struct SnapshotHeader
+    {
+        char magic[8];
+        quint32 version;
+        quint32 checksum;
+        quint64 sequence;
+        quint64 size;
+    };
+
+    struct RecordHeader
+    {
+        quint32 size;
+        quint32 checksum;
+        quint64 sequence;
+    };
+
+    static void append(RecordType type, const QByteArray& payload);
+    static bool switchJournal();
+    static void syncJournal();
+    static bool replay(const QString& fileName, quint64 fromSequence);
+    static void apply(RecordType type, QDataStream& stream);
+
+    static QString snapshotFileName();
+    static QString journalFileName(quint64 firstSequence);
+
+    static QString stateDirectory;
+    static std::unique_ptr<QFile> journal;
+    static std::atomic<bool> journaling;
+    static std::atomic<bool> dirty;
+    static int syncInterval;
+    static QThread* syncThread;
+    static Funds foldedDeposits;
+    static quint64 sequence;
+    static QMutex journalAccess;
+};
+
+#endif // ENGINESTATE_H
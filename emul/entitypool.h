@@ -0,0 +1,244 @@
+#ifndef ENTITYPOOL_H
+#define ENTITYPOOL_H
+
+#include <QMutex>
+#include <QtGlobal>
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+/// Slab allocated store of entities addressed by 32-bit handles.
+/// Entities live in fixed size slabs which are never moved nor freed till
+/// clear(), slots of destroyed entities are reused, so steady create and
+/// destroy do no allocation. Handle holds slot index in low 24 bits and
+/// generation of the slot in high 8 bits; destroy bumps generation, so a
+/// stale handle does not reach the next entity of its slot (till the slot
+/// is reused 255 times). Not synchronized, owner of the pool locks it.
+template <typename T>
+class EntityPool
+{
+public:
+    using Handle = quint32;
+    static const Handle INVALID = 0;
+
+    EntityPool() = default;
+    EntityPool(EntityPool&&) = default;
+    EntityPool& operator=(EntityPool&&) = default;
+
+    /// copies slabs as they are, so handles stay valid in the copy
+    EntityPool(const EntityPool& other)
+        :freeHead(other.freeHead), allocated(other.allocated), count(other.count)
+    {
+        slabs.reserve(other.slabs.size());
+        for (const std::unique_ptr<Slot[]>& slab: other.slabs)
+        {
+            slabs.emplace_back(new Slot[SLAB_SIZE]);
+            std::copy(slab.get(), slab.get() + SLAB_SIZE, slabs.back().get());
+        }
+    }
+
+    EntityPool& operator=(const EntityPool& other)
+    {
+        if (this != &other)
+            *this = EntityPool(other);
+        return *this;
+    }
+
+    Handle create(const T& value)
+    {
+        quint32 index;
+        if (freeHead != NO_SLOT)
+        {
+            index = freeHead;
+            freeHead = slot(index).nextFree;
+        }
+        else
+        {
+            if (allocated == MAX_SLOTS)
+                return INVALID;
+            index = allocated++;
+            if ((index >> SLAB_BITS) == slabs.size())
+                slabs.emplace_back(new Slot[SLAB_SIZE]);
+        }
+        Slot& s = slot(index);
+        s.value = value;
+        s.used = true;
+        count++;
+        return (static_cast<Handle>(s.generation) << INDEX_BITS) | index;
+    }
+
+    /// nullptr if handle is stale or invalid
+    T* get(Handle handle)
+    {
+        Slot* s = find(handle);
+        return s ? &s->value : nullptr;
+    }
+
+    const T* get(Handle handle) const
+    {
+        return const_cast<EntityPool*>(this)->get(handle);
+    }
+
+    bool destroy(Handle handle)
+    {
+        Slot* s = find(handle);
+        if (!s)
+            return false;
+        s->value = T();
+        s->used = false;
+        // generation 0 never happens, so no handle equals INVALID
+        s->generation = (s->generation == 0xFF) ? 1 : s->generation + 1;
+        s->nextFree = freeHead;
+        freeHead = handle & INDEX_MASK;
+        count--;
+        return true;
+    }
+
+    int size() const
+    {
+        return count;
+    }
+
+    /// slots allocated so far, used and free
+    quint32 capacity() const
+    {
+        return static_cast<quint32>(slabs.size()) << SLAB_BITS;
+    }
+
+    void clear()
+    {
+        slabs.clear();
+        freeHead = NO_SLOT;
+        allocated = 0;
+        count = 0;
+    }
+
+private:
+    static const int INDEX_BITS = 24;
+    static const quint32 INDEX_MASK = (1u << INDEX_BITS) - 1;
+    static const quint32 MAX_SLOTS = INDEX_MASK;
+    static const quint32 NO_SLOT = INDEX_MASK;
+    static const int SLAB_BITS = 12;
+    static const quint32 SLAB_SIZE = 1u << SLAB_BITS;
+
+    struct Slot
+    {
+        T value;
+        quint32 nextFree = NO_SLOT;
+        quint8 generation = 1;
+        bool used = false;
+    };
+
+    Slot& slot(quint32 index)
+    {
+        return slabs[index >> SLAB_BITS][index & (SLAB_SIZE - 1)];
+    }
+
+    Slot* find(Handle handle)
+    {
+        quint32 index = handle & INDEX_MASK;
+        if (handle == INVALID || index >= allocated)
+            return nullptr;
+        Slot& s = slot(index);
+        if (!s.used || s.generation != (handle >> INDEX_BITS))
+            return nullptr;
+        return &s;
+    }
+
+    std::vector<std::unique_ptr<Slot[]>> slabs;
+    quint32 freeHead = NO_SLOT;
+    quint32 allocated = 0;
+    int count = 0;
+};
+
+template <typename T>
+const typename EntityPool<T>::Handle EntityPool<T>::INVALID;
+
+/// Allocator for std::allocate_shared() of entities handed out as shared
+/// pointers across threads (OrderInfo, UserInfo, ApikeyInfo, TickerInfo).
+/// Entity and its reference counts take one block cut from a slab, freed
+/// blocks go to a free list of their size, so steady create and release
+/// does no malloc. Slabs are never freed.
+template <typename T>
+class SlabAllocator
+{
+public:
+    using value_type = T;
+
+    SlabAllocator() = default;
+    template <typename U>
+    SlabAllocator(const SlabAllocator<U>&) {}
+
+    T* allocate(std::size_t n)
+    {
+        if (n != 1)
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        FreeList& list = freeList();
+        QMutexLocker lock(&list.access);
+        if (!list.head)
+        {
+            Block* slab = static_cast<Block*>(::operator new(SLAB_SIZE * sizeof(Block)));
+            for (std::size_t i = 0; i < SLAB_SIZE; i++)
+            {
+                slab[i].next = list.head;
+                list.head = &slab[i];
+            }
+        }
+        Block* block = list.head;
+        list.head = block->next;
+        return reinterpret_cast<T*>(block);
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (n != 1)
+        {
+            ::operator delete(p);
+            return;
+        }
+        FreeList& list = freeList();
+        QMutexLocker lock(&list.access);
+        Block* block = reinterpret_cast<Block*>(p);
+        block->next = list.head;
+        list.head = block;
+    }
+
+private:
+    static const std::size_t SLAB_SIZE = 256;
+
+    union Block
+    {
+        Block* next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    struct FreeList
+    {
+        QMutex access;
+        Block* head = nullptr;
+    };
+
+    /// never destroyed: entities in static caches are released after exit
+    static FreeList& freeList()
+    {
+        static FreeList* list = new FreeList;
+        return *list;
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const SlabAllocator<T>&, const SlabAllocator<U>&)
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const SlabAllocator<T>&, const SlabAllocator<U>&)
+{
+    return false;
+}
+
+#endif // ENTITYPOOL_H
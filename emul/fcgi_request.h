@@ -156,6 +156,12 @@ public:
         return QString(FCGX_GetParam(paramName, request.envp));
     }
 
+    /// param value as stored in request environment, nullptr if missing
+    const char* rawParam(const char* paramName) const
+    {
+        return FCGX_GetParam(paramName, request.envp);
+    }
+
     QString request_uri() const
     {
         return getParam("REQUEST_URI");
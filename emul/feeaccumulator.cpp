@@ -0,0 +1,88 @@
+#include "feeaccumulator.h"
+
+QMap<PairName, FeeAccumulator::Shard*> FeeAccumulator::shards;
+QMutex FeeAccumulator::shardsAccess;
+QReadWriteLock FeeAccumulator::commitAccess;
+
+QReadWriteLock& FeeAccumulator::commitLock()
+{
+    return commitAccess;
+}
+
+FeeAccumulator::Shard* FeeAccumulator::shard(const PairName& pair)
+{
+    QMutexLocker lock(&shardsAccess);
+    Shard*& s = shards[pair];
+    if (!s)
+        s = new Shard;
+    return s;
+}
+
+void FeeAccumulator::add(const PairName& pair, const Funds& fees)
+{
+    if (fees.isEmpty())
+        return;
+    Shard* s = shard(pair);
+    QMutexLocker lock(&s->access);
+    for (auto fee = fees.constBegin(); fee != fees.constEnd(); fee++)
+        s->funds[fee.key()] += fee.value();
+}
+
+void FeeAccumulator::subtract(const Funds& fees)
+{
+    // folded amount may come from any shard, take it from shards in turn
+    Funds rest = fees;
+    QMutexLocker lock(&shardsAccess);
+    for (Shard* s: shards)
+    {
+        QMutexLocker shardLock(&s->access);
+        for (auto fee = rest.begin(); fee != rest.end(); fee++)
+        {
+            if (fee.value() == Amount(0) || !s->funds.contains(fee.key()))
+                continue;
+            Amount& available = s->funds[fee.key()];
+            Amount taken = qMin(available, fee.value());
+            available -= taken;
+            fee.value() -= taken;
+        }
+    }
+}
+
+Funds FeeAccumulator::pending()
+{
+    Funds total;
+    QMutexLocker lock(&shardsAccess);
+    for (Shard* s: shards)
+    {
+        QMutexLocker shardLock(&s->access);
+        for (auto fee = s->funds.constBegin(); fee != s->funds.constEnd(); fee++)
+            total[fee.key()] += fee.value();
+    }
+    return total;
+}
+
+void FeeAccumulator::save(QDataStream& stream)
+{
+    QMap<PairName, Funds> fees;
+    {
+        QMutexLocker lock(&shardsAccess);
+        for (auto s = shards.constBegin(); s != shards.constEnd(); s++)
+        {
+            QMutexLocker shardLock(&s.value()->access);
+            fees.insert(s.key(), s.value()->funds);
+        }
+    }
+    stream << fees;
+}
+
+void FeeAccumulator::restore(QDataStream& stream)
+{
+    QMap<PairName, Funds> fees;
+    stream >> fees;
+    for (auto s = fees.constBegin(); s != fees.constEnd(); s++)
+    {
+        Shard* target = shard(s.key());
+        QMutexLocker lock(&target->access);
+        target->funds = s.value();
+    }
+}
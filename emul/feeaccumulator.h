@@ -0,0 +1,46 @@
+#ifndef FEEACCUMULATOR_H
+#define FEEACCUMULATOR_H
+
+#include "types.h"
+
+#include <QMap>
+#include <QMutex>
+#include <QReadWriteLock>
+
+/// Exchange fee income accumulated in memory, sharded by pair.
+/// Trade mutexes are per pair and side, so buys and sells of one pair add
+/// to the same shard concurrently; every shard has its own mutex for that,
+/// held only for the few additions of a commit. Contention is thus limited
+/// to the two sides of one pair, while the exchange user deposits rows are
+/// only touched when pending fees are folded into them.
+class FeeAccumulator
+{
+public:
+    /// Commit of a trade and adding its fees is done under read lock,
+    /// folding and balance audit take write lock so they never observe
+    /// a fee that is both in deposits and still pending.
+    static QReadWriteLock& commitLock();
+
+    static void add(const PairName& pair, const Funds& fees);
+    static void subtract(const Funds& fees);
+    static Funds pending();
+
+    /// pending fees per pair, for state snapshots
+    static void save(QDataStream& stream);
+    static void restore(QDataStream& stream);
+
+private:
+    struct Shard
+    {
+        QMutex access;
+        Funds funds;
+    };
+
+    static Shard* shard(const PairName& pair);
+
+    static QMap<PairName, Shard*> shards;
+    static QMutex shardsAccess;
+    static QReadWriteLock commitAccess;
+};
+
+#endif // FEEACCUMULATOR_H
@@ -0,0 +1,81 @@
+#include "idallocator.h"
+#include "shardconfig.h"
+#include "utils.h"
+
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QVariant>
+
+QMutex IdAllocator::blocksAccess;
+IdAllocator::Block IdAllocator::orders;
+IdAllocator::Block IdAllocator::trades;
+std::atomic<quint32> IdAllocator::blockSize {1000};
+
+IdAllocator::IdAllocator(QSqlDatabase& db)
+    :db(db)
+{
+}
+
+IdAllocator::~IdAllocator()
+{
+    if (leaseConnectionName.isEmpty())
+        return;
+    QSqlDatabase::database(leaseConnectionName, false).close();
+    QSqlDatabase::removeDatabase(leaseConnectionName);
+}
+
+void IdAllocator::setBlockSize(quint32 size)
+{
+    QMutexLocker lock(&blocksAccess);
+    blockSize = qMax<quint32>(size, 1);
+    // rest of blocks of old size is skipped
+    orders = Block();
+    trades = Block();
+}
+
+void IdAllocator::prepare(QSqlDatabase& db)
+{
+    QSqlQuery sql(db);
+    performSql("create id sequences", sql, "create table if not exists id_sequences (name char(16) primary key, next_id bigint unsigned not null)", true);
+    performSql("add id sequences", sql, "insert ignore into id_sequences (name, next_id) values ('orders', 1), ('trades', 1)", true);
+    performSql("move orders sequence", sql, QString("update id_sequences set next_id = greatest(next_id, (select coalesce(max(order_id), 0) from orders) div %1 + 1, (select coalesce(max(order_id), 0) from orders_history) div %1 + 1) where name='orders'")
+               .arg(ShardConfig::count()), true);
+    performSql("move trades sequence", sql, "update id_sequences set next_id = greatest(next_id, (select coalesce(max(trade_id), 0) from trades) + 1, (select coalesce(max(trade_id), 0) from trades_history) + 1) where name='trades'", true);
+}
+
+quint64 IdAllocator::next(const char* sequence, Block& block)
+{
+    QMutexLocker lock(&blocksAccess);
+    if (block.next < block.end)
+        return block.next++;
+
+    if (leaseConnectionName.isEmpty())
+    {
+        leaseConnectionName = QString("id-lease-%1").arg(reinterpret_cast<quintptr>(this));
+        QSqlDatabase::cloneDatabase(db, leaseConnectionName).open();
+    }
+    QSqlDatabase leaseDb = QSqlDatabase::database(leaseConnectionName);
+    QSqlQuery sql(leaseDb);
+    quint32 size = blockSize;
+    prepareSql(sql, "update id_sequences set next_id = last_insert_id(next_id + :size) where name=:name");
+    QVariantMap params;
+    params[":size"] = size;
+    params[":name"] = sequence;
+    performSql("lease :size ids of :name", sql, params, true);
+    performSql("get leased ids", sql, "select last_insert_id()", true);
+    sql.next();
+    block.end = sql.value(0).toULongLong();
+    block.next = block.end - size;
+    return block.next++;
+}
+
+OrderId IdAllocator::nextOrderId()
+{
+    quint64 slot = next("orders", orders);
+    return static_cast<OrderId>(slot * ShardConfig::count() + ShardConfig::index() + 1);
+}
+
+TradeId IdAllocator::nextTradeId()
+{
+    return static_cast<TradeId>(next("trades", trades));
+}
@@ -0,0 +1,58 @@
+#ifndef IDALLOCATOR_H
+#define IDALLOCATOR_H
+
+#include "types.h"
+
+#include <QMutex>
+#include <QString>
+
+#include <atomic>
+
+class QSqlDatabase;
+
+/// Order and trade ids leased in blocks from id_sequences table instead of
+/// AUTO_INCREMENT, so an id is known before its row is inserted and inserts
+/// do not queue on the auto-increment lock.
+/// Blocks are shared by all data accessors (one per FastCGI worker) of the
+/// process, so ids grow in the order they are taken: matching breaks rate
+/// ties and trades pages sort by id. The accessor which empties a block
+/// leases the next one on its own autocommit connection, so a lease is
+/// never held by a trade transaction nor rolled back with it; ids of rolled
+/// back or unused leases are skipped.
+/// Sequence of orders counts slots: slot k gives id k * count + index + 1 of
+/// the shard, so ShardConfig::shardOfOrder() holds for leased ids too.
+class IdAllocator
+{
+public:
+    /// lease connection is cloned from db when first block is needed
+    explicit IdAllocator(QSqlDatabase& db);
+    ~IdAllocator();
+
+    OrderId nextOrderId();
+    TradeId nextTradeId();
+
+    /// creates sequences if needed and moves them past ids in use,
+    /// called at start before any order is created
+    static void prepare(QSqlDatabase& db);
+    /// drops leased blocks, next ids come from blocks of new size
+    static void setBlockSize(quint32 size);
+
+private:
+    struct Block
+    {
+        quint64 next = 0;
+        quint64 end = 0;
+    };
+
+    quint64 next(const char* sequence, Block& block);
+
+    QSqlDatabase& db;
+    QString leaseConnectionName;
+
+    static QMutex blocksAccess;
+    static Block orders;
+    static Block trades;
+    static std::atomic<quint32> blockSize;
+};
+
+#endif // IDALLOCATOR_H
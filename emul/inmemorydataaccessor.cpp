@@ -0,0 +1,958 @@
+#include "inmemorydataaccessor.h"
+#include "engineclock.h"
+#include "registry.h"
+#include "shardconfig.h"
+#include "utils.h"
+
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QVariant>
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+InMemoryDataAccessor::Tables InMemoryDataAccessor::tables;
+QReadWriteLock InMemoryDataAccessor::lock;
+std::atomic<quint64> InMemoryDataAccessor::nextOrderSlot {0};
+std::atomic<TradeId> InMemoryDataAccessor::nextTradeId {1};
+
+void InMemoryDataAccessor::Tables::activate(const Order& order)
+{
+    Book& book = books[order.pair];
+    Side& side = (order.type == OrderInfo::Type::Sell) ? book.sells : book.buys;
+    side.insert(sideKey(order), order.user_id);
+    userOrders[order.user_id].insert(order.order_id);
+}
+
+void InMemoryDataAccessor::Tables::deactivate(const Order& order)
+{
+    Book& book = books[order.pair];
+    Side& side = (order.type == OrderInfo::Type::Sell) ? book.sells : book.buys;
+    side.remove(sideKey(order));
+    userOrders[order.user_id].remove(order.order_id);
+}
+
+template <typename T>
+static void insertById(QVector<T>& list, const T& item)
+{
+    // ids come nearly in order, place is looked for from the end
+    int i = list.size();
+    while (i > 0 && item.trade_id < list.at(i - 1).trade_id)
+        i--;
+    list.insert(i, item);
+}
+
+void InMemoryDataAccessor::Tables::addTrade(const Trade& trade, const PairName& pair, UserId owner)
+{
+    insertById(trades[pair], trade);
+    UserTrade entry;
+    entry.trade_id = trade.trade_id;
+    entry.pair = pair;
+    entry.created = trade.created;
+    insertById(userTrades[trade.user_id], entry);
+    entry.yourOrder = true;
+    insertById(userTrades[owner], entry);
+}
+
+bool InMemoryDataAccessor::Pending::isEmpty() const
+{
+    return deposits.isEmpty() && createdOrders.isEmpty() && reductions.isEmpty() && finishes.isEmpty() && trades.isEmpty();
+}
+
+void InMemoryDataAccessor::Pending::clear()
+{
+    deposits.clear();
+    createdOrders.clear();
+    reductions.clear();
+    finishes.clear();
+    trades.clear();
+}
+
+InMemoryDataAccessor::InMemoryDataAccessor()
+{
+}
+
+InMemoryDataAccessor::~InMemoryDataAccessor()
+{
+}
+
+QPair<Rate, OrderId> InMemoryDataAccessor::sideKey(const Order& order)
+{
+    if (order.type == OrderInfo::Type::Buy)
+        return qMakePair(Rate(0) - order.rate, order.order_id);
+    return qMakePair(order.rate, order.order_id);
+}
+
+OrderInfo::Ptr InMemoryDataAccessor::toInfo(const Order& order)
+{
+    OrderInfo::Ptr info = OrderInfo::create();
+    info->order_id = order.order_id;
+    info->pair = order.pair;
+    info->type = order.type;
+    info->start_amount = order.start_amount;
+    info->amount = order.amount;
+    info->rate = order.rate;
+    info->created = order.created;
+    info->status = order.status;
+    info->user_id = order.user_id;
+    return info;
+}
+
+void InMemoryDataAccessor::finish(Order& order, bool cancel)
+{
+    if (cancel)
+    {
+        order.status = (order.start_amount == order.amount) ? OrderInfo::Status::Cancelled : OrderInfo::Status::PartiallyDone;
+    }
+    else
+    {
+        order.amount = Amount(0);
+        order.status = OrderInfo::Status::Done;
+    }
+}
+
+bool InMemoryDataAccessor::findOrder(OrderId order_id, Order& order) const
+{
+    auto it = tables.orders.constFind(order_id);
+    if (it != tables.orders.constEnd())
+        order = *it;
+    else
+    {
+        auto created = std::find_if(pending.createdOrders.cbegin(), pending.createdOrders.cend(),
+                                    [order_id](const Order& o) { return o.order_id == order_id; });
+        if (created == pending.createdOrders.cend())
+            return false;
+        order = *created;
+    }
+    auto reduction = pending.reductions.constFind(order_id);
+    if (reduction != pending.reductions.constEnd())
+        order.amount -= *reduction;
+    auto finished = pending.finishes.constFind(order_id);
+    if (finished != pending.finishes.constEnd() && order.status == OrderInfo::Status::Active)
+        finish(order, *finished);
+    return true;
+}
+
+Amount InMemoryDataAccessor::funds(UserId user_id, const User& user, CurrencyId currency) const
+{
+    auto diff = pending.deposits.constFind(user_id);
+    if (diff == pending.deposits.constEnd())
+        return user.funds[currency];
+    return user.funds[currency] + (*diff)[currency];
+}
+
+void InMemoryDataAccessor::autoCommit()
+{
+    if (!inTransaction)
+        publish();
+}
+
+void InMemoryDataAccessor::publish()
+{
+    if (pending.isEmpty())
+        return;
+    QWriteLocker locker(&lock);
+    for (const Order& order: pending.createdOrders)
+    {
+        tables.orders.insert(order.order_id, order);
+        tables.activate(order);
+    }
+    for (auto reduction = pending.reductions.cbegin(); reduction != pending.reductions.cend(); ++reduction)
+    {
+        auto order = tables.orders.find(reduction.key());
+        if (order != tables.orders.end())
+            order->amount -= reduction.value();
+    }
+    for (auto finished = pending.finishes.cbegin(); finished != pending.finishes.cend(); ++finished)
+    {
+        auto order = tables.orders.find(finished.key());
+        if (order == tables.orders.end() || order->status != OrderInfo::Status::Active)
+            continue;
+        tables.deactivate(*order);
+        finish(*order, finished.value());
+    }
+    for (auto diff = pending.deposits.cbegin(); diff != pending.deposits.cend(); ++diff)
+    {
+        auto user = tables.users.find(diff.key());
+        if (user == tables.users.end())
+            continue;
+        for (int currency = 0; currency < MAX_CURRENCIES; currency++)
+            user->funds[currency] += diff.value()[currency];
+    }
+    for (const Pending::NewTrade& trade: pending.trades)
+        tables.addTrade(trade.trade, trade.pair, trade.owner);
+    pending.clear();
+}
+
+void InMemoryDataAccessor::load(QSqlDatabase& db)
+{
+    Tables loaded;
+    DirectSqlDataAccessor sqlAccessor(db);
+    for (const PairInfo::Ptr& info: sqlAccessor.allPairsInfoList())
+    {
+        loaded.pairs.insert(info->pair, *info);
+        TickerInfo::Ptr ticker = sqlAccessor.tickerInfo(info->pair);
+        if (ticker)
+            loaded.tickers.insert(info->pair, *ticker);
+    }
+
+    QSqlQuery sql(db);
+    performSql("load users", sql, "select user_id, name, user_type from users", true);
+    while (sql.next())
+    {
+        User& user = loaded.users[sql.value(0).toUInt()];
+        user.name = sql.value(1).toString();
+        user.type = sql.value(2).toInt();
+    }
+
+    performSql("load deposits", sql, "select user_id, currency_id, volume from deposits", true);
+    while (sql.next())
+    {
+        CurrencyId currency = Registry::currencyOfSqlId(sql.value(1).toUInt());
+        auto user = loaded.users.find(sql.value(0).toUInt());
+        if (currency != INVALID_CURRENCY && user != loaded.users.end())
+            user->funds[currency] = Amount(sql.value(2).toString().toStdString());
+    }
+
+    performSql("load apikeys", sql, "select apikey, info, trade, withdraw, user_id, secret, nonce from apikeys", true);
+    while (sql.next())
+    {
+        Apikey key;
+        key.info = sql.value(1).toBool();
+        key.trade = sql.value(2).toBool();
+        key.withdraw = sql.value(3).toBool();
+        key.user_id = sql.value(4).toUInt();
+        key.secret = sql.value(5).toByteArray();
+        key.nonce = sql.value(6).toUInt();
+        loaded.apikeys.insert(sql.value(0).toString(), key);
+        loaded.userKeys[key.user_id].append(sql.value(0).toString());
+    }
+
+    OrderId maxOrderId = 0;
+    performSql("load orders", sql, "select o.order_id, p.pair, o.type, o.start_amount, o.amount, o.rate, o.created, o.status+0, o.user_id from orders o left join pairs p on p.pair_id = o.pair_id "
+                                   "union all select o.order_id, p.pair, o.type, o.start_amount, o.amount, o.rate, o.created, o.status+0, o.user_id from orders_history o left join pairs p on p.pair_id = o.pair_id", true);
+    while (sql.next())
+    {
+        Order order;
+        order.order_id = sql.value(0).toUInt();
+        order.pair = sql.value(1).toString();
+        order.type = (sql.value(2).toString() == "sell") ? OrderInfo::Type::Sell : OrderInfo::Type::Buy;
+        order.start_amount = Amount(sql.value(3).toString().toStdString());
+        order.amount = Amount(sql.value(4).toString().toStdString());
+        order.rate = Rate(sql.value(5).toString().toStdString());
+        order.created = sql.value(6).toDateTime();
+        order.status = static_cast<OrderInfo::Status>(sql.value(7).toInt());
+        order.user_id = sql.value(8).toUInt();
+        loaded.orders.insert(order.order_id, order);
+        if (order.status == OrderInfo::Status::Active)
+            loaded.activate(order);
+        maxOrderId = qMax(maxOrderId, order.order_id);
+    }
+
+    TradeId maxTradeId = 0;
+    performSql("load trades", sql, "select trade_id, user_id, order_id, amount, created from trades union all select trade_id, user_id, order_id, amount, created from trades_history order by trade_id", true);
+    while (sql.next())
+    {
+        auto order = loaded.orders.constFind(sql.value(2).toUInt());
+        if (order == loaded.orders.constEnd())
+            continue;
+        Trade trade;
+        trade.trade_id = sql.value(0).toUInt();
+        trade.user_id = sql.value(1).toUInt();
+        trade.order_id = order->order_id;
+        trade.type = (order->type == OrderInfo::Type::Buy) ? TradeInfo::Type::Bid : TradeInfo::Type::Ask;
+        trade.rate = order->rate;
+        trade.amount = Amount(sql.value(3).toString().toStdString());
+        trade.created = sql.value(4).toDateTime();
+        loaded.addTrade(trade, order->pair, order->user_id);
+        maxTradeId = qMax(maxTradeId, trade.trade_id);
+    }
+
+    QWriteLocker locker(&lock);
+    std::swap(tables, loaded);
+    nextOrderSlot = maxOrderId / ShardConfig::count() + 1;
+    nextTradeId = maxTradeId + 1;
+}
+
+void InMemoryDataAccessor::seed(int usersCount, UserId exchangeUserId)
+{
+    struct SeedPair
+    {
+        const char* name;
+        int decimal_places;
+        const char* min_price;
+        const char* max_price;
+        const char* min_amount;
+        const char* last;
+    };
+    // limits as btc-e had them, tests check their error messages
+    static const SeedPair seedPairs[] = {
+        {"btc_usd", 3, "0.1", "10000", "0.001", "1800"},
+        {"btc_eur", 5, "0.1", "10000", "0.001", "1650"},
+        {"ltc_usd", 6, "0.0001", "1000", "0.01", "50"},
+    };
+    const int depth = 50;
+
+    QList<PairName> names;
+    for (const SeedPair& seedPair: seedPairs)
+        names << seedPair.name;
+    Registry::load(names);
+
+    std::mt19937 random;
+    auto randomText = [&random](int length, const char* alphabet)
+    {
+        QByteArray text(length, 0);
+        int size = static_cast<int>(strlen(alphabet));
+        for (int i = 0; i < length; i++)
+            text[i] = alphabet[random() % size];
+        return text;
+    };
+
+    Tables seeded;
+    User& exchange = seeded.users[exchangeUserId];
+    exchange.name = "EXCHANGE";
+    QVector<UserId> traders;
+    for (int i = 0; i < usersCount; i++)
+    {
+        UserId user_id = exchangeUserId + 1 + static_cast<UserId>(i);
+        User& user = seeded.users[user_id];
+        user.name = QString("user%1").arg(user_id);
+        user.type = 1;
+        for (int currency = 0; currency < Registry::currenciesCount(); currency++)
+            user.funds[currency] = Amount(static_cast<double>(random() % 1000000) / 100);
+        for (int permissions = 0; permissions < 8; permissions++)
+        {
+            Apikey key;
+            key.info = permissions & 4;
+            key.trade = permissions & 2;
+            key.withdraw = permissions & 1;
+            key.secret = randomText(64, "0123456789abcdefghijklmnopqrstuvwxyz");
+            key.user_id = user_id;
+            QStringList parts;
+            for (int part = 0; part < 5; part++)
+                parts << QString::fromLatin1(randomText(8, "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"));
+            seeded.apikeys.insert(parts.join('-'), key);
+            seeded.userKeys[user_id].append(parts.join('-'));
+        }
+        traders << user_id;
+    }
+
+    // book around last rate and trades of finished orders at it
+    QDateTime now = EngineClock::now();
+    OrderId maxOrderId = 0;
+    TradeId maxTradeId = 0;
+    for (const SeedPair& seedPair: seedPairs)
+    {
+        PairInfo info;
+        info.pair = seedPair.name;
+        info.pair_id = Registry::pair(info.pair)->pair_id;
+        info.decimal_places = seedPair.decimal_places;
+        info.min_price = Rate(seedPair.min_price);
+        info.max_price = Rate(seedPair.max_price);
+        info.min_amount = Rate(seedPair.min_amount);
+        info.fee = Fee("0.2");
+        info.hidden = false;
+        seeded.pairs.insert(info.pair, info);
+
+        Rate last(seedPair.last);
+        TickerInfo ticker;
+        ticker.high = last * Rate("1.05");
+        ticker.low = last * Rate("0.95");
+        ticker.avg = ticker.last = ticker.buy = ticker.sell = last;
+        ticker.vol = Amount(0);
+        ticker.vol_cur = Amount(0);
+        ticker.updated = now;
+        ticker.pairName = info.pair;
+        seeded.tickers.insert(info.pair, ticker);
+        if (traders.size() < 2)
+            continue;
+
+        auto rounded = [&info](const Rate& rate) { return qstr2dec<7>(dec2qstr(rate, info.decimal_places)); };
+        auto randomTrader = [&random, &traders]() { return traders.at(static_cast<int>(random() % traders.size())); };
+        for (int level = 1; level <= depth; level++)
+            for (OrderInfo::Type type: {OrderInfo::Type::Sell, OrderInfo::Type::Buy})
+            {
+                Order order;
+                order.order_id = ++maxOrderId;
+                order.pair = info.pair;
+                order.type = type;
+                order.rate = rounded(last * Rate((type == OrderInfo::Type::Sell) ? 1 + 0.001 * level : 1 - 0.001 * level));
+                order.start_amount = order.amount = info.min_amount * Amount(static_cast<double>(1 + random() % 100));
+                order.created = now.addSecs(-60 * level);
+                order.user_id = randomTrader();
+                seeded.orders.insert(order.order_id, order);
+                seeded.activate(order);
+            }
+        for (int i = 0; i < depth; i++)
+        {
+            Order order;
+            order.order_id = ++maxOrderId;
+            order.pair = info.pair;
+            order.type = (random() % 2) ? OrderInfo::Type::Sell : OrderInfo::Type::Buy;
+            order.rate = rounded(last * Rate(1 + 0.0001 * (static_cast<int>(random() % 21) - 10)));
+            order.start_amount = info.min_amount * Amount(static_cast<double>(1 + random() % 100));
+            order.created = now.addSecs(-60 * (depth - i) - 30);
+            order.user_id = randomTrader();
+            finish(order, false);
+            seeded.orders.insert(order.order_id, order);
+
+            Trade trade;
+            trade.trade_id = ++maxTradeId;
+            do
+                trade.user_id = randomTrader();
+            while (trade.user_id == order.user_id);
+            trade.order_id = order.order_id;
+            trade.type = (order.type == OrderInfo::Type::Buy) ? TradeInfo::Type::Bid : TradeInfo::Type::Ask;
+            trade.rate = order.rate;
+            trade.amount = order.start_amount;
+            trade.created = order.created.addSecs(30);
+            seeded.addTrade(trade, order.pair, order.user_id);
+        }
+    }
+
+    QWriteLocker locker(&lock);
+    std::swap(tables, seeded);
+    nextOrderSlot = maxOrderId / ShardConfig::count() + 1;
+    nextTradeId = maxTradeId + 1;
+}
+
+void InMemoryDataAccessor::clear()
+{
+    QWriteLocker locker(&lock);
+    tables = Tables();
+    nextOrderSlot = 0;
+    nextTradeId = 1;
+}
+
+PairInfo::List InMemoryDataAccessor::allPairsInfoList()
+{
+    QReadLocker locker(&lock);
+    PairInfo::List ret;
+    for (const PairInfo& info: tables.pairs)
+    {
+        PairInfo::Ptr copy = PairInfo::create();
+        *copy = info;
+        ret.append(copy);
+    }
+    return ret;
+}
+
+PairInfo::Ptr InMemoryDataAccessor::pairInfo(const PairName& pair)
+{
+    QReadLocker locker(&lock);
+    auto it = tables.pairs.constFind(pair);
+    if (it == tables.pairs.constEnd())
+        return nullptr;
+    PairInfo::Ptr info = PairInfo::create();
+    *info = *it;
+    return info;
+}
+
+TickerInfo::Ptr InMemoryDataAccessor::tickerInfo(const PairName& pair)
+{
+    QReadLocker locker(&lock);
+    auto it = tables.tickers.constFind(pair);
+    if (it == tables.tickers.constEnd())
+        return nullptr;
+    TickerInfo::Ptr info = TickerInfo::create();
+    *info = *it;
+    return info;
+}
+
+OrderInfo::Ptr InMemoryDataAccessor::orderInfo(OrderId order_id)
+{
+    QReadLocker locker(&lock);
+    Order order;
+    if (!findOrder(order_id, order))
+        return nullptr;
+    return toInfo(order);
+}
+
+OrderInfo::List InMemoryDataAccessor::activeOrdersInfoList(const QString& apikey)
+{
+    QReadLocker locker(&lock);
+    OrderInfo::List list;
+    auto key = tables.apikeys.constFind(apikey);
+    if (key == tables.apikeys.constEnd())
+        return list;
+    for (OrderId order_id: tables.userOrders.value(key->user_id))
+        list.append(toInfo(tables.orders.value(order_id)));
+    return list;
+}
+
+TradeInfo::List InMemoryDataAccessor::allTradesInfo(const PairName& pair)
+{
+    QReadLocker locker(&lock);
+    TradeInfo::List list;
+    const QVector<Trade> trades = tables.trades.value(pair);
+    for (auto it = trades.crbegin(); it != trades.crend(); ++it)
+    {
+        TradeInfo::Ptr info = TradeInfo::create();
+        info->type = it->type;
+        info->rate = it->rate;
+        info->amount = it->amount;
+        info->tid = it->trade_id;
+        info->created = it->created;
+        info->order_id = it->order_id;
+        info->user_id = it->user_id;
+        list.append(info);
+    }
+    return list;
+}
+
+UserTradeInfo::List InMemoryDataAccessor::userTradesInfo(UserId user_id, const PairName& pair, const HistoryPage& page)
+{
+    QReadLocker locker(&lock);
+    UserTradeInfo::List list;
+    auto found = tables.userTrades.constFind(user_id);
+    if (found == tables.userTrades.constEnd())
+        return list;
+
+    // id and time ranges are both slices of the history
+    const QVector<UserTrade>& history = *found;
+    auto first = std::lower_bound(history.cbegin(), history.cend(), page.from_id,
+                                  [](const UserTrade& t, TradeId id) { return t.trade_id < id; });
+    auto last = std::upper_bound(first, history.cend(), page.end_id,
+                                 [](TradeId id, const UserTrade& t) { return id < t.trade_id; });
+    if (page.since.isValid())
+        first = std::lower_bound(first, last, page.since,
+                                 [](const UserTrade& t, const QDateTime& time) { return t.created < time; });
+    if (page.end.isValid())
+        last = std::upper_bound(first, last, page.end,
+                                [](const QDateTime& time, const UserTrade& t) { return time < t.created; });
+
+    quint32 skip = page.from;
+    for (int i = 0; i < last - first && static_cast<quint32>(list.size()) < page.count; i++)
+    {
+        const UserTrade& entry = page.desc ? *(last - 1 - i) : *(first + i);
+        if (!pair.isEmpty() && entry.pair != pair)
+            continue;
+        if (skip > 0)
+        {
+            skip--;
+            continue;
+        }
+        const QVector<Trade>& trades = *tables.trades.constFind(entry.pair);
+        auto trade = std::lower_bound(trades.cbegin(), trades.cend(), entry.trade_id,
+                                      [](const Trade& t, TradeId id) { return t.trade_id < id; });
+        if (trade == trades.cend() || trade->trade_id != entry.trade_id)
+            continue;
+        OrderInfo::Type orderType = (trade->type == TradeInfo::Type::Bid) ? OrderInfo::Type::Buy : OrderInfo::Type::Sell;
+        UserTradeInfo::Ptr info = UserTradeInfo::create();
+        info->tid = entry.trade_id;
+        info->pair = entry.pair;
+        info->is_your_order = entry.yourOrder;
+        if (entry.yourOrder)
+            info->type = orderType;
+        else
+            info->type = (orderType == OrderInfo::Type::Buy) ? OrderInfo::Type::Sell : OrderInfo::Type::Buy;
+        info->rate = trade->rate;
+        info->amount = trade->amount;
+        info->order_id = trade->order_id;
+        info->created = trade->created;
+        list.append(info);
+    }
+    return list;
+}
+
+ApikeyInfo::Ptr InMemoryDataAccessor::apikeyInfo(const ApiKey& apikey)
+{
+    QReadLocker locker(&lock);
+    auto it = tables.apikeys.constFind(apikey);
+    if (it == tables.apikeys.constEnd())
+        return nullptr;
+    ApikeyInfo::Ptr info = ApikeyInfo::create();
+    info->apikey = apikey;
+    info->info = it->info;
+    info->trade = it->trade;
+    info->withdraw = it->withdraw;
+    info->user_id = it->user_id;
+    info->secret = it->secret;
+    info->nonce = it->nonce;
+    return info;
+}
+
+UserInfo::Ptr InMemoryDataAccessor::userInfo(UserId user_id)
+{
+    QReadLocker locker(&lock);
+    auto it = tables.users.constFind(user_id);
+    if (it == tables.users.constEnd())
+        return nullptr;
+    UserInfo::Ptr info = UserInfo::create();
+    info->user_id = user_id;
+    info->name = it->name;
+    for (int currency = 0; currency < MAX_CURRENCIES; currency++)
+        info->funds[currency] = funds(user_id, *it, static_cast<CurrencyId>(currency));
+    return info;
+}
+
+QMap<PairName, BuySellDepth> InMemoryDataAccessor::allActiveOrdersAmountAgreggatedByRateList(const QList<PairName>& pairs)
+{
+    QReadLocker locker(&lock);
+    QMap<PairName, BuySellDepth> map;
+    for (const PairName& pair: pairs)
+    {
+        auto book = tables.books.constFind(pair);
+        if (book == tables.books.constEnd() || (book->buys.isEmpty() && book->sells.isEmpty()))
+            continue;
+        BuySellDepth& depth = map[pair];
+        // buys by rate descending, sells ascending, same as sides are kept
+        for (auto it = book->buys.cbegin(); it != book->buys.cend(); ++it)
+        {
+            const Order& order = *tables.orders.constFind(it.key().second);
+            if (!depth.first.isEmpty() && depth.first.last().first == order.rate)
+                depth.first.last().second += order.amount;
+            else
+                depth.first.append(qMakePair(order.rate, order.amount));
+        }
+        for (auto it = book->sells.cbegin(); it != book->sells.cend(); ++it)
+        {
+            const Order& order = *tables.orders.constFind(it.key().second);
+            if (!depth.second.isEmpty() && depth.second.last().first == order.rate)
+                depth.second.last().second += order.amount;
+            else
+                depth.second.append(qMakePair(order.rate, order.amount));
+        }
+    }
+    return map;
+}
+
+bool InMemoryDataAccessor::tradeUpdateDeposit(const UserId& user_id, CurrencyId currency, const Amount& diff, const QString& userName)
+{
+    Q_UNUSED(userName)
+    {
+        QReadLocker locker(&lock);
+        // as update of missing deposit row
+        if (!tables.users.contains(user_id) || currency >= MAX_CURRENCIES)
+            return true;
+    }
+    auto diffs = pending.deposits.find(user_id);
+    if (diffs == pending.deposits.end())
+        diffs = pending.deposits.insert(user_id, Balances {});
+    (*diffs)[currency] += diff;
+    autoCommit();
+    return true;
+}
+
+bool InMemoryDataAccessor::reduceOrderAmount(OrderId order_id, const Amount& amount)
+{
+    {
+        QReadLocker locker(&lock);
+        Order order;
+        if (!findOrder(order_id, order))
+            return false;
+    }
+    pending.reductions[order_id] += amount;
+    autoCommit();
+    return true;
+}
+
+bool InMemoryDataAccessor::finishOrder(OrderId order_id, bool cancel)
+{
+    {
+        QReadLocker locker(&lock);
+        Order order;
+        if (!findOrder(order_id, order))
+            return false;
+    }
+    if (!pending.finishes.contains(order_id))
+        pending.finishes.insert(order_id, cancel);
+    autoCommit();
+    return true;
+}
+
+bool InMemoryDataAccessor::closeOrder(OrderId order_id)
+{
+    return finishOrder(order_id, false);
+}
+
+bool InMemoryDataAccessor::cancelOrder(OrderId order_id)
+{
+    return finishOrder(order_id, true);
+}
+
+OrderInfo::List InMemoryDataAccessor::matchingOrders(const PairName& pair, OrderInfo::Type type, const Rate& rate, UserId user_id)
+{
+    QReadLocker locker(&lock);
+    OrderInfo::Type matchingType = (type == OrderInfo::Type::Buy) ? OrderInfo::Type::Sell : OrderInfo::Type::Buy;
+    Rate limit = (type == OrderInfo::Type::Buy) ? rate : Rate(0) - rate;
+    // committed side merged with orders still pending in this transaction
+    QMap<QPair<Rate, OrderId>, OrderId> matching;
+    auto book = tables.books.constFind(pair);
+    if (book != tables.books.constEnd())
+    {
+        const Side& side = (matchingType == OrderInfo::Type::Sell) ? book->sells : book->buys;
+        for (auto it = side.cbegin(); it != side.cend() && !(limit < it.key().first); ++it)
+            if (it.value() != user_id)
+                matching.insert(it.key(), it.key().second);
+    }
+    for (const Order& order: pending.createdOrders)
+        if (order.pair == pair && order.type == matchingType && order.user_id != user_id && !(limit < sideKey(order).first))
+            matching.insert(sideKey(order), order.order_id);
+
+    OrderInfo::List list;
+    for (OrderId order_id: matching)
+    {
+        Order order;
+        if (findOrder(order_id, order) && order.status == OrderInfo::Status::Active)
+            list.append(toInfo(order));
+    }
+    return list;
+}
+
+TradeId InMemoryDataAccessor::createNewTradeRecord(UserId user_id, OrderId order_id, const Amount& amount)
+{
+    Order order;
+    {
+        QReadLocker locker(&lock);
+        if (!findOrder(order_id, order) || amount < Amount(0))
+            return 0;
+    }
+    Pending::NewTrade trade;
+    trade.trade.trade_id = nextTradeId++;
+    trade.trade.user_id = user_id;
+    trade.trade.order_id = order_id;
+    trade.trade.type = (order.type == OrderInfo::Type::Buy) ? TradeInfo::Type::Bid : TradeInfo::Type::Ask;
+    trade.trade.rate = order.rate;
+    trade.trade.amount = amount;
+    trade.trade.created = EngineClock::now();
+    trade.pair = order.pair;
+    trade.owner = order.user_id;
+    pending.trades.append(trade);
+    autoCommit();
+    return trade.trade.trade_id;
+}
+
+OrderId InMemoryDataAccessor::createNewOrderRecord(const PairName& pair, const UserId& user_id, OrderInfo::Type type, const Rate& rate, const Amount& start_amount)
+{
+    {
+        QReadLocker locker(&lock);
+        if (!tables.pairs.contains(pair))
+            return static_cast<OrderId>(-1);
+    }
+    Order order;
+    order.order_id = static_cast<OrderId>(nextOrderSlot++ * ShardConfig::count() + ShardConfig::index() + 1);
+    order.pair = pair;
+    order.type = type;
+    order.start_amount = start_amount;
+    order.amount = start_amount;
+    order.rate = rate;
+    order.created = EngineClock::now();
+    order.status = OrderInfo::Status::Active;
+    order.user_id = user_id;
+    pending.createdOrders.append(order);
+    autoCommit();
+    return order.order_id;
+}
+
+bool InMemoryDataAccessor::reserveDepositVolume(UserId user_id, CurrencyId currency, const Amount& volume)
+{
+    QReadLocker locker(&lock);
+    auto user = tables.users.constFind(user_id);
+    if (user == tables.users.constEnd() || currency >= MAX_CURRENCIES)
+        return false;
+    return funds(user_id, *user, currency) >= volume;
+}
+
+Amount InMemoryDataAccessor::depositVolume(UserId user_id, CurrencyId currency)
+{
+    QReadLocker locker(&lock);
+    auto user = tables.users.constFind(user_id);
+    if (user == tables.users.constEnd() || currency >= MAX_CURRENCIES)
+        return Amount(0);
+    return funds(user_id, *user, currency);
+}
+
+QByteArray InMemoryDataAccessor::randomKeyWithPermissions(bool info, bool trade, bool withdraw)
+{
+    QReadLocker locker(&lock);
+    QList<ApiKey> keys;
+    for (auto it = tables.apikeys.cbegin(); it != tables.apikeys.cend(); ++it)
+        if (it->info == info && it->trade == trade && it->withdraw == withdraw
+                && tables.users.value(it->user_id).type == 1)
+            keys.append(it.key());
+    if (keys.isEmpty())
+        return QByteArray();
+    return keys.at(qrand() % keys.size()).toUtf8();
+}
+
+QByteArray InMemoryDataAccessor::randomKeyForTrade(const QString& currency, const Amount& amount)
+{
+    CurrencyId currencyId = Registry::currencyId(currency);
+    if (currencyId == INVALID_CURRENCY)
+        return QByteArray();
+    QReadLocker locker(&lock);
+    QList<ApiKey> keys;
+    for (auto it = tables.apikeys.cbegin(); it != tables.apikeys.cend(); ++it)
+    {
+        auto user = tables.users.constFind(it->user_id);
+        if (it->trade && user != tables.users.constEnd() && user->type == 1 && amount < user->funds[currencyId])
+            keys.append(it.key());
+    }
+    if (keys.isEmpty())
+        return QByteArray();
+    return keys.at(qrand() % keys.size()).toUtf8();
+}
+
+QByteArray InMemoryDataAccessor::signWithKey(const QByteArray& message, const ApiKey& key)
+{
+    QByteArray secret = secretForKey(key);
+    if (!secret.isEmpty())
+        return hmac_sha512(message, secret).toHex();
+    return QByteArray();
+}
+
+QByteArray InMemoryDataAccessor::secretForKey(const ApiKey& key)
+{
+    QReadLocker locker(&lock);
+    return tables.apikeys.value(key).secret;
+}
+
+bool InMemoryDataAccessor::updateNonce(const ApiKey& key, quint32 nonce)
+{
+    QWriteLocker locker(&lock);
+    auto it = tables.apikeys.find(key);
+    if (it != tables.apikeys.end())
+        it->nonce = nonce;
+    return true;
+}
+
+Amount InMemoryDataAccessor::getDepositCurrencyVolume(const ApiKey& key, const QString& currency)
+{
+    CurrencyId currencyId = Registry::currencyId(currency);
+    if (currencyId == INVALID_CURRENCY)
+        return Amount(0);
+    QReadLocker locker(&lock);
+    auto apikey = tables.apikeys.constFind(key);
+    if (apikey == tables.apikeys.constEnd())
+        return Amount(0);
+    return funds(apikey->user_id, tables.users.value(apikey->user_id), currencyId);
+}
+
+Amount InMemoryDataAccessor::getOrdersCurrencyVolume(const ApiKey& key, const QString& currency)
+{
+    CurrencyId currencyId = Registry::currencyId(currency);
+    Amount volume(0);
+    if (currencyId == INVALID_CURRENCY)
+        return volume;
+    QReadLocker locker(&lock);
+    auto apikey = tables.apikeys.constFind(key);
+    if (apikey == tables.apikeys.constEnd())
+        return volume;
+    // reserved by active orders: goods of sells, currency of buys
+    for (OrderId order_id: tables.userOrders.value(apikey->user_id))
+    {
+        const Order& order = *tables.orders.constFind(order_id);
+        const Registry::Pair* pair = Registry::pair(order.pair);
+        if (!pair)
+            continue;
+        if (order.type == OrderInfo::Type::Sell && pair->goods == currencyId)
+            volume += order.amount;
+        else if (order.type == OrderInfo::Type::Buy && pair->currency == currencyId)
+            volume += order.amount * order.rate;
+    }
+    return volume;
+}
+
+OrderInfo::List InMemoryDataAccessor::negativeAmountOrders()
+{
+    QReadLocker locker(&lock);
+    OrderInfo::List list;
+    for (const Order& order: tables.orders)
+        if (order.amount < Amount(0))
+            list.append(toInfo(order));
+    return list;
+}
+
+Funds InMemoryDataAccessor::exchangeFunds(const std::function<void()>& snapshotTaken)
+{
+    Balances total {};
+    {
+        QReadLocker locker(&lock);
+        for (const User& user: tables.users)
+            for (int currency = 0; currency < MAX_CURRENCIES; currency++)
+                total[currency] += user.funds[currency];
+        for (const QSet<OrderId>& active: tables.userOrders)
+            for (OrderId order_id: active)
+            {
+                const Order& order = *tables.orders.constFind(order_id);
+                const Registry::Pair* pair = Registry::pair(order.pair);
+                if (!pair)
+                    continue;
+                if (order.type == OrderInfo::Type::Sell)
+                    total[pair->goods] += order.amount;
+                else
+                    total[pair->currency] += order.amount * order.rate;
+            }
+    }
+    snapshotTaken();
+    return Registry::funds(total);
+}
+
+void InMemoryDataAccessor::allUsersFunds(QMap<UserId, Balances>& funds, QMap<UserId, OrderInfo::List>& orders)
+{
+    QReadLocker locker(&lock);
+    for (auto user = tables.users.cbegin(); user != tables.users.cend(); ++user)
+        funds.insert(user.key(), user->funds);
+    for (auto active = tables.userOrders.cbegin(); active != tables.userOrders.cend(); ++active)
+        for (OrderId order_id: *active)
+            orders[active.key()].append(toInfo(tables.orders.value(order_id)));
+}
+
+void InMemoryDataAccessor::updateTicker()
+{
+    QDateTime now = EngineClock::now();
+    QDateTime since = now.addSecs(-60 * 60 * 4);
+    QWriteLocker locker(&lock);
+    for (auto it = tables.trades.cbegin(); it != tables.trades.cend(); ++it)
+    {
+        Rate high(0), low(0), sum(0);
+        Amount vol(0), vol_cur(0);
+        int count = 0;
+        for (auto trade = it->crbegin(); trade != it->crend() && trade->created > since; ++trade)
+        {
+            if (!count || high < trade->rate)
+                high = trade->rate;
+            if (!count || trade->rate < low)
+                low = trade->rate;
+            sum += trade->rate;
+            vol += trade->amount;
+            vol_cur += trade->amount * trade->rate;
+            count++;
+        }
+        auto ticker = tables.tickers.find(it.key());
+        if (!count || ticker == tables.tickers.end())
+            continue;
+        ticker->high = high;
+        ticker->low = low;
+        ticker->avg = sum / Rate(count);
+        ticker->vol = vol;
+        ticker->vol_cur = vol_cur;
+        ticker->last = ticker->avg;
+        ticker->buy = ticker->avg;
+        ticker->sell = ticker->avg;
+        ticker->updated = now;
+    }
+}
+
+bool InMemoryDataAccessor::transaction()
+{
+    inTransaction = true;
+    pending.clear();
+    return true;
+}
+
+bool InMemoryDataAccessor::commit()
+{
+    publish();
+    inTransaction = false;
+    return true;
+}
+
+bool InMemoryDataAccessor::rollback()
+{
+    pending.clear();
+    inTransaction = false;
+    return true;
+}
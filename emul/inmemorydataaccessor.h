@@ -0,0 +1,212 @@
+#ifndef INMEMORYDATAACCESSOR_H
+#define INMEMORYDATAACCESSOR_H
+
+#include "sqlclient.h"
+
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QPair>
+#include <QReadWriteLock>
+#include <QSet>
+#include <QVector>
+
+#include <atomic>
+
+class QSqlDatabase;
+
+/// Data accessor keeping whole exchange in process memory, for load tests
+/// and test runs at memory speed. Tables are static and shared by every
+/// accessor (one per FastCGI worker) under one read-write lock, so each
+/// call is atomic. They are seeded from SQL by load() at start and never
+/// written back.
+/// Writes of a transaction are kept by its accessor and published by
+/// commit() at once under write lock, so other accessors do not see them
+/// before; rollback() just drops them. They are published as differences
+/// (deposit changes, amount reductions, closing of orders), which add to
+/// changes committed meanwhile by other accessors. Reads of this accessor
+/// by user or order id see its own pending writes, as a SQL transaction
+/// does. Orders matched by a trade may be cancelled only under the same
+/// trade mutex of Responce, so a cancel does not refund a stale amount.
+/// Changes outside of transaction are committed at once, nonces are never
+/// rolled back, same as with autocommit SQL connection of authentificator.
+class InMemoryDataAccessor : public AbstractDataAccessor
+{
+public:
+    InMemoryDataAccessor();
+    virtual ~InMemoryDataAccessor();
+
+    PairInfo::List   allPairsInfoList() override;
+    PairInfo::Ptr    pairInfo(const PairName& pair) override;
+    TickerInfo::Ptr  tickerInfo(const PairName& pair) override;
+    OrderInfo::Ptr   orderInfo(OrderId order_id) override;
+    OrderInfo::List  activeOrdersInfoList(const QString& apikey) override;
+    TradeInfo::List  allTradesInfo(const PairName& pair) override;
+    UserTradeInfo::List userTradesInfo(UserId user_id, const PairName& pair, const HistoryPage& page) override;
+    ApikeyInfo::Ptr  apikeyInfo(const ApiKey& apikey) override;
+    UserInfo::Ptr    userInfo(UserId user_id) override;
+
+    QMap<PairName, BuySellDepth> allActiveOrdersAmountAgreggatedByRateList(const QList<PairName>& pairs) override;
+    bool tradeUpdateDeposit(const UserId &user_id, CurrencyId currency, const Amount& diff, const QString& userName) override;
+    bool reduceOrderAmount(OrderId order_id, const Amount& amount) override;
+    bool closeOrder(OrderId order_id) override;
+    bool cancelOrder(OrderId order_id) override;
+    OrderInfo::List matchingOrders(const PairName& pair, OrderInfo::Type type, const Rate& rate, UserId user_id) override;
+    TradeId createNewTradeRecord(UserId user_id, OrderId order_id, const Amount& amount) override;
+    OrderId createNewOrderRecord(const PairName& pair, const UserId& user_id, OrderInfo::Type type, const Rate& rate, const Amount& start_amount) override;
+    bool reserveDepositVolume(UserId user_id, CurrencyId currency, const Amount& volume) override;
+    Amount depositVolume(UserId user_id, CurrencyId currency) override;
+
+    virtual QByteArray randomKeyWithPermissions(bool info, bool trade, bool withdraw) override;
+    virtual QByteArray randomKeyForTrade(const QString& currency, const Amount& amount) override;
+    virtual QByteArray signWithKey(const QByteArray& message, const ApiKey& key) override;
+    virtual QByteArray secretForKey(const ApiKey& key) override;
+    virtual bool       updateNonce(const ApiKey& key, quint32 nonce) override;
+
+    virtual Amount getDepositCurrencyVolume(const ApiKey& key, const QString& currency) override;
+    virtual Amount  getOrdersCurrencyVolume(const ApiKey& key, const QString& currency) override;
+
+    virtual OrderInfo::List negativeAmountOrders() override;
+    virtual Funds exchangeFunds(const std::function<void()>& snapshotTaken) override;
+    virtual void allUsersFunds(QMap<UserId, Balances>& funds, QMap<UserId, OrderInfo::List>& orders) override;
+
+    virtual void updateTicker() override;
+
+    virtual bool transaction() override;
+    virtual bool commit()      override;
+    virtual bool rollback()    override;
+
+    /// replaces tables by content of SQL schema, called before any request
+    static void load(QSqlDatabase& db);
+    /// replaces tables and Registry by generated ones, for tests without
+    /// database: btc_usd, btc_eur and ltc_usd with a book and trades each,
+    /// exchange user and emulated users with funds in every currency and
+    /// a key for each set of permissions; same content on every run
+    static void seed(int usersCount, UserId exchangeUserId);
+    static void clear();
+
+private:
+    struct Order
+    {
+        OrderId order_id = 0;
+        PairName pair;
+        OrderInfo::Type type = OrderInfo::Type::Buy;
+        Amount start_amount;
+        Amount amount;
+        Rate rate;
+        QDateTime created;
+        OrderInfo::Status status = OrderInfo::Status::Active;
+        UserId user_id = 0;
+    };
+
+    struct Trade
+    {
+        TradeId trade_id = 0;
+        UserId user_id = 0;
+        OrderId order_id = 0;
+        TradeInfo::Type type = TradeInfo::Type::Bid;
+        Rate rate;
+        Amount amount;
+        QDateTime created;
+    };
+
+    struct User
+    {
+        QString name;
+        int type = 0;
+        Balances funds {};
+    };
+
+    struct Apikey
+    {
+        bool info = false;
+        bool trade = false;
+        bool withdraw = false;
+        QByteArray secret;
+        quint32 nonce = 0;
+        UserId user_id = 0;
+    };
+
+    /// trade of a user in its history
+    struct UserTrade
+    {
+        TradeId trade_id = 0;
+        PairName pair;
+        bool yourOrder = false;
+        QDateTime created;
+    };
+
+    /// active orders of a side by matching priority: sells by rate, buys
+    /// by negated rate, then by id; value is owner to skip own orders
+    using Side = QMap<QPair<Rate, OrderId>, UserId>;
+
+    struct Book
+    {
+        Side sells;
+        Side buys;
+    };
+
+    struct Tables
+    {
+        QHash<PairName, PairInfo> pairs;
+        QHash<PairName, TickerInfo> tickers;
+        QHash<OrderId, Order> orders;
+        QHash<PairName, Book> books;
+        /// trades of a pair in id order
+        QHash<PairName, QVector<Trade>> trades;
+        /// trades of both users of each trade, in id and so in time order
+        QHash<UserId, QVector<UserTrade>> userTrades;
+        QHash<UserId, User> users;
+        QHash<UserId, QSet<OrderId>> userOrders;
+        QHash<ApiKey, Apikey> apikeys;
+        QHash<UserId, QList<ApiKey>> userKeys;
+
+        void activate(const Order& order);
+        void deactivate(const Order& order);
+        /// trades are kept in id order, though transactions commit in any
+        void addTrade(const Trade& trade, const PairName& pair, UserId owner);
+    };
+
+    /// writes not yet published to tables
+    struct Pending
+    {
+        struct NewTrade
+        {
+            Trade trade;
+            PairName pair;
+            UserId owner;
+        };
+
+        QHash<UserId, Balances> deposits;
+        QList<Order> createdOrders;
+        QHash<OrderId, Amount> reductions;
+        /// true for cancel, false for close
+        QHash<OrderId, bool> finishes;
+        QList<NewTrade> trades;
+
+        bool isEmpty() const;
+        void clear();
+    };
+
+    static QPair<Rate, OrderId> sideKey(const Order& order);
+    static OrderInfo::Ptr toInfo(const Order& order);
+    static void finish(Order& order, bool cancel);
+    /// order as this accessor sees it, with its pending writes; called
+    /// under lock, false if there is no such order
+    bool findOrder(OrderId order_id, Order& order) const;
+    Amount funds(UserId user_id, const User& user, CurrencyId currency) const;
+    bool finishOrder(OrderId order_id, bool cancel);
+    /// publishes pending writes, at once when not in transaction
+    void publish();
+    void autoCommit();
+
+    bool inTransaction = false;
+    Pending pending;
+
+    static Tables tables;
+    static QReadWriteLock lock;
+    static std::atomic<quint64> nextOrderSlot;
+    static std::atomic<TradeId> nextTradeId;
+};
+
+#endif // INMEMORYDATAACCESSOR_H
@@ -0,0 +1,119 @@
+#include "invariantmonitor.h"
+#include "registry.h"
+#include "utils.h"
+
+#include <iostream>
+
+// products in trade volumes are rounded to 7 digits, each order may leave a few units
+const Amount InvariantMonitor::tolerance = Amount("0.000001");
+
+QAtomicInt InvariantMonitor::violationsCount;
+QStringList InvariantMonitor::recentViolations;
+Funds InvariantMonitor::totalDrift;
+QMutex InvariantMonitor::access;
+
+void InvariantMonitor::Transaction::depositChanged(CurrencyId currency, const Amount& diff)
+{
+    net[currency] += diff;
+    touched |= 1u << currency;
+}
+
+void InvariantMonitor::Transaction::orderChanged(OrderId order_id, CurrencyId currency, const Amount& reserveDiff, const Amount& amountLeft)
+{
+    net[currency] += reserveDiff;
+    touched |= 1u << currency;
+    ordersCount++;
+    if (amountLeft < Amount(0))
+        negativeOrders.append(qMakePair(order_id, amountLeft));
+}
+
+void InvariantMonitor::Transaction::feeCollected(CurrencyId currency, const Amount& fee)
+{
+    net[currency] += fee;
+    touched |= 1u << currency;
+}
+
+void InvariantMonitor::Transaction::clear()
+{
+    for (int cur = 0; cur < MAX_CURRENCIES; cur++)
+        if (touched & (1u << cur))
+            net[cur] = Amount(0);
+    touched = 0;
+    ordersCount = 0;
+    negativeOrders.clear();
+}
+
+Amount InvariantMonitor::reserve(const OrderInfo& order, CurrencyId& currency)
+{
+    const Registry::Pair* pair = Registry::pair(order.pair);
+    if (!pair)
+        return Amount(0);
+    currency = (order.type == OrderInfo::Type::Sell) ? pair->goods : pair->currency;
+    if (order.status != OrderInfo::Status::Active)
+        return Amount(0);
+    return (order.type == OrderInfo::Type::Sell) ? order.amount : order.amount * order.rate;
+}
+
+bool InvariantMonitor::verify(const Transaction& transaction, QStringList& reasons)
+{
+    reasons.clear();
+    for (const QPair<OrderId, Amount>& order: transaction.negativeOrders)
+        reasons << QString("order %1 amount goes negative: %2").arg(order.first).arg(dec2qstr(order.second));
+
+    // residue of rounding grows with count of orders touched
+    Amount allowed = tolerance * Amount(qMax(transaction.ordersCount, 1));
+    for (int cur = 0; cur < MAX_CURRENCIES; cur++)
+        if ((transaction.touched & (1u << cur)) && (transaction.net[cur] > allowed || transaction.net[cur] < -allowed))
+            reasons << QString("%1 not conserved, transaction leaves %2").arg(Registry::currencyName(cur)).arg(dec2qstr(transaction.net[cur]));
+    return reasons.isEmpty();
+}
+
+bool InvariantMonitor::isConsistent(const Transaction& transaction, QStringList& reasons)
+{
+    return verify(transaction, reasons);
+}
+
+bool InvariantMonitor::check(const Transaction& transaction)
+{
+    QStringList reasons;
+    if (!verify(transaction, reasons))
+    {
+        for (const QString& reason: reasons)
+            reportViolation(reason);
+        return false;
+    }
+
+    QMutexLocker lock(&access);
+    for (int cur = 0; cur < MAX_CURRENCIES; cur++)
+        if (transaction.touched & (1u << cur))
+            totalDrift[Registry::currencyName(cur)] += transaction.net[cur];
+    return true;
+}
+
+void InvariantMonitor::reportViolation(const QString& reason)
+{
+    std::cerr << "***** ERROR **** : invariant violation: " << reason << std::endl;
+    violationsCount.ref();
+
+    QMutexLocker lock(&access);
+    recentViolations << reason;
+    while (recentViolations.size() > 20)
+        recentViolations.removeFirst();
+}
+
+int InvariantMonitor::violations()
+{
+    return violationsCount.load();
+}
+
+QStringList InvariantMonitor::lastViolations()
+{
+    QMutexLocker lock(&access);
+    return recentViolations;
+}
+
+Funds InvariantMonitor::drift()
+{
+    QMutexLocker lock(&access);
+    return totalDrift;
+}
@@ -0,0 +1,74 @@
+#ifndef INVARIANTMONITOR_H
+#define INVARIANTMONITOR_H
+
+#include "types.h"
+
+#include <QAtomicInt>
+#include <QMutex>
+#include <QPair>
+#include <QStringList>
+
+/// Online check of funds conservation and order amounts.
+/// Every exchange transaction notes the changes it passes to the data
+/// accessor: deposit differences, changes of funds reserved by orders,
+/// which are counted from amounts of the orders, and the exchange fees it
+/// collected. Before commit per currency they must sum up to zero, and no
+/// order may be left with amount below zero. The check costs O(1) per
+/// change and reads nothing; stored state is compared by the periodic
+/// audit.
+class InvariantMonitor
+{
+public:
+    class Transaction
+    {
+    public:
+        /// difference passed to tradeUpdateDeposit()
+        void depositChanged(CurrencyId currency, const Amount& diff);
+        /// change of funds reserved by order and amount it is left with
+        void orderChanged(OrderId order_id, CurrencyId currency, const Amount& reserveDiff, const Amount& amountLeft);
+        /// exchange income, kept in FeeAccumulator till folded
+        void feeCollected(CurrencyId currency, const Amount& fee);
+
+        void clear();
+
+    private:
+        friend class InvariantMonitor;
+        Balances net {};
+        /// bit per currency changed since clear
+        quint32 touched = 0;
+        int ordersCount = 0;
+        QList<QPair<OrderId, Amount>> negativeOrders;
+    };
+
+    /// funds held by order: goods of active sell, currency of active buy,
+    /// nothing for finished one
+    static Amount reserve(const OrderInfo& order, CurrencyId& currency);
+
+    /// false, if changes of transaction break an invariant; the
+    /// violation is logged and counted, transaction should be rolled back
+    static bool check(const Transaction& transaction);
+    /// same check without reporting, broken invariants go to reasons
+    static bool isConsistent(const Transaction& transaction, QStringList& reasons);
+
+    /// failure of a check done outside of exchange transactions
+    static void reportViolation(const QString& reason);
+
+    static int violations();
+    static QStringList lastViolations();
+
+    /// rounding residue of all checked transactions, it stays within
+    /// tolerance per transaction but is summed up here to spot slow leaks
+    static Funds drift();
+
+private:
+    static bool verify(const Transaction& transaction, QStringList& reasons);
+
+    static const Amount tolerance;
+
+    static QAtomicInt violationsCount;
+    static QStringList recentViolations;
+    static Funds totalDrift;
+    static QMutex access;
+};
+
+#endif // INVARIANTMONITOR_H
@@ -0,0 +1,1127 @@
+#include "lmdbdataaccessor.h"
+#include "engineclock.h"
+#include "registry.h"
+#include "shardconfig.h"
+#include "utils.h"
+
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QThread>
+#include <QTimer>
+#include <QVariant>
+#include <QtEndian>
+
+#include <iostream>
+
+MDB_env* LmdbDataAccessor::env = nullptr;
+MDB_dbi LmdbDataAccessor::dbi = 0;
+QThread* LmdbDataAccessor::syncThread = nullptr;
+
+static QByteArray bigEndian(quint32 value)
+{
+    QByteArray ret(sizeof(value), 0);
+    qToBigEndian(value, reinterpret_cast<uchar*>(ret.data()));
+    return ret;
+}
+
+static QByteArray bigEndian(quint64 value)
+{
+    QByteArray ret(sizeof(value), 0);
+    qToBigEndian(value, reinterpret_cast<uchar*>(ret.data()));
+    return ret;
+}
+
+static quint32 fromBigEndian32(const QByteArray& bytes, int offset = 0)
+{
+    return qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(bytes.constData() + offset));
+}
+
+static quint64 fromBigEndian64(const QByteArray& bytes)
+{
+    return qFromBigEndian<quint64>(reinterpret_cast<const uchar*>(bytes.constData()));
+}
+
+/// sells sort by rate ascending, buys descending
+static QByteArray rateKey(const Rate& rate, OrderInfo::Type type)
+{
+    quint64 key = static_cast<quint64>(rate.getUnbiased()) ^ (1ULL << 63);
+    if (type == OrderInfo::Type::Buy)
+        key = ~key;
+    return bigEndian(key);
+}
+
+static MDB_val toVal(const QByteArray& bytes)
+{
+    MDB_val val;
+    val.mv_size = static_cast<size_t>(bytes.size());
+    val.mv_data = const_cast<char*>(bytes.constData());
+    return val;
+}
+
+static QByteArray fromVal(const MDB_val& val)
+{
+    return QByteArray(static_cast<const char*>(val.mv_data), static_cast<int>(val.mv_size));
+}
+
+LmdbDataAccessor::Txn::Txn(LmdbDataAccessor& accessor, bool write)
+{
+    if (accessor.writeTxn)
+    {
+        txn = accessor.writeTxn;
+        return;
+    }
+    own = true;
+    int rc = mdb_txn_begin(env, nullptr, write ? 0 : MDB_RDONLY, &txn);
+    if (rc)
+    {
+        std::cerr << "[lmdb] cannot begin transaction: " << mdb_strerror(rc) << std::endl;
+        txn = nullptr;
+        failed = true;
+    }
+}
+
+LmdbDataAccessor::Txn::~Txn()
+{
+    if (own && txn)
+        mdb_txn_abort(txn);
+}
+
+bool LmdbDataAccessor::Txn::ok() const
+{
+    return !failed;
+}
+
+bool LmdbDataAccessor::Txn::commit()
+{
+    if (!own)
+        return !failed;
+    if (!txn)
+        return false;
+    MDB_txn* committed = txn;
+    txn = nullptr;
+    if (failed)
+    {
+        mdb_txn_abort(committed);
+        return false;
+    }
+    int rc = mdb_txn_commit(committed);
+    if (rc)
+    {
+        std::cerr << "[lmdb] cannot commit: " << mdb_strerror(rc) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool LmdbDataAccessor::Txn::get(const QByteArray& key, QByteArray& value)
+{
+    if (!txn)
+        return false;
+    MDB_val k = toVal(key);
+    MDB_val v;
+    int rc = mdb_get(txn, dbi, &k, &v);
+    if (rc)
+    {
+        if (rc != MDB_NOTFOUND)
+        {
+            std::cerr << "[lmdb] cannot get: " << mdb_strerror(rc) << std::endl;
+            failed = true;
+        }
+        return false;
+    }
+    value = fromVal(v);
+    return true;
+}
+
+bool LmdbDataAccessor::Txn::put(const QByteArray& key, const QByteArray& value)
+{
+    if (!txn)
+        return false;
+    MDB_val k = toVal(key);
+    MDB_val v = toVal(value);
+    int rc = mdb_put(txn, dbi, &k, &v, 0);
+    if (rc)
+    {
+        std::cerr << "[lmdb] cannot put: " << mdb_strerror(rc) << std::endl;
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+bool LmdbDataAccessor::Txn::remove(const QByteArray& key)
+{
+    if (!txn)
+        return false;
+    MDB_val k = toVal(key);
+    int rc = mdb_del(txn, dbi, &k, nullptr);
+    if (rc && rc != MDB_NOTFOUND)
+    {
+        std::cerr << "[lmdb] cannot delete: " << mdb_strerror(rc) << std::endl;
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+void LmdbDataAccessor::Txn::scan(const QByteArray& prefix, bool backward, const std::function<bool(const QByteArray&, QByteArray&)>& visit,
+                                 const QByteArray& start)
+{
+    MDB_cursor* cursor;
+    if (!txn || mdb_cursor_open(txn, dbi, &cursor))
+        return;
+    MDB_val k;
+    MDB_val v;
+    int rc;
+    if (!backward)
+    {
+        k = toVal(start.isEmpty() ? prefix : start);
+        rc = mdb_cursor_get(cursor, &k, &v, MDB_SET_RANGE);
+    }
+    else if (!start.isEmpty())
+    {
+        k = toVal(start);
+        rc = mdb_cursor_get(cursor, &k, &v, MDB_SET_RANGE);
+        if (rc)
+            rc = mdb_cursor_get(cursor, &k, &v, MDB_LAST);
+        else if (fromVal(k) != start)
+            rc = mdb_cursor_get(cursor, &k, &v, MDB_PREV);
+    }
+    else
+    {
+        // first key after the prefix range, or the end
+        QByteArray after = prefix;
+        while (!after.isEmpty() && static_cast<uchar>(after.at(after.size() - 1)) == 0xFF)
+            after.chop(1);
+        if (!after.isEmpty())
+            after[after.size() - 1] = static_cast<char>(after.at(after.size() - 1) + 1);
+        k = toVal(after);
+        if (after.isEmpty() || mdb_cursor_get(cursor, &k, &v, MDB_SET_RANGE))
+            rc = mdb_cursor_get(cursor, &k, &v, MDB_LAST);
+        else
+            rc = mdb_cursor_get(cursor, &k, &v, MDB_PREV);
+    }
+    while (rc == 0)
+    {
+        QByteArray key = fromVal(k);
+        if (!key.startsWith(prefix))
+            break;
+        QByteArray value = fromVal(v);
+        if (!visit(key, value))
+            break;
+        rc = mdb_cursor_get(cursor, &k, &v, backward ? MDB_PREV : MDB_NEXT);
+    }
+    mdb_cursor_close(cursor);
+}
+
+LmdbDataAccessor::LmdbDataAccessor()
+{
+}
+
+LmdbDataAccessor::~LmdbDataAccessor()
+{
+    rollback();
+}
+
+QByteArray LmdbDataAccessor::orderKey(OrderId order_id)
+{
+    return 'o' + bigEndian(order_id);
+}
+
+QByteArray LmdbDataAccessor::bookPrefix(const PairName& pair, OrderInfo::Type type)
+{
+    return 'b' + pair.toUtf8() + '\0' + ((type == OrderInfo::Type::Sell) ? 's' : 'b');
+}
+
+QByteArray LmdbDataAccessor::bookKey(const OrderInfo& order)
+{
+    return bookPrefix(order.pair, order.type) + rateKey(order.rate, order.type) + bigEndian(order.order_id);
+}
+
+QByteArray LmdbDataAccessor::userOrderKey(UserId user_id, OrderId order_id)
+{
+    return 'a' + bigEndian(user_id) + bigEndian(order_id);
+}
+
+QByteArray LmdbDataAccessor::tradeKey(const PairName& pair, TradeId trade_id)
+{
+    return 'r' + pair.toUtf8() + '\0' + bigEndian(trade_id);
+}
+
+QByteArray LmdbDataAccessor::userTradeKey(UserId user_id, TradeId trade_id)
+{
+    return 'h' + bigEndian(user_id) + bigEndian(trade_id);
+}
+
+QByteArray LmdbDataAccessor::depositKey(UserId user_id, const QString& currency)
+{
+    return 'd' + bigEndian(user_id) + currency.toUtf8();
+}
+
+QByteArray LmdbDataAccessor::packTrade(const Trade& trade)
+{
+    QByteArray buffer;
+    QDataStream stream(&buffer, QIODevice::WriteOnly);
+    stream << trade.user_id
+           << trade.order_id
+           << static_cast<int>(trade.type)
+           << trade.rate
+           << trade.amount
+           << trade.created;
+    return buffer;
+}
+
+LmdbDataAccessor::Trade LmdbDataAccessor::unpackTrade(QByteArray& value)
+{
+    Trade trade;
+    int type;
+    QDataStream stream(&value, QIODevice::ReadOnly);
+    stream >> trade.user_id
+           >> trade.order_id
+           >> type
+           >> trade.rate
+           >> trade.amount
+           >> trade.created;
+    trade.type = static_cast<TradeInfo::Type>(type);
+    return trade;
+}
+
+OrderInfo::Ptr LmdbDataAccessor::readOrder(Txn& txn, OrderId order_id)
+{
+    QByteArray value;
+    if (!txn.get(orderKey(order_id), value))
+        return nullptr;
+    OrderInfo::Ptr info = OrderInfo::create();
+    info->unpack(value);
+    return info;
+}
+
+bool LmdbDataAccessor::writeOrder(Txn& txn, const OrderInfo& order)
+{
+    return txn.put(orderKey(order.order_id), order.pack());
+}
+
+Amount LmdbDataAccessor::readDeposit(Txn& txn, UserId user_id, const QString& currency)
+{
+    QByteArray value;
+    if (!txn.get(depositKey(user_id, currency), value))
+        return Amount(0);
+    return qstr2dec<7>(QString::fromUtf8(value));
+}
+
+quint64 LmdbDataAccessor::nextId(Txn& txn, const char* sequence)
+{
+    QByteArray key = QByteArray("s") + sequence;
+    QByteArray value;
+    if (!txn.get(key, value))
+        return 0;
+    quint64 id = fromBigEndian64(value);
+    if (!txn.put(key, bigEndian(id + 1)))
+        return 0;
+    return id;
+}
+
+UserId LmdbDataAccessor::keyOwner(Txn& txn, const ApiKey& apikey)
+{
+    QByteArray value;
+    if (!txn.get('k' + apikey.toUtf8(), value))
+        return 0;
+    ApikeyInfo info;
+    info.unpack(value);
+    return info.user_id;
+}
+
+bool LmdbDataAccessor::open(const QString& directory, quint64 mapSize, int syncIntervalMsecs, QSqlDatabase& db)
+{
+    if (env)
+        return true;
+    QDir().mkpath(directory);
+    int rc = mdb_env_create(&env);
+    if (!rc)
+        rc = mdb_env_set_mapsize(env, mapSize);
+    // workers keep read transactions in their own accessors, not per thread
+    unsigned int flags = MDB_NOTLS;
+    if (syncIntervalMsecs > 0)
+        flags |= MDB_NOSYNC;
+    if (!rc)
+        rc = mdb_env_open(env, QFile::encodeName(directory).constData(), flags, 0644);
+    if (rc)
+    {
+        std::cerr << "[lmdb] cannot open " << directory.toStdString() << ": " << mdb_strerror(rc) << std::endl;
+        close();
+        return false;
+    }
+    int dead = 0;
+    mdb_reader_check(env, &dead);
+    if (dead)
+        std::clog << "[lmdb] cleared " << dead << " readers of dead processes" << std::endl;
+
+    MDB_txn* setup;
+    rc = mdb_txn_begin(env, nullptr, 0, &setup);
+    if (!rc)
+        rc = mdb_dbi_open(setup, nullptr, 0, &dbi);
+    if (!rc)
+        rc = mdb_txn_commit(setup);
+    if (rc)
+    {
+        std::cerr << "[lmdb] cannot open database: " << mdb_strerror(rc) << std::endl;
+        close();
+        return false;
+    }
+
+    bool empty;
+    {
+        LmdbDataAccessor accessor;
+        Txn txn(accessor, false);
+        QByteArray value;
+        empty = !txn.get("sorders", value);
+    }
+    if (empty && !import(db))
+    {
+        close();
+        return false;
+    }
+
+    if (syncIntervalMsecs > 0)
+    {
+        syncThread = new QThread;
+        QObject* context = new QObject;
+        context->moveToThread(syncThread);
+        QObject::connect(syncThread, &QThread::started, context, [context, syncIntervalMsecs]()
+        {
+            QTimer* timer = new QTimer(context);
+            QObject::connect(timer, &QTimer::timeout, context, &LmdbDataAccessor::sync);
+            timer->start(syncIntervalMsecs);
+        });
+        QObject::connect(syncThread, &QThread::finished, context, &QObject::deleteLater);
+        syncThread->start();
+    }
+    return true;
+}
+
+bool LmdbDataAccessor::isOpen()
+{
+    return env != nullptr;
+}
+
+void LmdbDataAccessor::sync()
+{
+    if (!env)
+        return;
+    int rc = mdb_env_sync(env, 1);
+    if (rc)
+        std::cerr << "[lmdb] cannot sync: " << mdb_strerror(rc) << std::endl;
+}
+
+void LmdbDataAccessor::close()
+{
+    if (syncThread)
+    {
+        syncThread->quit();
+        syncThread->wait();
+        delete syncThread;
+        syncThread = nullptr;
+    }
+    if (!env)
+        return;
+    sync();
+    mdb_env_close(env);
+    env = nullptr;
+}
+
+bool LmdbDataAccessor::import(QSqlDatabase& db)
+{
+    LmdbDataAccessor accessor;
+    Txn txn(accessor, true);
+    DirectSqlDataAccessor sqlAccessor(db);
+    for (const PairInfo::Ptr& info: sqlAccessor.allPairsInfoList())
+    {
+        txn.put('p' + info->pair.toUtf8(), info->pack());
+        TickerInfo::Ptr ticker = sqlAccessor.tickerInfo(info->pair);
+        if (ticker)
+            txn.put('t' + info->pair.toUtf8(), ticker->pack());
+    }
+
+    QSqlQuery sql(db);
+    performSql("export users", sql, "select user_id, name, user_type from users", true);
+    while (sql.next())
+    {
+        QByteArray value;
+        QDataStream stream(&value, QIODevice::WriteOnly);
+        stream << sql.value(1).toString() << sql.value(2).toInt();
+        txn.put('u' + bigEndian(sql.value(0).toUInt()), value);
+    }
+
+    performSql("export deposits", sql, "select d.user_id, c.currency, d.volume from deposits d left join currencies c on c.currency_id = d.currency_id", true);
+    while (sql.next())
+        txn.put(depositKey(sql.value(0).toUInt(), sql.value(1).toString()), sql.value(2).toString().toUtf8());
+
+    performSql("export apikeys", sql, "select apikey, info, trade, withdraw, user_id, secret, nonce from apikeys", true);
+    while (sql.next())
+    {
+        ApikeyInfo info;
+        info.apikey = sql.value(0).toString();
+        info.info = sql.value(1).toBool();
+        info.trade = sql.value(2).toBool();
+        info.withdraw = sql.value(3).toBool();
+        info.user_id = sql.value(4).toUInt();
+        info.secret = sql.value(5).toByteArray();
+        info.nonce = sql.value(6).toUInt();
+        txn.put('k' + info.apikey.toUtf8(), info.pack());
+        txn.put('K' + bigEndian(info.user_id) + info.apikey.toUtf8(), QByteArray());
+    }
+
+    OrderId maxOrderId = 0;
+    QHash<OrderId, QPair<PairName, TradeInfo::Type>> orderSides;
+    QHash<OrderId, Rate> orderRates;
+    QHash<OrderId, UserId> orderOwners;
+    performSql("export orders", sql, "select o.order_id, p.pair, o.type, o.start_amount, o.amount, o.rate, o.created, o.status+0, o.user_id from orders o left join pairs p on p.pair_id = o.pair_id "
+                                     "union all select o.order_id, p.pair, o.type, o.start_amount, o.amount, o.rate, o.created, o.status+0, o.user_id from orders_history o left join pairs p on p.pair_id = o.pair_id", true);
+    while (sql.next())
+    {
+        OrderInfo order;
+        order.order_id = sql.value(0).toUInt();
+        order.pair = sql.value(1).toString();
+        order.type = (sql.value(2).toString() == "sell") ? OrderInfo::Type::Sell : OrderInfo::Type::Buy;
+        order.start_amount = Amount(sql.value(3).toString().toStdString());
+        order.amount = Amount(sql.value(4).toString().toStdString());
+        order.rate = Rate(sql.value(5).toString().toStdString());
+        order.created = sql.value(6).toDateTime();
+        order.status = static_cast<OrderInfo::Status>(sql.value(7).toInt());
+        order.user_id = sql.value(8).toUInt();
+        writeOrder(txn, order);
+        if (order.status == OrderInfo::Status::Active)
+        {
+            txn.put(bookKey(order), bigEndian(order.user_id));
+            txn.put(userOrderKey(order.user_id, order.order_id), QByteArray());
+        }
+        orderSides.insert(order.order_id, qMakePair(order.pair, (order.type == OrderInfo::Type::Buy) ? TradeInfo::Type::Bid : TradeInfo::Type::Ask));
+        orderRates.insert(order.order_id, order.rate);
+        orderOwners.insert(order.order_id, order.user_id);
+        maxOrderId = qMax(maxOrderId, order.order_id);
+    }
+
+    TradeId maxTradeId = 0;
+    performSql("export trades", sql, "select trade_id, user_id, order_id, amount, created from trades union all select trade_id, user_id, order_id, amount, created from trades_history", true);
+    while (sql.next())
+    {
+        OrderId order_id = sql.value(2).toUInt();
+        if (!orderSides.contains(order_id))
+            continue;
+        Trade trade;
+        trade.user_id = sql.value(1).toUInt();
+        trade.order_id = order_id;
+        trade.type = orderSides.value(order_id).second;
+        trade.rate = orderRates.value(order_id);
+        trade.amount = Amount(sql.value(3).toString().toStdString());
+        trade.created = sql.value(4).toDateTime();
+        TradeId trade_id = sql.value(0).toUInt();
+        QByteArray pair = orderSides.value(order_id).first.toUtf8();
+        txn.put(tradeKey(orderSides.value(order_id).first, trade_id), packTrade(trade));
+        txn.put(userTradeKey(trade.user_id, trade_id), pair);
+        txn.put(userTradeKey(orderOwners.value(order_id), trade_id), pair);
+        maxTradeId = qMax(maxTradeId, trade_id);
+    }
+
+    txn.put("sorders", bigEndian(static_cast<quint64>(maxOrderId / ShardConfig::count() + 1)));
+    txn.put("strades", bigEndian(static_cast<quint64>(maxTradeId + 1)));
+    if (!txn.commit())
+        return false;
+    std::clog << "[lmdb] imported " << orderSides.size() << " orders from SQL" << std::endl;
+    return true;
+}
+
+PairInfo::List LmdbDataAccessor::allPairsInfoList()
+{
+    Txn txn(*this, false);
+    PairInfo::List ret;
+    txn.scan("p", false, [&ret](const QByteArray&, QByteArray& value)
+    {
+        PairInfo::Ptr info = PairInfo::create();
+        info->unpack(value);
+        ret.append(info);
+        return true;
+    });
+    return ret;
+}
+
+PairInfo::Ptr LmdbDataAccessor::pairInfo(const PairName& pair)
+{
+    Txn txn(*this, false);
+    QByteArray value;
+    if (!txn.get('p' + pair.toUtf8(), value))
+        return nullptr;
+    PairInfo::Ptr info = PairInfo::create();
+    info->unpack(value);
+    return info;
+}
+
+TickerInfo::Ptr LmdbDataAccessor::tickerInfo(const PairName& pair)
+{
+    Txn txn(*this, false);
+    QByteArray value;
+    if (!txn.get('t' + pair.toUtf8(), value))
+        return nullptr;
+    TickerInfo::Ptr info = TickerInfo::create();
+    info->unpack(value);
+    return info;
+}
+
+OrderInfo::Ptr LmdbDataAccessor::orderInfo(OrderId order_id)
+{
+    Txn txn(*this, false);
+    return readOrder(txn, order_id);
+}
+
+OrderInfo::List LmdbDataAccessor::activeOrdersInfoList(const QString& apikey)
+{
+    Txn txn(*this, false);
+    OrderInfo::List list;
+    UserId user_id = keyOwner(txn, apikey);
+    if (!user_id)
+        return list;
+    txn.scan('a' + bigEndian(user_id), false, [&txn, &list](const QByteArray& key, QByteArray&)
+    {
+        OrderInfo::Ptr info = readOrder(txn, fromBigEndian32(key, 5));
+        if (info)
+            list.append(info);
+        return true;
+    });
+    return list;
+}
+
+TradeInfo::List LmdbDataAccessor::allTradesInfo(const PairName& pair)
+{
+    Txn txn(*this, false);
+    TradeInfo::List list;
+    QByteArray prefix = 'r' + pair.toUtf8() + '\0';
+    txn.scan(prefix, true, [&list, &prefix](const QByteArray& key, QByteArray& value)
+    {
+        Trade trade = unpackTrade(value);
+        TradeInfo::Ptr info = TradeInfo::create();
+        info->type = trade.type;
+        info->rate = trade.rate;
+        info->amount = trade.amount;
+        info->tid = fromBigEndian32(key, prefix.size());
+        info->created = trade.created;
+        info->order_id = trade.order_id;
+        info->user_id = trade.user_id;
+        list.append(info);
+        return true;
+    });
+    return list;
+}
+
+UserTradeInfo::List LmdbDataAccessor::userTradesInfo(UserId user_id, const PairName& pair, const HistoryPage& page)
+{
+    Txn txn(*this, false);
+    UserTradeInfo::List list;
+    if (page.count == 0)
+        return list;
+    QByteArray prefix = 'h' + bigEndian(user_id);
+    quint32 skip = page.from;
+    txn.scan(prefix, page.desc, [&txn, &list, &prefix, &pair, &page, &skip, user_id](const QByteArray& key, QByteArray& value)
+    {
+        TradeId trade_id = fromBigEndian32(key, prefix.size());
+        if (page.desc ? trade_id < page.from_id : trade_id > page.end_id)
+            return false;
+        PairName tradePair = QString::fromUtf8(value);
+        QByteArray record;
+        if ((!pair.isEmpty() && tradePair != pair) || !txn.get(tradeKey(tradePair, trade_id), record))
+            return true;
+        Trade trade = unpackTrade(record);
+        // time grows with id, so time range ends the scan on one side
+        if (page.since.isValid() && trade.created < page.since)
+            return !page.desc;
+        if (page.end.isValid() && trade.created > page.end)
+            return page.desc;
+        if (skip > 0)
+        {
+            skip--;
+            return true;
+        }
+        OrderInfo::Type orderType = (trade.type == TradeInfo::Type::Bid) ? OrderInfo::Type::Buy : OrderInfo::Type::Sell;
+        UserTradeInfo::Ptr info = UserTradeInfo::create();
+        info->tid = trade_id;
+        info->pair = tradePair;
+        info->is_your_order = trade.user_id != user_id;
+        if (info->is_your_order)
+            info->type = orderType;
+        else
+            info->type = (orderType == OrderInfo::Type::Buy) ? OrderInfo::Type::Sell : OrderInfo::Type::Buy;
+        info->rate = trade.rate;
+        info->amount = trade.amount;
+        info->order_id = trade.order_id;
+        info->created = trade.created;
+        list.append(info);
+        return static_cast<quint32>(list.size()) < page.count;
+    }, prefix + bigEndian(page.desc ? page.end_id : page.from_id));
+    return list;
+}
+
+ApikeyInfo::Ptr LmdbDataAccessor::apikeyInfo(const ApiKey& apikey)
+{
+    Txn txn(*this, false);
+    QByteArray value;
+    if (!txn.get('k' + apikey.toUtf8(), value))
+        return nullptr;
+    ApikeyInfo::Ptr info = ApikeyInfo::create();
+    info->unpack(value);
+    return info;
+}
+
+UserInfo::Ptr LmdbDataAccessor::userInfo(UserId user_id)
+{
+    Txn txn(*this, false);
+    QByteArray record;
+    if (!txn.get('u' + bigEndian(user_id), record))
+        return nullptr;
+    UserInfo::Ptr info = UserInfo::create();
+    info->user_id = user_id;
+    QDataStream stream(&record, QIODevice::ReadOnly);
+    stream >> info->name;
+    QByteArray prefix = 'd' + bigEndian(user_id);
+    txn.scan(prefix, false, [&info, &prefix](const QByteArray& key, QByteArray& value)
+    {
+        CurrencyId currency = Registry::currencyId(QString::fromUtf8(key.mid(prefix.size())));
+        if (currency != INVALID_CURRENCY)
+            info->funds[currency] = qstr2dec<7>(QString::fromUtf8(value));
+        return true;
+    });
+    return info;
+}
+
+QMap<PairName, BuySellDepth> LmdbDataAccessor::allActiveOrdersAmountAgreggatedByRateList(const QList<PairName>& pairs)
+{
+    Txn txn(*this, false);
+    QMap<PairName, BuySellDepth> map;
+    for (const PairName& pair: pairs)
+    {
+        Depth buys;
+        Depth sells;
+        for (OrderInfo::Type type: {OrderInfo::Type::Buy, OrderInfo::Type::Sell})
+        {
+            // book keys go by rate in order of depth: buys descending, sells ascending
+            Depth& depth = (type == OrderInfo::Type::Buy) ? buys : sells;
+            QByteArray prefix = bookPrefix(pair, type);
+            txn.scan(prefix, false, [&txn, &depth, &prefix](const QByteArray& key, QByteArray&)
+            {
+                OrderInfo::Ptr order = readOrder(txn, fromBigEndian32(key, prefix.size() + 8));
+                if (!order)
+                    return true;
+                if (!depth.isEmpty() && depth.last().first == order->rate)
+                    depth.last().second += order->amount;
+                else
+                    depth.append(qMakePair(order->rate, order->amount));
+                return true;
+            });
+        }
+        if (!buys.isEmpty() || !sells.isEmpty())
+            map[pair] = qMakePair(buys, sells);
+    }
+    return map;
+}
+
+bool LmdbDataAccessor::tradeUpdateDeposit(const UserId& user_id, CurrencyId currency, const Amount& diff, const QString& userName)
+{
+    Q_UNUSED(userName)
+    Txn txn(*this, true);
+    QByteArray user;
+    // as update of missing deposit row
+    if (!txn.get('u' + bigEndian(user_id), user))
+        return txn.ok();
+    QString name = Registry::currencyName(currency);
+    Amount volume = readDeposit(txn, user_id, name) + diff;
+    return txn.put(depositKey(user_id, name), dec2qstr(volume, 7).toUtf8()) && txn.commit();
+}
+
+bool LmdbDataAccessor::reduceOrderAmount(OrderId order_id, const Amount& amount)
+{
+    Txn txn(*this, true);
+    OrderInfo::Ptr order = readOrder(txn, order_id);
+    if (!order)
+        return false;
+    order->amount -= amount;
+    return writeOrder(txn, *order) && txn.commit();
+}
+
+bool LmdbDataAccessor::finishOrder(OrderId order_id, bool cancel)
+{
+    Txn txn(*this, true);
+    OrderInfo::Ptr order = readOrder(txn, order_id);
+    if (!order)
+        return false;
+    if (order->status == OrderInfo::Status::Active)
+    {
+        txn.remove(bookKey(*order));
+        txn.remove(userOrderKey(order->user_id, order_id));
+    }
+    if (cancel)
+    {
+        order->status = (order->start_amount == order->amount) ? OrderInfo::Status::Cancelled : OrderInfo::Status::PartiallyDone;
+    }
+    else
+    {
+        order->amount = Amount(0);
+        order->status = OrderInfo::Status::Done;
+    }
+    return writeOrder(txn, *order) && txn.commit();
+}
+
+bool LmdbDataAccessor::closeOrder(OrderId order_id)
+{
+    return finishOrder(order_id, false);
+}
+
+bool LmdbDataAccessor::cancelOrder(OrderId order_id)
+{
+    return finishOrder(order_id, true);
+}
+
+OrderInfo::List LmdbDataAccessor::matchingOrders(const PairName& pair, OrderInfo::Type type, const Rate& rate, UserId user_id)
+{
+    Txn txn(*this, false);
+    OrderInfo::List list;
+    OrderInfo::Type matchedType = (type == OrderInfo::Type::Buy) ? OrderInfo::Type::Sell : OrderInfo::Type::Buy;
+    QByteArray prefix = bookPrefix(pair, matchedType);
+    QByteArray limit = rateKey(rate, matchedType);
+    txn.scan(prefix, false, [&](const QByteArray& key, QByteArray& value)
+    {
+        if (limit < key.mid(prefix.size(), 8))
+            return false;
+        if (fromBigEndian32(value) != user_id)
+        {
+            OrderInfo::Ptr order = readOrder(txn, fromBigEndian32(key, prefix.size() + 8));
+            if (order)
+                list.append(order);
+        }
+        return true;
+    });
+    return list;
+}
+
+TradeId LmdbDataAccessor::createNewTradeRecord(UserId user_id, OrderId order_id, const Amount& amount)
+{
+    Txn txn(*this, true);
+    OrderInfo::Ptr order = readOrder(txn, order_id);
+    if (!order || amount < Amount(0))
+        return 0;
+    TradeId trade_id = static_cast<TradeId>(nextId(txn, "trades"));
+    if (!trade_id)
+        return 0;
+    Trade trade;
+    trade.user_id = user_id;
+    trade.order_id = order_id;
+    trade.type = (order->type == OrderInfo::Type::Buy) ? TradeInfo::Type::Bid : TradeInfo::Type::Ask;
+    trade.rate = order->rate;
+    trade.amount = amount;
+    trade.created = EngineClock::now();
+    if (!txn.put(tradeKey(order->pair, trade_id), packTrade(trade))
+            || !txn.put(userTradeKey(user_id, trade_id), order->pair.toUtf8())
+            || !txn.put(userTradeKey(order->user_id, trade_id), order->pair.toUtf8())
+            || !txn.commit())
+        return 0;
+    return trade_id;
+}
+
+OrderId LmdbDataAccessor::createNewOrderRecord(const PairName& pair, const UserId& user_id, OrderInfo::Type type, const Rate& rate, const Amount& start_amount)
+{
+    Txn txn(*this, true);
+    QByteArray value;
+    if (!txn.get('p' + pair.toUtf8(), value))
+        return static_cast<OrderId>(-1);
+    PairInfo pairInfo;
+    pairInfo.unpack(value);
+    quint64 slot = nextId(txn, "orders");
+    if (!slot)
+        return static_cast<OrderId>(-1);
+
+    OrderInfo order;
+    order.order_id = static_cast<OrderId>(slot * ShardConfig::count() + ShardConfig::index() + 1);
+    order.pair = pair;
+    order.type = type;
+    // stored with decimal places of the pair, as SQL column is
+    order.rate = qstr2dec<7>(dec2qstr(rate, pairInfo.decimal_places));
+    order.start_amount = start_amount;
+    order.amount = start_amount;
+    order.created = EngineClock::now();
+    order.status = OrderInfo::Status::Active;
+    order.user_id = user_id;
+    if (!writeOrder(txn, order)
+            || !txn.put(bookKey(order), bigEndian(user_id))
+            || !txn.put(userOrderKey(user_id, order.order_id), QByteArray())
+            || !txn.commit())
+        return static_cast<OrderId>(-1);
+    return order.order_id;
+}
+
+bool LmdbDataAccessor::reserveDepositVolume(UserId user_id, CurrencyId currency, const Amount& volume)
+{
+    Txn txn(*this, false);
+    QByteArray value;
+    if (!txn.get(depositKey(user_id, Registry::currencyName(currency)), value))
+        return false;
+    return qstr2dec<7>(QString::fromUtf8(value)) >= volume;
+}
+
+Amount LmdbDataAccessor::depositVolume(UserId user_id, CurrencyId currency)
+{
+    Txn txn(*this, false);
+    return readDeposit(txn, user_id, Registry::currencyName(currency));
+}
+
+QList<QByteArray> LmdbDataAccessor::keysOfTraders(const std::function<bool(Txn&, const ApikeyInfo&)>& accept)
+{
+    Txn txn(*this, false);
+    QList<QByteArray> keys;
+    txn.scan("k", false, [&](const QByteArray&, QByteArray& value)
+    {
+        ApikeyInfo key;
+        key.unpack(value);
+        QByteArray user;
+        QString name;
+        int userType = 0;
+        if (txn.get('u' + bigEndian(key.user_id), user))
+        {
+            QDataStream stream(&user, QIODevice::ReadOnly);
+            stream >> name >> userType;
+        }
+        if (userType == 1 && accept(txn, key))
+            keys.append(key.apikey.toUtf8());
+        return true;
+    });
+    return keys;
+}
+
+QByteArray LmdbDataAccessor::randomKeyWithPermissions(bool info, bool trade, bool withdraw)
+{
+    QList<QByteArray> keys = keysOfTraders([info, trade, withdraw](Txn&, const ApikeyInfo& key)
+    {
+        return key.info == info && key.trade == trade && key.withdraw == withdraw;
+    });
+    if (keys.isEmpty())
+        return QByteArray();
+    return keys.at(qrand() % keys.size());
+}
+
+QByteArray LmdbDataAccessor::randomKeyForTrade(const QString& currency, const Amount& amount)
+{
+    QList<QByteArray> keys = keysOfTraders([&currency, &amount](Txn& txn, const ApikeyInfo& key)
+    {
+        return key.trade && amount < readDeposit(txn, key.user_id, currency);
+    });
+    if (keys.isEmpty())
+        return QByteArray();
+    return keys.at(qrand() % keys.size());
+}
+
+QByteArray LmdbDataAccessor::signWithKey(const QByteArray& message, const ApiKey& key)
+{
+    QByteArray secret = secretForKey(key);
+    if (!secret.isEmpty())
+        return hmac_sha512(message, secret).toHex();
+    return QByteArray();
+}
+
+QByteArray LmdbDataAccessor::secretForKey(const ApiKey& key)
+{
+    ApikeyInfo::Ptr info = apikeyInfo(key);
+    if (info)
+        return info->secret;
+    return QByteArray();
+}
+
+bool LmdbDataAccessor::updateNonce(const ApiKey& key, quint32 nonce)
+{
+    Txn txn(*this, true);
+    QByteArray value;
+    if (!txn.get('k' + key.toUtf8(), value))
+        return txn.ok();
+    ApikeyInfo info;
+    info.unpack(value);
+    info.nonce = nonce;
+    return txn.put('k' + key.toUtf8(), info.pack()) && txn.commit();
+}
+
+Amount LmdbDataAccessor::getDepositCurrencyVolume(const ApiKey& key, const QString& currency)
+{
+    Txn txn(*this, false);
+    UserId user_id = keyOwner(txn, key);
+    if (!user_id)
+        return Amount(0);
+    return readDeposit(txn, user_id, currency);
+}
+
+Amount LmdbDataAccessor::getOrdersCurrencyVolume(const ApiKey& key, const QString& currency)
+{
+    CurrencyId currencyId = Registry::currencyId(currency);
+    Amount volume(0);
+    if (currencyId == INVALID_CURRENCY)
+        return volume;
+    // reserved by active orders: goods of sells, currency of buys
+    for (const OrderInfo::Ptr& order: activeOrdersInfoList(key))
+    {
+        const Registry::Pair* pair = Registry::pair(order->pair);
+        if (!pair)
+            continue;
+        if (order->type == OrderInfo::Type::Sell && pair->goods == currencyId)
+            volume += order->amount;
+        else if (order->type == OrderInfo::Type::Buy && pair->currency == currencyId)
+            volume += order->amount * order->rate;
+    }
+    return volume;
+}
+
+OrderInfo::List LmdbDataAccessor::negativeAmountOrders()
+{
+    Txn txn(*this, false);
+    OrderInfo::List list;
+    txn.scan("o", false, [&list](const QByteArray&, QByteArray& value)
+    {
+        OrderInfo::Ptr order = OrderInfo::create();
+        order->unpack(value);
+        if (order->amount < Amount(0))
+            list.append(order);
+        return true;
+    });
+    return list;
+}
+
+Funds LmdbDataAccessor::exchangeFunds(const std::function<void()>& snapshotTaken)
+{
+    // read transaction is the snapshot, commits after its start are not seen
+    Txn txn(*this, false);
+    snapshotTaken();
+    Funds total;
+    txn.scan("d", false, [&total](const QByteArray& key, QByteArray& value)
+    {
+        total[QString::fromUtf8(key.mid(5))] += qstr2dec<7>(QString::fromUtf8(value));
+        return true;
+    });
+    txn.scan("a", false, [&total, &txn](const QByteArray& key, QByteArray&)
+    {
+        OrderInfo::Ptr order = readOrder(txn, fromBigEndian32(key, 5));
+        const Registry::Pair* pair = order ? Registry::pair(order->pair) : nullptr;
+        if (!pair)
+            return true;
+        if (order->type == OrderInfo::Type::Sell)
+            total[Registry::currencyName(pair->goods)] += order->amount;
+        else
+            total[Registry::currencyName(pair->currency)] += order->amount * order->rate;
+        return true;
+    });
+    return total;
+}
+
+void LmdbDataAccessor::allUsersFunds(QMap<UserId, Balances>& funds, QMap<UserId, OrderInfo::List>& orders)
+{
+    Txn txn(*this, false);
+    txn.scan("u", false, [&funds](const QByteArray& key, QByteArray&)
+    {
+        funds.insert(fromBigEndian32(key, 1), Balances {});
+        return true;
+    });
+    txn.scan("d", false, [&funds](const QByteArray& key, QByteArray& value)
+    {
+        auto user = funds.find(fromBigEndian32(key, 1));
+        CurrencyId currency = Registry::currencyId(QString::fromUtf8(key.mid(5)));
+        if (user != funds.end() && currency != INVALID_CURRENCY)
+            (*user)[currency] = qstr2dec<7>(QString::fromUtf8(value));
+        return true;
+    });
+    txn.scan("a", false, [&orders, &txn](const QByteArray& key, QByteArray&)
+    {
+        OrderInfo::Ptr order = readOrder(txn, fromBigEndian32(key, 5));
+        if (order)
+            orders[order->user_id].append(order);
+        return true;
+    });
+}
+
+void LmdbDataAccessor::updateTicker()
+{
+    QDateTime now = EngineClock::now();
+    QDateTime since = now.addSecs(-60 * 60 * 4);
+    PairInfo::List pairs = allPairsInfoList();
+    Txn txn(*this, true);
+    for (const PairInfo::Ptr& pair: pairs)
+    {
+        QByteArray tickerKey = 't' + pair->pair.toUtf8();
+        QByteArray value;
+        if (!txn.get(tickerKey, value))
+            continue;
+        Rate high(0), low(0), sum(0);
+        Amount vol(0), vol_cur(0);
+        int count = 0;
+        // newest trades first, till the window start
+        txn.scan('r' + pair->pair.toUtf8() + '\0', true, [&](const QByteArray&, QByteArray& trade)
+        {
+            Trade t = unpackTrade(trade);
+            if (t.created <= since)
+                return false;
+            if (!count || high < t.rate)
+                high = t.rate;
+            if (!count || t.rate < low)
+                low = t.rate;
+            sum += t.rate;
+            vol += t.amount;
+            vol_cur += t.amount * t.rate;
+            count++;
+            return true;
+        });
+        if (!count)
+            continue;
+        TickerInfo ticker;
+        ticker.unpack(value);
+        ticker.high = high;
+        ticker.low = low;
+        ticker.avg = sum / Rate(count);
+        ticker.vol = vol;
+        ticker.vol_cur = vol_cur;
+        ticker.last = ticker.avg;
+        ticker.buy = ticker.avg;
+        ticker.sell = ticker.avg;
+        ticker.updated = now;
+        txn.put(tickerKey, ticker.pack());
+    }
+    txn.commit();
+}
+
+bool LmdbDataAccessor::transaction()
+{
+    if (writeTxn)
+        return false;
+    int rc = mdb_txn_begin(env, nullptr, 0, &writeTxn);
+    if (rc)
+    {
+        std::cerr << "[lmdb] cannot begin transaction: " << mdb_strerror(rc) << std::endl;
+        writeTxn = nullptr;
+        return false;
+    }
+    return true;
+}
+
+bool LmdbDataAccessor::commit()
+{
+    if (!writeTxn)
+        return false;
+    int rc = mdb_txn_commit(writeTxn);
+    writeTxn = nullptr;
+    if (rc)
+    {
+        std::cerr << "[lmdb] cannot commit: " << mdb_strerror(rc) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool LmdbDataAccessor::rollback()
+{
+    if (writeTxn)
+        mdb_txn_abort(writeTxn);
+    writeTxn = nullptr;
+    return true;
+}
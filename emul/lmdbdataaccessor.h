@@ -0,0 +1,151 @@
+#ifndef LMDBDATAACCESSOR_H
+#define LMDBDATAACCESSOR_H
+
+#include "sqlclient.h"
+
+#include <QByteArray>
+#include <QString>
+
+#include <functional>
+
+#include <lmdb.h>
+
+class QSqlDatabase;
+class QThread;
+
+/// Data accessor keeping exchange in embedded LMDB store, a memory mapped
+/// copy-on-write B+tree, for single node deployments. Records are packed
+/// by types.cpp under keys whose prefix orders range scans:
+///   o<order id>                          order
+///   b<pair>\0<s|b><rate key><order id>   active order in book, value is owner
+///   a<user id><order id>                 active order of user
+///   r<pair>\0<trade id>                  trade
+///   h<user id><trade id>                 trade of taker and of order owner, value is pair
+///   u<user id>, d<user id><currency>     user and its deposits
+///   k<apikey>, K<user id><apikey>        key and keys of user
+///   p<pair>, t<pair>, s<sequence>        pair, ticker and id sequences
+/// Ids are big endian and rate keys flip sign bit, buys also all bits, so
+/// book keys sort in matching order. Currencies and pairs are stored by
+/// name, their Registry ids change between runs.
+/// transaction() holds the single write transaction of the store till
+/// commit() or rollback(), calls outside of it run in own transactions.
+/// Engine locks a commit needs are taken before transaction(), a writer
+/// waiting for them would block every other one.
+/// With sync interval commits are not flushed one by one: a timer flushes
+/// them in groups, so a system crash loses at most the last interval,
+/// while a process crash loses nothing. Store is never left half written,
+/// open() only clears reader slots of dead processes.
+class LmdbDataAccessor : public AbstractDataAccessor
+{
+public:
+    LmdbDataAccessor();
+    virtual ~LmdbDataAccessor();
+
+    PairInfo::List   allPairsInfoList() override;
+    PairInfo::Ptr    pairInfo(const PairName& pair) override;
+    TickerInfo::Ptr  tickerInfo(const PairName& pair) override;
+    OrderInfo::Ptr   orderInfo(OrderId order_id) override;
+    OrderInfo::List  activeOrdersInfoList(const QString& apikey) override;
+    TradeInfo::List  allTradesInfo(const PairName& pair) override;
+    UserTradeInfo::List userTradesInfo(UserId user_id, const PairName& pair, const HistoryPage& page) override;
+    ApikeyInfo::Ptr  apikeyInfo(const ApiKey& apikey) override;
+    UserInfo::Ptr    userInfo(UserId user_id) override;
+
+    QMap<PairName, BuySellDepth> allActiveOrdersAmountAgreggatedByRateList(const QList<PairName>& pairs) override;
+    bool tradeUpdateDeposit(const UserId &user_id, CurrencyId currency, const Amount& diff, const QString& userName) override;
+    bool reduceOrderAmount(OrderId order_id, const Amount& amount) override;
+    bool closeOrder(OrderId order_id) override;
+    bool cancelOrder(OrderId order_id) override;
+    OrderInfo::List matchingOrders(const PairName& pair, OrderInfo::Type type, const Rate& rate, UserId user_id) override;
+    TradeId createNewTradeRecord(UserId user_id, OrderId order_id, const Amount& amount) override;
+    OrderId createNewOrderRecord(const PairName& pair, const UserId& user_id, OrderInfo::Type type, const Rate& rate, const Amount& start_amount) override;
+    bool reserveDepositVolume(UserId user_id, CurrencyId currency, const Amount& volume) override;
+    Amount depositVolume(UserId user_id, CurrencyId currency) override;
+
+    virtual QByteArray randomKeyWithPermissions(bool info, bool trade, bool withdraw) override;
+    virtual QByteArray randomKeyForTrade(const QString& currency, const Amount& amount) override;
+    virtual QByteArray signWithKey(const QByteArray& message, const ApiKey& key) override;
+    virtual QByteArray secretForKey(const ApiKey& key) override;
+    virtual bool       updateNonce(const ApiKey& key, quint32 nonce) override;
+
+    virtual Amount getDepositCurrencyVolume(const ApiKey& key, const QString& currency) override;
+    virtual Amount  getOrdersCurrencyVolume(const ApiKey& key, const QString& currency) override;
+
+    virtual OrderInfo::List negativeAmountOrders() override;
+    virtual Funds exchangeFunds(const std::function<void()>& snapshotTaken) override;
+    virtual void allUsersFunds(QMap<UserId, Balances>& funds, QMap<UserId, OrderInfo::List>& orders) override;
+
+    virtual void updateTicker() override;
+
+    virtual bool transaction() override;
+    virtual bool commit()      override;
+    virtual bool rollback()    override;
+
+    /// opens store in directory, an empty store is filled from SQL schema;
+    /// zero sync interval flushes every commit
+    static bool open(const QString& directory, quint64 mapSize, int syncIntervalMsecs, QSqlDatabase& db);
+    static bool isOpen();
+    static void sync();
+    static void close();
+
+private:
+    /// own transaction, or the one started by transaction() if there is
+    class Txn
+    {
+    public:
+        Txn(LmdbDataAccessor& accessor, bool write);
+        ~Txn();
+        bool ok() const;
+        bool commit();
+
+        bool get(const QByteArray& key, QByteArray& value);
+        bool put(const QByteArray& key, const QByteArray& value);
+        bool remove(const QByteArray& key);
+        /// keys starting with prefix in order, or in reverse, till visit returns false;
+        /// given start key scan begins at it, or next to it in scan direction
+        void scan(const QByteArray& prefix, bool backward, const std::function<bool(const QByteArray& key, QByteArray& value)>& visit,
+                  const QByteArray& start = QByteArray());
+
+    private:
+        MDB_txn* txn = nullptr;
+        bool own = false;
+        bool failed = false;
+    };
+
+    struct Trade
+    {
+        UserId user_id = 0;
+        OrderId order_id = 0;
+        TradeInfo::Type type = TradeInfo::Type::Bid;
+        Rate rate;
+        Amount amount;
+        QDateTime created;
+    };
+
+    static QByteArray orderKey(OrderId order_id);
+    static QByteArray bookKey(const OrderInfo& order);
+    static QByteArray bookPrefix(const PairName& pair, OrderInfo::Type type);
+    static QByteArray userOrderKey(UserId user_id, OrderId order_id);
+    static QByteArray tradeKey(const PairName& pair, TradeId trade_id);
+    static QByteArray userTradeKey(UserId user_id, TradeId trade_id);
+    static QByteArray depositKey(UserId user_id, const QString& currency);
+
+    static QByteArray packTrade(const Trade& trade);
+    static Trade unpackTrade(QByteArray& value);
+    static OrderInfo::Ptr readOrder(Txn& txn, OrderId order_id);
+    static bool writeOrder(Txn& txn, const OrderInfo& order);
+    static Amount readDeposit(Txn& txn, UserId user_id, const QString& currency);
+    static quint64 nextId(Txn& txn, const char* sequence);
+    static UserId keyOwner(Txn& txn, const ApiKey& apikey);
+    bool finishOrder(OrderId order_id, bool cancel);
+    QList<QByteArray> keysOfTraders(const std::function<bool(Txn& txn, const ApikeyInfo& key)>& accept);
+    static bool import(QSqlDatabase& db);
+
+    MDB_txn* writeTxn = nullptr;
+
+    static MDB_env* env;
+    static MDB_dbi dbi;
+    static QThread* syncThread;
+};
+
+#endif // LMDBDATAACCESSOR_H
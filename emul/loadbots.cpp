@@ -0,0 +1,264 @@
+#include "loadbots.h"
+#include "registry.h"
+#include "responce.h"
+#include "shardconfig.h"
+
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QSettings>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+
+#include <iostream>
+
+// grid step and distance of taker and canceller orders from last rate
+#define GRID_STEP 0.001
+#define TAKER_CROSS 0.01
+#define CANCELLER_DISTANCE 0.5
+
+QStringList LoadBots::pairs;
+int LoadBots::gridSize = 10;
+quint32 LoadBots::duration = 60;
+std::vector<pthread_t> LoadBots::threads;
+std::atomic<bool> LoadBots::stopRequested {false};
+std::atomic<int> LoadBots::running {0};
+std::atomic<quint64> LoadBots::orders {0};
+std::atomic<quint64> LoadBots::cancels {0};
+std::atomic<quint64> LoadBots::rejects {0};
+
+static qint64 startedMsecs = 0;
+
+void LoadBots::start(QSettings& settings, QSqlDatabase& db)
+{
+    if (!settings.value("bots/enabled", false).toBool())
+        return;
+
+    pairs.clear();
+    for (const QString& pair: settings.value("bots/pairs", "btc_usd").toString().split(',', QString::SkipEmptyParts))
+        if (Registry::pair(pair) && ShardConfig::owns(pair))
+            pairs << pair;
+    if (pairs.isEmpty())
+    {
+        std::cerr << "[bots] no pair of this shard to trade" << std::endl;
+        return;
+    }
+    gridSize = qMax(settings.value("bots/grid_size", 10).toInt(), 1);
+    duration = settings.value("bots/duration", 60).toUInt();
+
+    QList<QPair<Kind, int>> populations;
+    populations << qMakePair(Kind::MarketMaker, settings.value("bots/makers", 0).toInt())
+                << qMakePair(Kind::Taker, settings.value("bots/takers", 0).toInt())
+                << qMakePair(Kind::Canceller, settings.value("bots/cancellers", 0).toInt());
+
+    stopRequested = false;
+    orders = 0;
+    cancels = 0;
+    rejects = 0;
+    startedMsecs = QDateTime::currentMSecsSinceEpoch();
+    int id = 0;
+    for (const QPair<Kind, int>& population: populations)
+        for (int i = 0; i < population.second; i++)
+        {
+            BotData* pData = new BotData;
+            pData->pDb = &db;
+            pData->id = id++;
+            pData->kind = population.first;
+            running++;
+            pthread_t thread;
+            pthread_create(&thread, nullptr, botThread, pData);
+            threads.push_back(thread);
+        }
+    std::clog << "[bots] " << id << " bots trade " << pairs.join(',').toStdString() << std::endl;
+}
+
+void LoadBots::stop()
+{
+    stopRequested = true;
+    for (pthread_t thread: threads)
+        pthread_join(thread, nullptr);
+    threads.clear();
+}
+
+quint64 LoadBots::ordersCount()
+{
+    return orders;
+}
+
+quint64 LoadBots::cancelsCount()
+{
+    return cancels;
+}
+
+void* LoadBots::botThread(void* data)
+{
+    BotData* pData = static_cast<BotData*>(data);
+    QString dbConnectionName = QString("bot-db-%1").arg(pData->id);
+    std::unique_ptr<QSqlDatabase> db = std::make_unique<QSqlDatabase>(QSqlDatabase::cloneDatabase(*pData->pDb, dbConnectionName));
+    db->open();
+    int id = pData->id;
+    Kind kind = pData->kind;
+    delete pData;
+
+    {
+        Responce responce(*db);
+        Bot bot(responce, kind, id);
+        QElapsedTimer timer;
+        timer.start();
+        while (!stopRequested && (duration == 0 || timer.elapsed() < duration * 1000))
+        {
+            try
+            {
+                bot.round();
+            }
+            catch (const QSqlQuery& e)
+            {
+                std::cerr << "[bots] bot " << id << ": " << e.lastError().text().toStdString() << std::endl;
+                rejects++;
+            }
+        }
+    }
+
+    db->close();
+    db.reset();
+    QSqlDatabase::removeDatabase(dbConnectionName);
+
+    if (--running == 0)
+    {
+        qint64 elapsed = qMax<qint64>(QDateTime::currentMSecsSinceEpoch() - startedMsecs, 1);
+        std::clog << "[bots] " << orders << " orders, " << cancels << " cancels, " << rejects << " rejects in "
+                  << elapsed << " ms (" << (orders + cancels) * 1000 / elapsed << " ops/s)" << std::endl;
+    }
+    return nullptr;
+}
+
+LoadBots::Bot::Bot(Responce& responce, Kind kind, int id)
+    :responce(responce), kind(kind), id(id)
+{
+}
+
+void LoadBots::Bot::round()
+{
+    const PairName& pair = pairs.at(static_cast<int>((step++ + id) % pairs.size()));
+    int decimal_places = 0;
+    Rate last = lastRate(pair, decimal_places);
+    PairInfo::Ptr info = responce.dataAccessor->pairInfo(pair);
+    if (!info || last == Rate(0))
+        return;
+    auto rounded = [decimal_places, &info](const Rate& rate)
+    {
+        return qBound(info->min_price, qstr2dec<7>(dec2qstr(rate, decimal_places)), info->max_price);
+    };
+
+    QList<OrderId> created;
+    switch (kind)
+    {
+        case Kind::MarketMaker:
+        {
+            // previous grid makes way for the new one
+            cancel(grid);
+            QList<Rate> buys;
+            QList<Rate> sells;
+            for (int k = 1; k <= gridSize; k++)
+            {
+                buys << rounded(last * Rate(1 - GRID_STEP * k));
+                sells << rounded(last * Rate(1 + GRID_STEP * k));
+            }
+            place(pair, OrderInfo::Type::Buy, buys, info->min_amount * Amount(2), grid);
+            place(pair, OrderInfo::Type::Sell, sells, info->min_amount * Amount(2), grid);
+            break;
+        }
+        case Kind::Taker:
+        {
+            OrderInfo::Type type = (step % 2) ? OrderInfo::Type::Buy : OrderInfo::Type::Sell;
+            Rate rate = rounded(last * Rate((type == OrderInfo::Type::Buy) ? 1 + TAKER_CROSS : 1 - TAKER_CROSS));
+            place(pair, type, {rate}, info->min_amount, created);
+            break;
+        }
+        case Kind::Canceller:
+        {
+            place(pair, OrderInfo::Type::Buy, {rounded(last * Rate(CANCELLER_DISTANCE))}, info->min_amount, created);
+            cancel(created);
+            break;
+        }
+    }
+}
+
+Rate LoadBots::Bot::lastRate(const PairName& pair, int& decimal_places)
+{
+    PairInfo::Ptr info = responce.dataAccessor->pairInfo(pair);
+    if (!info)
+        return Rate(0);
+    decimal_places = info->decimal_places;
+    TickerInfo::Ptr ticker = responce.dataAccessor->tickerInfo(pair);
+    if (ticker && ticker->last > Rate(0))
+        return ticker->last;
+    return (info->min_price + info->max_price) / Rate(2);
+}
+
+ApiKey& LoadBots::Bot::keyFor(const PairName& pair, OrderInfo::Type type, const Amount& volume)
+{
+    const Registry::Pair* pairRef = Registry::pair(pair);
+    const QString& currency = Registry::currencyName((type == OrderInfo::Type::Buy) ? pairRef->currency : pairRef->goods);
+    ApiKey& key = keys[currency];
+    if (key.isEmpty())
+        key = QString::fromUtf8(responce.dataAccessor->randomKeyForTrade(currency, volume));
+    return key;
+}
+
+bool LoadBots::Bot::place(const PairName& pair, OrderInfo::Type type, const QList<Rate>& rates, const Amount& amount, QList<OrderId>& created)
+{
+    Amount volume(0);
+    for (const Rate& rate: rates)
+        volume += (type == OrderInfo::Type::Buy) ? amount * rate : amount;
+    ApiKey& key = keyFor(pair, type, volume);
+    if (key.isEmpty())
+        return false;
+    QList<Responce::NewOrder> batch;
+    for (const Rate& rate: rates)
+    {
+        Responce::NewOrder order;
+        order.type = type;
+        order.rate = rate;
+        order.amount = amount;
+        batch.append(order);
+    }
+    QList<Responce::OrderCreateResult> results;
+    QString errMsg;
+    if (!responce.checkParamsAndDoExchange(key, pair, batch, results, errMsg))
+    {
+        // user ran out of funds, next round trades with another one
+        key.clear();
+        rejects++;
+        return false;
+    }
+    for (const Responce::OrderCreateResult& result: results)
+        if (result.order_id)
+            created.append(result.order_id);
+    orders += results.size();
+    return true;
+}
+
+void LoadBots::Bot::cancel(QList<OrderId>& order_ids)
+{
+    if (order_ids.isEmpty())
+        return;
+    // orders of a user go together, bots keep one user per currency
+    QMap<UserId, QList<OrderId>> byUser;
+    for (OrderId order_id: order_ids)
+    {
+        OrderInfo::Ptr info = responce.dataAccessor->orderInfo(order_id);
+        if (info)
+            byUser[info->user_id].append(order_id);
+    }
+    for (auto user = byUser.cbegin(); user != byUser.cend(); ++user)
+    {
+        QList<OrderId> cancelled;
+        QMap<OrderId, QString> errors;
+        if (responce.cancelOrders(user.key(), user.value(), cancelled, errors))
+            cancels += cancelled.size();
+        else
+            rejects++;
+    }
+    order_ids.clear();
+}
@@ -0,0 +1,85 @@
+#ifndef LOADBOTS_H
+#define LOADBOTS_H
+
+#include "types.h"
+
+#include <QHash>
+#include <QList>
+#include <QStringList>
+
+#include <atomic>
+#include <vector>
+
+#include <pthread.h>
+
+class QSettings;
+class QSqlDatabase;
+class Responce;
+
+/// In-process load driver: bot threads trade through Responce engine calls,
+/// with no HTTP, signing or FastCGI in between, so throughput of matching
+/// engine is measured alone. Populations:
+///   market makers put a grid of buys and sells around last rate in two
+///     batches a round and cancel grid of previous round,
+///   takers cross the book with small orders,
+///   cancellers put an order far from the book and cancel it at once.
+/// Every bot has own SQL connection and Responce, like a FastCGI worker,
+/// and trades with keys of users having funds. Counters are printed when
+/// the last bot stops.
+class LoadBots
+{
+public:
+    enum class Kind {MarketMaker, Taker, Canceller};
+
+    /// [bots] enabled, makers, takers, cancellers, pairs, grid_size, duration;
+    /// called after order books are loaded, zero duration runs till stop()
+    static void start(QSettings& settings, QSqlDatabase& db);
+    static void stop();
+
+    static quint64 ordersCount();
+    static quint64 cancelsCount();
+
+private:
+    struct BotData
+    {
+        QSqlDatabase* pDb;
+        int id;
+        Kind kind;
+    };
+
+    class Bot
+    {
+    public:
+        Bot(Responce& responce, Kind kind, int id);
+        void round();
+
+    private:
+        Rate lastRate(const PairName& pair, int& decimal_places);
+        bool place(const PairName& pair, OrderInfo::Type type, const QList<Rate>& rates, const Amount& amount, QList<OrderId>& created);
+        void cancel(QList<OrderId>& order_ids);
+        /// key of a user having volume of currency spent by orders of type,
+        /// kept till the user runs out of funds
+        ApiKey& keyFor(const PairName& pair, OrderInfo::Type type, const Amount& volume);
+
+        Responce& responce;
+        Kind kind;
+        int id;
+        quint64 step = 0;
+        QHash<QString, ApiKey> keys;
+        QList<OrderId> grid;
+    };
+
+    static void* botThread(void* data);
+
+    static QStringList pairs;
+    static int gridSize;
+    static quint32 duration;
+    static std::vector<pthread_t> threads;
+    static std::atomic<bool> stopRequested;
+    static std::atomic<int> running;
+    static std::atomic<quint64> orders;
+    static std::atomic<quint64> cancels;
+    static std::atomic<quint64> rejects;
+};
+
+#endif // LOADBOTS_H
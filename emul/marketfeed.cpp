@@ -0,0 +1,365 @@
+#include "marketfeed.h"
+#include "registry.h"
+#include "shardconfig.h"
+#include "tickerquotes.h"
+
+#include <QJsonDocument>
+#include <QThread>
+#include <QWebSocket>
+#include <QWebSocketServer>
+
+#include <iostream>
+
+#define RECENT_TRADES_COUNT 30
+#define DEFAULT_BOOK_LENGTH 25
+
+MarketFeed* MarketFeed::instance = nullptr;
+QList<MarketFeed::Event> MarketFeed::queue;
+QMutex MarketFeed::queueAccess;
+
+MarketFeed::MarketFeed(const QString& address, quint16 port)
+    :address(address), port(port), server(nullptr), heartbeatTimer(this), nextChanId(1)
+{
+}
+
+void MarketFeed::start(const QString& address, quint16 port)
+{
+    QThread* thread = new QThread;
+    instance = new MarketFeed(address, port);
+    instance->moveToThread(thread);
+    connect(thread, &QThread::started, instance, &MarketFeed::listen);
+    thread->start();
+
+    OrderBook::addListener(&MarketFeed::publishBook);
+}
+
+bool MarketFeed::isRunning()
+{
+    return instance != nullptr;
+}
+
+QString MarketFeed::bitfinexPair(const PairName& pair)
+{
+    return QString(pair).remove('_').toUpper();
+}
+
+PairName MarketFeed::emulatorPair(const QString& symbol)
+{
+    QString s = symbol;
+    if (s.length() == 7 && s.startsWith('t'))
+        s = s.mid(1);
+    if (s.length() == 6)
+        return QString("%1_%2").arg(s.left(3)).arg(s.mid(3)).toLower();
+    return s.toLower();
+}
+
+void MarketFeed::enqueue(const Event& event)
+{
+    if (!instance)
+        return;
+    bool wasEmpty;
+    {
+        QMutexLocker lock(&queueAccess);
+        wasEmpty = queue.isEmpty();
+        queue.append(event);
+    }
+    // one wakeup per batch of events
+    if (wasEmpty)
+        QMetaObject::invokeMethod(instance, "flush", Qt::QueuedConnection);
+}
+
+void MarketFeed::publishBook(const PairName& pair, const OrderBook::Updates& updates)
+{
+    Event event;
+    event.kind = Event::Kind::Book;
+    event.pair = pair;
+    event.book = updates;
+    enqueue(event);
+}
+
+void MarketFeed::publishTrades(const PairName& pair, const QList<Trade>& trades)
+{
+    if (trades.isEmpty())
+        return;
+    Event event;
+    event.kind = Event::Kind::Trades;
+    event.pair = pair;
+    event.trades = trades;
+    enqueue(event);
+}
+
+void MarketFeed::publishTicker(const PairName& pair)
+{
+    Event event;
+    event.kind = Event::Kind::Ticker;
+    event.pair = pair;
+    enqueue(event);
+}
+
+void MarketFeed::listen()
+{
+    server = new QWebSocketServer("emul", QWebSocketServer::NonSecureMode, this);
+    connect(server, &QWebSocketServer::newConnection, this, &MarketFeed::onNewConnection);
+    if (!server->listen(QHostAddress(address), port))
+        std::cerr << "[feed] fail to listen on " << address.toStdString() << ':' << port << ": "
+                  << server->errorString().toStdString() << std::endl;
+    else
+        std::clog << "[feed] listening on " << address.toStdString() << ':' << port << std::endl;
+
+    connect(&heartbeatTimer, &QTimer::timeout, this, &MarketFeed::onHeartbeat);
+    heartbeatTimer.start(15000);
+}
+
+void MarketFeed::onNewConnection()
+{
+    while (server->hasPendingConnections())
+    {
+        QWebSocket* socket = server->nextPendingConnection();
+        connect(socket, &QWebSocket::textMessageReceived, this, &MarketFeed::onTextMessage);
+        connect(socket, &QWebSocket::disconnected, this, &MarketFeed::onDisconnected);
+
+        QVariantMap info;
+        info["event"] = "info";
+        info["version"] = 2;
+        sendEvent(socket, info);
+    }
+}
+
+void MarketFeed::onDisconnected()
+{
+    QWebSocket* socket = qobject_cast<QWebSocket*>(sender());
+    if (!socket)
+        return;
+    for (auto channel = channels.begin(); channel != channels.end();)
+    {
+        if (channel->socket == socket)
+            channel = channels.erase(channel);
+        else
+            channel++;
+    }
+    socket->deleteLater();
+}
+
+void MarketFeed::onTextMessage(const QString& message)
+{
+    QWebSocket* socket = qobject_cast<QWebSocket*>(sender());
+    if (!socket)
+        return;
+    QVariantMap m = QJsonDocument::fromJson(message.toUtf8()).toVariant().toMap();
+    QString event = m["event"].toString();
+    if (event == "subscribe")
+        subscribe(socket, m);
+    else if (event == "unsubscribe")
+        unsubscribe(socket, m);
+    else if (event == "ping")
+    {
+        QVariantMap pong;
+        pong["event"] = "pong";
+        pong["cid"] = m["cid"];
+        sendEvent(socket, pong);
+    }
+    else
+    {
+        QVariantMap error;
+        error["event"] = "error";
+        error["msg"] = "unknown event";
+        error["code"] = 10000;
+        sendEvent(socket, error);
+    }
+}
+
+void MarketFeed::subscribe(QWebSocket* socket, const QVariantMap& message)
+{
+    QString name = message["channel"].toString();
+    QString symbol = message.contains("symbol") ? message["symbol"].toString() : message["pair"].toString();
+    PairName pair = emulatorPair(symbol);
+
+    // symbol comes from client: unknown pairs get no channel, nor a book
+    if (   (name != "book" && name != "trades" && name != "ticker")
+        || !Registry::pair(pair) || !ShardConfig::owns(pair))
+    {
+        QVariantMap error;
+        error["event"] = "error";
+        error["msg"] = "subscribe: invalid";
+        error["code"] = 10300;
+        sendEvent(socket, error);
+        return;
+    }
+
+    Channel channel;
+    channel.chanId = nextChanId++;
+    channel.name = name;
+    channel.pair = pair;
+    channel.socket = socket;
+    channel.sequence = 0;
+    channel.bookVersion = 0;
+    channel.bookLength = message.value("len", DEFAULT_BOOK_LENGTH).toInt();
+
+    QVariantMap subscribed;
+    subscribed["event"] = "subscribed";
+    subscribed["channel"] = name;
+    subscribed["chanId"] = channel.chanId;
+    subscribed["pair"] = bitfinexPair(pair);
+    subscribed["symbol"] = "t" + bitfinexPair(pair);
+    sendEvent(socket, subscribed);
+
+    Channel& stored = channels[channel.chanId] = channel;
+    if (name == "book")
+        sendBookSnapshot(stored);
+    else if (name == "trades")
+        sendTradesSnapshot(stored);
+    else
+        send(stored, QVariantList() << QVariant(tickerPayload(pair)));
+}
+
+void MarketFeed::unsubscribe(QWebSocket* socket, const QVariantMap& message)
+{
+    quint32 chanId = message["chanId"].toUInt();
+    QVariantMap reply;
+    auto channel = channels.find(chanId);
+    if (channel == channels.end() || channel->socket != socket)
+    {
+        reply["event"] = "error";
+        reply["msg"] = "unsubscribe: invalid";
+        reply["code"] = 10400;
+    }
+    else
+    {
+        channels.erase(channel);
+        reply["event"] = "unsubscribed";
+        reply["status"] = "OK";
+        reply["chanId"] = chanId;
+    }
+    sendEvent(socket, reply);
+}
+
+void MarketFeed::sendEvent(QWebSocket* socket, const QVariantMap& message)
+{
+    socket->sendTextMessage(QString::fromUtf8(QJsonDocument::fromVariant(message).toJson(QJsonDocument::Compact)));
+}
+
+void MarketFeed::send(Channel& channel, QVariantList message)
+{
+    message.prepend(channel.chanId);
+    message.append(++channel.sequence);
+    channel.socket->sendTextMessage(QString::fromUtf8(QJsonDocument::fromVariant(message).toJson(QJsonDocument::Compact)));
+}
+
+QVariantList MarketFeed::bookEntry(const OrderBook::Level& level)
+{
+    // bids have positive amount, asks negative; removed level has zero
+    // count and amount of 1 or -1, clients take its side from the sign
+    double amount = (level.count > 0) ? level.amount.getAsDouble() : 1.0;
+    if (level.type == OrderInfo::Type::Sell)
+        amount = -amount;
+    return QVariantList() << level.rate.getAsDouble() << level.count << amount;
+}
+
+QVariantList MarketFeed::tradeEntry(const Trade& trade)
+{
+    // positive amount if taker was buyer
+    double amount = trade.amount.getAsDouble();
+    if (trade.type == OrderInfo::Type::Sell)
+        amount = -amount;
+    return QVariantList() << trade.id << trade.created.toMSecsSinceEpoch() << amount << trade.rate.getAsDouble();
+}
+
+void MarketFeed::sendBookSnapshot(Channel& channel)
+{
+    QList<OrderBook::Level> bids;
+    QList<OrderBook::Level> asks;
+    channel.bookVersion = OrderBook::snapshot(channel.pair, channel.bookLength, bids, asks);
+
+    QVariantList entries;
+    for (const OrderBook::Level& level: bids)
+        entries << QVariant(bookEntry(level));
+    for (const OrderBook::Level& level: asks)
+        entries << QVariant(bookEntry(level));
+    send(channel, QVariantList() << QVariant(entries));
+}
+
+void MarketFeed::sendTradesSnapshot(Channel& channel)
+{
+    QVariantList entries;
+    const QList<Trade>& trades = recentTrades[channel.pair];
+    for (auto trade = trades.crbegin(); trade != trades.crend(); trade++)
+        entries << QVariant(tradeEntry(*trade));
+    send(channel, QVariantList() << QVariant(entries));
+}
+
+QVariantList MarketFeed::tickerPayload(const PairName& pair)
+{
+    QList<OrderBook::Level> bids;
+    QList<OrderBook::Level> asks;
+    OrderBook::snapshot(pair, 1, bids, asks);
+    TickerQuotes::Quote quote;
+    bool hasQuote = TickerQuotes::quote(pair, quote);
+
+    // BID, BID_SIZE, ASK, ASK_SIZE, DAILY_CHANGE, DAILY_CHANGE_PERC, LAST_PRICE, VOLUME, HIGH, LOW
+    QVariantList ticker;
+    ticker << (bids.isEmpty() ? 0.0 : bids.first().rate.getAsDouble())
+           << (bids.isEmpty() ? 0.0 : bids.first().amount.getAsDouble())
+           << (asks.isEmpty() ? 0.0 : asks.first().rate.getAsDouble())
+           << (asks.isEmpty() ? 0.0 : asks.first().amount.getAsDouble())
+           << 0.0 << 0.0
+           << (hasQuote ? quote.last.getAsDouble() : 0.0)
+           << 0.0 << 0.0 << 0.0;
+    return ticker;
+}
+
+void MarketFeed::flush()
+{
+    QList<Event> events;
+    {
+        QMutexLocker lock(&queueAccess);
+        events.swap(queue);
+    }
+
+    for (const Event& event: events)
+    {
+        if (event.kind == Event::Kind::Trades)
+        {
+            QList<Trade>& recent = recentTrades[event.pair];
+            recent += event.trades;
+            while (recent.size() > RECENT_TRADES_COUNT)
+                recent.removeFirst();
+        }
+
+        for (Channel& channel: channels)
+        {
+            if (channel.pair != event.pair)
+                continue;
+            switch (event.kind)
+            {
+                case Event::Kind::Book:
+                    if (channel.name != "book" || event.book.version <= channel.bookVersion)
+                        break;
+                    for (const OrderBook::Level& level: event.book.levels)
+                        send(channel, QVariantList() << QVariant(bookEntry(level)));
+                    channel.bookVersion = event.book.version;
+                    break;
+                case Event::Kind::Trades:
+                    if (channel.name != "trades")
+                        break;
+                    // as Bitfinex, "te" on execution and "tu" with the same
+                    // entry once the trade is final; clients act on "tu"
+                    for (const Trade& trade: event.trades)
+                    {
+                        send(channel, QVariantList() << "te" << QVariant(tradeEntry(trade)));
+                        send(channel, QVariantList() << "tu" << QVariant(tradeEntry(trade)));
+                    }
+                    break;
+                case Event::Kind::Ticker:
+                    if (channel.name == "ticker")
+                        send(channel, QVariantList() << QVariant(tickerPayload(event.pair)));
+                    break;
+            }
+        }
+    }
+}
+
+void MarketFeed::onHeartbeat()
+{
+    for (Channel& channel: channels)
+        channel.socket->sendTextMessage(QString("[%1,\"hb\"]").arg(channel.chanId));
+}
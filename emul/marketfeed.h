@@ -0,0 +1,104 @@
+#ifndef MARKETFEED_H
+#define MARKETFEED_H
+
+#include "orderbook.h"
+#include "types.h"
+
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QObject>
+#include <QTimer>
+#include <QVariant>
+
+class QWebSocket;
+class QWebSocketServer;
+
+/// Push market data feed over WebSocket, shaped like Bitfinex v2 public
+/// channels: "book", "trades" and "ticker". Every channel message carries
+/// sequence number of the channel as last element, a subscriber gets
+/// snapshot first and then only updates newer than the snapshot.
+/// Feed runs in its own thread with event loop, FastCGI threads only put
+/// events to a queue.
+class MarketFeed : public QObject
+{
+    Q_OBJECT
+public:
+    struct Trade
+    {
+        /// tid of the trade in /api/3/trades
+        TradeId id;
+        OrderInfo::Type type;
+        Rate rate;
+        Amount amount;
+        QDateTime created;
+    };
+
+    static void start(const QString& address, quint16 port);
+    static bool isRunning();
+
+    static void publishBook(const PairName& pair, const OrderBook::Updates& updates);
+    static void publishTrades(const PairName& pair, const QList<Trade>& trades);
+    static void publishTicker(const PairName& pair);
+
+    /// "btc_usd" <-> "BTCUSD", "tBTCUSD" is accepted too
+    static QString bitfinexPair(const PairName& pair);
+    static PairName emulatorPair(const QString& symbol);
+
+private slots:
+    void listen();
+    void onNewConnection();
+    void onTextMessage(const QString& message);
+    void onDisconnected();
+    void onHeartbeat();
+    void flush();
+
+private:
+    MarketFeed(const QString& address, quint16 port);
+
+    struct Event
+    {
+        enum class Kind {Book, Trades, Ticker};
+        Kind kind;
+        PairName pair;
+        OrderBook::Updates book;
+        QList<Trade> trades;
+    };
+
+    struct Channel
+    {
+        quint32 chanId;
+        QString name;
+        PairName pair;
+        QWebSocket* socket;
+        quint64 sequence;
+        quint64 bookVersion;
+        int bookLength;
+    };
+
+    static void enqueue(const Event& event);
+
+    void subscribe(QWebSocket* socket, const QVariantMap& message);
+    void unsubscribe(QWebSocket* socket, const QVariantMap& message);
+    void sendEvent(QWebSocket* socket, const QVariantMap& message);
+    void send(Channel& channel, QVariantList message);
+    void sendBookSnapshot(Channel& channel);
+    void sendTradesSnapshot(Channel& channel);
+    QVariantList tickerPayload(const PairName& pair);
+    static QVariantList bookEntry(const OrderBook::Level& level);
+    static QVariantList tradeEntry(const Trade& trade);
+
+    QString address;
+    quint16 port;
+    QWebSocketServer* server;
+    QTimer heartbeatTimer;
+    QMap<quint32, Channel> channels;
+    quint32 nextChanId;
+    QMap<PairName, QList<Trade>> recentTrades;
+
+    static MarketFeed* instance;
+    static QList<Event> queue;
+    static QMutex queueAccess;
+};
+
+#endif // MARKETFEED_H
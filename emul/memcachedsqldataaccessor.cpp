@@ -1,4 +1,7 @@
 #include "memcachedsqldataaccessor.h"
+#include "engineclock.h"
+#include "entitypool.h"
+#include "metrics.h"
 
 #include <QCoreApplication>
 #include <QDataStream>
@@ -62,11 +65,12 @@ typename INFO::Ptr MemcachedSqlDataAccessor::cache_get(const QByteArray& key)
     size_t value_length;
     uint32_t flags;
     data = memcached_get(memc, key.constData(), key.length(), &value_length, &flags, &rc);
+    Metrics::cacheLookup(Metrics::Cache::Memcached, rc == MEMCACHED_SUCCESS);
     if (rc == MEMCACHED_SUCCESS)
     {
         QByteArray value;
         value.setRawData(data, value_length);
-        info = std::make_shared<INFO>();
+        info = std::allocate_shared<INFO>(SlabAllocator<INFO>());
         info->unpack(value);
     }
     free(data);
@@ -156,7 +160,7 @@ UserInfo::Ptr MemcachedSqlDataAccessor::userInfo(UserId user_id)
     return info;
 }
 
-bool MemcachedSqlDataAccessor::tradeUpdateDeposit(const UserId& user_id, const QString& currency, const Amount& diff, const QString& userName)
+bool MemcachedSqlDataAccessor::tradeUpdateDeposit(const UserId& user_id, CurrencyId currency, const Amount& diff, const QString& userName)
 {
     bool ok = DirectSqlDataAccessor::tradeUpdateDeposit(user_id, currency, diff, userName);
     if (ok)
@@ -199,12 +203,23 @@ bool MemcachedSqlDataAccessor::closeOrder(OrderId order_id)
     return ok;
 }
 
+bool MemcachedSqlDataAccessor::cancelOrder(OrderId order_id)
+{
+    bool ok = DirectSqlDataAccessor::cancelOrder(order_id);
+    if (ok)
+    {
+        QByteArray key = QString("order:%1").arg(order_id).toUtf8();
+        memcached_delete(memc, key.constData(), key.length(), 0);
+    }
+    return ok;
+}
+
 OrderId MemcachedSqlDataAccessor::createNewOrderRecord(const PairName& pair, const UserId& user_id, OrderInfo::Type type, const Rate& rate, const Amount& start_amount)
 {
     OrderId id = DirectSqlDataAccessor::createNewOrderRecord(pair, user_id, type, rate, start_amount);
     if (id)
     {
-        OrderInfo::Ptr info = std::make_shared<OrderInfo>();
+        OrderInfo::Ptr info = OrderInfo::create();
         info->pair = pair;
         info->user_id = user_id;
         info->type = type;
@@ -212,7 +227,7 @@ OrderId MemcachedSqlDataAccessor::createNewOrderRecord(const PairName& pair, con
         info->start_amount = start_amount;
         info->amount = start_amount;
         info->order_id = id;
-        info->created = QDateTime::currentDateTime();
+        info->created = EngineClock::now();
         info->status = OrderInfo::Status::Active;
 
         QByteArray key = QString("order:%1").arg(id).toUtf8();
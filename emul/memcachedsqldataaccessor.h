@@ -19,9 +19,10 @@ public:
     virtual ApikeyInfo::Ptr  apikeyInfo(const ApiKey& apikey) override;
     virtual UserInfo::Ptr    userInfo(UserId user_id) override;
 
-    virtual bool tradeUpdateDeposit(const UserId &user_id, const QString& currency, const Amount& diff, const QString& userName) override;
+    virtual bool tradeUpdateDeposit(const UserId &user_id, CurrencyId currency, const Amount& diff, const QString& userName) override;
     virtual bool reduceOrderAmount(OrderId order_id, const Amount& amount) override;
     virtual bool closeOrder(OrderId order_id) override;
+    virtual bool cancelOrder(OrderId order_id) override;
     virtual OrderId createNewOrderRecord(const PairName& pair, const UserId& user_id, OrderInfo::Type type, const Rate& rate, const Amount& start_amount) override;
 
     virtual bool       updateNonce(const ApiKey& apikey, quint32 nonce) override;
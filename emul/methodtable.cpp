@@ -0,0 +1,95 @@
+#include "methodtable.h"
+
+#include <cstring>
+#include <stdexcept>
+
+static const MethodTable::Entry methodEntries[] =
+{
+    {"info",               false, Method::PublicInfo,                MethodTable::Permission::None},
+    {"ticker",             false, Method::PublicTicker,              MethodTable::Permission::None},
+    {"depth",              false, Method::PublicDepth,               MethodTable::Permission::None},
+    {"trades",             false, Method::PublicTrades,              MethodTable::Permission::None},
+
+    {"getInfo",            true,  Method::PrivateGetInfo,            MethodTable::Permission::Info},
+    {"ActiveOrders",       true,  Method::PrivateActiveOrders,       MethodTable::Permission::Info},
+    {"OrderInfo",          true,  Method::PrivateOrderInfo,          MethodTable::Permission::Info},
+    {"TradeHistory",       true,  Method::PrivateTradeHistory,       MethodTable::Permission::Info},
+    {"TransHistory",       true,  Method::PrivateTransHistory,       MethodTable::Permission::Info},
+    {"CoinDepositAddress", true,  Method::PrivateCoinDepositAddress, MethodTable::Permission::Info},
+    {"Trade",              true,  Method::PrivateTrade,              MethodTable::Permission::Trade},
+    {"CancelOrder",        true,  Method::PrivateCanelOrder,         MethodTable::Permission::Trade},
+    {"TradeBatch",         true,  Method::PrivateTradeBatch,         MethodTable::Permission::Trade},
+    {"CancelOrderBatch",   true,  Method::PrivateCancelOrderBatch,   MethodTable::Permission::Trade},
+    {"WithdrawCoin",       true,  Method::PrivateWithdrawCoin,       MethodTable::Permission::Withdraw},
+    {"CreateCupon",        true,  Method::PrivateCreateCupon,        MethodTable::Permission::Withdraw},
+    {"RedeemCupon",        true,  Method::PrivateRedeemCupon,        MethodTable::Permission::Withdraw},
+};
+
+static const int methodEntriesCount = sizeof(methodEntries) / sizeof(methodEntries[0]);
+
+MethodTable::MethodTable()
+    :mask(0), seed(0)
+{
+    // search for a seed giving no collisions; grow the table if none found
+    for (quint32 tableSize = 16; tableSize <= 4096; tableSize <<= 1)
+        for (quint32 s = 1; s < 10000; s++)
+            if (build(tableSize, s))
+                return;
+    throw std::runtime_error("fail to build method table");
+}
+
+const MethodTable& MethodTable::instance()
+{
+    static MethodTable table;
+    return table;
+}
+
+quint32 MethodTable::hash(bool isPrivate, const char* name, int length, quint32 hashSeed) const
+{
+    // FNV-1a, seeded
+    quint32 h = 2166136261u ^ hashSeed;
+    h = (h ^ (isPrivate?1u:0u)) * 16777619u;
+    for (int i=0; i<length; i++)
+        h = (h ^ static_cast<quint8>(name[i])) * 16777619u;
+    return h;
+}
+
+bool MethodTable::build(quint32 tableSize, quint32 candidateSeed)
+{
+    QVector<const Entry*> candidate(tableSize, nullptr);
+    for (int i=0; i<methodEntriesCount; i++)
+    {
+        const Entry& entry = methodEntries[i];
+        quint32 slot = hash(entry.isPrivate, entry.name, static_cast<int>(strlen(entry.name)), candidateSeed) & (tableSize - 1);
+        if (candidate[slot])
+            return false;
+        candidate[slot] = &entry;
+    }
+    buckets = candidate;
+    mask = tableSize - 1;
+    seed = candidateSeed;
+    return true;
+}
+
+const MethodTable::Entry* MethodTable::lookup(bool isPrivate, const char* name, int length)
+{
+    if (!name || length <= 0)
+        return nullptr;
+
+    const MethodTable& table = instance();
+    const Entry* entry = table.buckets[table.hash(isPrivate, name, length, table.seed) & table.mask];
+    if (   entry
+        && entry->isPrivate == isPrivate
+        && strncmp(entry->name, name, length) == 0
+        && entry->name[length] == '\0')
+        return entry;
+    return nullptr;
+}
+
+const char* MethodTable::name(Method method)
+{
+    for (const Entry& entry: methodEntries)
+        if (entry.method == method)
+            return entry.name;
+    return nullptr;
+}
@@ -0,0 +1,39 @@
+#ifndef METHODTABLE_H
+#define METHODTABLE_H
+
+#include "types.h"
+
+#include <QVector>
+
+/// Maps api method names to Method ids through a perfect hash built once at startup.
+/// Lookup costs one hash over the name and one comparison, no allocations.
+class MethodTable
+{
+public:
+    enum class Permission {None, Info, Trade, Withdraw};
+
+    struct Entry
+    {
+        const char* name;
+        bool        isPrivate;
+        Method      method;
+        Permission  permission;
+    };
+
+    static const Entry* lookup(bool isPrivate, const char* name, int length);
+    /// api name of method, nullptr for Invalid and other pseudo methods
+    static const char* name(Method method);
+
+private:
+    MethodTable();
+    static const MethodTable& instance();
+
+    quint32 hash(bool isPrivate, const char* name, int length, quint32 hashSeed) const;
+    bool build(quint32 tableSize, quint32 candidateSeed);
+
+    QVector<const Entry*> buckets;
+    quint32 mask;
+    quint32 seed;
+};
+
+#endif // METHODTABLE_H
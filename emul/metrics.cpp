@@ -0,0 +1,332 @@
+#include "metrics.h"
+#include "methodtable.h"
+#include "utils.h"
+
+#include <QHostAddress>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QThread>
+
+#include <iostream>
+
+const qint64 Metrics::bucketBounds[BUCKETS_COUNT - 1] = {50, 100, 250, 500, 1000, 2500, 5000, 10000,
+                                                         25000, 50000, 100000, 250000, 500000, 1000000, 2500000};
+
+std::atomic<quint64> Metrics::requests[METHODS_COUNT] = {};
+Metrics::Histogram Metrics::requestLatency[METHODS_COUNT];
+Metrics::Histogram Metrics::stageLatency[static_cast<int>(Stage::Count)];
+Metrics::Histogram Metrics::tradeLockLatency;
+std::atomic<quint64> Metrics::deadlockRetries{0};
+std::atomic<quint64> Metrics::cacheHits[static_cast<int>(Cache::Count)] = {};
+std::atomic<quint64> Metrics::cacheMisses[static_cast<int>(Cache::Count)] = {};
+std::atomic<quint64> Metrics::rejections[static_cast<int>(Rejection::Count)] = {};
+
+namespace
+{
+struct RequestStages
+{
+    qint64 nsecs[static_cast<int>(Metrics::Stage::Count)];
+    bool touched[static_cast<int>(Metrics::Stage::Count)];
+    quint64 sqlStart;
+};
+thread_local RequestStages current;
+}
+
+void Metrics::Histogram::observe(qint64 nsecs)
+{
+    qint64 usecs = nsecs / 1000;
+    int bucket = 0;
+    while (bucket < BUCKETS_COUNT - 1 && usecs > bucketBounds[bucket])
+        bucket++;
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sumUsecs.fetch_add(static_cast<quint64>(usecs), std::memory_order_relaxed);
+}
+
+qint64 Metrics::Histogram::quantile(double q) const
+{
+    quint64 total = count.load(std::memory_order_relaxed);
+    if (!total)
+        return 0;
+    quint64 rank = static_cast<quint64>(q * total);
+    quint64 seen = 0;
+    for (int bucket = 0; bucket < BUCKETS_COUNT - 1; bucket++)
+    {
+        seen += buckets[bucket].load(std::memory_order_relaxed);
+        if (seen > rank)
+            return bucketBounds[bucket];
+    }
+    return -1;
+}
+
+void Metrics::beginRequest()
+{
+    for (int stage = 0; stage < static_cast<int>(Stage::Count); stage++)
+    {
+        current.nsecs[stage] = 0;
+        current.touched[stage] = false;
+    }
+    current.sqlStart = sqlTimeSpent();
+}
+
+void Metrics::addStage(Stage stage, qint64 nsecs)
+{
+    current.nsecs[static_cast<int>(stage)] += nsecs;
+    current.touched[static_cast<int>(stage)] = true;
+}
+
+void Metrics::endRequest(Method method, qint64 nsecs)
+{
+    quint64 sql = sqlTimeSpent() - current.sqlStart;
+    if (sql)
+        addStage(Stage::Sql, static_cast<qint64>(sql));
+    for (int stage = 0; stage < static_cast<int>(Stage::Count); stage++)
+        if (current.touched[stage])
+            stageLatency[stage].observe(current.nsecs[stage]);
+
+    int index = static_cast<int>(method);
+    if (index < 0 || index >= METHODS_COUNT)
+        index = Method::Invalid;
+    requests[index].fetch_add(1, std::memory_order_relaxed);
+    requestLatency[index].observe(nsecs);
+}
+
+Metrics::StageTimer::StageTimer(Stage stage)
+    :stage(stage), sqlStart(sqlTimeSpent()), running(true)
+{
+    timer.start();
+}
+
+Metrics::StageTimer::~StageTimer()
+{
+    stop();
+}
+
+void Metrics::StageTimer::stop()
+{
+    if (!running)
+        return;
+    running = false;
+    qint64 sql = static_cast<qint64>(sqlTimeSpent() - sqlStart);
+    addStage(stage, qMax<qint64>(0, timer.nsecsElapsed() - sql));
+}
+
+void Metrics::tradeLockWait(qint64 nsecs)
+{
+    tradeLockLatency.observe(nsecs);
+}
+
+void Metrics::deadlockRetry()
+{
+    deadlockRetries.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::cacheLookup(Cache cache, bool hit)
+{
+    std::atomic<quint64>* counters = hit ? cacheHits : cacheMisses;
+    counters[static_cast<int>(cache)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::rateLimited(Rejection rejection)
+{
+    rejections[static_cast<int>(rejection)].fetch_add(1, std::memory_order_relaxed);
+}
+
+QString Metrics::methodName(int method)
+{
+    const char* name = MethodTable::name(static_cast<Method>(method));
+    return name ? QString(name) : QString("invalid");
+}
+
+const char* Metrics::stageName(int stage)
+{
+    static const char* names[] = {"accept", "parse", "auth", "cache", "sql", "match", "serialize", "write"};
+    return names[stage];
+}
+
+const char* Metrics::cacheName(int cache)
+{
+    static const char* names[] = {"memcached", "local", "response"};
+    return names[cache];
+}
+
+const char* Metrics::rejectionName(int rejection)
+{
+    static const char* names[] = {"key", "address", "key_overflow", "address_overflow"};
+    return names[rejection];
+}
+
+void Metrics::writeHistogram(QByteArray& out, const char* name, const QByteArray& labels, const Histogram& histogram)
+{
+    QByteArray prefix = labels.isEmpty() ? QByteArray() : labels + ',';
+    quint64 cumulative = 0;
+    for (int bucket = 0; bucket < BUCKETS_COUNT; bucket++)
+    {
+        cumulative += histogram.buckets[bucket].load(std::memory_order_relaxed);
+        QByteArray le = (bucket < BUCKETS_COUNT - 1) ? QByteArray::number(bucketBounds[bucket] / 1e6, 'g', 6) : QByteArray("+Inf");
+        out += QByteArray(name) + "_bucket{" + prefix + "le=\"" + le + "\"} " + QByteArray::number(cumulative) + '\n';
+    }
+    QByteArray braces = labels.isEmpty() ? QByteArray() : '{' + labels + '}';
+    out += QByteArray(name) + "_sum" + braces + ' ' + QByteArray::number(histogram.sumUsecs.load(std::memory_order_relaxed) / 1e6, 'f', 6) + '\n';
+    out += QByteArray(name) + "_count" + braces + ' ' + QByteArray::number(histogram.count.load(std::memory_order_relaxed)) + '\n';
+}
+
+QByteArray Metrics::prometheus()
+{
+    QByteArray out;
+    out += "# TYPE emulator_requests_total counter\n";
+    for (int method = 0; method < METHODS_COUNT; method++)
+        if (requests[method].load(std::memory_order_relaxed))
+            out += "emulator_requests_total{method=\"" + methodName(method).toUtf8() + "\"} "
+                    + QByteArray::number(requests[method].load(std::memory_order_relaxed)) + '\n';
+
+    out += "# TYPE emulator_request_duration_seconds histogram\n";
+    for (int method = 0; method < METHODS_COUNT; method++)
+        if (requestLatency[method].count.load(std::memory_order_relaxed))
+            writeHistogram(out, "emulator_request_duration_seconds", "method=\"" + methodName(method).toUtf8() + '"', requestLatency[method]);
+
+    out += "# TYPE emulator_stage_duration_seconds histogram\n";
+    for (int stage = 0; stage < static_cast<int>(Stage::Count); stage++)
+        writeHistogram(out, "emulator_stage_duration_seconds", QByteArray("stage=\"") + stageName(stage) + '"', stageLatency[stage]);
+
+    out += "# TYPE emulator_trade_lock_wait_seconds histogram\n";
+    writeHistogram(out, "emulator_trade_lock_wait_seconds", QByteArray(), tradeLockLatency);
+
+    out += "# TYPE emulator_deadlock_retries_total counter\n";
+    out += "emulator_deadlock_retries_total " + QByteArray::number(deadlockRetries.load(std::memory_order_relaxed)) + '\n';
+
+    out += "# TYPE emulator_cache_lookups_total counter\n";
+    for (int cache = 0; cache < static_cast<int>(Cache::Count); cache++)
+    {
+        out += QByteArray("emulator_cache_lookups_total{cache=\"") + cacheName(cache) + "\",result=\"hit\"} "
+                + QByteArray::number(cacheHits[cache].load(std::memory_order_relaxed)) + '\n';
+        out += QByteArray("emulator_cache_lookups_total{cache=\"") + cacheName(cache) + "\",result=\"miss\"} "
+                + QByteArray::number(cacheMisses[cache].load(std::memory_order_relaxed)) + '\n';
+    }
+
+    out += "# TYPE emulator_rate_limited_total counter\n";
+    for (int rejection = 0; rejection < static_cast<int>(Rejection::Count); rejection++)
+        out += QByteArray("emulator_rate_limited_total{limit=\"") + rejectionName(rejection) + "\"} "
+                + QByteArray::number(rejections[rejection].load(std::memory_order_relaxed)) + '\n';
+    return out;
+}
+
+static QJsonObject histogramJson(quint64 count, quint64 sumUsecs, qint64 p50, qint64 p99)
+{
+    QJsonObject object;
+    object["count"] = static_cast<qint64>(count);
+    object["mean_us"] = count ? static_cast<qint64>(sumUsecs / count) : 0;
+    // -1 means beyond the last bucket
+    object["p50_us"] = p50;
+    object["p99_us"] = p99;
+    return object;
+}
+
+QByteArray Metrics::json()
+{
+    auto toJson = [](const Histogram& h)
+    {
+        return histogramJson(h.count.load(std::memory_order_relaxed), h.sumUsecs.load(std::memory_order_relaxed),
+                             h.quantile(0.5), h.quantile(0.99));
+    };
+
+    QJsonObject methods;
+    for (int method = 0; method < METHODS_COUNT; method++)
+        if (requests[method].load(std::memory_order_relaxed))
+            methods[methodName(method)] = toJson(requestLatency[method]);
+
+    QJsonObject stages;
+    for (int stage = 0; stage < static_cast<int>(Stage::Count); stage++)
+        stages[stageName(stage)] = toJson(stageLatency[stage]);
+
+    QJsonObject caches;
+    for (int cache = 0; cache < static_cast<int>(Cache::Count); cache++)
+    {
+        quint64 hits = cacheHits[cache].load(std::memory_order_relaxed);
+        quint64 misses = cacheMisses[cache].load(std::memory_order_relaxed);
+        QJsonObject object;
+        object["hits"] = static_cast<qint64>(hits);
+        object["misses"] = static_cast<qint64>(misses);
+        object["hit_rate"] = (hits + misses) ? static_cast<double>(hits) / (hits + misses) : 0.;
+        caches[cacheName(cache)] = object;
+    }
+
+    QJsonObject rateLimited;
+    for (int rejection = 0; rejection < static_cast<int>(Rejection::Count); rejection++)
+        rateLimited[rejectionName(rejection)] = static_cast<qint64>(rejections[rejection].load(std::memory_order_relaxed));
+
+    QJsonObject root;
+    root["methods"] = methods;
+    root["stages"] = stages;
+    root["trade_lock_wait"] = toJson(tradeLockLatency);
+    root["deadlock_retries"] = static_cast<qint64>(deadlockRetries.load(std::memory_order_relaxed));
+    root["caches"] = caches;
+    root["rate_limited"] = rateLimited;
+    return QJsonDocument(root).toJson();
+}
+
+bool Metrics::dumpJson(const QString& fileName)
+{
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    file.write(json());
+    return file.commit();
+}
+
+void Metrics::startServer(const QString& address, quint16 port)
+{
+    QThread* thread = new QThread;
+    QObject* context = new QObject;
+    context->moveToThread(thread);
+    QObject::connect(thread, &QThread::started, context, [context, address, port]()
+    {
+        QTcpServer* server = new QTcpServer(context);
+        QObject::connect(server, &QTcpServer::newConnection, context, [server]()
+        {
+            while (server->hasPendingConnections())
+            {
+                QTcpSocket* socket = server->nextPendingConnection();
+                QObject::connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+                QObject::connect(socket, &QTcpSocket::readyRead, socket, [socket]()
+                {
+                    if (!socket->canReadLine())
+                        return;
+                    // GET /metrics HTTP/1.1, headers are not needed
+                    QList<QByteArray> request = socket->readLine().split(' ');
+                    QByteArray path = request.size() > 1 ? request[1] : QByteArray();
+                    QByteArray status = "200 OK";
+                    QByteArray type;
+                    QByteArray body;
+                    if (path == "/metrics")
+                    {
+                        type = "text/plain; version=0.0.4";
+                        body = prometheus();
+                    }
+                    else if (path == "/metrics.json")
+                    {
+                        type = "application/json";
+                        body = json();
+                    }
+                    else
+                    {
+                        status = "404 Not Found";
+                        type = "text/plain";
+                    }
+                    socket->write("HTTP/1.0 " + status + "\r\nContent-Type: " + type
+                                  + "\r\nContent-Length: " + QByteArray::number(body.size()) + "\r\nConnection: close\r\n\r\n" + body);
+                    socket->disconnectFromHost();
+                });
+            }
+        });
+        if (!server->listen(QHostAddress(address), port))
+            std::cerr << "[metrics] fail to listen on " << address.toStdString() << ':' << port << ": "
+                      << server->errorString().toStdString() << std::endl;
+        else
+            std::clog << "[metrics] listening on " << address.toStdString() << ':' << port << std::endl;
+    });
+    thread->start();
+}
@@ -0,0 +1,91 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "types.h"
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QString>
+
+#include <atomic>
+
+/// Process metrics: request counts and latency per method, latency of
+/// request stages, waits on per pair trade mutexes, deadlock retries, hit
+/// rates of data accessor caches and requests rejected by rate limits.
+/// Counters are atomics updated by FastCGI threads without locks. They are
+/// exported in Prometheus text format on a local port and dumped as JSON.
+class Metrics
+{
+public:
+    enum class Stage {Accept, Parse, Auth, Cache, Sql, Match, Serialize, Write, Count};
+    enum class Cache {Memcached, LocalCaches, Response, Count};
+    /// overflow is a request with no bucket left for its id
+    enum class Rejection {KeyRate, AddressRate, KeyOverflow, AddressOverflow, Count};
+
+    /// stages of one request are summed per thread between these calls,
+    /// every touched stage is observed once per request
+    static void beginRequest();
+    static void endRequest(Method method, qint64 nsecs);
+    static void addStage(Stage stage, qint64 nsecs);
+
+    /// times a stage, SQL done meanwhile goes to Sql stage instead
+    class StageTimer
+    {
+    public:
+        explicit StageTimer(Stage stage);
+        ~StageTimer();
+        void stop();
+
+    private:
+        Stage stage;
+        QElapsedTimer timer;
+        quint64 sqlStart;
+        bool running;
+    };
+
+    static void tradeLockWait(qint64 nsecs);
+    static void deadlockRetry();
+    static void cacheLookup(Cache cache, bool hit);
+    static void rateLimited(Rejection rejection);
+
+    static QByteArray prometheus();
+    static QByteArray json();
+    static bool dumpJson(const QString& fileName);
+    /// serves /metrics and /metrics.json over HTTP in its own thread
+    static void startServer(const QString& address, quint16 port);
+
+private:
+    /// latency buckets in microseconds, last one is +Inf
+    static const int BUCKETS_COUNT = 16;
+    static const qint64 bucketBounds[BUCKETS_COUNT - 1];
+
+    struct Histogram
+    {
+        std::atomic<quint64> buckets[BUCKETS_COUNT] = {};
+        std::atomic<quint64> count{0};
+        std::atomic<quint64> sumUsecs{0};
+
+        void observe(qint64 nsecs);
+        /// upper bound of bucket holding given quantile, in microseconds
+        qint64 quantile(double q) const;
+    };
+
+    static const int METHODS_COUNT = Method::PrivateCancelOrderBatch + 1;
+
+    static void writeHistogram(QByteArray& out, const char* name, const QByteArray& labels, const Histogram& histogram);
+    static QString methodName(int method);
+    static const char* stageName(int stage);
+    static const char* cacheName(int cache);
+    static const char* rejectionName(int rejection);
+
+    static std::atomic<quint64> requests[METHODS_COUNT];
+    static Histogram requestLatency[METHODS_COUNT];
+    static Histogram stageLatency[static_cast<int>(Stage::Count)];
+    static Histogram tradeLockLatency;
+    static std::atomic<quint64> deadlockRetries;
+    static std::atomic<quint64> cacheHits[static_cast<int>(Cache::Count)];
+    static std::atomic<quint64> cacheMisses[static_cast<int>(Cache::Count)];
+    static std::atomic<quint64> rejections[static_cast<int>(Rejection::Count)];
+};
+
+#endif // METRICS_H
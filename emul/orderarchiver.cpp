@@ -0,0 +1,39 @@
+#include "orderarchiver.h"
+#include "utils.h"
+
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QStringList>
+#include <QVariant>
+
+int OrderArchiver::archiveBatch(QSqlDatabase& db, int batchSize)
+{
+    QSqlQuery sql(db);
+    db.transaction();
+    try
+    {
+        performSql("select finished orders", sql, QString("select order_id from orders where status<>'active' order by order_id limit %1 for update").arg(batchSize), true);
+        QStringList ids;
+        while (sql.next())
+            ids << sql.value(0).toString();
+        if (ids.isEmpty())
+        {
+            db.rollback();
+            return 0;
+        }
+
+        // trades first: they refer to orders
+        QString in = ids.join(',');
+        performSql("archive trades", sql, QString("insert into trades_history select * from trades where order_id in (%1)").arg(in), true);
+        performSql("remove archived trades", sql, QString("delete from trades where order_id in (%1)").arg(in), true);
+        performSql("archive orders", sql, QString("insert into orders_history select * from orders where order_id in (%1)").arg(in), true);
+        performSql("remove archived orders", sql, QString("delete from orders where order_id in (%1)").arg(in), true);
+        db.commit();
+        return ids.size();
+    }
+    catch (const QSqlQuery&)
+    {
+        db.rollback();
+        throw;
+    }
+}
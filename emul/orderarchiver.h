@@ -0,0 +1,22 @@
+#ifndef ORDERARCHIVER_H
+#define ORDERARCHIVER_H
+
+#include <QtGlobal>
+
+class QSqlDatabase;
+
+/// Moves finished orders and their trades from hot orders and trades tables
+/// to orders_history and trades_history, so matching and active orders
+/// queries keep reading a table of about the size of the books.
+/// Trades refer to the order they filled, which is finished by then, so an
+/// order goes with all its trades. Readers of single orders and of trades
+/// look into history tables too.
+class OrderArchiver
+{
+public:
+    /// moves up to batchSize oldest finished orders in one transaction,
+    /// returns count of moved orders, throws QSqlQuery on SQL error
+    static int archiveBatch(QSqlDatabase& db, int batchSize);
+};
+
+#endif // ORDERARCHIVER_H
@@ -0,0 +1,411 @@
+#include "orderbook.h"
+
+#define BOOK_HISTORY_LENGTH 1024
+
+QHash<PairName, OrderBook::Book*> OrderBook::books;
+QMutex OrderBook::booksAccess;
+QList<OrderBook::Listener> OrderBook::listeners;
+int OrderBook::maxTicks = 0;
+
+OrderBook::LevelState& OrderBook::Side::operator[](const Rate& rate)
+{
+    if (ladder)
+    {
+        int tick;
+        if (ladder->tick(rate, tick))
+        {
+            if (!ladder->isUsed(tick))
+                ladder->use(tick);
+            return ladder->value(tick);
+        }
+        useTree();
+    }
+    return tree[rate];
+}
+
+void OrderBook::Side::remove(const Rate& rate)
+{
+    if (!ladder)
+    {
+        tree.remove(rate);
+        return;
+    }
+    int tick;
+    if (ladder->tick(rate, tick) && ladder->isUsed(tick))
+        ladder->release(tick);
+}
+
+void OrderBook::Side::clear()
+{
+    if (ladder)
+        ladder->clear();
+    tree.clear();
+}
+
+QList<OrderBook::Level> OrderBook::Side::best(OrderInfo::Type type, int limit) const
+{
+    QList<Level> ret;
+    Level level;
+    level.type = type;
+    if (ladder)
+    {
+        bool bids = (type == OrderInfo::Type::Buy);
+        for (int tick = bids ? ladder->highest() : ladder->lowest();
+             tick != TickLadder<LevelState>::NONE && ret.size() < limit;
+             tick = bids ? ladder->below(tick) : ladder->above(tick))
+        {
+            level.rate = ladder->rate(tick);
+            level.amount = ladder->value(tick).amount;
+            level.count = ladder->value(tick).count;
+            ret.append(level);
+        }
+    }
+    else if (type == OrderInfo::Type::Buy)
+    {
+        auto item = tree.constEnd();
+        while (item != tree.constBegin() && ret.size() < limit)
+        {
+            item--;
+            level.rate = item.key();
+            level.amount = item->amount;
+            level.count = item->count;
+            ret.append(level);
+        }
+    }
+    else
+    {
+        for (auto item = tree.constBegin(); item != tree.constEnd() && ret.size() < limit; item++)
+        {
+            level.rate = item.key();
+            level.amount = item->amount;
+            level.count = item->count;
+            ret.append(level);
+        }
+    }
+    return ret;
+}
+
+QMap<Rate, OrderBook::LevelState> OrderBook::Side::toMap() const
+{
+    if (!ladder)
+        return tree;
+    QMap<Rate, LevelState> levels;
+    for (int tick = ladder->lowest(); tick != TickLadder<LevelState>::NONE; tick = ladder->above(tick))
+        levels.insert(ladder->rate(tick), ladder->value(tick));
+    return levels;
+}
+
+void OrderBook::Side::assign(const QMap<Rate, LevelState>& levels)
+{
+    clear();
+    for (auto level = levels.constBegin(); level != levels.constEnd(); level++)
+        (*this)[level.key()] = level.value();
+}
+
+bool OrderBook::Side::useTicks(const Rate& min_price, int decimal_places, int ticks)
+{
+    QMap<Rate, LevelState> levels = toMap();
+    std::unique_ptr<TickLadder<LevelState>> created(new TickLadder<LevelState>(min_price, decimal_places, ticks));
+    int tick;
+    for (const Rate& rate: levels.keys())
+        if (!created->tick(rate, tick))
+            return false;
+    ladder = std::move(created);
+    tree.clear();
+    assign(levels);
+    return true;
+}
+
+void OrderBook::Side::useTree()
+{
+    tree = toMap();
+    ladder.reset();
+}
+
+void OrderBook::Batch::levelChanged(const PairName& pair, OrderInfo::Type type, const Rate& rate, const Amount& amount, int orders)
+{
+    Change change;
+    change.pair = pair;
+    change.level.type = type;
+    change.level.rate = rate;
+    change.level.amount = amount;
+    change.level.count = orders;
+    changes.append(change);
+}
+
+OrderBook::Book* OrderBook::book(const PairName& pair)
+{
+    QMutexLocker lock(&booksAccess);
+    Book*& b = books[pair];
+    if (!b)
+        b = new Book;
+    return b;
+}
+
+OrderBook::Book* OrderBook::findBook(const PairName& pair)
+{
+    QMutexLocker lock(&booksAccess);
+    return books.value(pair);
+}
+
+void OrderBook::reset()
+{
+    QMutexLocker lock(&booksAccess);
+    for (Book* b: books)
+    {
+        QMutexLocker bookLock(&b->access);
+        b->bids.clear();
+        b->asks.clear();
+        b->history.clear();
+        b->version++;
+    }
+}
+
+void OrderBook::setMaxTicks(int ticks)
+{
+    maxTicks = ticks;
+}
+
+bool OrderBook::useTicks(const PairName& pair, const Rate& min_price, const Rate& max_price, int decimal_places)
+{
+    if (decimal_places < 0 || decimal_places > 7 || max_price < min_price)
+        return false;
+    qint64 step = 1;
+    for (int i = decimal_places; i < 7; i++)
+        step *= 10;
+    qint64 ticks = (max_price.getUnbiased() - min_price.getUnbiased()) / step + 1;
+    if (ticks > maxTicks)
+        return false;
+
+    Book* b = book(pair);
+    QMutexLocker lock(&b->access);
+    bool bids = b->bids.useTicks(min_price, decimal_places, static_cast<int>(ticks));
+    bool asks = b->asks.useTicks(min_price, decimal_places, static_cast<int>(ticks));
+    return bids && asks;
+}
+
+bool OrderBook::usesTicks(const PairName& pair)
+{
+    Book* b = findBook(pair);
+    if (!b)
+        return false;
+    QMutexLocker lock(&b->access);
+    return b->bids.isLadder() && b->asks.isLadder();
+}
+
+void OrderBook::load(const PairName& pair, const Level& level)
+{
+    Book* b = book(pair);
+    QMutexLocker lock(&b->access);
+    LevelState& state = b->side(level.type)[level.rate];
+    state.amount = level.amount;
+    state.count = level.count;
+}
+
+void OrderBook::addListener(Listener listener)
+{
+    listeners.append(listener);
+}
+
+void OrderBook::apply(const Batch& batch)
+{
+    QMap<PairName, QList<const Batch::Change*>> byPair;
+    for (const Batch::Change& change: batch.changes)
+        byPair[change.pair].append(&change);
+
+    for (auto pair = byPair.constBegin(); pair != byPair.constEnd(); pair++)
+    {
+        Book* b = book(pair.key());
+        QMutexLocker lock(&b->access);
+        Updates updates;
+        updates.version = ++b->version;
+        for (const Batch::Change* change: pair.value())
+        {
+            Side& side = b->side(change->level.type);
+            LevelState& state = side[change->level.rate];
+            state.amount += change->level.amount;
+            state.count += change->level.count;
+
+            Level level = change->level;
+            level.amount = state.amount;
+            level.count = state.count;
+            // removed level keeps zero amount here, as depth deltas report
+            // it; the feed turns it to Bitfinex form on its way out
+            if (state.count <= 0 || state.amount <= Amount(0))
+            {
+                side.remove(change->level.rate);
+                level.amount = Amount(0);
+                level.count = 0;
+            }
+            updates.levels.append(level);
+        }
+        b->history.append(updates);
+        if (b->history.size() > BOOK_HISTORY_LENGTH)
+            b->history.removeFirst();
+        for (const Listener& listener: listeners)
+            listener(pair.key(), updates);
+    }
+}
+
+QList<OrderBook::Level> OrderBook::sideLevels(Book* b, OrderInfo::Type type, int limit)
+{
+    return b->side(type).best(type, limit);
+}
+
+QList<OrderBook::Level> OrderBook::levels(const PairName& pair, OrderInfo::Type type, int limit, quint64* version)
+{
+    Book* b = findBook(pair);
+    if (!b)
+    {
+        if (version)
+            *version = 0;
+        return QList<Level>();
+    }
+    QMutexLocker lock(&b->access);
+    if (version)
+        *version = b->version;
+    return sideLevels(b, type, limit);
+}
+
+quint64 OrderBook::snapshot(const PairName& pair, int limit, QList<Level>& bids, QList<Level>& asks)
+{
+    Book* b = findBook(pair);
+    if (!b)
+    {
+        bids.clear();
+        asks.clear();
+        return 0;
+    }
+    QMutexLocker lock(&b->access);
+    bids = sideLevels(b, OrderInfo::Type::Buy, limit);
+    asks = sideLevels(b, OrderInfo::Type::Sell, limit);
+    return b->version;
+}
+
+quint64 OrderBook::version(const PairName& pair)
+{
+    // pair may come from url, do not create book for it
+    Book* b = findBook(pair);
+    if (!b)
+        return 0;
+    QMutexLocker lock(&b->access);
+    return b->version;
+}
+
+bool OrderBook::changesSince(const PairName& pair, quint64 since, QList<Level>& bids, QList<Level>& asks, quint64& version)
+{
+    Book* b = findBook(pair);
+    if (!b)
+    {
+        version = 0;
+        return since == 0;
+    }
+    QMutexLocker lock(&b->access);
+    version = b->version;
+    if (since > b->version)
+        return false;
+    if (since == b->version)
+        return true;
+    if (b->history.isEmpty() || b->history.first().version > since + 1)
+        return false;
+
+    // later change of a level overrides earlier ones
+    QMap<Rate, Level> changedBids;
+    QMap<Rate, Level> changedAsks;
+    for (auto updates = b->history.crbegin(); updates != b->history.crend() && updates->version > since; updates++)
+    {
+        for (auto level = updates->levels.crbegin(); level != updates->levels.crend(); level++)
+        {
+            QMap<Rate, Level>& side = (level->type == OrderInfo::Type::Buy) ? changedBids : changedAsks;
+            if (!side.contains(level->rate))
+                side.insert(level->rate, *level);
+        }
+    }
+
+    for (auto level = changedBids.constEnd(); level != changedBids.constBegin();)
+        bids.append(*--level);
+    asks = changedAsks.values();
+    return true;
+}
+
+void OrderBook::applyUpdates(const PairName& pair, const Updates& updates)
+{
+    Book* b = book(pair);
+    QMutexLocker lock(&b->access);
+    if (updates.version <= b->version)
+        return;
+    // levels carry resulting state, not differences
+    for (const Level& level: updates.levels)
+    {
+        Side& side = b->side(level.type);
+        if (level.count <= 0)
+            side.remove(level.rate);
+        else
+        {
+            LevelState& state = side[level.rate];
+            state.amount = level.amount;
+            state.count = level.count;
+        }
+    }
+    b->version = updates.version;
+    b->history.append(updates);
+    if (b->history.size() > BOOK_HISTORY_LENGTH)
+        b->history.removeFirst();
+    for (const Listener& listener: listeners)
+        listener(pair, updates);
+}
+
+void OrderBook::writeUpdates(QDataStream& stream, const Updates& updates)
+{
+    stream << updates.version << static_cast<quint32>(updates.levels.size());
+    for (const Level& level: updates.levels)
+        stream << static_cast<quint8>(level.type) << level.rate << level.amount << static_cast<qint32>(level.count);
+}
+
+void OrderBook::readUpdates(QDataStream& stream, Updates& updates)
+{
+    quint32 count;
+    stream >> updates.version >> count;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++)
+    {
+        Level level;
+        quint8 type;
+        qint32 levelCount;
+        stream >> type >> level.rate >> level.amount >> levelCount;
+        level.type = static_cast<OrderInfo::Type>(type);
+        level.count = levelCount;
+        updates.levels.append(level);
+    }
+}
+
+void OrderBook::save(QDataStream& stream)
+{
+    QMutexLocker lock(&booksAccess);
+    stream << static_cast<quint32>(books.size());
+    for (auto b = books.constBegin(); b != books.constEnd(); b++)
+    {
+        QMutexLocker bookLock(&b.value()->access);
+        stream << b.key() << b.value()->version << b.value()->bids.toMap() << b.value()->asks.toMap();
+    }
+}
+
+void OrderBook::restore(QDataStream& stream)
+{
+    quint32 count;
+    stream >> count;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++)
+    {
+        PairName pair;
+        quint64 version;
+        QMap<Rate, LevelState> bids;
+        QMap<Rate, LevelState> asks;
+        stream >> pair >> version >> bids >> asks;
+
+        Book* b = book(pair);
+        QMutexLocker lock(&b->access);
+        b->version = version;
+        b->bids.assign(bids);
+        b->asks.assign(asks);
+        b->history.clear();
+    }
+}
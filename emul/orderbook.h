@@ -0,0 +1,160 @@
+#ifndef ORDERBOOK_H
+#define ORDERBOOK_H
+
+#include "types.h"
+#include "tickladder.h"
+
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+
+#include <functional>
+#include <memory>
+
+/// In-memory price ladder of active orders, aggregated by rate.
+/// Levels are loaded from SQL once and then kept up to date by changes
+/// collected in a Batch during a transaction and applied after commit.
+/// Every applied batch increments version of each pair it touches, last
+/// changes are kept per pair so a client can ask only for levels changed
+/// since the version it has seen.
+/// A side is kept in a tree of rates, or in a TickLadder when the pair
+/// has a narrow enough range of prices (see useTicks()).
+class OrderBook
+{
+public:
+    /// state of price level, zero count means level is removed
+    struct Level
+    {
+        OrderInfo::Type type;
+        Rate rate;
+        Amount amount;
+        int count;
+    };
+
+    struct Updates
+    {
+        quint64 version;
+        QList<Level> levels;
+    };
+
+    class Batch
+    {
+    public:
+        /// amount and orders are differences, not resulting values
+        void levelChanged(const PairName& pair, OrderInfo::Type type, const Rate& rate, const Amount& amount, int orders);
+
+        void clear() { changes.clear(); }
+        bool isEmpty() const { return changes.isEmpty(); }
+
+    private:
+        friend class OrderBook;
+        struct Change
+        {
+            PairName pair;
+            Level level;
+        };
+        QList<Change> changes;
+    };
+
+    /// called with resulting state of changed levels of every pair touched by
+    /// applied batch, while book of the pair is still locked, so calls for
+    /// one pair come in version order
+    using Listener = std::function<void(const PairName&, const Updates&)>;
+    /// listeners are added at start, before any batch is applied
+    static void addListener(Listener listener);
+
+    /// drops all levels before books are loaded again
+    static void reset();
+    /// largest ladder allowed per side, zero keeps all books in trees
+    static void setMaxTicks(int ticks);
+    /// keeps book of the pair in ladders of ticks, if its price range fits
+    /// max ticks; a rate off the ticks turns a side back into a tree
+    static bool useTicks(const PairName& pair, const Rate& min_price, const Rate& max_price, int decimal_places);
+    static bool usesTicks(const PairName& pair);
+    static void load(const PairName& pair, const Level& level);
+    static void apply(const Batch& batch);
+    /// applies updates made by another instance, ones not newer than the
+    /// book are skipped; listeners are called as for own batches
+    static void applyUpdates(const PairName& pair, const Updates& updates);
+
+    /// best levels of one side, bids by rate desc and asks by rate asc;
+    /// unknown pair has no levels and version 0
+    static QList<Level> levels(const PairName& pair, OrderInfo::Type type, int limit, quint64* version = nullptr);
+    /// both sides taken at one version
+    static quint64 snapshot(const PairName& pair, int limit, QList<Level>& bids, QList<Level>& asks);
+    static quint64 version(const PairName& pair);
+
+    /// levels and versions of all books, history is not kept
+    static void save(QDataStream& stream);
+    static void restore(QDataStream& stream);
+    static void writeUpdates(QDataStream& stream, const Updates& updates);
+    static void readUpdates(QDataStream& stream, Updates& updates);
+    /// latest state of levels changed after given version, zero count for
+    /// removed ones; false if changes since the version are no longer kept
+    static bool changesSince(const PairName& pair, quint64 since, QList<Level>& bids, QList<Level>& asks, quint64& version);
+
+private:
+    struct LevelState
+    {
+        Amount amount;
+        int count = 0;
+
+        friend QDataStream& operator<<(QDataStream& stream, const LevelState& state)
+        {
+            return stream << state.amount << static_cast<qint32>(state.count);
+        }
+        friend QDataStream& operator>>(QDataStream& stream, LevelState& state)
+        {
+            qint32 count;
+            stream >> state.amount >> count;
+            state.count = count;
+            return stream;
+        }
+    };
+    class Side
+    {
+    public:
+        /// level of the rate, added if missing
+        LevelState& operator[](const Rate& rate);
+        void remove(const Rate& rate);
+        void clear();
+        /// best levels first, highest rates for bids and lowest for asks
+        QList<Level> best(OrderInfo::Type type, int limit) const;
+        QMap<Rate, LevelState> toMap() const;
+        void assign(const QMap<Rate, LevelState>& levels);
+        /// false and tree kept if a level is off the ticks
+        bool useTicks(const Rate& min_price, int decimal_places, int ticks);
+        bool isLadder() const { return ladder != nullptr; }
+
+    private:
+        void useTree();
+
+        QMap<Rate, LevelState> tree;
+        std::unique_ptr<TickLadder<LevelState>> ladder;
+    };
+
+    struct Book
+    {
+        QMutex access;
+        quint64 version = 0;
+        Side bids;
+        Side asks;
+        QList<Updates> history;
+
+        Side& side(OrderInfo::Type type) { return type == OrderInfo::Type::Buy ? bids : asks; }
+    };
+
+    static Book* book(const PairName& pair);
+    /// nullptr if there is no book of the pair; read paths take pairs from
+    /// requests, they must not create books
+    static Book* findBook(const PairName& pair);
+    static QList<Level> sideLevels(Book* b, OrderInfo::Type type, int limit);
+
+    static QHash<PairName, Book*> books;
+    static QMutex booksAccess;
+    static int maxTicks;
+    static QList<Listener> listeners;
+};
+
+#endif // ORDERBOOK_H
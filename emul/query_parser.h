@@ -3,115 +3,158 @@
 
 #include "fcgi_request.h"
 #include "authentificator.h"
+#include "methodtable.h"
 
-#include <QUrl>
-#include <QUrlQuery>
+#include <QVarLengthArray>
 
+#include <cstring>
+#include <iostream>
+#include <limits>
 
 #define API_PATH "/api/3/"
 #define TAPI_PATH "/tapi"
 
-
+/// Single pass parser over raw FastCGI params and post data.
+/// All fields are kept as views into request buffers and only converted
+/// to Qt strings on demand, so parsing itself does not allocate.
+/// Views into params stay valid while the FcgiRequest is alive (till next accept).
 class QueryParser
 {
-    QueryParser(const QString& scheme, const QString& addr, const QString& port, const QString& path, const QString& query,
-                const QMap<QString, QString>& headers = QMap<QString,QString>(), const QByteArray& postData = QByteArray())
-    {
-        QUrl u;
-        u.setScheme(scheme);
-        u.setHost(addr);
-        u.setPort(port.toInt());
-        u.setPath(path);
-        u.setQuery(query);
-
-        setUrl(std::move(u), headers, postData);
-    }
+public:
+    enum Scope {Public, Private, Unknown};
 
-    void setUrl(const QUrl& u, const QMap<QString, QString>& headers = QMap<QString,QString>(), const QByteArray& postData = QByteArray())
+    struct View
     {
-        url = u;
+        const char* data = nullptr;
+        int size = 0;
 
-        QString p = url.path();
+        View() {}
+        View(const char* data, int size) :data(data), size(size) {}
 
-        if (p.startsWith(API_PATH))
+        bool isNull() const { return data == nullptr; }
+        bool isEmpty() const { return size == 0; }
+        bool equals(const char* str) const
         {
-            scope = Scope::Public;
-            p = p.remove(API_PATH);
-            splittedPath = p.split('/');
+            int len = static_cast<int>(strlen(str));
+            return len == size && (size == 0 || memcmp(data, str, size) == 0);
         }
-        else if(p.startsWith(TAPI_PATH))
+        QString toString() const
         {
-            scope = Scope::Private;
-            splittedPath.clear();
+            if (size == 0)
+                return QString();
+            if (memchr(data, '%', size))
+                return QString::fromUtf8(QByteArray::fromPercentEncoding(QByteArray(data, size)));
+            return QString::fromUtf8(data, size);
         }
-        else
-            std::cerr << "bad url path" << std::endl;
-
-
-        this->headers = headers;
+        int toInt(bool* ok = nullptr) const
+        {
+            int i = 0;
+            bool negative = false;
+            if (size > 0 && (data[0] == '-' || data[0] == '+'))
+            {
+                negative = data[0] == '-';
+                i++;
+            }
+            qint64 value = 0;
+            bool valid = i < size;
+            for (; i < size && valid; i++)
+            {
+                if (data[i] < '0' || data[i] > '9')
+                    valid = false;
+                else
+                {
+                    value = value * 10 + (data[i] - '0');
+                    if (value > std::numeric_limits<int>::max())
+                        valid = false;
+                }
+            }
+            if (ok)
+                *ok = valid;
+            if (!valid)
+                return 0;
+            return static_cast<int>(negative?-value:value);
+        }
+    };
 
-        rawPostData = postData;
-        QString str = QString::fromUtf8(postData);
-        postParams.setQuery(str);
-    }
-public:
-    enum Scope {Public, Private};
+    struct Item
+    {
+        View name;
+        View value;
+    };
 
     QueryParser(const FcgiRequest& request)
-        :QueryParser(request.getParam("REQUEST_SCHEME"),
-                     request.getParam("SERVER_ADDR"),
-                     request.getParam("SERVER_PORT"),
-                     request.getParam("DOCUMENT_URI"),
-                     request.getParam("QUERY_STRING"),
-                     request.authHeaders(),
-                     request.postData())
+        :scope(Scope::Unknown), methodEntry(nullptr), limitValue(150), ignoreInvalidValue(false), sinceSeen(false), sinceValue(0)
     {
+        documentUri = rawView(request.rawParam("DOCUMENT_URI"));
+        queryString = rawView(request.rawParam("QUERY_STRING"));
+        keyParam    = rawView(request.rawParam("KEY"));
+        signParam   = rawView(request.rawParam("SIGN"));
+        rawPostData = request.postData();
+
+        parsePath();
+        parseQueryString();
+        splitItems(rawPostData.constData(), rawPostData.size(), postParams);
+
+        if (scope == Scope::Public)
+            methodEntry = MethodTable::lookup(false, methodView.data, methodView.size);
+        else if (scope == Scope::Private)
+        {
+            methodView = postParam("method");
+            methodEntry = MethodTable::lookup(true, methodView.data, methodView.size);
+        }
     }
 
     QString toString() const
     {
-        return url.toString();
+        QString ret = QString::fromUtf8(documentUri.data, documentUri.size);
+        if (!queryString.isEmpty())
+            ret += '?' + QString::fromUtf8(queryString.data, queryString.size);
+        return ret;
     }
     QString method() const
     {
-        QString ret;
-        if (apiScope() == Scope::Public)
-        {
-            if (splittedPath.length() > 0)
-                ret = splittedPath[0];
-        }
-        else
-        {
-            ret = postParams.queryItemValue("method");
-        }
-        return ret;
+        return methodView.toString();
+    }
+    /// entry of requested method in method table or nullptr for unknown method
+    const MethodTable::Entry* methodInfo() const
+    {
+        return methodEntry;
+    }
+    Method methodId() const
+    {
+        return methodEntry ? methodEntry->method : Method::Invalid;
     }
     QStringList pairs() const
     {
         QStringList ret;
-        if (splittedPath.length() > 1)
-            ret = splittedPath[1].split('-');
+        for (const View& v: pairViews)
+            ret << v.toString();
         return ret;
     }
+    int pairsCount() const
+    {
+        return pairViews.size();
+    }
+    const View& pairAt(int i) const
+    {
+        return pairViews[i];
+    }
     bool ignoreInvalid() const
     {
-        QUrlQuery q(url);
-        if (q.hasQueryItem("ignore_invalid") && q.queryItemValue("ignore_invalid").toInt() == 1)
-            return true;
-        return false;
+        return ignoreInvalidValue;
     }
     int limit() const
     {
-        QUrlQuery q(url);
-        if (!q.hasQueryItem("limit"))
-            return 150;
-        bool ok;
-        int l = q.queryItemValue("limit").toInt(&ok);
-        if (!ok)
-            return 150;
-        if (l>5000)
-            return 5000;
-        return l;
+        return limitValue;
+    }
+    /// book version given by client of delta depth
+    bool hasSince() const
+    {
+        return sinceSeen;
+    }
+    quint64 since() const
+    {
+        return sinceValue;
     }
     Scope apiScope() const
     {
@@ -119,15 +162,15 @@ public:
     }
     QString key() const
     {
-        return headers["Key"];
+        return keyParam.toString();
     }
     QByteArray sign() const
     {
-        return headers["Sign"].toUtf8();
+        return QByteArray(signParam.data, signParam.size);
     }
     QString nonce() const
     {
-        return postParams.queryItemValue("nonce");
+        return postParam("nonce").toString();
     }
     QByteArray signedData() const
     {
@@ -135,31 +178,168 @@ public:
     }
     QString order_id() const
     {
-        return postParams.queryItemValue("order_id");
+        return postParam("order_id").toString();
     }
     QString amount() const
     {
-        return postParams.queryItemValue("amount");
+        return postParam("amount").toString();
     }
     QString pair() const
     {
-        return postParams.queryItemValue("pair");
+        return postParam("pair").toString();
     }
     QString rate() const
     {
-        return postParams.queryItemValue("rate");
+        return postParam("rate").toString();
     }
     QString orderType() const
     {
-        return postParams.queryItemValue("type");
+        return postParam("type").toString();
+    }
+
+    /// first value for given post field name, null view if field is missing
+    View postParam(const char* name) const
+    {
+        for (const Item& item: postParams)
+            if (item.name.equals(name))
+                return item.value;
+        return View();
     }
 
 private:
-    QUrl url;
-    QStringList splittedPath;
+    static View rawView(const char* str)
+    {
+        if (!str)
+            return View();
+        return View(str, static_cast<int>(strlen(str)));
+    }
+
+    template<int N>
+    static void splitItems(const char* data, int size, QVarLengthArray<Item, N>& items)
+    {
+        int start = 0;
+        while (start < size)
+        {
+            const char* amp = static_cast<const char*>(memchr(data + start, '&', size - start));
+            int end = amp ? static_cast<int>(amp - data) : size;
+            if (end > start)
+            {
+                Item item;
+                const char* eq = static_cast<const char*>(memchr(data + start, '=', end - start));
+                if (eq)
+                {
+                    int eqPos = static_cast<int>(eq - data);
+                    item.name = View(data + start, eqPos - start);
+                    item.value = View(eq + 1, end - eqPos - 1);
+                }
+                else
+                {
+                    item.name = View(data + start, end - start);
+                    item.value = View(data + end, 0);
+                }
+                items.append(item);
+            }
+            start = end + 1;
+        }
+    }
+
+    void parsePath()
+    {
+        static const int apiPathLen = static_cast<int>(strlen(API_PATH));
+        static const int tapiPathLen = static_cast<int>(strlen(TAPI_PATH));
+
+        const char* p = documentUri.data;
+        int size = documentUri.size;
+
+        if (size >= apiPathLen && memcmp(p, API_PATH, apiPathLen) == 0)
+        {
+            scope = Scope::Public;
+            p += apiPathLen;
+            size -= apiPathLen;
+
+            const char* slash = static_cast<const char*>(memchr(p, '/', size));
+            if (!slash)
+            {
+                methodView = View(p, size);
+                return;
+            }
+            int methodLen = static_cast<int>(slash - p);
+            methodView = View(p, methodLen);
+
+            // pairs segment ends at the next slash, if any
+            const char* pairsBegin = slash + 1;
+            int rest = size - methodLen - 1;
+            const char* pairsEnd = static_cast<const char*>(memchr(pairsBegin, '/', rest));
+            int pairsLen = pairsEnd ? static_cast<int>(pairsEnd - pairsBegin) : rest;
+
+            int start = 0;
+            while (true)
+            {
+                const char* dash = static_cast<const char*>(memchr(pairsBegin + start, '-', pairsLen - start));
+                int end = dash ? static_cast<int>(dash - pairsBegin) : pairsLen;
+                pairViews.append(View(pairsBegin + start, end - start));
+                if (!dash)
+                    break;
+                start = end + 1;
+            }
+        }
+        else if (size >= tapiPathLen && memcmp(p, TAPI_PATH, tapiPathLen) == 0)
+        {
+            scope = Scope::Private;
+        }
+        else
+            std::cerr << "bad url path" << std::endl;
+    }
+
+    void parseQueryString()
+    {
+        QVarLengthArray<Item, 8> items;
+        splitItems(queryString.data, queryString.size, items);
+
+        bool limitSeen = false;
+        bool ignoreInvalidSeen = false;
+        for (const Item& item: items)
+        {
+            if (!limitSeen && item.name.equals("limit"))
+            {
+                limitSeen = true;
+                bool ok;
+                int l = item.value.toInt(&ok);
+                if (ok)
+                    limitValue = qMin(l, 5000);
+            }
+            else if (!ignoreInvalidSeen && item.name.equals("ignore_invalid"))
+            {
+                ignoreInvalidSeen = true;
+                ignoreInvalidValue = item.value.toInt() == 1;
+            }
+            else if (!sinceSeen && item.name.equals("since"))
+            {
+                bool ok;
+                quint64 v = QByteArray::fromRawData(item.value.data, item.value.size).toULongLong(&ok);
+                if (ok)
+                {
+                    sinceSeen = true;
+                    sinceValue = v;
+                }
+            }
+        }
+    }
+
     Scope scope;
-    QMap<QString, QString> headers;
-    QUrlQuery postParams;
+    const MethodTable::Entry* methodEntry;
+    int limitValue;
+    bool ignoreInvalidValue;
+    bool sinceSeen;
+    quint64 sinceValue;
+
+    View documentUri;
+    View queryString;
+    View keyParam;
+    View signParam;
+    View methodView;
+    QVarLengthArray<View, 8> pairViews;
+    QVarLengthArray<Item, 16> postParams;
     QByteArray rawPostData;
 };
 #endif // QUERY_PARSER_H
@@ -0,0 +1,150 @@
+#include "ratelimiter.h"
+#include "metrics.h"
+
+#include <QSettings>
+
+#include <chrono>
+
+// bucket of an id is looked for in this many slots after its home one
+#define RATE_LIMIT_PROBES 16
+#define TOKEN 1000
+
+RateLimiter::Table RateLimiter::tables[static_cast<int>(Limit::Count)];
+
+void RateLimiter::load(QSettings& settings)
+{
+    quint32 slots = settings.value("ratelimit/slots", 65536).toUInt();
+    configure(Limit::Key, settings.value("ratelimit/key_rate", 0).toUInt(),
+              settings.value("ratelimit/key_burst", 20).toUInt(), slots);
+    configure(Limit::Address, settings.value("ratelimit/address_rate", 0).toUInt(),
+              settings.value("ratelimit/address_burst", 50).toUInt(), slots);
+}
+
+void RateLimiter::configure(Limit limit, quint32 rate, quint32 burst, quint32 slots)
+{
+    Table& table = tables[static_cast<int>(limit)];
+    delete [] table.buckets;
+    table = Table();
+    if (!rate)
+        return;
+
+    quint32 size = 1;
+    while (size < slots)
+        size <<= 1;
+    table.buckets = new Bucket[size];
+    table.mask = size - 1;
+    table.rate = rate;
+    table.burst = static_cast<quint64>(qBound<quint32>(1, burst, 4000)) * TOKEN;
+}
+
+bool RateLimiter::isEnabled(Limit limit)
+{
+    return tables[static_cast<int>(limit)].buckets != nullptr;
+}
+
+quint32 RateLimiter::now()
+{
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    // zero time marks a bucket never used
+    return static_cast<quint32>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()) + 1;
+}
+
+bool RateLimiter::isIdle(const Table& table, quint64 state, quint32 time)
+{
+    // zero state is a bucket just claimed, its first request is on the way
+    if (!state)
+        return false;
+    qint32 elapsed = static_cast<qint32>(time - static_cast<quint32>(state >> 32));
+    if (elapsed < 0)
+        return false;
+    // tokens would reach burst, and then stay there for another burst time
+    return (state & 0xFFFFFFFFULL) + static_cast<quint64>(elapsed) * table.rate >= 2 * table.burst;
+}
+
+RateLimiter::Bucket* RateLimiter::bucket(Table& table, const QByteArray& id, quint32 time)
+{
+    // FNV-1a, zero is reserved for free buckets
+    quint64 hash = 14695981039346656037ULL;
+    for (char c: id)
+    {
+        hash ^= static_cast<quint8>(c);
+        hash *= 1099511628211ULL;
+    }
+    hash |= 1;
+
+    quint32 index = static_cast<quint32>(hash) & table.mask;
+    Bucket* idle = nullptr;
+    for (int probe = 0; probe < RATE_LIMIT_PROBES; probe++, index = (index + 1) & table.mask)
+    {
+        Bucket& b = table.buckets[index];
+        quint64 owner = b.id.load(std::memory_order_acquire);
+        if (owner == 0)
+        {
+            // another thread may claim it first, maybe for the same id
+            if (b.id.compare_exchange_strong(owner, hash, std::memory_order_acq_rel))
+                return &b;
+        }
+        if (owner == hash)
+            return &b;
+        if (!idle && isIdle(table, b.state.load(std::memory_order_relaxed), time))
+            idle = &b;
+    }
+    if (!idle)
+        return nullptr;
+
+    // all probed buckets were seen, so the id has none of its own yet;
+    // idle one is taken if it is still idle and nobody took it meanwhile
+    quint64 owner = idle->id.load(std::memory_order_acquire);
+    quint64 state = idle->state.load(std::memory_order_relaxed);
+    if (owner == hash)
+        return idle;
+    if (!isIdle(table, state, time) || !idle->id.compare_exchange_strong(owner, hash, std::memory_order_acq_rel))
+        return nullptr;
+    // a request of the former owner racing with us may leave its token
+    // here, which is at most one token of a full bucket
+    idle->state.compare_exchange_strong(state, 0, std::memory_order_acq_rel);
+    return idle;
+}
+
+bool RateLimiter::admit(Limit limit, const QByteArray& id)
+{
+    Table& table = tables[static_cast<int>(limit)];
+    if (!table.buckets)
+        return true;
+    quint32 time = now();
+    Bucket* b = bucket(table, id, time);
+    if (!b)
+    {
+        Metrics::rateLimited(limit == Limit::Key ? Metrics::Rejection::KeyOverflow : Metrics::Rejection::AddressOverflow);
+        return false;
+    }
+
+    quint64 state = b->state.load(std::memory_order_relaxed);
+    bool ok;
+    quint64 updated;
+    do
+    {
+        quint64 tokens = table.burst;
+        quint32 refilled = time;
+        if (state)
+        {
+            // difference survives wrap of the ms counter; another thread may
+            // have refilled at a later time than ours
+            qint32 elapsed = static_cast<qint32>(time - static_cast<quint32>(state >> 32));
+            if (elapsed < 0)
+            {
+                elapsed = 0;
+                refilled = static_cast<quint32>(state >> 32);
+            }
+            tokens = qMin(table.burst, (state & 0xFFFFFFFFULL) + static_cast<quint64>(elapsed) * table.rate);
+        }
+        ok = tokens >= TOKEN;
+        if (ok)
+            tokens -= TOKEN;
+        updated = (static_cast<quint64>(refilled) << 32) | tokens;
+    } while (!b->state.compare_exchange_weak(state, updated, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    if (!ok)
+        Metrics::rateLimited(limit == Limit::Key ? Metrics::Rejection::KeyRate : Metrics::Rejection::AddressRate);
+    return ok;
+}
@@ -0,0 +1,57 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <QByteArray>
+
+#include <atomic>
+
+class QSettings;
+
+/// Token buckets limiting request rate per API key and per client address,
+/// checked before signature or any SQL work.
+/// Buckets live in fixed open addressing tables, a bucket is claimed by hash
+/// of its id with compare-and-swap and its state is one atomic word, so
+/// admission takes no lock and allocates nothing. A bucket that stayed full
+/// for the time of one burst refill is idle and may be taken by another id,
+/// its owner would get a full bucket anyway. When probes find neither a free
+/// nor an idle bucket the request is rejected and counted as overflow.
+class RateLimiter
+{
+public:
+    enum class Limit {Key, Address, Count};
+
+    /// [ratelimit] key_rate, key_burst, address_rate, address_burst, slots;
+    /// called before FastCGI threads start, zero rate disables the limit
+    static void load(QSettings& settings);
+    /// rate in requests per second, burst in requests (at most 4000)
+    static void configure(Limit limit, quint32 rate, quint32 burst, quint32 slots = 65536);
+    static bool isEnabled(Limit limit);
+
+    /// takes one token, false if the bucket of id is empty
+    static bool admit(Limit limit, const QByteArray& id);
+
+private:
+    struct Bucket
+    {
+        std::atomic<quint64> id {0};
+        /// refill time in ms since start in high half, milli-tokens in low one
+        std::atomic<quint64> state {0};
+    };
+
+    struct Table
+    {
+        Bucket* buckets = nullptr;
+        quint32 mask = 0;
+        /// milli-tokens per ms is the same number as tokens per second
+        quint64 rate = 0;
+        quint64 burst = 0;
+    };
+
+    static Bucket* bucket(Table& table, const QByteArray& id, quint32 time);
+    static bool isIdle(const Table& table, quint64 state, quint32 time);
+    static quint32 now();
+
+    static Table tables[static_cast<int>(Limit::Count)];
+};
+
+#endif // RATELIMITER_H
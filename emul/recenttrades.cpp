@@ -0,0 +1,90 @@
+#include "recenttrades.h"
+
+// trades method limit is capped at 5000 too
+#define RECENT_TRADES_LENGTH 5000
+
+QHash<PairName, QList<RecentTrades::Trade>> RecentTrades::pairs;
+QMutex RecentTrades::pairsAccess;
+
+void RecentTrades::add(const PairName& pair, const QList<Trade>& trades)
+{
+    if (trades.isEmpty())
+        return;
+    QMutexLocker lock(&pairsAccess);
+    QList<Trade>& list = pairs[pair];
+    for (const Trade& trade: trades)
+        list.prepend(trade);
+    while (list.size() > RECENT_TRADES_LENGTH)
+        list.removeLast();
+}
+
+void RecentTrades::load(const PairName& pair, const TradeInfo::List& trades)
+{
+    QList<Trade> list;
+    for (const TradeInfo::Ptr& info: trades)
+    {
+        if (list.size() >= RECENT_TRADES_LENGTH)
+            break;
+        Trade trade;
+        trade.tid = info->tid;
+        trade.type = info->type;
+        trade.rate = info->rate;
+        trade.amount = info->amount;
+        trade.created = info->created;
+        list.append(trade);
+    }
+    QMutexLocker lock(&pairsAccess);
+    pairs[pair] = list;
+}
+
+QList<RecentTrades::Trade> RecentTrades::trades(const PairName& pair, int limit)
+{
+    QMutexLocker lock(&pairsAccess);
+    return pairs.value(pair).mid(0, limit);
+}
+
+void RecentTrades::writeTrade(QDataStream& stream, const Trade& trade)
+{
+    stream << trade.tid << static_cast<quint8>(trade.type) << trade.rate << trade.amount << trade.created;
+}
+
+void RecentTrades::readTrade(QDataStream& stream, Trade& trade)
+{
+    quint8 type;
+    stream >> trade.tid >> type >> trade.rate >> trade.amount >> trade.created;
+    trade.type = static_cast<TradeInfo::Type>(type);
+}
+
+void RecentTrades::save(QDataStream& stream)
+{
+    QMutexLocker lock(&pairsAccess);
+    stream << static_cast<quint32>(pairs.size());
+    for (auto pair = pairs.constBegin(); pair != pairs.constEnd(); pair++)
+    {
+        stream << pair.key() << static_cast<quint32>(pair->size());
+        for (const Trade& trade: pair.value())
+            writeTrade(stream, trade);
+    }
+}
+
+void RecentTrades::restore(QDataStream& stream)
+{
+    QHash<PairName, QList<Trade>> restored;
+    quint32 count;
+    stream >> count;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++)
+    {
+        PairName pair;
+        quint32 tradesCount;
+        stream >> pair >> tradesCount;
+        QList<Trade>& list = restored[pair];
+        for (quint32 j = 0; j < tradesCount && stream.status() == QDataStream::Ok; j++)
+        {
+            Trade trade;
+            readTrade(stream, trade);
+            list.append(trade);
+        }
+    }
+    QMutexLocker lock(&pairsAccess);
+    pairs.swap(restored);
+}
@@ -0,0 +1,43 @@
+#ifndef RECENTTRADES_H
+#define RECENTTRADES_H
+
+#include "types.h"
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+
+/// Last trades of every pair, newest first, as public trades method shows
+/// them. Kept by primary for change stream snapshots and by replicas to
+/// answer trades without SQL.
+class RecentTrades
+{
+public:
+    struct Trade
+    {
+        TradeId tid;
+        /// type of matched order, as in trades table
+        TradeInfo::Type type;
+        Rate rate;
+        Amount amount;
+        QDateTime created;
+    };
+
+    /// trades in order they were done
+    static void add(const PairName& pair, const QList<Trade>& trades);
+    /// replaces trades of pair, list is newest first
+    static void load(const PairName& pair, const TradeInfo::List& trades);
+    static QList<Trade> trades(const PairName& pair, int limit);
+
+    static void save(QDataStream& stream);
+    static void restore(QDataStream& stream);
+
+    static void writeTrade(QDataStream& stream, const Trade& trade);
+    static void readTrade(QDataStream& stream, Trade& trade);
+
+private:
+    static QHash<PairName, QList<Trade>> pairs;
+    static QMutex pairsAccess;
+};
+
+#endif // RECENTTRADES_H
@@ -0,0 +1,141 @@
+#include "registry.h"
+#include "utils.h"
+
+#include <QSqlDatabase>
+#include <QSqlQuery>
+
+#include <iostream>
+
+QVector<QString> Registry::currencyNames;
+QVector<quint32> Registry::currencySqlIds;
+QHash<QString, CurrencyId> Registry::currencyIds;
+QHash<quint32, CurrencyId> Registry::currencyIdsBySqlId;
+QVector<Registry::Pair> Registry::pairs;
+QHash<PairName, quint16> Registry::pairIndexes;
+
+void Registry::clear()
+{
+    currencyNames.clear();
+    currencySqlIds.clear();
+    currencyIds.clear();
+    currencyIdsBySqlId.clear();
+    pairs.clear();
+    pairIndexes.clear();
+}
+
+bool Registry::addCurrency(quint32 currency_id, const QString& currency)
+{
+    if (currencyNames.size() == MAX_CURRENCIES)
+    {
+        std::cerr << "more than " << MAX_CURRENCIES << " currencies, rest are ignored" << std::endl;
+        return false;
+    }
+    CurrencyId id = static_cast<CurrencyId>(currencyNames.size());
+    currencyNames.append(currency);
+    currencySqlIds.append(currency_id);
+    currencyIds.insert(currency, id);
+    currencyIdsBySqlId.insert(currency_id, id);
+    return true;
+}
+
+void Registry::addPair(PairId pair_id, const PairName& name)
+{
+    Pair pair;
+    pair.index = static_cast<quint16>(pairs.size());
+    pair.pair_id = pair_id;
+    pair.name = name;
+    pair.goods = currencyId(pair.name.left(3));
+    pair.currency = currencyId(pair.name.right(3));
+    if (pair.goods == INVALID_CURRENCY || pair.currency == INVALID_CURRENCY)
+        return;
+    pairIndexes.insert(pair.name, pair.index);
+    pairs.append(pair);
+}
+
+void Registry::load(QSqlDatabase& db)
+{
+    clear();
+    QSqlQuery sql(db);
+    performSql("load currencies", sql, "select currency_id, currency from currencies order by currency_id", true);
+    while (sql.next())
+        if (!addCurrency(sql.value(0).toUInt(), sql.value(1).toString()))
+            break;
+
+    performSql("load pairs", sql, "select pair_id, pair from pairs order by pair_id", true);
+    while (sql.next())
+        addPair(sql.value(0).toUInt(), sql.value(1).toString());
+}
+
+void Registry::load(const QList<PairName>& names)
+{
+    clear();
+    for (const PairName& name: names)
+        for (const QString& currency: {name.left(3), name.right(3)})
+            if (currencyId(currency) == INVALID_CURRENCY)
+                addCurrency(static_cast<quint32>(currencyNames.size() + 1), currency);
+    for (const PairName& name: names)
+        addPair(static_cast<PairId>(pairs.size() + 1), name);
+}
+
+int Registry::currenciesCount()
+{
+    return currencyNames.size();
+}
+
+CurrencyId Registry::currencyId(const QString& currency)
+{
+    return currencyIds.value(currency, INVALID_CURRENCY);
+}
+
+CurrencyId Registry::currencyOfSqlId(quint32 currency_id)
+{
+    return currencyIdsBySqlId.value(currency_id, INVALID_CURRENCY);
+}
+
+const QString& Registry::currencyName(CurrencyId id)
+{
+    return currencyNames.at(id);
+}
+
+quint32 Registry::currencySqlId(CurrencyId id)
+{
+    return currencySqlIds.at(id);
+}
+
+int Registry::pairsCount()
+{
+    return pairs.size();
+}
+
+const Registry::Pair* Registry::pair(const PairName& pair)
+{
+    auto iter = pairIndexes.constFind(pair);
+    if (iter == pairIndexes.constEnd())
+        return nullptr;
+    return &pairs.at(iter.value());
+}
+
+const Registry::Pair& Registry::pair(quint16 index)
+{
+    return pairs.at(index);
+}
+
+Funds Registry::funds(const Balances& balances)
+{
+    Funds funds;
+    for (int id = 0; id < currencyNames.size(); id++)
+        funds.insert(currencyNames.at(id), balances[id]);
+    return funds;
+}
+
+Balances Registry::balances(const Funds& funds)
+{
+    Balances balances {};
+    for (auto fund = funds.constBegin(); fund != funds.constEnd(); fund++)
+    {
+        CurrencyId id = currencyId(fund.key());
+        if (id != INVALID_CURRENCY)
+            balances[id] = fund.value();
+    }
+    return balances;
+}
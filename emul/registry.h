@@ -0,0 +1,66 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include "types.h"
+
+#include <QHash>
+#include <QList>
+#include <QVector>
+
+class QSqlDatabase;
+
+/// Pairs and currencies interned into small ids at start, so hot paths
+/// index arrays instead of hashing and slicing names.
+/// Loaded from currencies and pairs tables before any request or state
+/// restore and read only afterwards, so lookups take no lock. Pairs and
+/// currencies added to database later are unknown till restart.
+/// Ids are given in order of database ids, names still go to SQL, state
+/// files, memcached and API responses.
+class Registry
+{
+public:
+    struct Pair
+    {
+        quint16 index;
+        PairId pair_id;
+        PairName name;
+        CurrencyId goods;
+        CurrencyId currency;
+    };
+
+    static void load(QSqlDatabase& db);
+    /// without database: currencies of pairs in order of first use,
+    /// database ids are counted from 1
+    static void load(const QList<PairName>& pairs);
+
+    static int currenciesCount();
+    /// INVALID_CURRENCY if currency is unknown
+    static CurrencyId currencyId(const QString& currency);
+    static CurrencyId currencyOfSqlId(quint32 currency_id);
+    static const QString& currencyName(CurrencyId id);
+    static quint32 currencySqlId(CurrencyId id);
+
+    static int pairsCount();
+    /// nullptr if pair is unknown
+    static const Pair* pair(const PairName& pair);
+    static const Pair& pair(quint16 index);
+
+    /// conversion at API and storage boundaries, unknown currencies are dropped
+    static Funds funds(const Balances& balances);
+    static Balances balances(const Funds& funds);
+
+private:
+    static void clear();
+    /// false when there is no room for more currencies
+    static bool addCurrency(quint32 currency_id, const QString& currency);
+    static void addPair(PairId pair_id, const PairName& name);
+
+    static QVector<QString> currencyNames;
+    static QVector<quint32> currencySqlIds;
+    static QHash<QString, CurrencyId> currencyIds;
+    static QHash<quint32, CurrencyId> currencyIdsBySqlId;
+    static QVector<Pair> pairs;
+    static QHash<PairName, quint16> pairIndexes;
+};
+
+#endif // REGISTRY_H
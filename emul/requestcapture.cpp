@@ -0,0 +1,104 @@
+#include "requestcapture.h"
+
+#include <QDataStream>
+
+#include <cstring>
+#include <iostream>
+
+static const char captureMagic[8] = {'E', 'M', 'U', 'L', 'C', 'A', 'P', 'T'};
+static const quint32 captureVersion = 1;
+static const QDataStream::Version streamVersion = QDataStream::Qt_5_6;
+
+std::unique_ptr<QFile> RequestCapture::captureFile;
+QMutex RequestCapture::captureAccess;
+
+bool RequestCapture::open(const QString& fileName)
+{
+    QMutexLocker lock(&captureAccess);
+    captureFile.reset(new QFile(fileName));
+    if (!captureFile->open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        std::cerr << "cannot open capture file " << fileName.toStdString() << ": "
+                  << captureFile->errorString().toStdString() << std::endl;
+        captureFile.reset();
+        return false;
+    }
+    captureFile->write(captureMagic, sizeof(captureMagic));
+    captureFile->write(reinterpret_cast<const char*>(&captureVersion), sizeof(captureVersion));
+    return true;
+}
+
+bool RequestCapture::isOpen()
+{
+    QMutexLocker lock(&captureAccess);
+    return captureFile != nullptr;
+}
+
+void RequestCapture::write(const Record& record)
+{
+    QByteArray buffer;
+    {
+        QDataStream stream(&buffer, QIODevice::WriteOnly);
+        stream.setVersion(streamVersion);
+        stream << quint32(0)
+               << record.arrival << record.latency
+               << record.documentUri << record.queryString
+               << record.key << record.sign << record.postData;
+    }
+    quint32 size = static_cast<quint32>(buffer.size() - sizeof(quint32));
+    memcpy(buffer.data(), &size, sizeof(size));
+
+    QMutexLocker lock(&captureAccess);
+    if (captureFile)
+        captureFile->write(buffer);
+}
+
+void RequestCapture::flush()
+{
+    QMutexLocker lock(&captureAccess);
+    if (captureFile)
+        captureFile->flush();
+}
+
+void RequestCapture::close()
+{
+    QMutexLocker lock(&captureAccess);
+    captureFile.reset();
+}
+
+bool RequestCapture::Reader::open(const QString& fileName)
+{
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    char magic[sizeof(captureMagic)];
+    quint32 version = 0;
+    if (   file.read(magic, sizeof(magic)) != sizeof(magic)
+        || memcmp(magic, captureMagic, sizeof(magic)) != 0
+        || file.read(reinterpret_cast<char*>(&version), sizeof(version)) != sizeof(version)
+        || version != captureVersion)
+    {
+        std::cerr << fileName.toStdString() << " is not a request capture of version " << captureVersion << std::endl;
+        file.close();
+        return false;
+    }
+    return true;
+}
+
+bool RequestCapture::Reader::next(Record& record)
+{
+    quint32 size;
+    if (file.read(reinterpret_cast<char*>(&size), sizeof(size)) != sizeof(size))
+        return false;
+    QByteArray buffer = file.read(size);
+    if (static_cast<quint32>(buffer.size()) != size)
+        return false;
+
+    QDataStream stream(buffer);
+    stream.setVersion(streamVersion);
+    stream >> record.arrival >> record.latency
+           >> record.documentUri >> record.queryString
+           >> record.key >> record.sign >> record.postData;
+    return stream.status() == QDataStream::Ok;
+}
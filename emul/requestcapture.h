@@ -0,0 +1,50 @@
+#ifndef REQUESTCAPTURE_H
+#define REQUESTCAPTURE_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QMutex>
+
+#include <memory>
+
+/// Binary capture of FastCGI requests for replay.
+/// File starts with magic and version, then records follow, each is
+/// record size (quint32) and fields serialized with QDataStream.
+/// Writing is shared by all FastCGI threads, reading is done by replay tool.
+class RequestCapture
+{
+public:
+    struct Record
+    {
+        qint64  arrival;  ///< microseconds since epoch
+        quint32 latency;  ///< microseconds spent by emulator on request
+        QByteArray documentUri;
+        QByteArray queryString;
+        QByteArray key;
+        QByteArray sign;
+        QByteArray postData;
+    };
+
+    class Reader
+    {
+    public:
+        bool open(const QString& fileName);
+        /// false at end of file or on torn record
+        bool next(Record& record);
+
+    private:
+        QFile file;
+    };
+
+    static bool open(const QString& fileName);
+    static bool isOpen();
+    static void write(const Record& record);
+    static void flush();
+    static void close();
+
+private:
+    static std::unique_ptr<QFile> captureFile;
+    static QMutex captureAccess;
+};
+
+#endif // REQUESTCAPTURE_H
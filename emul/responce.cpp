@@ -1,42 +1,76 @@
 #include "responce.h"
+#include "changestream.h"
+#include "engineclock.h"
+#include "enginestate.h"
+#include "feeaccumulator.h"
+#include "invariantmonitor.h"
+#include "metrics.h"
 #include "query_parser.h"
+#include "recenttrades.h"
+#include "shardconfig.h"
+#include "tickerquotes.h"
 #include "sql_database.h"
+#include "inmemorydataaccessor.h"
+#include "lmdbdataaccessor.h"
 #include "memcachedsqldataaccessor.h"
 #include "utils.h"
 
 #include <QCache>
+#include <QElapsedTimer>
+#include <QReadWriteLock>
 #include <QSqlError>
 #include <QSqlQuery>
 
+#include <vector>
+
 QAtomicInt Responce::counter = 0;
+QString Responce::dataAccessorName = "memcached";
 
 Responce::Responce(QSqlDatabase& database)
     :db(database)
 {
-    dataAccessor = std::make_shared<MemcachedSqlDataAccessor>(db);
+    if (dataAccessorName == "memory" || dataAccessorName == "lmdb")
+    {
+        // accessor keeps whole state, schema is not read around it
+        if (dataAccessorName == "memory")
+            dataAccessor = std::make_shared<InMemoryDataAccessor>();
+        else
+            dataAccessor = std::make_shared<LmdbDataAccessor>();
+        sqlAccessor = dataAccessor;
+    }
+    else
+    {
+        if (dataAccessorName == "sql")
+            dataAccessor = std::make_shared<DirectSqlDataAccessor>(db);
+        else if (dataAccessorName == "local_caches")
+            dataAccessor = std::make_shared<LocalCachesSqlDataAccessor>(db);
+        else
+            dataAccessor = std::make_shared<MemcachedSqlDataAccessor>(db);
+        sqlAccessor = std::make_shared<DirectSqlDataAccessor>(db);
+    }
     auth.reset(new Authentificator(dataAccessor));
+}
 
-    selectActiveOrdersCountQuery.reset(new QSqlQuery(db));
-
-    cancelOrderQuery.reset(new QSqlQuery(db));
-
-    startTransaction.reset(new QSqlQuery("start transaction", db));
-    commitTransaction.reset(new QSqlQuery("commit", db));
-    rollbackTransaction.reset(new QSqlQuery("rollback", db));
-
-
-    prepareSql(*selectActiveOrdersCountQuery, "select count(*) from apikeys a left join orders o on o.user_id=a.user_id where a.apikey=:key and o.status = 'active'");
-
+void Responce::useDataAccessor(const QString& name, QSqlDatabase& db)
+{
+    if (name == "memory")
+        InMemoryDataAccessor::load(db);
+    else
+        InMemoryDataAccessor::clear();
+    dataAccessorName = name;
+}
 
-    prepareSql(*cancelOrderQuery, "update orders set status=case when start_amount=amount then 'cancelled' else 'part_done' end where order_id=:order_id");
+void Responce::useDataAccessor(const QString& name)
+{
+    dataAccessorName = name;
 }
 
-Responce::TradeCurrencyVolume Responce::trade_volumes (OrderInfo::Type type, const QString& pair, Fee fee,
+Responce::TradeCurrencyVolume Responce::trade_volumes (OrderInfo::Type type, const Registry::Pair& pair, Fee fee,
                                  Amount trade_amount, Rate matched_order_rate)
 {
     TradeCurrencyVolume ret;
-    ret.currency = pair.right(3);
-    ret.goods = pair.left(3);
+    ret.currency = pair.currency;
+    ret.goods = pair.goods;
 
     Fee contra_fee = Fee(1) - fee;
     if (type == OrderInfo::Type::Buy)
@@ -63,17 +97,17 @@ Responce::TradeCurrencyVolume Responce::trade_volumes (OrderInfo::Type type, con
     return ret;
 }
 
-Responce::NewOrderVolume Responce::new_order_currency_volume (OrderInfo::Type type, const QString& pair, Amount amount, Rate rate)
+Responce::NewOrderVolume Responce::new_order_currency_volume (OrderInfo::Type type, const Registry::Pair& pair, Amount amount, Rate rate)
 {
     NewOrderVolume ret;
     if (type == OrderInfo::Type::Sell)
     {
-        ret.currency = pair.left(3);
+        ret.currency = pair.goods;
         ret.volume = amount;
     }
     else
     {
-        ret.currency = pair.right(3);
+        ret.currency = pair.currency;
         ret.volume = amount * rate;
     }
     return ret;
@@ -86,26 +120,16 @@ OrderInfo::Type Responce::oppositOrderType(OrderInfo::Type type)
     return OrderInfo::Type::Buy;
 }
 
-quint32 Responce::doExchange(QString userName, const Rate& rate, TradeCurrencyVolume volumes, OrderInfo::Type type, Rate rt, const PairName& pair, QSqlQuery& query, Amount& amnt, Fee fee, UserId user_id)
+quint32 Responce::doExchange(QString userName, const Rate& rate, TradeCurrencyVolume volumes, OrderInfo::Type type, Rate rt, const Registry::Pair& pair, Amount& amnt, Fee fee, UserId user_id)
 {
     quint32 ret = 0;
-    QVariantMap params;
-    params[":pair"] = pair;
-    params[":user_id"] = user_id;
-    params[":rate"] = QString::fromStdString(DEC_NAMESPACE::toString(rate));
-    QString matchedOrderType = (oppositOrderType(type) == OrderInfo::Type::Buy)?"buy":"sell";
-    if (!performSql(QString("get %1 orders").arg(matchedOrderType), query, params, true))
+    for (const OrderInfo::Ptr& matched: dataAccessor->matchingOrders(pair.name, type, rate, user_id))
     {
-        return (quint32)-1;
-    }
-    while(query.next())
-    {
-        PairInfo::Ptr pairInfo = dataAccessor->pairInfo(pair);
-        OrderId matched_order_id = query.value(0).toUInt();
-        Amount matched_amount = qvar2dec<7>(query.value(1));
-        Amount matched_rate   = qvar2dec<7>(query.value(2));
-        UserId matched_user_id = query.value(3).toUInt();
-        QString matched_userName = query.value(4).toString();
+        OrderId matched_order_id = matched->order_id;
+        Amount matched_amount = matched->amount;
+        Amount matched_rate   = matched->rate;
+        UserId matched_user_id = matched->user_id;
+        QString matched_userName = QString::number(matched_user_id);
 
 //        std::clog << '\t'
 //                  <<QString("Found %5 order %1 from user %2 for %3 @ %4 ")
@@ -122,35 +146,61 @@ quint32 Responce::doExchange(QString userName, const Rate& rate, TradeCurrencyVo
         if (! (   dataAccessor->tradeUpdateDeposit(user_id, volumes.trader_currency_in, volumes.trader_volume_in , userName)
                && dataAccessor->tradeUpdateDeposit(user_id, volumes.trader_currency_out, -volumes.trader_volume_out , userName)
                && dataAccessor->tradeUpdateDeposit(matched_user_id, volumes.parter_currency_in, volumes.partner_volume_in, matched_userName)
-               && dataAccessor->tradeUpdateDeposit(EXCHNAGE_USER_ID, volumes.currency, volumes.exchange_currency_in, "Exchange")
-               && dataAccessor->tradeUpdateDeposit(EXCHNAGE_USER_ID, volumes.goods, volumes.exchange_goods_in, "Exchange")
                   ))
                 return (quint32)-1;
 
+        // exchange income goes to fee accumulator after commit, see foldExchangeFees()
+        pendingFees[volumes.currency] += volumes.exchange_currency_in;
+        pendingFees[volumes.goods] += volumes.exchange_goods_in;
+
+        indexUpdates.balanceChanged(user_id, volumes.trader_currency_in, volumes.trader_volume_in);
+        indexUpdates.balanceChanged(user_id, volumes.trader_currency_out, -volumes.trader_volume_out);
+        indexUpdates.balanceChanged(matched_user_id, volumes.parter_currency_in, volumes.partner_volume_in);
+
+        invariants.depositChanged(volumes.trader_currency_in, volumes.trader_volume_in);
+        invariants.depositChanged(volumes.trader_currency_out, -volumes.trader_volume_out);
+        invariants.depositChanged(volumes.parter_currency_in, volumes.partner_volume_in);
+        invariants.feeCollected(volumes.currency, volumes.exchange_currency_in);
+        invariants.feeCollected(volumes.goods, volumes.exchange_goods_in);
+        // matched order gives up reserve of the amount it is reduced by
+        NewOrderVolume filled = new_order_currency_volume(oppositOrderType(type), pair, trade_amount, matched_rate);
+        invariants.orderChanged(matched_order_id, filled.currency, -filled.volume, matched_amount - trade_amount);
+
         if (trade_amount >= matched_amount)
         {
             if (!dataAccessor->closeOrder(matched_order_id))
                 return (quint32)-1;
+            indexUpdates.orderClosed(matched_user_id, matched_order_id);
+            bookUpdates.levelChanged(pair.name, oppositOrderType(type), matched_rate, -trade_amount, -1);
         }
         else
         {
             if (!dataAccessor->reduceOrderAmount(matched_order_id, trade_amount))
                 return (quint32)-1;
+            indexUpdates.orderReduced(matched_user_id, matched_order_id, trade_amount);
+            bookUpdates.levelChanged(pair.name, oppositOrderType(type), matched_rate, -trade_amount, 0);
         }
-        if (!dataAccessor->createNewTradeRecord(user_id, matched_order_id, trade_amount))
+        TradeId tid = dataAccessor->createNewTradeRecord(user_id, matched_order_id, trade_amount);
+        if (!tid)
             return (quint32)-1;
-        else
+        // ticker quote and feed trades are published after commit
+        lastFillRate = matched_rate;
+        RecentTrades::Trade recent;
+        recent.tid = tid;
+        recent.type = (oppositOrderType(type) == OrderInfo::Type::Buy) ? TradeInfo::Type::Bid : TradeInfo::Type::Ask;
+        recent.rate = matched_rate;
+        recent.amount = trade_amount;
+        recent.created = EngineClock::now();
+        recentTrades.append(recent);
+        if (MarketFeed::isRunning())
         {
-            TickerInfo::Ptr ticker = dataAccessor->tickerInfo(pair);
-            if (ticker)
-            {
-                QMutexLocker lock(&ticker->updateAccess);
-                ticker->last = matched_rate;
-                if (type == OrderInfo::Type::Buy)
-                    ticker->buy = matched_rate;
-                else
-                    ticker->sell = matched_rate;
-            }
+            MarketFeed::Trade trade;
+            trade.id = tid;
+            trade.type = type;
+            trade.rate = matched_rate;
+            trade.amount = trade_amount;
+            trade.created = EngineClock::now();
+            feedTrades.append(trade);
         }
 
         amnt -= trade_amount;
@@ -163,26 +213,64 @@ quint32 Responce::doExchange(QString userName, const Rate& rate, TradeCurrencyVo
         orderVolume = new_order_currency_volume(type, pair, amnt, rt);
         if (!dataAccessor->tradeUpdateDeposit(user_id, orderVolume.currency, -orderVolume.volume, userName))
             return (quint32)-1;
+        invariants.depositChanged(orderVolume.currency, -orderVolume.volume);
 
 
-        ret = dataAccessor->createNewOrderRecord(pair, user_id, type, rate, amnt);
+        ret = dataAccessor->createNewOrderRecord(pair.name, user_id, type, rate, amnt);
+        indexUpdates.balanceChanged(user_id, orderVolume.currency, -orderVolume.volume);
+
+        if (ret != (quint32)-1)
+        {
+            // deposit goes to reserve of the new order, counted from its record
+            NewOrderVolume reserved = new_order_currency_volume(type, pair, amnt, rate);
+            invariants.orderChanged(ret, reserved.currency, reserved.volume, amnt);
+            UserIndex::Order order;
+            order.order_id = ret;
+            order.pair = pair.name;
+            order.type = type;
+            order.start_amount = amnt;
+            order.amount = amnt;
+            order.rate = rate;
+            order.created = EngineClock::now();
+            indexUpdates.orderCreated(user_id, order);
+            bookUpdates.levelChanged(pair.name, type, rate, amnt, 1);
+        }
     }
     return ret;
 }
 
 Responce::OrderCreateResult Responce::checkParamsAndDoExchange(const ApiKey& key, const PairName& pair, OrderInfo::Type type, const Rate& rate, const Amount& amount)
 {
+    NewOrder order;
+    order.type = type;
+    order.rate = rate;
+    order.amount = amount;
+    QList<OrderCreateResult> results;
     OrderCreateResult ret;
     ret.recieved = 0;
     ret.remains = 0;
     ret.order_id = 0;
-    ret.ok = false;
+    ret.ok = checkParamsAndDoExchange(key, pair, {order}, results, ret.errMsg);
+    if (ret.ok)
+        return results.first();
+    return ret;
+}
+
+bool Responce::checkParamsAndDoExchange(const ApiKey& key, const PairName& pair, const QList<NewOrder>& orders, QList<OrderCreateResult>& results, QString& errMsg)
+{
+    results.clear();
 
     PairInfo::Ptr info = dataAccessor->pairInfo(pair);
-    if (!info)
+    const Registry::Pair* pairRef = Registry::pair(pair);
+    if (!info || !pairRef)
     {
-        ret.errMsg = "You incorrectly entered one of fields.";
-        return ret;
+        errMsg = "You incorrectly entered one of fields.";
+        return false;
+    }
+    if (!ShardConfig::owns(pair))
+    {
+        errMsg = "pair is served by another shard";
+        return false;
     }
 
     const Rate& min_price  = info->min_price;
@@ -191,56 +279,52 @@ Responce::OrderCreateResult Responce::checkParamsAndDoExchange(const ApiKey& key
     const Fee& fee         = info->fee/Fee(100);
     int decimal_places = info->decimal_places;
 
-    QString currency;
-
-    if (type == OrderInfo::Type::Buy)
-        currency = pair.right(3);
-    else
-        currency = pair.left(3);
-
     ApikeyInfo::Ptr apikey = dataAccessor->apikeyInfo(key);
-    UserInfo::Ptr user = apikey->user_ptr.lock();
-    if (!user)
-    {
-        user = dataAccessor->userInfo(apikey->user_id);
-        apikey->user_ptr = user;
-    }
-    Amount currencyAvailable = user->funds[currency];
-
-    Amount amnt = amount;
+    UserInfo::Ptr user = dataAccessor->userInfo(apikey->user_id);
 
-    if (amnt < min_amount)
+    // orders of a batch are checked against funds left by previous ones
+    Balances required {};
+    for (int i = 0; i < orders.size(); i++)
     {
-        ret.errMsg = QString("Value %1 must be greater than %2 %1.")
-                .arg(currency.toUpper())
-                .arg(dec2qstr(min_amount, 6));
-        return ret;
-    }
+        const NewOrder& order = orders[i];
+        QString prefix = (orders.size() > 1) ? QString("order %1: ").arg(i) : QString();
+        CurrencyId currency = (order.type == OrderInfo::Type::Buy) ? pairRef->currency : pairRef->goods;
+        const QString& currencyName = Registry::currencyName(currency);
 
-    if (rate < min_price)
-    {
-        ret.errMsg = QString("Price per %1 must be greater than %2 %3.")
-                .arg(pair.left(3).toUpper())
-                .arg(dec2qstr(min_price, decimal_places))
-                .arg(pair.right(3).toUpper());
-        return ret;
-    }
-    if (rate > max_price)
-    {
-        ret.errMsg = QString("Price per %1 must be lower than %2 %3.")
-                .arg(pair.left(3).toUpper())
-                .arg(dec2qstr(max_price, decimal_places))
-                .arg(pair.right(3).toUpper());
-        return ret;
-    }
+        if (order.amount < min_amount)
+        {
+            errMsg = prefix + QString("Value %1 must be greater than %2 %1.")
+                    .arg(currencyName.toUpper())
+                    .arg(dec2qstr(min_amount, 6));
+            return false;
+        }
 
-    if (   (type == OrderInfo::Type::Sell && currencyAvailable < amnt)
-        || (type == OrderInfo::Type::Buy && currencyAvailable < amnt * rate))
-    {
-        ret.errMsg =         QString("It is not enough %1 for %2")
-                .arg(currency.toUpper())
-                .arg((type == OrderInfo::Type::Sell)?"sell":"purchase");
-        return ret;
+        if (order.rate < min_price)
+        {
+            errMsg = prefix + QString("Price per %1 must be greater than %2 %3.")
+                    .arg(Registry::currencyName(pairRef->goods).toUpper())
+                    .arg(dec2qstr(min_price, decimal_places))
+                    .arg(Registry::currencyName(pairRef->currency).toUpper());
+            return false;
+        }
+        if (order.rate > max_price)
+        {
+            errMsg = prefix + QString("Price per %1 must be lower than %2 %3.")
+                    .arg(Registry::currencyName(pairRef->goods).toUpper())
+                    .arg(dec2qstr(max_price, decimal_places))
+                    .arg(Registry::currencyName(pairRef->currency).toUpper());
+            return false;
+        }
+
+        required[currency] += (order.type == OrderInfo::Type::Sell) ? order.amount : order.amount * order.rate;
+        // cached funds miss trades of other shards, there reservation below decides
+        if (!ShardConfig::isSharded() && user->funds[currency] < required[currency])
+        {
+            errMsg = prefix + QString("It is not enough %1 for %2")
+                    .arg(currencyName.toUpper())
+                    .arg((order.type == OrderInfo::Type::Sell)?"sell":"purchase");
+            return false;
+        }
     }
 
 
@@ -253,100 +337,175 @@ Responce::OrderCreateResult Responce::checkParamsAndDoExchange(const ApiKey& key
 //              << std::endl;
 
     TradeCurrencyVolume volumes;
-    static QMap<QString, QMutex*> tradeMutex;
-    static QMutex mutexsCollectionAccess;
 
-    QString mutexKey = QString("%1-%2").arg(pair).arg(static_cast<int>(type));
-    mutexsCollectionAccess.lock();
-    QMutex* pMutex = nullptr;
-    auto iter = tradeMutex.find(mutexKey);
-    if (iter == tradeMutex.end())
-    {
-        pMutex = new QMutex;
-        tradeMutex.insert(mutexKey, pMutex);
-    }
-    else
-        pMutex = iter.value();
-    mutexsCollectionAccess.unlock();
+    // a batch takes books of both sides it trades, always in the same order
+    QMap<quint32, QMutex*> pMutexes;
+    for (const NewOrder& order: orders)
+        pMutexes.insert(tradeMutexKey(*pairRef, order.type), tradeMutex(*pairRef, order.type));
 
+    QList<Amount> remains;
+    bool failed = false;
     bool success = true;
     do
     {
         try
         {
-            QMutexLocker lock(pMutex);
+            QElapsedTimer lockTimer;
+            lockTimer.start();
+            std::vector<std::unique_ptr<QMutexLocker>> locks;
+            for (QMutex* pMutex: pMutexes)
+                locks.emplace_back(new QMutexLocker(pMutex));
+            Metrics::tradeLockWait(lockTimer.nsecsElapsed());
+            indexUpdates.clear();
+            bookUpdates.clear();
+            feedTrades.clear();
+            recentTrades.clear();
+            pendingFees.fill(Amount(0));
+            lastFillRate = Rate(0);
+            invariants.clear();
+            results.clear();
+            remains.clear();
+            failed = false;
+            // engine locks before the store transaction, in the order of
+            // foldExchangeFees(): LMDB has a single writer, and it would be
+            // blocked by a fold waiting for this commit
+            QReadLocker indexLock(&UserIndex::commitLock());
+            QReadLocker feeLock(&FeeAccumulator::commitLock());
             dataAccessor->transaction();
-            QSqlQuery query(db);
-            if (type == OrderInfo::Type::Buy)
-                prepareSql(query,  "select order_id, amount, rate, o.user_id, w.name from orders o left join pairs p on p.pair_id = o.pair_id left join users w on w.user_id=o.user_id where type='sell' and status='active' and pair=:pair and o.user_id<>:user_id and rate <= :rate order by rate asc, order_id asc");
-            else if (type == OrderInfo::Type::Sell)
-                prepareSql(query, "select order_id, amount, rate, o.user_id, w.name from orders o left join pairs p on p.pair_id = o.pair_id left join users w on w.user_id=o.user_id where type='buy'  and status='active' and pair=:pair and o.user_id<>:user_id and rate >= :rate order by rate desc, order_id asc");
-
-            amnt = amount;
-            ret.order_id = doExchange(userName, rate, volumes, type, rate, pair, query, amnt, fee, user_id);
-            dataAccessor->commit();
+            // other shards trade the same balances, check again under row lock
+            if (ShardConfig::isSharded())
+                for (CurrencyId currency: {pairRef->goods, pairRef->currency})
+                    if (required[currency] > Amount(0) && !dataAccessor->reserveDepositVolume(user_id, currency, required[currency]))
+                    {
+                        dataAccessor->rollback();
+                        errMsg = QString("It is not enough %1 for %2")
+                                .arg(Registry::currencyName(currency).toUpper())
+                                .arg((currency == pairRef->goods)?"sell":"purchase");
+                        return false;
+                    }
+            QMap<OrderInfo::Type, Rate> fillRates;
+            for (const NewOrder& order: orders)
+            {
+                Amount amnt = order.amount;
+                OrderCreateResult ret;
+                {
+                    Metrics::StageTimer matchTimer(Metrics::Stage::Match);
+                    ret.order_id = doExchange(userName, order.rate, volumes, order.type, order.rate, *pairRef, amnt, fee, user_id);
+                }
+                if (ret.order_id == (quint32)-1)
+                {
+                    failed = true;
+                    break;
+                }
+                if (lastFillRate != Rate(0))
+                    fillRates[order.type] = lastFillRate;
+                lastFillRate = Rate(0);
+                results.append(ret);
+                remains.append(amnt);
+            }
+            if (failed || !InvariantMonitor::check(invariants))
+            {
+                indexUpdates.clear();
+                bookUpdates.clear();
+                feedTrades.clear();
+                recentTrades.clear();
+                pendingFees.fill(Amount(0));
+                dataAccessor->rollback();
+                failed = true;
+            }
+            else
+            {
+                dataAccessor->commit();
+                UserIndex::apply(indexUpdates);
+                Funds fees;
+                for (CurrencyId cur: {pairRef->goods, pairRef->currency})
+                    if (pendingFees[cur] != Amount(0))
+                        fees.insert(Registry::currencyName(cur), pendingFees[cur]);
+                FeeAccumulator::add(pair, fees);
+                EngineState::recordCommit(indexUpdates, pair, fees);
+                RecentTrades::add(pair, recentTrades);
+                ChangeStream::recordCommit(indexUpdates);
+                ChangeStream::recordTrades(pair, recentTrades);
+                feeLock.unlock();
+                indexLock.unlock();
+                OrderBook::apply(bookUpdates);
+                MarketFeed::publishTrades(pair, feedTrades);
+                for (auto fill = fillRates.cbegin(); fill != fillRates.cend(); ++fill)
+                {
+                    QDateTime now = EngineClock::now();
+                    TickerQuotes::publish(pair, fill.key(), fill.value(), now);
+                    EngineState::recordQuote(pair, fill.key(), fill.value(), now);
+                    ChangeStream::recordQuote(pair, fill.key(), fill.value(), now);
+                    MarketFeed::publishTicker(pair);
+                }
+            }
             success = true;
         }
         catch(const QSqlQuery& e)
         {
+            indexUpdates.clear();
+            bookUpdates.clear();
+            feedTrades.clear();
+            recentTrades.clear();
+            pendingFees.fill(Amount(0));
             dataAccessor->rollback();
             if (e.lastError().nativeErrorCode() != "1213")
                 throw;
+            Metrics::deadlockRetry();
             success = false;
         }
     } while (!success);
 
-    if (ret.order_id != (quint32)-1)
+    if (failed)
     {
-        ret.ok = true;
-        ret.recieved = (amount - amnt) * (Fee(1) - fee);
-        ret.remains = amnt;
-        ret.errMsg.clear();
+        results.clear();
+        errMsg = "internal database error";
+        return false;
     }
-    else
+
+    for (int i = 0; i < results.size(); i++)
     {
-        ret.errMsg = "internal database error";
-        ret.ok = false;
+        OrderCreateResult& ret = results[i];
+        ret.ok = true;
+        ret.recieved = (orders[i].amount - remains[i]) * (Fee(1) - fee);
+        ret.remains = remains[i];
+        ret.errMsg.clear();
     }
-
-    return ret;
+    return true;
 }
 
 QVariantMap Responce::getResponce(const QueryParser& parser, Method& method)
 {
     method = Method::Invalid;
-    QString methodName = parser.method();
     QVariantMap var;
 
     QueryParser::Scope scope = parser.apiScope();
     if (scope == QueryParser::Scope::Public)
     {
-        if (methodName == "info")
+        switch (parser.methodId())
         {
-            var = getInfoResponce( method);
-        }
-        else if (methodName == "ticker" )
-        {
-            var = getTickerResponce(parser, method);
-        }
-        else if (methodName == "depth")
-        {
-            var = getDepthResponce(parser, method);
-        }
-        else if (methodName == "trades")
-        {
-            var = getTradesResponce(parser, method);
+            case Method::PublicInfo:   var = getInfoResponce(method); break;
+            case Method::PublicTicker: var = getTickerResponce(parser, method); break;
+            case Method::PublicDepth:  var = getDepthResponce(parser, method); break;
+            case Method::PublicTrades: var = getTradesResponce(parser, method); break;
+            default: break;
         }
     }
     else if (scope == QueryParser::Scope::Private)
     {
+        if (ChangeStream::isReplica() && (   parser.methodId() == Method::PrivateTrade || parser.methodId() == Method::PrivateCanelOrder
+                                          || parser.methodId() == Method::PrivateTradeBatch || parser.methodId() == Method::PrivateCancelOrderBatch))
+        {
+            var["success"] = 0;
+            var["error"] = "read-only replica";
+            method = parser.methodId();
+            return var;
+        }
+
         QString authErrMsg;
         QString key = parser.key();
 
-        QStringList methodsRequresInfo = {"getInfo", "ActiveOrders", "OrderInfo", "TradeHistory", "TransHistory", "CoinDepositAddress",};
-        QStringList methodsRequresTrade = {"Trade", "CancelOrder"};
-        QStringList methodsRequresWithdraw = {"WithdrawCoin", "CreateCupon",  "RedeemCupon"};
-
+        Metrics::StageTimer authTimer(Metrics::Stage::Auth);
         if (!auth->authOk(key, parser.sign(), parser.nonce(), parser.signedData(), authErrMsg))
         {
             var["success"] = 0;
@@ -355,77 +514,50 @@ QVariantMap Responce::getResponce(const QueryParser& parser, Method& method)
             return var;
         }
 
-        if (methodsRequresInfo.contains(methodName) && !auth->hasInfo(key))
+        const MethodTable::Entry* entry = parser.methodInfo();
+        MethodTable::Permission permission = entry ? entry->permission : MethodTable::Permission::None;
+        if (permission == MethodTable::Permission::Info && !auth->hasInfo(key))
         {
             var["success"] = 0;
             var["error"] = "api key dont have info permission";
             method = AccessIssue;
             return var;
         }
-        else if (methodsRequresTrade.contains(methodName) && !auth->hasTrade(key))
+        else if (permission == MethodTable::Permission::Trade && !auth->hasTrade(key))
         {
             var["success"] = 0;
             var["error"] = "api key dont have trade permission";
             method = AccessIssue;
             return var;
         }
-        else if (methodsRequresWithdraw.contains(methodName) && !auth->hasWithdraw(key))
+        else if (permission == MethodTable::Permission::Withdraw && !auth->hasWithdraw(key))
         {
             var["success"] = 0;
             var["error"] = "api key dont have withdraw permission";
             method = AccessIssue;
             return var;
         }
+        authTimer.stop();
 
-        if (methodName == "getInfo")
-        {
-            var = getPrivateInfoResponce(parser, method);
-        }
-        else if (methodName == "ActiveOrders")
-        {
-            var = getPrivateActiveOrdersResponce(parser, method);
-        }
-        else if (methodName == "Trade")
-        {
-            var = getPrivateTradeResponce(parser, method);
-        }
-        else if (methodName == "OrderInfo")
-        {
-            var = getPrivateOrderInfoResponce( parser, method);
-        }
-        else if (methodName == "CancelOrder")
-        {
-            var = getPrivateCancelOrderResponce(parser, method);
-        }
-        else if (methodName == "TradeHistory")
-        {
-            var["success"] = 0;
-            var["error"] = "not implemented yet";
-        }
-        else if (methodName == "TransHistory")
-        {
-            var["success"] = 0;
-            var["error"] = "not implemented yet";
-        }
-        else if (methodName == "CoinDepositAddress")
+        switch (parser.methodId())
         {
-            var["success"] = 0;
-            var["error"] = "not implemented yet";
-        }
-        else if (methodName == "WithdrawCoin")
-        {
-            var["success"] = 0;
-            var["error"] = "not implemented yet";
-        }
-        else if (methodName == "CreateCupon")
-        {
-            var["success"] = 0;
-            var["error"] = "not implemented yet";
-        }
-        else if (methodName == "RedeemCupon")
-        {
-            var["success"] = 0;
-            var["error"] = "not implemented yet";
+            case Method::PrivateGetInfo:      var = getPrivateInfoResponce(parser, method); break;
+            case Method::PrivateActiveOrders: var = getPrivateActiveOrdersResponce(parser, method); break;
+            case Method::PrivateTrade:        var = getPrivateTradeResponce(parser, method); break;
+            case Method::PrivateOrderInfo:    var = getPrivateOrderInfoResponce(parser, method); break;
+            case Method::PrivateCanelOrder:   var = getPrivateCancelOrderResponce(parser, method); break;
+            case Method::PrivateTradeBatch:   var = getPrivateTradeBatchResponce(parser, method); break;
+            case Method::PrivateCancelOrderBatch: var = getPrivateCancelOrderBatchResponce(parser, method); break;
+            case Method::PrivateTradeHistory: var = getPrivateTradeHistoryResponce(parser, method); break;
+            case Method::PrivateTransHistory: var = getPrivateTransHistoryResponce(parser, method); break;
+            case Method::PrivateCoinDepositAddress:
+            case Method::PrivateWithdrawCoin:
+            case Method::PrivateCreateCupon:
+            case Method::PrivateRedeemCupon:
+                var["success"] = 0;
+                var["error"] = "not implemented yet";
+                break;
+            default: break;
         }
     }
 
@@ -448,7 +580,7 @@ QVariantMap Responce::getInfoResponce(Method &method)
     QVariantMap var;
     QVariantMap pairs;
 
-    var["server_time"] = QDateTime::currentDateTime().toTime_t();
+    var["server_time"] = EngineClock::now().toTime_t();
     PairInfo::List allPairs = dataAccessor->allPairsInfoList();
     for (PairInfo::Ptr info: allPairs)
     {
@@ -487,19 +619,33 @@ QVariantMap Responce::getTickerResponce(const QueryParser& httpQuery, Method& me
         if (info)
         {
             QVariantMap pair;
-            PairInfo::Ptr pinfo = info->pair_ptr.lock();
+            // ticker is not linked to its pair, values keep full precision
             int decimal_places=  7;
-            if (pinfo)
-                decimal_places = pinfo->decimal_places;
             pair["high"] = dec2qstr(info->high, decimal_places);
             pair["low"]  = dec2qstr(info->low, decimal_places);
             pair["avg"]  = dec2qstr(info->avg, decimal_places);
             pair["vol"]  = dec2qstr(info->vol, 6);
             pair["vol_cur"] = dec2qstr(info->vol_cur, decimal_places);
-            pair["last"] = dec2qstr(info->last, decimal_places);
-            pair["buy"] = dec2qstr(info->buy, decimal_places);
-            pair["sell"] = dec2qstr(info->sell, decimal_places);
-            pair["updated"] = info->updated.toTime_t();
+            // fills done after last ticker update override its quote
+            TickerQuotes::Quote quote;
+            if (TickerQuotes::quote(pairName, quote) && quote.updated >= info->updated)
+            {
+                if (quote.buy == Rate(0))
+                    quote.buy = info->buy;
+                if (quote.sell == Rate(0))
+                    quote.sell = info->sell;
+            }
+            else
+            {
+                quote.last = info->last;
+                quote.buy = info->buy;
+                quote.sell = info->sell;
+                quote.updated = info->updated;
+            }
+            pair["last"] = dec2qstr(quote.last, decimal_places);
+            pair["buy"] = dec2qstr(quote.buy, decimal_places);
+            pair["sell"] = dec2qstr(quote.sell, decimal_places);
+            pair["updated"] = quote.updated.toTime_t();
 
             var[pairName] = pair;
         }
@@ -538,12 +684,114 @@ QVariantList Responce::appendDepthToMap(const Depth& depth, int limit, int dp)
 }
 
 
+Depth Responce::levelsToDepth(const QList<OrderBook::Level>& levels)
+{
+    Depth depth;
+    depth.reserve(levels.size());
+    for (const OrderBook::Level& level: levels)
+        depth << DepthItem(level.rate, level.amount);
+    return depth;
+}
+
+QVariantMap Responce::getDepthDeltaResponce(const QueryParser& httpQuery)
+{
+    QVariantMap var;
+    int limit = httpQuery.limit();
+    for (const PairName& pairName: httpQuery.pairs())
+    {
+        if (pairName.isEmpty())
+            continue;
+        if (var.contains(pairName))
+        {
+            var.clear();
+            var["success"] = 0;
+            var["error"] = "Duplicated pair name: " + pairName;
+            break;
+        }
+        PairInfo::Ptr pinfo = dataAccessor->pairInfo(pairName);
+        if (!pinfo)
+        {
+            if (httpQuery.ignoreInvalid())
+                continue;
+            var.clear();
+            var["success"] = 0;
+            var["error"] = "Invalid pair name: " + pairName;
+            break;
+        }
+        if (!ShardConfig::owns(pairName))
+        {
+            var.clear();
+            var["success"] = 0;
+            var["error"] = "pair is served by another shard: " + pairName;
+            break;
+        }
+
+        // since=0 or version unknown to the book history: full snapshot
+        QList<OrderBook::Level> bids;
+        QList<OrderBook::Level> asks;
+        quint64 version = 0;
+        bool delta = httpQuery.since() > 0 && OrderBook::changesSince(pairName, httpQuery.since(), bids, asks, version);
+        if (!delta)
+        {
+            bids.clear();
+            asks.clear();
+            version = OrderBook::snapshot(pairName, limit, bids, asks);
+        }
+
+        // changed levels are not cut by limit, removed ones come with zero amount
+        QVariantMap p;
+        p["version"] = version;
+        p["delta"] = delta ? 1 : 0;
+        p["bids"] = appendDepthToMap(levelsToDepth(bids), delta ? bids.size() : limit, pinfo->decimal_places);
+        p["asks"] = appendDepthToMap(levelsToDepth(asks), delta ? asks.size() : limit, pinfo->decimal_places);
+        var[pairName] = p;
+    }
+    if (var.isEmpty())
+    {
+        var["success"] = 0;
+        var["error"] = "Empty pair list";
+    }
+    return var;
+}
+
 QVariantMap Responce::getDepthResponce(const QueryParser& httpQuery, Method& method)
 {
     method = Method::PublicDepth;
+    if (httpQuery.hasSince())
+        return getDepthDeltaResponce(httpQuery);
+
     QVariantMap var;
     int limit = httpQuery.limit();
-    QMap<PairName, BuySellDepth> pairsDepth = dataAccessor->allActiveOrdersAmountAgreggatedByRateList(httpQuery.pairs());
+    QMap<PairName, BuySellDepth> pairsDepth;
+    if (ChangeStream::isReplica())
+    {
+        // replica has no write access to check, its books follow the primary;
+        // pairs come from url, so they are checked before books are read
+        for (const PairName& pair: httpQuery.pairs())
+        {
+            if (pair.isEmpty())
+                continue;
+            if (!Registry::pair(pair))
+            {
+                if (httpQuery.ignoreInvalid())
+                    continue;
+                var["success"] = 0;
+                var["error"] = "Invalid pair name: " + pair;
+                return var;
+            }
+            if (!ShardConfig::owns(pair))
+            {
+                var["success"] = 0;
+                var["error"] = "pair is served by another shard: " + pair;
+                return var;
+            }
+            QList<OrderBook::Level> bids, asks;
+            OrderBook::snapshot(pair, limit, bids, asks);
+            pairsDepth[pair] = BuySellDepth(levelsToDepth(bids), levelsToDepth(asks));
+        }
+    }
+    else
+        pairsDepth = dataAccessor->allActiveOrdersAmountAgreggatedByRateList(httpQuery.pairs());
     for (QMap<PairName, BuySellDepth>::const_iterator item = pairsDepth.constBegin(); item != pairsDepth.constEnd(); item++)
     {
         const QString& pairName = item.key();
@@ -589,7 +837,22 @@ QVariantMap Responce::getTradesResponce(const QueryParser &httpQuery, Method &me
             var["error"] = "Duplicated pair name: " + pairName;
             break;
         }
-        TradeInfo::List tradesList = dataAccessor->allTradesInfo(pairName);
+        TradeInfo::List tradesList;
+        if (ChangeStream::isReplica())
+        {
+            for (const RecentTrades::Trade& trade: RecentTrades::trades(pairName, limit))
+            {
+                TradeInfo::Ptr info = TradeInfo::create();
+                info->tid = trade.tid;
+                info->type = trade.type;
+                info->rate = trade.rate;
+                info->amount = trade.amount;
+                info->created = trade.created;
+                tradesList << info;
+            }
+        }
+        else
+            tradesList = dataAccessor->allTradesInfo(pairName);
         QVariantList list;
         QVariantMap tr;
         QString type;
@@ -626,6 +889,61 @@ QVariantMap Responce::getTradesResponce(const QueryParser &httpQuery, Method &me
     return var;
 }
 
+bool Responce::ensureUserIndexed(const ApikeyInfo::Ptr& apikey)
+{
+    if (UserIndex::isLoaded(apikey->user_id) || ChangeStream::isReplica())
+        return UserIndex::isLoaded(apikey->user_id);
+
+    QWriteLocker lock(&UserIndex::commitLock());
+    if (UserIndex::isLoaded(apikey->user_id))
+        return true;
+
+    UserInfo::Ptr user = sqlAccessor->userInfo(apikey->user_id);
+    if (!user)
+        return false;
+    UserIndex::load(apikey->user_id, user->funds, sqlAccessor->activeOrdersInfoList(apikey->apikey));
+    ChangeStream::recordUserLoaded(apikey->user_id);
+    return true;
+}
+
+bool Responce::userFunds(const ApikeyInfo::Ptr& apikey, Funds& funds)
+{
+    if (ShardConfig::isSharded())
+    {
+        UserInfo::Ptr user = sqlAccessor->userInfo(apikey->user_id);
+        if (!user)
+            return false;
+        funds = Registry::funds(user->funds);
+        return true;
+    }
+    return ensureUserIndexed(apikey) && UserIndex::funds(apikey->user_id, funds);
+}
+
+QList<UserIndex::Order> Responce::userActiveOrders(const ApikeyInfo::Ptr& apikey)
+{
+    if (!ShardConfig::isSharded())
+    {
+        if (!ensureUserIndexed(apikey))
+            return QList<UserIndex::Order>();
+        return UserIndex::activeOrders(apikey->user_id);
+    }
+
+    QList<UserIndex::Order> orders;
+    for (const OrderInfo::Ptr& info: sqlAccessor->activeOrdersInfoList(apikey->apikey))
+    {
+        UserIndex::Order order;
+        order.order_id = info->order_id;
+        order.pair = info->pair;
+        order.type = info->type;
+        order.start_amount = info->start_amount;
+        order.amount = info->amount;
+        order.rate = info->rate;
+        order.created = info->created;
+        orders.append(order);
+    }
+    return orders;
+}
+
 QVariantMap Responce::getPrivateInfoResponce(const QueryParser &httpQuery, Method& method)
 {
     method = Method::PrivateGetInfo;
@@ -634,34 +952,27 @@ QVariantMap Responce::getPrivateInfoResponce(const QueryParser &httpQuery, Metho
     QVariantMap rights;
     QVariantMap result;
 
-
-    QVariantMap params;
     ApikeyInfo::Ptr apikey = dataAccessor->apikeyInfo(httpQuery.key());
-    UserInfo::Ptr user = apikey->user_ptr.lock();
-    if (!user)
-    {
-        user = dataAccessor->userInfo(apikey->user_id);
-        apikey->user_ptr = user;
-    }
-    Funds& f = user->funds;
-    for(const QString& cur: f.keys())
+    if (!apikey)
+        return var;
+
+    Funds f;
+    if (userFunds(apikey, f))
     {
-        funds[cur] = dec2qstr(f[cur], 6);
+        for(const QString& cur: f.keys())
+            funds[cur] = dec2qstr(f[cur], 6);
+        result["funds"] = funds;
     }
-    result["funds"] = funds;
     rights["info"] = apikey->info;
     rights["trade"] = apikey->trade;
     rights["withdraw"] = apikey->withdraw;
     result["rights"] = rights;
-    if (performSql("get orders count", *selectActiveOrdersCountQuery, params, true))
-    {
-        if (selectActiveOrdersCountQuery->next())
-            result["open_orders"] = selectActiveOrdersCountQuery->value(0).toUInt();
-    }
+    result["open_orders"] = ShardConfig::isSharded() ? userActiveOrders(apikey).size() : UserIndex::openOrdersCount(apikey->user_id);
+
     if (result.contains("rights") && result.contains("funds") && result.contains("open_orders"))
     {
         result["transaction_count"] = 0;
-        result["server_time"] = QDateTime::currentDateTime().toTime_t();
+        result["server_time"] = EngineClock::now().toTime_t();
         var["return"] = result;
         var["success"] = 1;
     }
@@ -676,24 +987,27 @@ QVariantMap Responce::getPrivateActiveOrdersResponce(const QueryParser &httpQuer
     method = Method::PrivateActiveOrders;
     QVariantMap var;
 
-    OrderInfo::List list = dataAccessor->activeOrdersInfoList(httpQuery.key());
+    ApikeyInfo::Ptr apikey = dataAccessor->apikeyInfo(httpQuery.key());
+    if (!apikey)
+        return var;
+
+    QList<UserIndex::Order> list = userActiveOrders(apikey);
     QVariantMap result;
-    for(OrderInfo::Ptr& info: list)
+    for(const UserIndex::Order& info: list)
     {
-        OrderId order_id = info->order_id;
         QVariantMap order;
-        PairInfo::Ptr pinfo = dataAccessor->pairInfo(info->pair);
+        PairInfo::Ptr pinfo = dataAccessor->pairInfo(info.pair);
         int decimal_places = 7;
         if (pinfo)
             decimal_places = pinfo->decimal_places;
-        order["pair"]   = info->pair;
-        order["type"]   = (info->type == OrderInfo::Type::Sell)?"sell":"buy";
-        order["amount"] = dec2qstr(info->amount, 6);
-        order["rate"]   = dec2qstr(info->rate, decimal_places);
-        order["timestamp_created"] = info->created.toTime_t();
-        order["status"] = static_cast<int>(info->status) - 1;
-
-        result[QString::number(order_id)] = order;
+        order["pair"]   = info.pair;
+        order["type"]   = (info.type == OrderInfo::Type::Sell)?"sell":"buy";
+        order["amount"] = dec2qstr(info.amount, 6);
+        order["rate"]   = dec2qstr(info.rate, decimal_places);
+        order["timestamp_created"] = info.created.toTime_t();
+        order["status"] = static_cast<int>(OrderInfo::Status::Active) - 1;
+
+        result[QString::number(info.order_id)] = order;
     }
     var["return"] = result;
     var["success"] = 1;
@@ -745,6 +1059,147 @@ QVariantMap Responce::getPrivateOrderInfoResponce(const QueryParser &httpQuery,
     return var;
 }
 
+bool Responce::readHistoryPage(const QueryParser& httpQuery, HistoryPage& page, QString& errMsg)
+{
+    struct Field
+    {
+        const char* name;
+        quint32* value;
+    };
+    quint32 since = 0;
+    quint32 end = 0;
+    for (const Field& field: {Field{"from", &page.from}, Field{"count", &page.count},
+                              Field{"from_id", &page.from_id}, Field{"end_id", &page.end_id},
+                              Field{"since", &since}, Field{"end", &end}})
+    {
+        QueryParser::View view = httpQuery.postParam(field.name);
+        if (view.isNull())
+            continue;
+        bool ok = false;
+        int value = view.toInt(&ok);
+        if (!ok || value < 0)
+        {
+            errMsg = QString("invalid parameter: %1").arg(field.name);
+            return false;
+        }
+        *field.value = static_cast<quint32>(value);
+    }
+    if (since)
+        page.since = QDateTime::fromTime_t(since);
+    if (end)
+        page.end = QDateTime::fromTime_t(end);
+
+    QueryParser::View order = httpQuery.postParam("order");
+    if (order.isNull() || order.equals("DESC"))
+        page.desc = true;
+    else if (order.equals("ASC"))
+        page.desc = false;
+    else
+    {
+        errMsg = "invalid parameter: order";
+        return false;
+    }
+    return true;
+}
+
+QVariantMap Responce::getPrivateTradeHistoryResponce(const QueryParser& httpQuery, Method& method)
+{
+    method = Method::PrivateTradeHistory;
+    QVariantMap var;
+
+    ApikeyInfo::Ptr apikey = dataAccessor->apikeyInfo(httpQuery.key());
+    if (!apikey)
+        return var;
+
+    HistoryPage page;
+    QString errMsg;
+    PairName pair = httpQuery.pair();
+    if (!pair.isEmpty() && !Registry::pair(pair))
+        errMsg = "invalid parameter: pair";
+    if (!errMsg.isEmpty() || !readHistoryPage(httpQuery, page, errMsg))
+    {
+        var["success"] = 0;
+        var["error"] = errMsg;
+        return var;
+    }
+
+    QVariantMap result;
+    for (const UserTradeInfo::Ptr& info: sqlAccessor->userTradesInfo(apikey->user_id, pair, page))
+    {
+        QVariantMap trade;
+        PairInfo::Ptr pinfo = dataAccessor->pairInfo(info->pair);
+        int decimal_places = 7;
+        if (pinfo)
+            decimal_places = pinfo->decimal_places;
+        trade["pair"] = info->pair;
+        trade["type"] = (info->type == OrderInfo::Type::Buy)?"buy":"sell";
+        trade["amount"] = dec2qstr(info->amount, 6);
+        trade["rate"] = dec2qstr(info->rate, decimal_places);
+        trade["order_id"] = info->order_id;
+        trade["is_your_order"] = info->is_your_order ? 1 : 0;
+        trade["timestamp"] = info->created.toTime_t();
+
+        result[QString::number(info->tid)] = trade;
+    }
+    var["return"] = result;
+    var["success"] = 1;
+
+    return var;
+}
+
+QVariantMap Responce::getPrivateTransHistoryResponce(const QueryParser& httpQuery, Method& method)
+{
+    method = Method::PrivateTransHistory;
+    QVariantMap var;
+
+    ApikeyInfo::Ptr apikey = dataAccessor->apikeyInfo(httpQuery.key());
+    if (!apikey)
+        return var;
+
+    HistoryPage page;
+    QString errMsg;
+    if (!readHistoryPage(httpQuery, page, errMsg))
+    {
+        var["success"] = 0;
+        var["error"] = errMsg;
+        return var;
+    }
+
+    // every trade credits each of its two users once, so a transaction is
+    // the user's side of a trade and has the trade id
+    QVariantMap result;
+    for (const UserTradeInfo::Ptr& info: sqlAccessor->userTradesInfo(apikey->user_id, PairName(), page))
+    {
+        const Registry::Pair* pair = Registry::pair(info->pair);
+        PairInfo::Ptr pinfo = dataAccessor->pairInfo(info->pair);
+        if (!pair || !pinfo)
+            continue;
+        Fee fee = pinfo->fee / Fee(100);
+        QString goods = Registry::currencyName(pair->goods).toUpper();
+        QString currency = Registry::currencyName(pair->currency).toUpper();
+        Amount total = info->amount * info->rate;
+        bool buy = info->type == OrderInfo::Type::Buy;
+
+        QVariantMap transaction;
+        transaction["type"] = 4;
+        transaction["amount"] = dec2qstr(buy ? info->amount * (Fee(1) - fee) : total * (Fee(1) - fee), 6);
+        transaction["currency"] = buy ? goods : currency;
+        transaction["desc"] = QString("%1 %2 %3 %4by price %5 %6 total %7 %6 (-%8%)")
+                .arg(buy ? "Buy" : "Sell").arg(dec2qstr(info->amount, 6)).arg(goods)
+                .arg(info->is_your_order ? QString("from your order :order:%1: ").arg(info->order_id) : QString())
+                .arg(dec2qstr(info->rate, pinfo->decimal_places)).arg(currency)
+                .arg(dec2qstr(total, 6)).arg(dec2qstr(pinfo->fee, 2));
+        transaction["status"] = 2;
+        transaction["timestamp"] = info->created.toTime_t();
+
+        result[QString::number(info->tid)] = transaction;
+    }
+    var["return"] = result;
+    var["success"] = 1;
+
+    return var;
+}
+
 QVariantMap Responce::getPrivateTradeResponce(const QueryParser& httpQuery, Method& method)
 {
     method = Method::PrivateTrade;
@@ -791,13 +1246,8 @@ QVariantMap Responce::getPrivateTradeResponce(const QueryParser& httpQuery, Meth
                 res["error"] = "invalid api key";
                 return res;
             }
-            UserInfo::Ptr  uInfo = aInfo->user_ptr.lock();
-            if (!uInfo)
-            {
-                uInfo = dataAccessor->userInfo(aInfo->user_id);
-                aInfo->user_ptr = uInfo;
-            }
-            Funds& f = uInfo->funds;
+            Funds f;
+            userFunds(aInfo, f);
             for(const QString& cur: f.keys())
                 funds[cur] = dec2qstr(f[cur], 6);
             res["funds"] = funds;
@@ -811,7 +1261,6 @@ QVariantMap Responce::getPrivateCancelOrderResponce(const QueryParser& httpQuery
 {
     method = Method::PrivateCanelOrder;
     QVariantMap var;
-    QVariantMap params;
     QVariantMap funds;
     QVariantMap ret;
     QString order_id = httpQuery.order_id();
@@ -821,13 +1270,24 @@ QVariantMap Responce::getPrivateCancelOrderResponce(const QueryParser& httpQuery
         var["error"] = "invalid parameter: order_id";
         return var;
     }
-    params[":order_id"] = order_id;
+    // takers of the opposite side change the order, see cancelOrders()
+    std::unique_ptr<QMutexLocker> tradeLock;
+    {
+        OrderInfo::Ptr info = dataAccessor->orderInfo(order_id.toUInt());
+        const Registry::Pair* pairRef = info ? Registry::pair(info->pair) : nullptr;
+        if (pairRef)
+            tradeLock.reset(new QMutexLocker(tradeMutex(*pairRef, oppositOrderType(info->type))));
+    }
     bool done = false;
     do
     {
         try
         {
-            startTransaction->exec();
+            indexUpdates.clear();
+            bookUpdates.clear();
+            // index lock before the store transaction, see checkParamsAndDoExchange()
+            QReadLocker indexLock(&UserIndex::commitLock());
+            dataAccessor->transaction();
             OrderInfo::Ptr info = dataAccessor->orderInfo(order_id.toUInt());
             if (info)
             {
@@ -841,19 +1301,51 @@ QVariantMap Responce::getPrivateCancelOrderResponce(const QueryParser& httpQuery
 
                 if (status != OrderInfo::Status::Active)
                 {
+                    dataAccessor->rollback();
                     var["success"] = 0;
                     var["error"] = "not active order";
                     return var;
                 }
-                NewOrderVolume orderVolume = new_order_currency_volume(type, pair, amount, rate);
+                if (!ShardConfig::owns(pair))
+                {
+                    dataAccessor->rollback();
+                    var["success"] = 0;
+                    var["error"] = "order is served by another shard";
+                    return var;
+                }
+                const Registry::Pair* pairRef = Registry::pair(pair);
+                if (!pairRef)
+                {
+                    dataAccessor->rollback();
+                    var["success"] = 0;
+                    var["error"] = "internal database error";
+                    return var;
+                }
+                invariants.clear();
+                NewOrderVolume orderVolume = new_order_currency_volume(type, *pairRef, amount, rate);
                 dataAccessor->tradeUpdateDeposit(user_id, orderVolume.currency, orderVolume.volume, QString::number(user_id));
+                invariants.depositChanged(orderVolume.currency, orderVolume.volume);
+                CurrencyId reserveCurrency = orderVolume.currency;
+                invariants.orderChanged(order_id.toUInt(), reserveCurrency, -InvariantMonitor::reserve(*info, reserveCurrency), amount);
+                indexUpdates.balanceChanged(user_id, orderVolume.currency, orderVolume.volume);
 
-                UserInfo::Ptr user = dataAccessor->userInfo(user_id);
-                for(const QString& cur: user->funds.keys())
-                    funds[cur] = funds[cur];
+                for (int cur = 0; cur < Registry::currenciesCount(); cur++)
+                    funds[Registry::currencyName(cur)] = funds[Registry::currencyName(cur)];
                 ret["funds"] = funds;
 
-                performSql("cancel order", *cancelOrderQuery, params, true);
+                if (!dataAccessor->cancelOrder(order_id.toUInt()))
+                    throw std::runtime_error("cannot cancel order");
+                indexUpdates.orderClosed(user_id, order_id.toUInt());
+                bookUpdates.levelChanged(pair, type, rate, -amount, -1);
+                if (!InvariantMonitor::check(invariants))
+                {
+                    indexUpdates.clear();
+                    bookUpdates.clear();
+                    dataAccessor->rollback();
+                    var["success"] = 0;
+                    var["error"] = "internal database error";
+                    return var;
+                }
 
                 ret["order_id"] = order_id;
 
@@ -861,45 +1353,369 @@ QVariantMap Responce::getPrivateCancelOrderResponce(const QueryParser& httpQuery
                 var["success"] = 1;
                 var["return"] = ret;
             }
-            commitTransaction->exec();
+            dataAccessor->commit();
+            UserIndex::apply(indexUpdates);
+            EngineState::recordCommit(indexUpdates, PairName(), Funds());
+            ChangeStream::recordCommit(indexUpdates);
+            indexLock.unlock();
+            OrderBook::apply(bookUpdates);
             done = true;
         }
         catch (std::runtime_error& e)
         {
             std::cerr << e.what() << std::endl;
-            rollbackTransaction->exec();
+            indexUpdates.clear();
+            bookUpdates.clear();
+            dataAccessor->rollback();
         }
         catch (const QSqlQuery& q)
         {
             std::cerr << q.lastError().text() << std::endl;
-            rollbackTransaction->exec();
+            if (q.lastError().nativeErrorCode() == "1213")
+                Metrics::deadlockRetry();
+            indexUpdates.clear();
+            bookUpdates.clear();
+            dataAccessor->rollback();
         }
     } while (!done);
 
     return var;
 }
 
+QVariantMap Responce::getPrivateTradeBatchResponce(const QueryParser& httpQuery, Method& method)
+{
+    method = Method::PrivateTradeBatch;
+    QVariantMap var;
+
+    // orders=<type>:<rate>:<amount>,...
+    QList<NewOrder> orders;
+    for (const QString& item: httpQuery.postParam("orders").toString().split(',', QString::SkipEmptyParts))
+    {
+        QStringList fields = item.split(':');
+        NewOrder order;
+        if (fields.size() != 3 || (fields[0] != "buy" && fields[0] != "sell"))
+        {
+            var["success"] = 0;
+            var["error"] = "You incorrectly entered one of fields.";
+            return var;
+        }
+        order.type = (fields[0] == "buy") ? OrderInfo::Type::Buy : OrderInfo::Type::Sell;
+        order.rate = Rate(fields[1].toStdString());
+        order.amount = Amount(fields[2].toStdString());
+        orders.append(order);
+    }
+    if (orders.isEmpty() || orders.size() > MAX_BATCH_SIZE)
+    {
+        var["success"] = 0;
+        var["error"] = QString("invalid parameter: orders, 1 to %1 orders expected").arg(MAX_BATCH_SIZE);
+        return var;
+    }
+
+    QList<OrderCreateResult> results;
+    QString errMsg;
+    if (!checkParamsAndDoExchange(httpQuery.key(), httpQuery.pair(), orders, results, errMsg))
+    {
+        var["success"] = 0;
+        var["error"] = errMsg;
+        return var;
+    }
+
+    QVariantList created;
+    for (const OrderCreateResult& ret: results)
+    {
+        QVariantMap res;
+        res["remains"] = dec2qstr(ret.remains, 7);
+        res["received"] = dec2qstr(ret.recieved, 6);
+        res["order_id"] = ret.order_id;
+        created.append(res);
+    }
+    QVariantMap res;
+    res["orders"] = created;
+
+    QVariantMap funds;
+    ApikeyInfo::Ptr aInfo = dataAccessor->apikeyInfo(httpQuery.key());
+    Funds f;
+    if (aInfo)
+        userFunds(aInfo, f);
+    for(const QString& cur: f.keys())
+        funds[cur] = dec2qstr(f[cur], 6);
+    res["funds"] = funds;
+    var["return"] = res;
+    var["success"] = 1;
+    return var;
+}
+
+QVariantMap Responce::getPrivateCancelOrderBatchResponce(const QueryParser& httpQuery, Method& method)
+{
+    method = Method::PrivateCancelOrderBatch;
+    QVariantMap var;
+
+    ApikeyInfo::Ptr apikey = dataAccessor->apikeyInfo(httpQuery.key());
+    if (!apikey)
+        return var;
+
+    QList<OrderId> order_ids;
+    for (const QString& item: httpQuery.postParam("order_ids").toString().split(',', QString::SkipEmptyParts))
+    {
+        bool ok = false;
+        OrderId order_id = item.toUInt(&ok);
+        if (!ok || order_id == 0)
+        {
+            order_ids.clear();
+            break;
+        }
+        order_ids.append(order_id);
+    }
+    if (order_ids.isEmpty() || order_ids.size() > MAX_BATCH_SIZE)
+    {
+        var["success"] = 0;
+        var["error"] = QString("invalid parameter: order_ids, 1 to %1 ids expected").arg(MAX_BATCH_SIZE);
+        return var;
+    }
+
+    QList<OrderId> cancelled;
+    QMap<OrderId, QString> errors;
+    if (!cancelOrders(apikey->user_id, order_ids, cancelled, errors))
+    {
+        var["success"] = 0;
+        var["error"] = "internal database error";
+        return var;
+    }
+
+    QVariantMap ret;
+    QVariantList cancelledList;
+    for (OrderId order_id: cancelled)
+        cancelledList.append(order_id);
+    ret["cancelled"] = cancelledList;
+    QVariantMap errorsMap;
+    for (auto error = errors.cbegin(); error != errors.cend(); ++error)
+        errorsMap[QString::number(error.key())] = error.value();
+    ret["errors"] = errorsMap;
+    QVariantMap funds;
+    Funds f;
+    userFunds(apikey, f);
+    for(const QString& cur: f.keys())
+        funds[cur] = dec2qstr(f[cur], 6);
+    ret["funds"] = funds;
+    var["return"] = ret;
+    var["success"] = 1;
+    return var;
+}
+
+quint32 Responce::tradeMutexKey(const Registry::Pair& pair, OrderInfo::Type type)
+{
+    return (static_cast<quint32>(pair.index) << 1) | static_cast<quint32>(type);
+}
+
+QMutex* Responce::tradeMutex(const Registry::Pair& pair, OrderInfo::Type type)
+{
+    static QHash<quint32, QMutex*> tradeMutexes;
+    static QMutex mutexsCollectionAccess;
+
+    QMutexLocker lock(&mutexsCollectionAccess);
+    QMutex*& pMutex = tradeMutexes[tradeMutexKey(pair, type)];
+    if (!pMutex)
+        pMutex = new QMutex;
+    return pMutex;
+}
+
+bool Responce::cancelOrders(UserId user_id, const QList<OrderId>& order_ids, QList<OrderId>& cancelled, QMap<OrderId, QString>& errors)
+{
+    // an order is changed by takers of the opposite side, cancel waits for
+    // them so it refunds amount left by the last fill; mutexes are taken in
+    // key order, as a batch of trades does
+    QMap<quint32, QMutex*> pMutexes;
+    for (OrderId order_id: order_ids)
+    {
+        OrderInfo::Ptr info = dataAccessor->orderInfo(order_id);
+        const Registry::Pair* pairRef = info ? Registry::pair(info->pair) : nullptr;
+        if (pairRef)
+        {
+            OrderInfo::Type taker = oppositOrderType(info->type);
+            pMutexes.insert(tradeMutexKey(*pairRef, taker), tradeMutex(*pairRef, taker));
+        }
+    }
+    std::vector<std::unique_ptr<QMutexLocker>> locks;
+    for (QMutex* pMutex: pMutexes)
+        locks.emplace_back(new QMutexLocker(pMutex));
+
+    // orders which cannot be cancelled are reported and do not stop the rest
+    bool done = false;
+    do
+    {
+        try
+        {
+            indexUpdates.clear();
+            bookUpdates.clear();
+            cancelled.clear();
+            errors.clear();
+            invariants.clear();
+            // index lock before the store transaction, see checkParamsAndDoExchange()
+            QReadLocker indexLock(&UserIndex::commitLock());
+            dataAccessor->transaction();
+            for (OrderId order_id: order_ids)
+            {
+                OrderInfo::Ptr info = dataAccessor->orderInfo(order_id);
+                const Registry::Pair* pairRef = info ? Registry::pair(info->pair) : nullptr;
+                if (!info || info->user_id != user_id || !pairRef)
+                    errors[order_id] = "invalid order";
+                else if (info->status != OrderInfo::Status::Active)
+                    errors[order_id] = "not active order";
+                else if (!ShardConfig::owns(info->pair))
+                    errors[order_id] = "order is served by another shard";
+                if (errors.contains(order_id))
+                    continue;
+
+                NewOrderVolume orderVolume = new_order_currency_volume(info->type, *pairRef, info->amount, info->rate);
+                dataAccessor->tradeUpdateDeposit(info->user_id, orderVolume.currency, orderVolume.volume, QString::number(info->user_id));
+                invariants.depositChanged(orderVolume.currency, orderVolume.volume);
+                CurrencyId reserveCurrency = orderVolume.currency;
+                invariants.orderChanged(order_id, reserveCurrency, -InvariantMonitor::reserve(*info, reserveCurrency), info->amount);
+                indexUpdates.balanceChanged(info->user_id, orderVolume.currency, orderVolume.volume);
+                if (!dataAccessor->cancelOrder(order_id))
+                    throw std::runtime_error("cannot cancel order");
+                indexUpdates.orderClosed(info->user_id, order_id);
+                bookUpdates.levelChanged(info->pair, info->type, info->rate, -info->amount, -1);
+                cancelled.append(order_id);
+            }
+            if (!InvariantMonitor::check(invariants))
+                throw std::runtime_error("invariant violation on cancel");
+            dataAccessor->commit();
+            UserIndex::apply(indexUpdates);
+            EngineState::recordCommit(indexUpdates, PairName(), Funds());
+            ChangeStream::recordCommit(indexUpdates);
+            indexLock.unlock();
+            OrderBook::apply(bookUpdates);
+            done = true;
+        }
+        catch (std::runtime_error& e)
+        {
+            std::cerr << e.what() << std::endl;
+            indexUpdates.clear();
+            bookUpdates.clear();
+            dataAccessor->rollback();
+            cancelled.clear();
+            return false;
+        }
+        catch (const QSqlQuery& q)
+        {
+            std::cerr << q.lastError().text() << std::endl;
+            if (q.lastError().nativeErrorCode() == "1213")
+                Metrics::deadlockRetry();
+            indexUpdates.clear();
+            bookUpdates.clear();
+            dataAccessor->rollback();
+        }
+    } while (!done);
+    return true;
+}
+
 QVariantMap Responce::exchangeBalance()
 {
     QVariantMap balance;
-    QSqlQuery sql(db);
-    sql.exec("START TRANSACTION");
-    QString query = "SELECT cur, sum(vol) from ("
-                   "select c.currency as cur, sum(volume) as vol from deposits d left join currencies c on c.currency_id = d.currency_id group by d.currency_id  "
-                   " UNION "
-                   "select right(p.pair,3) as cur, sum(amount*rate) as vol  from orders o left join pairs p on p.pair_id = o.pair_id where status='active' and type='buy'  group by right(p.pair, 3) "
-                   " UNION "
-                   "select left(p.pair,3) as cur, sum(amount)      as vol  from orders o left join pairs p on p.pair_id = o.pair_id where status='active' and type='sell' group by  left(p.pair, 3)"
-                   ") A group by cur";
-    performSql("get deposits balance", sql, query, true);
-    sql.exec("COMMIT");
-    while(sql.next())
-        balance[sql.value(0).toString()] = sql.value(1).toFloat();
 
+    // hold trades commits and fee folding only while snapshot is taken,
+    // so pending fees match deposits seen by the snapshot
+    QWriteLocker feeLock(&FeeAccumulator::commitLock());
+    Funds total = FeeAccumulator::pending();
+    Funds stored = dataAccessor->exchangeFunds([&feeLock]() { feeLock.unlock(); });
+    feeLock.unlock();
+
+    for (auto cur = stored.constBegin(); cur != stored.constEnd(); cur++)
+        total[cur.key()] += cur.value();
+    for (auto cur = total.constBegin(); cur != total.constEnd(); cur++)
+        balance[cur.key()] = static_cast<float>(cur.value().getAsDouble());
 
     return balance;
 }
 
+bool Responce::foldExchangeFees()
+{
+    QReadLocker indexLock(&UserIndex::commitLock());
+    QWriteLocker feeLock(&FeeAccumulator::commitLock());
+
+    Funds fees = FeeAccumulator::pending();
+    if (fees.isEmpty())
+        return true;
+
+    UserIndex::Batch batch;
+    Funds deposits;
+    try
+    {
+        dataAccessor->transaction();
+        for (auto fee = fees.constBegin(); fee != fees.constEnd(); fee++)
+        {
+            CurrencyId currency = Registry::currencyId(fee.key());
+            if (fee.value() == Amount(0) || currency == INVALID_CURRENCY)
+                continue;
+            dataAccessor->tradeUpdateDeposit(EXCHNAGE_USER_ID, currency, fee.value(), "Exchange");
+            batch.balanceChanged(EXCHNAGE_USER_ID, currency, fee.value());
+            deposits[fee.key()] = dataAccessor->depositVolume(EXCHNAGE_USER_ID, currency);
+        }
+        dataAccessor->commit();
+    }
+    catch (const QSqlQuery& e)
+    {
+        std::cerr << "fail to fold exchange fees: " << e.lastError().text() << std::endl;
+        dataAccessor->rollback();
+        return false;
+    }
+
+    FeeAccumulator::subtract(fees);
+    UserIndex::apply(batch);
+    EngineState::recordFold(batch, fees, deposits);
+    ChangeStream::recordCommit(batch);
+    return true;
+}
+
+void Responce::reconcileState()
+{
+    QWriteLocker indexLock(&UserIndex::commitLock());
+    QWriteLocker feeLock(&FeeAccumulator::commitLock());
+
+    // exchange user gets nothing but folds, so a deposit above the last
+    // fold known to state means later fold records were lost
+    Funds known = EngineState::exchangeDeposits();
+    Funds actual;
+    Funds folded;
+    for (int i = 0; i < Registry::currenciesCount(); i++)
+    {
+        CurrencyId currency = static_cast<CurrencyId>(i);
+        const QString& name = Registry::currencyName(currency);
+        actual[name] = dataAccessor->depositVolume(EXCHNAGE_USER_ID, currency);
+        if (!known.contains(name) || actual[name] == known[name])
+            continue;
+        if (actual[name] > known[name])
+            folded[name] = actual[name] - known[name];
+        else
+            std::cerr << "exchange deposit in " << name << " is below last fold by " << dec2qstr(known[name] - actual[name]) << std::endl;
+    }
+    if (!folded.isEmpty())
+    {
+        std::cerr << "state missed fees folded to SQL, dropped from pending ones:";
+        for (auto fee = folded.constBegin(); fee != folded.constEnd(); fee++)
+            std::cerr << ' ' << dec2qstr(fee.value()) << ' ' << fee.key();
+        std::cerr << std::endl;
+        FeeAccumulator::subtract(folded);
+    }
+    EngineState::setExchangeDeposits(actual);
+
+    // balances move with every order change, a user whose commit record
+    // was lost has other funds in SQL
+    int reloaded = 0;
+    for (UserId user_id: UserIndex::loadedUsers())
+    {
+        UserInfo::Ptr user = sqlAccessor->userInfo(user_id);
+        Funds funds;
+        if (user && UserIndex::funds(user_id, funds) && Registry::funds(user->funds) == funds)
+            continue;
+        UserIndex::unload(user_id);
+        reloaded++;
+    }
+    if (reloaded)
+        std::cerr << reloaded << " users of restored state differ from SQL, they are loaded again" << std::endl;
+}
+
 OrderInfo::List Responce::negativeAmountOrders()
 {
     return dataAccessor->negativeAmountOrders();
@@ -909,3 +1725,89 @@ void Responce::updateTicker()
 {
     dataAccessor->updateTicker();
 }
+
+void Responce::useBookTicks()
+{
+    int ladders = 0;
+    for (const PairInfo::Ptr& info: dataAccessor->allPairsInfoList())
+        if (ShardConfig::owns(info->pair) && OrderBook::useTicks(info->pair, info->min_price, info->max_price, info->decimal_places))
+            ladders++;
+    std::clog << ladders << " order books kept in tick ladders" << std::endl;
+}
+
+void Responce::loadOrderBooks()
+{
+    if (sqlAccessor == dataAccessor)
+    {
+        // schema may be behind the accessor: walk its books, a buy at max
+        // price meets every sell and a sell at zero every buy
+        OrderBook::reset();
+        useBookTicks();
+        for (const PairInfo::Ptr& info: dataAccessor->allPairsInfoList())
+        {
+            if (!ShardConfig::owns(info->pair))
+                continue;
+            for (OrderInfo::Type type: {OrderInfo::Type::Buy, OrderInfo::Type::Sell})
+            {
+                OrderBook::Level level;
+                level.type = oppositOrderType(type);
+                level.count = 0;
+                Rate rate = (type == OrderInfo::Type::Buy) ? info->max_price : Rate(0);
+                for (const OrderInfo::Ptr& order: dataAccessor->matchingOrders(info->pair, type, rate, 0))
+                {
+                    if (level.count && level.rate != order->rate)
+                    {
+                        OrderBook::load(info->pair, level);
+                        level.count = 0;
+                    }
+                    if (!level.count)
+                    {
+                        level.rate = order->rate;
+                        level.amount = Amount(0);
+                    }
+                    level.amount += order->amount;
+                    level.count++;
+                }
+                if (level.count)
+                    OrderBook::load(info->pair, level);
+            }
+        }
+        return;
+    }
+
+    QSqlQuery sql(db);
+    QString query = "select p.pair, o.type, o.rate, sum(o.amount), count(*) from orders o left join pairs p on p.pair_id = o.pair_id "
+                    "where o.status='active' group by p.pair, o.type, o.rate";
+    performSql("load order books", sql, query, true);
+    OrderBook::reset();
+    useBookTicks();
+    while (sql.next())
+    {
+        OrderBook::Level level;
+        level.type = (sql.value(1).toString() == "buy") ? OrderInfo::Type::Buy : OrderInfo::Type::Sell;
+        level.rate = qstr2dec<7>(sql.value(2).toString());
+        level.amount = qstr2dec<7>(sql.value(3).toString());
+        level.count = sql.value(4).toInt();
+        if (ShardConfig::owns(sql.value(0).toString()))
+            OrderBook::load(sql.value(0).toString(), level);
+    }
+}
+
+void Responce::loadAllUsers()
+{
+    QMap<UserId, Balances> funds;
+    QMap<UserId, OrderInfo::List> orders;
+
+    QWriteLocker lock(&UserIndex::commitLock());
+    dataAccessor->allUsersFunds(funds, orders);
+    for (auto user = funds.constBegin(); user != funds.constEnd(); user++)
+        if (!UserIndex::isLoaded(user.key()))
+            UserIndex::load(user.key(), user.value(), orders.value(user.key()));
+}
+
+void Responce::loadRecentTrades()
+{
+    for (const PairInfo::Ptr& info: dataAccessor->allPairsInfoList())
+        if (ShardConfig::owns(info->pair))
+            RecentTrades::load(info->pair, sqlAccessor->allTradesInfo(info->pair));
+}
@@ -2,7 +2,13 @@
 #define RESPONCE_H
 
 #include "types.h"
+#include "invariantmonitor.h"
+#include "marketfeed.h"
+#include "orderbook.h"
+#include "recenttrades.h"
+#include "registry.h"
 #include "sqlclient.h"
+#include "userindex.h"
 
 #include <QDateTime>
 #include <QMap>
@@ -17,6 +23,8 @@ class QSqlDatabase;
 class QSqlQuery;
 
 #define EXCHNAGE_USER_ID 1000
+/// orders or cancel ids in one batch request
+#define MAX_BATCH_SIZE 100
 
 class Responce
 {
@@ -26,35 +34,60 @@ public:
     QVariantMap getResponce(const QueryParser& parser, Method& method);
 
     QVariantMap exchangeBalance();
+    bool foldExchangeFees();
+    /// checks restored engine state against SQL: fees of a fold lost from
+    /// journal are dropped, users with other balances are loaded again
+    void reconcileState();
     OrderInfo::List negativeAmountOrders();
     void updateTicker();
+    void loadOrderBooks();
+    void useBookTicks();
+    /// change stream primary: replicas get every user in snapshot
+    void loadAllUsers();
+    void loadRecentTrades();
 
     static OrderInfo::Type oppositOrderType(OrderInfo::Type type);
+    /// accessor of responces created later: memcached, local_caches, sql,
+    /// memory, which loads tables from SQL once here, or lmdb, opened before
+    static void useDataAccessor(const QString& name, QSqlDatabase& db);
+    /// same keeping memory tables, as InMemoryDataAccessor::seed() made them
+    static void useDataAccessor(const QString& name);
 private:
+    /// bots trade through engine calls directly, skipping transport
+    friend class LoadBots;
+
     static QAtomicInt counter;
+    static QString dataAccessorName;
     QSqlDatabase& db;
 
     QVariantMap getInfoResponce(Method& method);
     QVariantMap getTickerResponce(const QueryParser& httpQuery, Method& method);
     QVariantMap getDepthResponce(const QueryParser& httpQuery, Method& method);
+    QVariantMap getDepthDeltaResponce(const QueryParser& httpQuery);
     QVariantMap getTradesResponce(const QueryParser& httpQuery, Method& method);
 
     QVariantMap getPrivateInfoResponce(const QueryParser& httpQuery, Method &method);
     QVariantMap getPrivateActiveOrdersResponce(const QueryParser& httpQuery, Method &method);
     QVariantMap getPrivateOrderInfoResponce(const QueryParser &httpQuery, Method& method);
+    QVariantMap getPrivateTradeHistoryResponce(const QueryParser& httpQuery, Method& method);
+    QVariantMap getPrivateTransHistoryResponce(const QueryParser& httpQuery, Method& method);
+    /// from, count, from_id, end_id, order, since and end parameters
+    static bool readHistoryPage(const QueryParser& httpQuery, HistoryPage& page, QString& errMsg);
 
     QVariantMap getPrivateTradeResponce(const QueryParser& httpQuery, Method& method);
     QVariantMap getPrivateCancelOrderResponce(const QueryParser& httpQuery, Method& method);
+    QVariantMap getPrivateTradeBatchResponce(const QueryParser& httpQuery, Method& method);
+    QVariantMap getPrivateCancelOrderBatchResponce(const QueryParser& httpQuery, Method& method);
 
     struct TradeCurrencyVolume
     {
-        QString  goods;
-        QString  currency;
-        QString  trader_currency_in;
+        CurrencyId goods;
+        CurrencyId currency;
+        CurrencyId trader_currency_in;
         Amount   trader_volume_in;
-        QString  trader_currency_out;
+        CurrencyId trader_currency_out;
         Amount   trader_volume_out;
-        QString  parter_currency_in;
+        CurrencyId parter_currency_in;
         Amount   partner_volume_in;
         Amount   exchange_currency_in;
         Amount   exchange_goods_in;
@@ -62,10 +95,17 @@ private:
 
     struct NewOrderVolume
     {
-        QString           currency;
+        CurrencyId        currency;
         Amount  volume;
     };
 
+    struct NewOrder
+    {
+        OrderInfo::Type type;
+        Rate rate;
+        Amount amount;
+    };
+
     struct OrderCreateResult
     {
         QString  errMsg;
@@ -75,24 +115,40 @@ private:
         bool     ok;
     };
 
-    NewOrderVolume new_order_currency_volume (OrderInfo::Type type, const QString& pair, Amount amount, Rate rate);
+    NewOrderVolume new_order_currency_volume (OrderInfo::Type type, const Registry::Pair& pair, Amount amount, Rate rate);
     QVariantList appendDepthToMap(const Depth& depth, int limit, int dp);
-    TradeCurrencyVolume trade_volumes (OrderInfo::Type type, const QString& pair, Fee fee,
+    static Depth levelsToDepth(const QList<OrderBook::Level>& levels);
+    TradeCurrencyVolume trade_volumes (OrderInfo::Type type, const Registry::Pair& pair, Fee fee,
                                      Amount trade_amount, Rate matched_order_rate);
-    quint32 doExchange(QString userName, const Rate& rate, TradeCurrencyVolume volumes, OrderInfo::Type type, Rate rt, const PairName &pair, QSqlQuery& query, Amount& amnt, Fee fee, UserId user_id);
+    quint32 doExchange(QString userName, const Rate& rate, TradeCurrencyVolume volumes, OrderInfo::Type type, Rate rt, const Registry::Pair& pair, Amount& amnt, Fee fee, UserId user_id);
     OrderCreateResult checkParamsAndDoExchange(const ApiKey& key, const PairName& pair, OrderInfo::Type type, const Rate& rate, const Amount& amount);
+    /// orders of one pair matched in order and committed in one transaction,
+    /// all or none of them
+    bool checkParamsAndDoExchange(const ApiKey& key, const PairName& pair, const QList<NewOrder>& orders, QList<OrderCreateResult>& results, QString& errMsg);
+    /// serializes trades of a pair and side: taker of the side matches
+    /// resting orders of the opposite one
+    static QMutex* tradeMutex(const Registry::Pair& pair, OrderInfo::Type type);
+    static quint32 tradeMutexKey(const Registry::Pair& pair, OrderInfo::Type type);
+    /// cancels active orders of user in one transaction, false on internal error;
+    /// takes trade mutexes of sides matching the orders
+    bool cancelOrders(UserId user_id, const QList<OrderId>& order_ids, QList<OrderId>& cancelled, QMap<OrderId, QString>& errors);
+    bool ensureUserIndexed(const ApikeyInfo::Ptr& apikey);
+    /// sharded: other shards change the same users, so these read shared schema
+    bool userFunds(const ApikeyInfo::Ptr& apikey, Funds& funds);
+    QList<UserIndex::Order> userActiveOrders(const ApikeyInfo::Ptr& apikey);
 
     std::unique_ptr<Authentificator>  auth;
-    std::unique_ptr<QSqlQuery>  selectActiveOrdersCountQuery;
-
-
-    std::unique_ptr<QSqlQuery>  cancelOrderQuery;
-
-    std::unique_ptr<QSqlQuery>  startTransaction;
-    std::unique_ptr<QSqlQuery>  commitTransaction;
-    std::unique_ptr<QSqlQuery>  rollbackTransaction;
 
     std::shared_ptr<AbstractDataAccessor> dataAccessor;
+    std::shared_ptr<AbstractDataAccessor> sqlAccessor;
+
+    UserIndex::Batch indexUpdates;
+    OrderBook::Batch bookUpdates;
+    QList<MarketFeed::Trade> feedTrades;
+    QList<RecentTrades::Trade> recentTrades;
+    Balances pendingFees {};
+    Rate lastFillRate;
+    InvariantMonitor::Transaction invariants;
 };
 
 #endif // RESPONCE_H
@@ -0,0 +1,152 @@
+#include "responsecache.h"
+#include "orderbook.h"
+
+#include <QDateTime>
+#include <QList>
+
+#include <zlib.h>
+
+#define MAX_CACHED_RESPONSES 512
+#define MIN_COMPRESSED_SIZE 1024
+
+QHash<QByteArray, ResponseCache::EntryPtr> ResponseCache::entries;
+QReadWriteLock ResponseCache::entriesAccess;
+// tags of different emulator runs must not match
+const QByteArray ResponseCache::epoch = QByteArray::number(QDateTime::currentMSecsSinceEpoch(), 36);
+
+const QByteArray& ResponseCache::Entry::body(Encoding encoding) const
+{
+    if (encoding == Encoding::Gzip)
+        return gzip;
+    if (encoding == Encoding::Deflate)
+        return deflate;
+    return json;
+}
+
+bool ResponseCache::isCacheable(const QueryParser& httpQuery)
+{
+    Method method = httpQuery.methodId();
+    if (method == Method::PublicTrades)
+        return true;
+    // delta depth is small and differs for every client
+    return method == Method::PublicDepth && !httpQuery.hasSince();
+}
+
+QByteArray ResponseCache::etag(const QueryParser& httpQuery)
+{
+    QByteArray tag = '"' + epoch;
+    for (const QString& pair: httpQuery.pairs())
+        tag += '-' + QByteArray::number(OrderBook::version(pair), 36);
+    tag += '"';
+    return tag;
+}
+
+ResponseCache::EntryPtr ResponseCache::find(const QByteArray& key, const QByteArray& etag)
+{
+    QReadLocker lock(&entriesAccess);
+    auto entry = entries.constFind(key);
+    if (entry == entries.constEnd() || entry.value()->etag != etag)
+        return EntryPtr();
+    return entry.value();
+}
+
+ResponseCache::EntryPtr ResponseCache::store(const QByteArray& key, const QByteArray& etag, const QByteArray& json)
+{
+    std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+    entry->etag = etag;
+    entry->json = json;
+    // compression is done outside of the lock, once per data version
+    if (json.size() >= MIN_COMPRESSED_SIZE)
+    {
+        entry->gzip = compress(json, Encoding::Gzip);
+        entry->deflate = compress(json, Encoding::Deflate);
+    }
+
+    QWriteLocker lock(&entriesAccess);
+    if (entries.size() >= MAX_CACHED_RESPONSES && !entries.contains(key))
+        entries.clear();
+    entries[key] = entry;
+    return entry;
+}
+
+QByteArray ResponseCache::compress(const QByteArray& data, Encoding encoding)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 15 is zlib format, which is what HTTP calls deflate, +16 is gzip
+    int windowBits = (encoding == Encoding::Gzip) ? 15 + 16 : 15;
+    if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return QByteArray();
+
+    QByteArray out;
+    out.resize(static_cast<int>(deflateBound(&stream, static_cast<uLong>(data.size()))));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.constData()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = reinterpret_cast<Bytef*>(out.data());
+    stream.avail_out = static_cast<uInt>(out.size());
+    int rc = deflate(&stream, Z_FINISH);
+    out.resize(static_cast<int>(stream.total_out));
+    deflateEnd(&stream);
+
+    if (rc != Z_STREAM_END)
+        return QByteArray();
+    return out;
+}
+
+ResponseCache::Encoding ResponseCache::encoding(const char* acceptEncoding, const Entry& entry)
+{
+    if (!acceptEncoding)
+        return Encoding::Identity;
+
+    bool gzip = false;
+    bool deflate = false;
+    for (const QByteArray& item: QByteArray(acceptEncoding).split(','))
+    {
+        QList<QByteArray> parts = item.split(';');
+        QByteArray name = parts.first().trimmed().toLower();
+        bool allowed = true;
+        for (int i = 1; i < parts.size(); i++)
+        {
+            QByteArray param = parts[i].trimmed();
+            if (param.startsWith("q=") && param.mid(2).toDouble() <= 0)
+                allowed = false;
+        }
+        if (name == "gzip" || name == "x-gzip")
+            gzip = allowed;
+        else if (name == "deflate")
+            deflate = allowed;
+    }
+
+    if (gzip && !entry.gzip.isEmpty())
+        return Encoding::Gzip;
+    if (deflate && !entry.deflate.isEmpty())
+        return Encoding::Deflate;
+    return Encoding::Identity;
+}
+
+const char* ResponseCache::encodingName(Encoding encoding)
+{
+    if (encoding == Encoding::Gzip)
+        return "gzip";
+    if (encoding == Encoding::Deflate)
+        return "deflate";
+    return "identity";
+}
+
+bool ResponseCache::matches(const char* ifNoneMatch, const QByteArray& etag)
+{
+    if (!ifNoneMatch)
+        return false;
+    for (QByteArray tag: QByteArray(ifNoneMatch).split(','))
+    {
+        tag = tag.trimmed();
+        if (tag == "*")
+            return true;
+        // weak comparison, as for GET
+        if (tag.startsWith("W/"))
+            tag = tag.mid(2);
+        if (tag == etag)
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,53 @@
+#ifndef RESPONSECACHE_H
+#define RESPONSECACHE_H
+
+#include "query_parser.h"
+
+#include <QByteArray>
+#include <QHash>
+#include <QReadWriteLock>
+
+#include <memory>
+
+/// Ready to send bodies of large public responses (depth and trades),
+/// kept with their gzip and deflate variants.
+/// Entry is valid while order book versions of requested pairs stay the same:
+/// every fill and every order change bumps them, so the version string is
+/// also used as ETag.
+class ResponseCache
+{
+public:
+    enum class Encoding {Identity, Gzip, Deflate};
+
+    struct Entry
+    {
+        QByteArray etag;
+        QByteArray json;
+        QByteArray gzip;
+        QByteArray deflate;
+
+        const QByteArray& body(Encoding encoding) const;
+    };
+    using EntryPtr = std::shared_ptr<const Entry>;
+
+    static bool isCacheable(const QueryParser& httpQuery);
+    /// taken before response is built, so cached body is never older than its tag
+    static QByteArray etag(const QueryParser& httpQuery);
+
+    static EntryPtr find(const QByteArray& key, const QByteArray& etag);
+    static EntryPtr store(const QByteArray& key, const QByteArray& etag, const QByteArray& json);
+
+    /// best encoding allowed by Accept-Encoding which entry has
+    static Encoding encoding(const char* acceptEncoding, const Entry& entry);
+    static const char* encodingName(Encoding encoding);
+    static bool matches(const char* ifNoneMatch, const QByteArray& etag);
+
+private:
+    static QByteArray compress(const QByteArray& data, Encoding encoding);
+
+    static QHash<QByteArray, EntryPtr> entries;
+    static QReadWriteLock entriesAccess;
+    static const QByteArray epoch;
+};
+
+#endif // RESPONSECACHE_H
@@ -0,0 +1,42 @@
+#include "shardconfig.h"
+
+quint32 ShardConfig::shardIndex = 0;
+quint32 ShardConfig::shardsCount = 1;
+QSet<PairName> ShardConfig::pairs;
+
+void ShardConfig::load(QSettings& settings)
+{
+    shardIndex = settings.value("shard/index", 0).toUInt();
+    shardsCount = qMax(1u, settings.value("shard/count", 1).toUInt());
+    pairs.clear();
+    // QSettings splits unquoted comma separated value into list itself
+    for (const QString& pair: settings.value("shard/pairs").toStringList())
+        if (!pair.trimmed().isEmpty())
+            pairs.insert(pair.trimmed());
+}
+
+bool ShardConfig::isSharded()
+{
+    return shardsCount > 1;
+}
+
+bool ShardConfig::owns(const PairName& pair)
+{
+    return pairs.isEmpty() || pairs.contains(pair);
+}
+
+quint32 ShardConfig::index()
+{
+    return shardIndex;
+}
+
+quint32 ShardConfig::count()
+{
+    return shardsCount;
+}
+
+quint32 ShardConfig::shardOfOrder(OrderId order_id, quint32 count)
+{
+    // auto_increment_offset is index + 1
+    return (order_id + count - 1) % count;
+}
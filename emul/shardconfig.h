@@ -0,0 +1,37 @@
+#ifndef SHARDCONFIG_H
+#define SHARDCONFIG_H
+
+#include "types.h"
+
+#include <QSet>
+#include <QSettings>
+
+/// Pair ownership of this emulator instance in sharded deployment.
+/// Every shard owns a subset of pairs and runs matching, order book and
+/// feed only for them, while all shards share one database schema: user
+/// deposits there are the balance service, a trade locks deposit row of
+/// the funds it spends (see reserveDepositVolume) till commit, so shards
+/// never overspend the same balance. Order ids are leased with step of
+/// shards count and offset of shard index (see IdAllocator), so router
+/// finds the shard of an order from its id alone.
+class ShardConfig
+{
+public:
+    /// [shard] index, count and comma separated pairs, empty pairs means all
+    static void load(QSettings& settings);
+
+    static bool isSharded();
+    static bool owns(const PairName& pair);
+    static quint32 index();
+    static quint32 count();
+
+    /// shard which allocated the order id
+    static quint32 shardOfOrder(OrderId order_id, quint32 count);
+
+private:
+    static quint32 shardIndex;
+    static quint32 shardsCount;
+    static QSet<PairName> pairs;
+};
+
+#endif // SHARDCONFIG_H
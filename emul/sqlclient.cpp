@@ -1,4 +1,7 @@
 #include "sqlclient.h"
+#include "engineclock.h"
+#include "metrics.h"
+#include "registry.h"
 #include "utils.h"
 #include <QCache>
 #include <QSqlQuery>
@@ -86,6 +89,31 @@ Amount DirectSqlDataAccessor::getDepositCurrencyVolume(const ApiKey& key, const
 
 }
 
+bool DirectSqlDataAccessor::reserveDepositVolume(UserId user_id, CurrencyId currency, const Amount& volume)
+{
+    QSqlQuery sql(db);
+    prepareSql(sql, "select volume from deposits where user_id=:user_id and currency_id=:currency_id for update");
+    QVariantMap params;
+    params[":user_id"] = user_id;
+    params[":currency_id"] = Registry::currencySqlId(currency);
+    if (performSql("lock :currency_id deposit of user :user_id", sql, params, true) && sql.next())
+        return Amount(sql.value(0).toString().toStdString()) >= volume;
+    return false;
+}
+
+Amount DirectSqlDataAccessor::depositVolume(UserId user_id, CurrencyId currency)
+{
+    // locking read: plain one could return snapshot older than own update
+    QSqlQuery sql(db);
+    prepareSql(sql, "select volume from deposits where user_id=:user_id and currency_id=:currency_id for update");
+    QVariantMap params;
+    params[":user_id"] = user_id;
+    params[":currency_id"] = Registry::currencySqlId(currency);
+    if (performSql("read :currency_id deposit of user :user_id", sql, params, true) && sql.next())
+        return Amount(sql.value(0).toString().toStdString());
+    return Amount(0);
+}
+
 Amount DirectSqlDataAccessor::getOrdersCurrencyVolume(const ApiKey &key, const QString &currency)
 {
     Q_UNUSED(key)
@@ -105,12 +133,70 @@ OrderInfo::List DirectSqlDataAccessor::negativeAmountOrders()
     return list;
 }
 
+Funds DirectSqlDataAccessor::exchangeFunds(const std::function<void()>& snapshotTaken)
+{
+    Funds total;
+    QSqlQuery sql(db);
+    sql.exec("START TRANSACTION WITH CONSISTENT SNAPSHOT");
+    snapshotTaken();
+    QString query = "SELECT cur, sum(vol) from ("
+                   "select c.currency as cur, sum(volume) as vol from deposits d left join currencies c on c.currency_id = d.currency_id group by d.currency_id  "
+                   " UNION "
+                   "select right(p.pair,3) as cur, sum(amount*rate) as vol  from orders o left join pairs p on p.pair_id = o.pair_id where status='active' and type='buy'  group by right(p.pair, 3) "
+                   " UNION "
+                   "select left(p.pair,3) as cur, sum(amount)      as vol  from orders o left join pairs p on p.pair_id = o.pair_id where status='active' and type='sell' group by  left(p.pair, 3)"
+                   ") A group by cur";
+    performSql("get deposits balance", sql, query, true);
+    sql.exec("COMMIT");
+
+    while(sql.next())
+        total[sql.value(0).toString()] += qstr2dec<7>(sql.value(1).toString());
+    return total;
+}
+
+void DirectSqlDataAccessor::allUsersFunds(QMap<UserId, Balances>& funds, QMap<UserId, OrderInfo::List>& orders)
+{
+    QSqlQuery sql(db);
+    performSql("load all deposits", sql, "select u.user_id, d.currency_id, d.volume from users u left join deposits d on d.user_id=u.user_id", true);
+    while (sql.next())
+    {
+        Balances& userFunds = funds[sql.value(0).toUInt()];
+        CurrencyId currency = sql.value(1).isNull() ? INVALID_CURRENCY : Registry::currencyOfSqlId(sql.value(1).toUInt());
+        if (currency != INVALID_CURRENCY)
+            userFunds[currency] = qstr2dec<7>(sql.value(2).toString());
+    }
+    performSql("load all active orders", sql, "select o.order_id, p.pair, o.type, o.start_amount, o.amount, o.rate, o.created, o.user_id from orders o "
+                                              "left join pairs p on p.pair_id = o.pair_id where o.status='active'", true);
+    while (sql.next())
+    {
+        OrderInfo::Ptr info = OrderInfo::create();
+        info->order_id = sql.value(0).toUInt();
+        info->pair = sql.value(1).toString();
+        info->type = (sql.value(2).toString() == "sell") ? OrderInfo::Type::Sell : OrderInfo::Type::Buy;
+        info->start_amount = qstr2dec<7>(sql.value(3).toString());
+        info->amount = qstr2dec<7>(sql.value(4).toString());
+        info->rate = qstr2dec<7>(sql.value(5).toString());
+        info->created = sql.value(6).toDateTime();
+        info->status = OrderInfo::Status::Active;
+        info->user_id = sql.value(7).toUInt();
+        orders[info->user_id].append(info);
+    }
+}
+
 void DirectSqlDataAccessor::updateTicker()
 {
     QSqlQuery sql1(db);
     QSqlQuery sql2(db);
 
-    prepareSql(sql1, "select max(o.rate) as high, min(o.rate) as low, avg(o.rate) as avg, sum(t.amount) as vol, sum(t.amount * o.rate) as vol_cur, p.pair  from trades t left join orders o on o.order_id=t.order_id left join pairs p on p.pair_id=o.pair_id where now()-t.created < 60 * 60 * 4  group by o.pair_id");
+    // archiver may have moved trades of finished orders already;
+    // window is measured by engine clock, not by SQL server one
+    QDateTime now = EngineClock::now();
+    prepareSql(sql1, "select max(o.rate) as high, min(o.rate) as low, avg(o.rate) as avg, sum(t.amount) as vol, sum(t.amount * o.rate) as vol_cur, p.pair from "
+                     "(select t.amount, o.rate, o.pair_id from trades t left join orders o on o.order_id=t.order_id where t.created > :since "
+                     " union all select t.amount, o.rate, o.pair_id from trades_history t left join orders_history o on o.order_id=t.order_id where t.created > :since_history) o "
+                     "left join pairs p on p.pair_id=o.pair_id group by o.pair_id");
+    sql1.bindValue(":since", now.addSecs(-60 * 60 * 4));
+    sql1.bindValue(":since_history", now.addSecs(-60 * 60 * 4));
     prepareSql(sql2, "update ticker t left join pairs p on p.pair_id=t.pair_id set high=:high, low=:low, avg=:avg, vol=:vol, vol_cur=:vol_cur, updated=:updated, last=avg, buy=avg, sell=avg where p.pair=:pair");
 
     if (sql1.exec())
@@ -124,7 +210,7 @@ void DirectSqlDataAccessor::updateTicker()
             params[":vol"] = sql1.value(3).toDouble();
             params[":vol_cur"] = sql1.value(4).toDouble();
             params[":pair"] = sql1.value(5).toString();
-            params[":updated"] = QDateTime::currentDateTime();
+            params[":updated"] = now;
 
             performSql("update ticker for pair ':pair'", sql2, params, true);
         }
@@ -139,7 +225,7 @@ bool DirectSqlDataAccessor::commit() { return db.commit();}
 bool DirectSqlDataAccessor::rollback() { return db.rollback(); }
 
 DirectSqlDataAccessor::DirectSqlDataAccessor(QSqlDatabase &db)
-    :db(db)
+    :db(db), ids(db)
 {
 }
 
@@ -156,7 +242,7 @@ PairInfo::List DirectSqlDataAccessor::allPairsInfoList()
     {
         while(sql.next())
         {
-            PairInfo::Ptr info (new PairInfo);
+            PairInfo::Ptr info = PairInfo::create();
             info->pair = sql.value(0).toString();
             info->decimal_places = sql.value(1).toInt();
             info->min_price = Rate(sql.value(2).toString().toStdString());
@@ -181,7 +267,7 @@ PairInfo::Ptr DirectSqlDataAccessor::pairInfo(const PairName& pair)
     params[":pair"] = pair;
     if (performSql("get pair :pair info", sql, params, true) && sql.next())
     {
-        PairInfo::Ptr info (new PairInfo());
+        PairInfo::Ptr info = PairInfo::create();
         info->min_price = Rate(sql.value(0).toString().toStdString());
         info->max_price = Rate(sql.value(1).toString().toStdString());
         info->min_amount = Rate(sql.value(2).toString().toStdString());
@@ -207,7 +293,7 @@ TickerInfo::Ptr DirectSqlDataAccessor::tickerInfo(const PairName& pairName)
     params[":name"] = pairName;
     if (performSql("get ticker for pair ':name'", sql, params, true) && sql.next())
     {
-        TickerInfo::Ptr info (new TickerInfo);
+        TickerInfo::Ptr info = TickerInfo::create();
 
         info->high = Rate(sql.value(0).toString().toStdString());
         info->low  = Rate(sql.value(1).toString().toStdString());
@@ -237,20 +323,27 @@ OrderInfo::Ptr DirectSqlDataAccessor::orderInfo(OrderId order_id)
     prepareSql(sql, "select p.pair, o.type, o.start_amount, o.amount, o.rate, o.created, o.status+0, o.user_id from orders o left join pairs p on p.pair_id = o.pair_id where o.order_id=:order_id");
     QVariantMap params;
     params[":order_id"] = order_id;
-    if (performSql("get info for order :order_id", sql, params, true) && sql.next())
+    bool found = performSql("get info for order :order_id", sql, params, true) && sql.next();
+    if (!found)
+    {
+        // finished orders are archived
+        prepareSql(sql, "select p.pair, o.type, o.start_amount, o.amount, o.rate, o.created, o.status+0, o.user_id from orders_history o left join pairs p on p.pair_id = o.pair_id where o.order_id=:order_id");
+        found = performSql("get archived info for order :order_id", sql, params, true) && sql.next();
+    }
+    if (found)
     {
-        OrderInfo::Ptr* info = new OrderInfo::Ptr(new OrderInfo);
-        (*info)->pair = sql.value(0).toString();
-        (*info)->type = (sql.value(1).toString() == "sell")?OrderInfo::Type::Sell : OrderInfo::Type::Buy;
-        (*info)->start_amount = Amount(sql.value(2).toString().toStdString());
-        (*info)->amount = Amount(sql.value(3).toString().toStdString());
-        (*info)->rate = Rate(sql.value(4).toString().toStdString());
-        (*info)->created = sql.value(5).toDateTime();
-        (*info)->status = static_cast<OrderInfo::Status>(sql.value(6).toInt());
-        (*info)->user_id = sql.value(7).toUInt();
-        (*info)->order_id = order_id;
+        OrderInfo::Ptr info = OrderInfo::create();
+        info->pair = sql.value(0).toString();
+        info->type = (sql.value(1).toString() == "sell")?OrderInfo::Type::Sell : OrderInfo::Type::Buy;
+        info->start_amount = Amount(sql.value(2).toString().toStdString());
+        info->amount = Amount(sql.value(3).toString().toStdString());
+        info->rate = Rate(sql.value(4).toString().toStdString());
+        info->created = sql.value(5).toDateTime();
+        info->status = static_cast<OrderInfo::Status>(sql.value(6).toInt());
+        info->user_id = sql.value(7).toUInt();
+        info->order_id = order_id;
 
-        return *info;
+        return info;
     }
     else
         return nullptr;
@@ -267,9 +360,8 @@ OrderInfo::List DirectSqlDataAccessor::activeOrdersInfoList(const QString &apike
         while(sql.next())
         {
             OrderId order_id = sql.value(0).toUInt();
-            OrderInfo::Ptr info (new OrderInfo);
+            OrderInfo::Ptr info = OrderInfo::create();
             info->pair = sql.value(1).toString();
-            //info->pair_ptr = pairInfo(pair);
             info->type = (sql.value(2).toString() == "sell")?OrderInfo::Type::Sell : OrderInfo::Type::Buy;
             info->start_amount = Amount(sql.value(3).toString().toStdString());
             info->amount = Amount(sql.value(4).toString().toStdString());
@@ -288,13 +380,15 @@ TradeInfo::List DirectSqlDataAccessor::allTradesInfo(const PairName &pair)
 {
     QSqlQuery sql(db);
     TradeInfo::List list;
-    prepareSql(sql, "select o.type, o.rate, t.amount, t.trade_id, t.created, t.order_id, t.user_id from trades t left join orders o on o.order_id=t.order_id left join pairs p on o.pair_id=p.pair_id where p.pair=:pair  order by t.trade_id desc");
+    prepareSql(sql, "select o.type, o.rate, t.amount, t.trade_id, t.created, t.order_id, t.user_id from trades t left join orders o on o.order_id=t.order_id left join pairs p on o.pair_id=p.pair_id where p.pair=:pair "
+                    "union all select o.type, o.rate, t.amount, t.trade_id, t.created, t.order_id, t.user_id from trades_history t left join orders_history o on o.order_id=t.order_id left join pairs p on o.pair_id=p.pair_id where p.pair=:pair "
+                    "order by trade_id desc");
     QVariantMap params;
     params[":pair"] = pair;
     performSql("get all trades for pair ':pair'", sql, params, true);
     while (sql.next())
     {
-        TradeInfo::Ptr info (new TradeInfo);
+        TradeInfo::Ptr info = TradeInfo::create();
         if (sql.value(0).toString() == "buy")
             info->type = TradeInfo::Type::Bid;
         else if (sql.value(0).toString() == "sell")
@@ -311,6 +405,54 @@ TradeInfo::List DirectSqlDataAccessor::allTradesInfo(const PairName &pair)
     return list;
 }
 
+UserTradeInfo::List DirectSqlDataAccessor::userTradesInfo(UserId user_id, const PairName& pair, const HistoryPage& page)
+{
+    // each part reads user_trades or user_orders index of its table, archived
+    // trades have their orders archived too
+    static const QString takerPart = "select t.trade_id, p.pair, o.type, o.rate, t.amount, t.order_id, 0, t.created from %1 t "
+                                     "join %2 o on o.order_id=t.order_id join pairs p on p.pair_id=o.pair_id "
+                                     "where t.user_id=:user_id and t.trade_id between :from_id and :end_id and t.created between :since and :end and (:pair='' or p.pair=:pair)";
+    static const QString makerPart = "select t.trade_id, p.pair, o.type, o.rate, t.amount, t.order_id, 1, t.created from %2 o "
+                                     "join %1 t on t.order_id=o.order_id join pairs p on p.pair_id=o.pair_id "
+                                     "where o.user_id=:user_id and t.trade_id between :from_id and :end_id and t.created between :since and :end and (:pair='' or p.pair=:pair)";
+    // every part stops at the end of the page in its own trade_id order, so
+    // only that many rows of each are merged, not the whole history
+    QString direction = page.desc ? "desc" : "asc";
+    QString partPage = QString(" order by t.trade_id %1 limit %2").arg(direction).arg(static_cast<quint64>(page.from) + page.count);
+    QSqlQuery sql(db);
+    UserTradeInfo::List list;
+    prepareSql(sql, QString("(%1) union all (%2) union all (%3) union all (%4) order by trade_id %5 limit %6, %7")
+                    .arg(takerPart.arg("trades", "orders") + partPage, makerPart.arg("trades", "orders") + partPage)
+                    .arg(takerPart.arg("trades_history", "orders_history") + partPage, makerPart.arg("trades_history", "orders_history") + partPage)
+                    .arg(direction).arg(page.from).arg(page.count));
+    QVariantMap params;
+    params[":user_id"] = user_id;
+    params[":from_id"] = page.from_id;
+    params[":end_id"] = page.end_id;
+    params[":since"] = page.since.isValid() ? page.since : QDateTime::fromTime_t(0);
+    params[":end"] = page.end.isValid() ? page.end : QDateTime::fromTime_t(std::numeric_limits<qint32>::max());
+    params[":pair"] = pair;
+    performSql("get trades of user :user_id", sql, params, true);
+    while (sql.next())
+    {
+        UserTradeInfo::Ptr info = UserTradeInfo::create();
+        info->tid = sql.value(0).toUInt();
+        info->pair = sql.value(1).toString();
+        OrderInfo::Type orderType = (sql.value(2).toString() == "sell") ? OrderInfo::Type::Sell : OrderInfo::Type::Buy;
+        info->is_your_order = sql.value(6).toBool();
+        if (info->is_your_order)
+            info->type = orderType;
+        else
+            info->type = (orderType == OrderInfo::Type::Sell) ? OrderInfo::Type::Buy : OrderInfo::Type::Sell;
+        info->rate = Rate(sql.value(3).toString().toStdString());
+        info->amount = Amount(sql.value(4).toString().toStdString());
+        info->order_id = sql.value(5).toUInt();
+        info->created = sql.value(7).toDateTime();
+        list.append(info);
+    }
+    return list;
+}
+
 ApikeyInfo::Ptr DirectSqlDataAccessor::apikeyInfo(const ApiKey &apikey)
 {
     QSqlQuery sql(db);
@@ -319,7 +461,7 @@ ApikeyInfo::Ptr DirectSqlDataAccessor::apikeyInfo(const ApiKey &apikey)
     prepareSql(sql, "select info, trade, withdraw, user_id, secret, nonce from apikeys where apikey=:key");
     if ( performSql("get info for key ':key'", sql, params, true) && sql.next())
     {
-        ApikeyInfo::Ptr info (new ApikeyInfo);
+        ApikeyInfo::Ptr info = ApikeyInfo::create();
         info->apikey = apikey;
         info->info = sql.value(0).toBool();
         info->trade = sql.value(1).toBool();
@@ -336,17 +478,19 @@ ApikeyInfo::Ptr DirectSqlDataAccessor::apikeyInfo(const ApiKey &apikey)
 UserInfo::Ptr DirectSqlDataAccessor::userInfo(UserId user_id)
 {
     QSqlQuery sql(db);
-    prepareSql(sql, "select c.currency, d.volume, u.name from deposits d left join currencies c on c.currency_id=d.currency_id left join users u on u.user_id=d.user_id where u.user_id=:user_id");
+    prepareSql(sql, "select d.currency_id, d.volume, u.name from deposits d left join users u on u.user_id=d.user_id where u.user_id=:user_id");
     QVariantMap params;
     params[":user_id"] = user_id;
     if (performSql("get user name and deposits for user id ':user_id'", sql, params, true))
     {
-        UserInfo::Ptr info (new UserInfo);
+        UserInfo::Ptr info = UserInfo::create();
         info->user_id = user_id;
         while(sql.next())
         {
             info->name = sql.value(2).toString();
-            info->funds.insert(sql.value(0).toString(), Amount(sql.value(1).toString().toStdString()));
+            CurrencyId currency = Registry::currencyOfSqlId(sql.value(0).toUInt());
+            if (currency != INVALID_CURRENCY)
+                info->funds[currency] = Amount(sql.value(1).toString().toStdString());
         }
         return info;
     }
@@ -378,23 +522,23 @@ QMap<PairName, BuySellDepth> DirectSqlDataAccessor::allActiveOrdersAmountAgregga
     return map;
 }
 
-bool DirectSqlDataAccessor::tradeUpdateDeposit(const UserId &user_id, const QString &currency, const Amount& diff, const QString &userName)
+bool DirectSqlDataAccessor::tradeUpdateDeposit(const UserId &user_id, CurrencyId currency, const Amount& diff, const QString &userName)
 {
     QSqlQuery sql(db);
-    prepareSql(sql, "update deposits d left join currencies c on c.currency_id=d.currency_id set d.volume = volume + :diff where user_id=:user_id and c.currency=:currency");
+    prepareSql(sql, "update deposits set volume = volume + :diff where user_id=:user_id and currency_id=:currency_id");
     QVariantMap updateDepParams;
     updateDepParams[":user_id"] = user_id;
-    updateDepParams[":currency"] = currency;
+    updateDepParams[":currency_id"] = Registry::currencySqlId(currency);
     updateDepParams[":diff"] = dec2qstr(diff, 7);
     bool ok;
-    ok = performSql("update ':currency' amount by :diff for user :user_id", sql, updateDepParams, true);
+    ok = performSql("update :currency_id amount by :diff for user :user_id", sql, updateDepParams, true);
     if (ok)
     {
 //        std::clog << "\t\t" << QString("%1: %2 %3 %4")
 //                     .arg(userName)
 //                     .arg((diff.sign() == -1)?"lost":"recieved")
 //                     .arg(QString::number(qAbs(diff.getAsDouble()), 'f', 6))
-//                     .arg(currency.toUpper())
+//                     .arg(Registry::currencyName(currency).toUpper())
 //                  << std::endl;
     }
     return ok;
@@ -428,42 +572,84 @@ bool DirectSqlDataAccessor::closeOrder(OrderId order_id)
     return true;
 }
 
-bool DirectSqlDataAccessor::createNewTradeRecord(UserId user_id, OrderId order_id, const Amount &amount)
+bool DirectSqlDataAccessor::cancelOrder(OrderId order_id)
 {
     QSqlQuery sql(db);
-    prepareSql(sql, "insert into trades (user_id, order_id, amount, created) values (:user_id, :order_id, :amount, :created)");
+    prepareSql(sql, "update orders set status=case when start_amount=amount then 'cancelled' else 'part_done' end where order_id=:order_id");
     QVariantMap params;
+    params[":order_id"] = order_id;
+    return performSql("cancel order :order_id", sql, params, true);
+}
+
+OrderInfo::List DirectSqlDataAccessor::matchingOrders(const PairName& pair, OrderInfo::Type type, const Rate& rate, UserId user_id)
+{
+    QSqlQuery sql(db);
+    if (type == OrderInfo::Type::Buy)
+        prepareSql(sql, "select order_id, amount, rate, o.user_id from orders o left join pairs p on p.pair_id = o.pair_id where type='sell' and status='active' and pair=:pair and o.user_id<>:user_id and rate <= :rate order by rate asc, order_id asc");
+    else
+        prepareSql(sql, "select order_id, amount, rate, o.user_id from orders o left join pairs p on p.pair_id = o.pair_id where type='buy'  and status='active' and pair=:pair and o.user_id<>:user_id and rate >= :rate order by rate desc, order_id asc");
+    QVariantMap params;
+    params[":pair"] = pair;
+    params[":user_id"] = user_id;
+    params[":rate"] = QString::fromStdString(DEC_NAMESPACE::toString(rate));
+    performSql(QString("get %1 orders").arg((type == OrderInfo::Type::Buy) ? "sell" : "buy"), sql, params, true);
+
+    OrderInfo::List list;
+    while (sql.next())
+    {
+        OrderInfo::Ptr info = OrderInfo::create();
+        info->order_id = sql.value(0).toUInt();
+        info->amount = qvar2dec<7>(sql.value(1));
+        info->rate = qvar2dec<7>(sql.value(2));
+        info->user_id = sql.value(3).toUInt();
+        info->pair = pair;
+        info->type = (type == OrderInfo::Type::Buy) ? OrderInfo::Type::Sell : OrderInfo::Type::Buy;
+        info->status = OrderInfo::Status::Active;
+        list.append(info);
+    }
+    return list;
+}
+
+TradeId DirectSqlDataAccessor::createNewTradeRecord(UserId user_id, OrderId order_id, const Amount &amount)
+{
+    QSqlQuery sql(db);
+    prepareSql(sql, "insert into trades (trade_id, user_id, order_id, amount, created) values (:trade_id, :user_id, :order_id, :amount, :created)");
+    TradeId trade_id = ids.nextTradeId();
+    QVariantMap params;
+    params[":trade_id"] = trade_id;
     params[":user_id"] = user_id;
     params[":order_id"] = order_id;
-    params[":created"] = QDateTime::currentDateTime();
+    params[":created"] = EngineClock::now();
     params[":amount"] = dec2qstr(amount, 7);
     if (amount < Amount(0))
     {
         throw 1;
     }
     performSql("create new trade for user :user_id", sql, params, true);
-    return true;
+    return trade_id;
 
 }
 
 OrderId DirectSqlDataAccessor::createNewOrderRecord(const PairName &pair, const UserId &user_id, OrderInfo::Type type, const Rate& rate, const Amount& start_amount)
 {
     QSqlQuery sql(db);
+    OrderId order_id = ids.nextOrderId();
     QVariantMap params;
+    params[":order_id"] = order_id;
     params[":pair_id"]  = pairInfo(pair)->pair_id;
     params[":user_id"]  = user_id;
     params[":type"]     = (type == OrderInfo::Type::Buy)?"buy":"sell";
     params[":rate"]     = dec2qstr(rate, pairInfo(pair)->decimal_places);
     params[":start_amount"] = dec2qstr(start_amount, 7);
-    params[":created"] = QDateTime::currentDateTime();
-    if (!prepareSql(sql, "insert into orders (pair_id, user_id, type, rate, start_amount, amount, created, status) values (:pair_id, :user_id, :type, :rate, :start_amount, :start_amount, :created, 'active')"))
+    params[":created"] = EngineClock::now();
+    if (!prepareSql(sql, "insert into orders (order_id, pair_id, user_id, type, rate, start_amount, amount, created, status) values (:order_id, :pair_id, :user_id, :type, :rate, :start_amount, :start_amount, :created, 'active')"))
         return static_cast<OrderId>(-1);
     if (!performSql("create new ':pair' order for user :user_id as :amount @ :rate", sql, params, true ))
         return static_cast<OrderId>(-1);
 
 //    std:: << "new " << ((type == OrderInfo::Type::Buy)?"buy":"sell") << " order for " << start_amount << " @ " << rate << " created" << std::endl;
 
-    return sql.lastInsertId().toUInt();
+    return order_id;
 }
 
 
@@ -509,6 +695,7 @@ PairInfo::Ptr LocalCachesSqlDataAccessor::pairInfo(const PairName& pair)
 {
     QMutexLocker rlock(&LocalCachesSqlDataAccessor::pairInfoCacheRWAccess);
     auto p = LocalCachesSqlDataAccessor::pairInfoCache.find(pair);
+    Metrics::cacheLookup(Metrics::Cache::LocalCaches, p != LocalCachesSqlDataAccessor::pairInfoCache.end());
     if (p != LocalCachesSqlDataAccessor::pairInfoCache.end())
         return p.value();
 
@@ -522,8 +709,10 @@ TickerInfo::Ptr LocalCachesSqlDataAccessor::tickerInfo(const PairName& pair)
 {
     QMutexLocker lock(&LocalCachesSqlDataAccessor::tickerInfoCacheRWAccess);
     auto p = LocalCachesSqlDataAccessor::tickerInfoCache.find(pair);
-    if (     p != LocalCachesSqlDataAccessor::tickerInfoCache.end()
-          && p.value()->updated.secsTo(QDateTime::currentDateTime())  > TICKER_CACHE_EXPIRE_SECONDS)
+    bool hit =  p != LocalCachesSqlDataAccessor::tickerInfoCache.end()
+             && p.value()->updated.secsTo(EngineClock::now())  > TICKER_CACHE_EXPIRE_SECONDS;
+    Metrics::cacheLookup(Metrics::Cache::LocalCaches, hit);
+    if (hit)
         return p.value();
 
     TickerInfo::Ptr info = DirectSqlDataAccessor::tickerInfo(pair);
@@ -537,6 +726,7 @@ OrderInfo::Ptr LocalCachesSqlDataAccessor::orderInfo(OrderId order_id)
     OrderInfo::Ptr* pinfo = nullptr;
     QMutexLocker lock(&LocalCachesSqlDataAccessor::orderInfoCacheRWAccess);
     pinfo = LocalCachesSqlDataAccessor::orderInfoCache.object(order_id);
+    Metrics::cacheLookup(Metrics::Cache::LocalCaches, pinfo != nullptr);
     if (pinfo)
         return *pinfo;
 
@@ -550,6 +740,7 @@ ApikeyInfo::Ptr LocalCachesSqlDataAccessor::apikeyInfo(const ApiKey& apikey)
 {
     QMutexLocker lock(&LocalCachesSqlDataAccessor::apikeyInfoCacheRWAccess);
     ApikeyInfo::Ptr* info = LocalCachesSqlDataAccessor::apikeyInfoCache.object(apikey);
+    Metrics::cacheLookup(Metrics::Cache::LocalCaches, info != nullptr);
     if (info)
         return *info;
 
@@ -564,6 +755,7 @@ UserInfo::Ptr LocalCachesSqlDataAccessor::userInfo(UserId user_id)
 {
     QMutexLocker rlock(&LocalCachesSqlDataAccessor::userInfoCacheRWAccess);
     UserInfo::Ptr* info = LocalCachesSqlDataAccessor::userInfoCache.object(user_id);
+    Metrics::cacheLookup(Metrics::Cache::LocalCaches, info != nullptr);
     if (info)
         return *info;
 
@@ -573,21 +765,16 @@ UserInfo::Ptr LocalCachesSqlDataAccessor::userInfo(UserId user_id)
     return *info;
 }
 
-bool LocalCachesSqlDataAccessor::tradeUpdateDeposit(const UserId& user_id, const QString& currency, const Amount& diff, const QString& userName)
+bool LocalCachesSqlDataAccessor::tradeUpdateDeposit(const UserId& user_id, CurrencyId currency, const Amount& diff, const QString& userName)
 {
     bool ok = DirectSqlDataAccessor::tradeUpdateDeposit(user_id, currency, diff, userName);
     if (ok)
     {
-        UserInfo::Ptr* info = nullptr;
-        {
-            QMutexLocker lock(&LocalCachesSqlDataAccessor::userInfoCacheRWAccess);
-            info = LocalCachesSqlDataAccessor::userInfoCache.object(user_id);
-        }
+        // cached entries carry no lock, cache one guards their updates
+        QMutexLocker lock(&LocalCachesSqlDataAccessor::userInfoCacheRWAccess);
+        UserInfo::Ptr* info = LocalCachesSqlDataAccessor::userInfoCache.object(user_id);
         if (info)
-        {
-            QMutexLocker lock(&(*info)->updateAccess);
             (*info)->funds[currency] += diff;
-        }
     }
     return ok;
 }
@@ -597,16 +784,10 @@ bool LocalCachesSqlDataAccessor::reduceOrderAmount(OrderId order_id, const Amoun
     bool ok = DirectSqlDataAccessor::reduceOrderAmount(order_id, amount);
     if (ok)
     {
-        OrderInfo::Ptr* info = nullptr;
-        {
-            QMutexLocker lock(&LocalCachesSqlDataAccessor::orderInfoCacheRWAccess);
-            info = LocalCachesSqlDataAccessor::orderInfoCache.object(order_id);
-        }
+        QMutexLocker lock(&LocalCachesSqlDataAccessor::orderInfoCacheRWAccess);
+        OrderInfo::Ptr* info = LocalCachesSqlDataAccessor::orderInfoCache.object(order_id);
         if (info)
-        {
-            QMutexLocker lock(&(*info)->updateAccess);
             (*info)->amount -= amount;
-        }
     }
     return ok;
 }
@@ -622,12 +803,23 @@ bool LocalCachesSqlDataAccessor::closeOrder(OrderId order_id)
     return ok;
 }
 
+bool LocalCachesSqlDataAccessor::cancelOrder(OrderId order_id)
+{
+    bool ok = DirectSqlDataAccessor::cancelOrder(order_id);
+    if (ok)
+    {
+        QMutexLocker lock(&LocalCachesSqlDataAccessor::orderInfoCacheRWAccess);
+        LocalCachesSqlDataAccessor::orderInfoCache.remove(order_id);
+    }
+    return ok;
+}
+
 OrderId LocalCachesSqlDataAccessor::createNewOrderRecord(const PairName& pair, const UserId& user_id, OrderInfo::Type type, const Rate& rate, const Amount& start_amount)
 {
     OrderId id = DirectSqlDataAccessor::createNewOrderRecord(pair, user_id, type, rate, start_amount);
     if (id)
     {
-        OrderInfo::Ptr* pinfo = new OrderInfo::Ptr(new OrderInfo);
+        OrderInfo::Ptr* pinfo = new OrderInfo::Ptr(OrderInfo::create());
         (*pinfo)->pair = pair;
         (*pinfo)->user_id = user_id;
         (*pinfo)->type = type;
@@ -635,7 +827,7 @@ OrderId LocalCachesSqlDataAccessor::createNewOrderRecord(const PairName& pair, c
         (*pinfo)->start_amount = start_amount;
         (*pinfo)->amount = start_amount;
         (*pinfo)->order_id = id;
-        (*pinfo)->created = QDateTime::currentDateTime();
+        (*pinfo)->created = EngineClock::now();
         (*pinfo)->status = OrderInfo::Status::Active;
 
         QMutexLocker lock(&LocalCachesSqlDataAccessor::orderInfoCacheRWAccess);
@@ -649,16 +841,10 @@ bool LocalCachesSqlDataAccessor::updateNonce(const ApiKey& key, quint32 nonce)
     bool ok  = DirectSqlDataAccessor::updateNonce(key, nonce);
     if (ok)
     {
-        ApikeyInfo::Ptr* info = nullptr;
-        {
-            QMutexLocker lock(&LocalCachesSqlDataAccessor::apikeyInfoCacheRWAccess);
-            info = LocalCachesSqlDataAccessor::apikeyInfoCache.object(key);
-        }
+        QMutexLocker lock(&LocalCachesSqlDataAccessor::apikeyInfoCacheRWAccess);
+        ApikeyInfo::Ptr* info = LocalCachesSqlDataAccessor::apikeyInfoCache.object(key);
         if (info)
-        {
-            QMutexLocker lock(&(*info)->updateAccess);
             (*info)->nonce = nonce;
-        }
     }
     return ok;
 }
@@ -1,11 +1,13 @@
 #ifndef SQLCLIENT_H
 #define SQLCLIENT_H
 
+#include "idallocator.h"
 #include "types.h"
 
 #include <QtCore/qglobal.h>
 #include <QMutex>
 
+#include <functional>
 #include <memory>
 
 class QSqlDatabase;
@@ -19,15 +21,28 @@ public:
     virtual OrderInfo::Ptr   orderInfo(OrderId order_id) =0;
     virtual OrderInfo::List  activeOrdersInfoList(const QString& apikey) =0;
     virtual TradeInfo::List  allTradesInfo(const PairName& pair) =0;
+    /// trades where user took an order or owned the matched one, of pair
+    /// or of all pairs if it is empty, paged by trade id and time
+    virtual UserTradeInfo::List userTradesInfo(UserId user_id, const PairName& pair, const HistoryPage& page) =0;
     virtual ApikeyInfo::Ptr  apikeyInfo(const ApiKey& apikey) =0;
     virtual UserInfo::Ptr    userInfo(UserId user_id) =0;
 
     virtual QMap<PairName, BuySellDepth> allActiveOrdersAmountAgreggatedByRateList(const QList<PairName>& pairs) =0;
-    virtual bool tradeUpdateDeposit(const UserId &user_id, const QString& currency, const Amount &diff, const QString& userName) =0;
+    virtual bool tradeUpdateDeposit(const UserId &user_id, CurrencyId currency, const Amount &diff, const QString& userName) =0;
     virtual bool reduceOrderAmount(OrderId, const Amount& amount) =0;
     virtual bool closeOrder(OrderId order_id) =0;
-    virtual bool createNewTradeRecord(UserId user_id, OrderId order_id, const Amount& amount) =0;
+    /// marks active order cancelled, or partially done if it was filled in part
+    virtual bool cancelOrder(OrderId order_id) =0;
+    /// active orders of other users which an order of type at rate meets,
+    /// in order of matching: best rate first, then oldest
+    virtual OrderInfo::List matchingOrders(const PairName& pair, OrderInfo::Type type, const Rate& rate, UserId user_id) =0;
+    /// id of the new trade
+    virtual TradeId createNewTradeRecord(UserId user_id, OrderId order_id, const Amount& amount) =0;
     virtual OrderId createNewOrderRecord(const PairName& pair, const UserId& user_id, OrderInfo::Type type, const Rate& rate, const Amount& start_amount) =0;
+    /// locks deposit row till the end of transaction, false if it has less than volume
+    virtual bool reserveDepositVolume(UserId user_id, CurrencyId currency, const Amount& volume) =0;
+    /// deposit as stored, bypassing caches, also inside transaction changing it
+    virtual Amount depositVolume(UserId user_id, CurrencyId currency) =0;
 
     virtual QByteArray randomKeyWithPermissions(bool info, bool trade, bool withdraw) =0;
     virtual QByteArray randomKeyForTrade(const QString& currency, const Amount& amount) =0;
@@ -40,6 +55,12 @@ public:
     virtual Amount  getOrdersCurrencyVolume(const ApiKey& key, const QString& currency) =0;
 
     virtual OrderInfo::List negativeAmountOrders() = 0;
+    /// deposits of all users and volumes reserved by active orders by
+    /// currency, read from one state; snapshotTaken is called as soon as
+    /// later commits cannot change the result
+    virtual Funds exchangeFunds(const std::function<void()>& snapshotTaken) =0;
+    /// funds of every user, also of users without deposits, and active orders by owner
+    virtual void allUsersFunds(QMap<UserId, Balances>& funds, QMap<UserId, OrderInfo::List>& orders) =0;
 
     virtual void updateTicker() = 0;
 
@@ -51,6 +72,7 @@ public:
 class DirectSqlDataAccessor : public AbstractDataAccessor
 {
     QSqlDatabase& db;
+    IdAllocator ids;
 public :
     DirectSqlDataAccessor(QSqlDatabase& db);
     virtual ~DirectSqlDataAccessor();
@@ -61,15 +83,20 @@ public :
     OrderInfo::Ptr   orderInfo(OrderId order_id) override;
     OrderInfo::List  activeOrdersInfoList(const QString& apikey) override;
     TradeInfo::List  allTradesInfo(const PairName& pair) override;
+    UserTradeInfo::List userTradesInfo(UserId user_id, const PairName& pair, const HistoryPage& page) override;
     ApikeyInfo::Ptr  apikeyInfo(const ApiKey& apikey) override;
     UserInfo::Ptr    userInfo(UserId user_id) override;
 
     QMap<PairName, BuySellDepth> allActiveOrdersAmountAgreggatedByRateList(const QList<PairName>& pairs) override;
-    bool tradeUpdateDeposit(const UserId &user_id, const QString& currency, const Amount& diff, const QString& userName) override;
+    bool tradeUpdateDeposit(const UserId &user_id, CurrencyId currency, const Amount& diff, const QString& userName) override;
     bool reduceOrderAmount(OrderId order_id, const Amount& amount) override;
     bool closeOrder(OrderId order_id) override;
-    bool createNewTradeRecord(UserId user_id, OrderId order_id, const Amount& amount) override;
+    bool cancelOrder(OrderId order_id) override;
+    OrderInfo::List matchingOrders(const PairName& pair, OrderInfo::Type type, const Rate& rate, UserId user_id) override;
+    TradeId createNewTradeRecord(UserId user_id, OrderId order_id, const Amount& amount) override;
     OrderId createNewOrderRecord(const PairName& pair, const UserId& user_id, OrderInfo::Type type, const Rate& rate, const Amount& start_amount) override;
+    bool reserveDepositVolume(UserId user_id, CurrencyId currency, const Amount& volume) override;
+    Amount depositVolume(UserId user_id, CurrencyId currency) override;
 
     virtual QByteArray randomKeyWithPermissions(bool info, bool trade, bool withdraw) override;
     virtual QByteArray randomKeyForTrade(const QString& currency, const Amount& amount) override;
@@ -81,6 +108,8 @@ public :
     virtual Amount  getOrdersCurrencyVolume(const ApiKey& key, const QString& currency) override;
 
     virtual OrderInfo::List negativeAmountOrders() override;
+    virtual Funds exchangeFunds(const std::function<void()>& snapshotTaken) override;
+    virtual void allUsersFunds(QMap<UserId, Balances>& funds, QMap<UserId, OrderInfo::List>& orders) override;
 
     virtual void updateTicker() override;
 
@@ -116,9 +145,10 @@ public :
     ApikeyInfo::Ptr  apikeyInfo(const ApiKey& apikey) override;
     UserInfo::Ptr    userInfo(UserId user_id) override;
 
-    bool tradeUpdateDeposit(const UserId &user_id, const QString& currency, const Amount& diff, const QString& userName) override;
+    bool tradeUpdateDeposit(const UserId &user_id, CurrencyId currency, const Amount& diff, const QString& userName) override;
     bool reduceOrderAmount(OrderId order_id, const Amount& amount) override;
     bool closeOrder(OrderId order_id) override;
+    bool cancelOrder(OrderId order_id) override;
     OrderId createNewOrderRecord(const PairName& pair, const UserId& user_id, OrderInfo::Type type, const Rate& rate, const Amount& start_amount) override;
 
     virtual bool       updateNonce(const ApiKey& key, quint32 nonce) override;
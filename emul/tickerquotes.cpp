@@ -0,0 +1,113 @@
+#include "tickerquotes.h"
+
+std::atomic<const TickerQuotes::Slots*> TickerQuotes::current {new TickerQuotes::Slots};
+QMutex TickerQuotes::slotsCreateAccess;
+
+TickerQuotes::Slot* TickerQuotes::slot(const PairName& pair)
+{
+    Slot* s = current.load(std::memory_order_acquire)->value(pair, nullptr);
+    if (s)
+        return s;
+
+    QMutexLocker lock(&slotsCreateAccess);
+    const Slots* old = current.load(std::memory_order_acquire);
+    s = old->value(pair, nullptr);
+    if (s)
+        return s;
+
+    // readers may still use old map, so it is never deleted;
+    // it happens once per pair only
+    Slots* updated = new Slots(*old);
+    s = new Slot;
+    updated->insert(pair, s);
+    current.store(updated, std::memory_order_release);
+    return s;
+}
+
+void TickerQuotes::write(Slot* s, qint64 last, qint64 buy, qint64 sell, qint64 updated)
+{
+    while (s->writer.test_and_set(std::memory_order_acquire))
+        ;
+
+    quint32 seq = s->sequence.load(std::memory_order_relaxed);
+    s->sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // negative value keeps the field as it is
+    s->last.store(last, std::memory_order_relaxed);
+    if (buy >= 0)
+        s->buy.store(buy, std::memory_order_relaxed);
+    if (sell >= 0)
+        s->sell.store(sell, std::memory_order_relaxed);
+    s->updated.store(updated, std::memory_order_relaxed);
+
+    s->sequence.store(seq + 2, std::memory_order_release);
+    s->writer.clear(std::memory_order_release);
+}
+
+void TickerQuotes::publish(const PairName& pair, OrderInfo::Type type, const Rate& rate, const QDateTime& updated)
+{
+    qint64 value = rate.getUnbiased();
+    if (type == OrderInfo::Type::Buy)
+        write(slot(pair), value, value, -1, updated.toMSecsSinceEpoch());
+    else
+        write(slot(pair), value, -1, value, updated.toMSecsSinceEpoch());
+}
+
+bool TickerQuotes::quote(const PairName& pair, Quote& quote)
+{
+    Slot* s = current.load(std::memory_order_acquire)->value(pair, nullptr);
+    if (!s)
+        return false;
+
+    quint32 before, after;
+    qint64 last, buy, sell, updated;
+    do
+    {
+        before = s->sequence.load(std::memory_order_acquire);
+        last = s->last.load(std::memory_order_relaxed);
+        buy = s->buy.load(std::memory_order_relaxed);
+        sell = s->sell.load(std::memory_order_relaxed);
+        updated = s->updated.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = s->sequence.load(std::memory_order_relaxed);
+    } while (before != after || (before & 1));
+
+    if (before == 0)
+        return false;
+
+    quote.last.setUnbiased(last);
+    quote.buy.setUnbiased(buy);
+    quote.sell.setUnbiased(sell);
+    quote.updated = QDateTime::fromMSecsSinceEpoch(updated);
+    return true;
+}
+
+void TickerQuotes::save(QDataStream& stream)
+{
+    const Slots* all = current.load(std::memory_order_acquire);
+    QMap<PairName, Quote> quotes;
+    for (auto s = all->constBegin(); s != all->constEnd(); s++)
+    {
+        Quote q;
+        if (quote(s.key(), q))
+            quotes.insert(s.key(), q);
+    }
+
+    stream << static_cast<quint32>(quotes.size());
+    for (auto q = quotes.constBegin(); q != quotes.constEnd(); q++)
+        stream << q.key() << q->last << q->buy << q->sell << q->updated;
+}
+
+void TickerQuotes::restore(QDataStream& stream)
+{
+    quint32 count;
+    stream >> count;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++)
+    {
+        PairName pair;
+        Quote q;
+        stream >> pair >> q.last >> q.buy >> q.sell >> q.updated;
+        write(slot(pair), q.last.getUnbiased(), q.buy.getUnbiased(), q.sell.getUnbiased(), q.updated.toMSecsSinceEpoch());
+    }
+}
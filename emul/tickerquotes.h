@@ -0,0 +1,61 @@
+#ifndef TICKERQUOTES_H
+#define TICKERQUOTES_H
+
+#include "engineclock.h"
+#include "types.h"
+
+#include <QHash>
+#include <QMutex>
+
+#include <atomic>
+
+/// Live last/buy/sell quotes of pairs, updated by fills.
+/// Every pair has a seqlock protected slot: a writer never waits for readers,
+/// readers retry until they have read a quote that was not changed meanwhile.
+/// Slots are never removed, the pair -> slot map is replaced as a whole when
+/// a new pair appears, so lookup does not take any lock either.
+class TickerQuotes
+{
+public:
+    struct Quote
+    {
+        Rate last;
+        Rate buy;
+        Rate sell;
+        QDateTime updated;
+    };
+
+    /// last fill of order of given type was done at rate
+    static void publish(const PairName& pair, OrderInfo::Type type, const Rate& rate,
+                        const QDateTime& updated = EngineClock::now());
+
+    /// false if there was no fill on pair yet, zero buy/sell means there
+    /// was no fill of that side
+    static bool quote(const PairName& pair, Quote& quote);
+
+    /// all quotes, for state snapshots
+    static void save(QDataStream& stream);
+    static void restore(QDataStream& stream);
+
+private:
+    struct Slot
+    {
+        std::atomic<quint32> sequence {0};
+        std::atomic<qint64> last {0};
+        std::atomic<qint64> buy {0};
+        std::atomic<qint64> sell {0};
+        std::atomic<qint64> updated {0};
+
+        /// buy and sell fills of one pair are not serialized with each other
+        std::atomic_flag writer = ATOMIC_FLAG_INIT;
+    };
+    using Slots = QHash<PairName, Slot*>;
+
+    static Slot* slot(const PairName& pair);
+    static void write(Slot* s, qint64 last, qint64 buy, qint64 sell, qint64 updated);
+
+    static std::atomic<const Slots*> current;
+    static QMutex slotsCreateAccess;
+};
+
+#endif // TICKERQUOTES_H
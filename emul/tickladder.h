@@ -0,0 +1,146 @@
+#ifndef TICKLADDER_H
+#define TICKLADDER_H
+
+#include "types.h"
+
+#include <QVector>
+#include <QtAlgorithms>
+
+/// Price levels of one book side in a dense array indexed by tick, the
+/// step of the last decimal place a pair accepts, from its min price up.
+/// Two bitmap layers mark used ticks: a bit per tick and a bit per word of
+/// those, so the next used level is found with a few word scans instead
+/// of walking a tree. Memory is linear in ticks count, so it suits pairs
+/// with a narrow range of prices only. Not synchronized, owner locks it.
+template <typename T>
+class TickLadder
+{
+public:
+    static const int NONE = -1;
+
+    TickLadder(const Rate& min_price, int decimal_places, int ticks)
+        :minimum(min_price.getUnbiased())
+        ,step(1)
+        ,values(ticks)
+        ,words((ticks + 63) / 64)
+        ,summary((words.size() + 63) / 64)
+    {
+        for (int i = decimal_places; i < 7; i++)
+            step *= 10;
+    }
+
+    /// false if rate is out of range or between ticks
+    bool tick(const Rate& rate, int& tick) const
+    {
+        qint64 offset = rate.getUnbiased() - minimum;
+        if (offset < 0 || offset % step || offset / step >= values.size())
+            return false;
+        tick = static_cast<int>(offset / step);
+        return true;
+    }
+
+    Rate rate(int tick) const
+    {
+        Rate ret;
+        ret.setUnbiased(minimum + step * tick);
+        return ret;
+    }
+
+    T& value(int tick) { return values[tick]; }
+    const T& value(int tick) const { return values.at(tick); }
+
+    bool isUsed(int tick) const
+    {
+        return words.at(tick >> 6) & (1ULL << (tick & 63));
+    }
+
+    void use(int tick)
+    {
+        words[tick >> 6] |= 1ULL << (tick & 63);
+        summary[tick >> 12] |= 1ULL << ((tick >> 6) & 63);
+        used++;
+    }
+
+    void release(int tick)
+    {
+        values[tick] = T();
+        words[tick >> 6] &= ~(1ULL << (tick & 63));
+        if (!words.at(tick >> 6))
+            summary[tick >> 12] &= ~(1ULL << ((tick >> 6) & 63));
+        used--;
+    }
+
+    int size() const
+    {
+        return used;
+    }
+
+    void clear()
+    {
+        for (int tick = lowest(); tick != NONE; tick = above(tick))
+            values[tick] = T();
+        words.fill(0);
+        summary.fill(0);
+        used = 0;
+    }
+
+    int lowest() const { return used ? next(0) : NONE; }
+    int highest() const { return used ? previous(values.size() - 1) : NONE; }
+    int above(int tick) const { return tick + 1 < values.size() ? next(tick + 1) : NONE; }
+    int below(int tick) const { return tick > 0 ? previous(tick - 1) : NONE; }
+
+private:
+    /// first used tick at or after from
+    int next(int from) const
+    {
+        int word = from >> 6;
+        quint64 bits = words.at(word) & (~0ULL << (from & 63));
+        if (bits)
+            return (word << 6) + qCountTrailingZeroBits(bits);
+        for (int group = (word + 1) >> 6; group < summary.size(); group++)
+        {
+            quint64 groupBits = summary.at(group);
+            if (group == (word + 1) >> 6)
+                groupBits &= ~0ULL << ((word + 1) & 63);
+            if (groupBits)
+            {
+                word = (group << 6) + qCountTrailingZeroBits(groupBits);
+                return (word << 6) + qCountTrailingZeroBits(words.at(word));
+            }
+        }
+        return NONE;
+    }
+
+    /// last used tick at or before from
+    int previous(int from) const
+    {
+        int word = from >> 6;
+        quint64 bits = words.at(word) & (~0ULL >> (63 - (from & 63)));
+        if (bits)
+            return (word << 6) + 63 - qCountLeadingZeroBits(bits);
+        for (int group = (word - 1) >> 6; word > 0 && group >= 0; group--)
+        {
+            quint64 groupBits = summary.at(group);
+            if (group == (word - 1) >> 6)
+                groupBits &= ~0ULL >> (63 - ((word - 1) & 63));
+            if (groupBits)
+            {
+                word = (group << 6) + 63 - qCountLeadingZeroBits(groupBits);
+                return (word << 6) + 63 - qCountLeadingZeroBits(words.at(word));
+            }
+        }
+        return NONE;
+    }
+
+    qint64 minimum;
+    qint64 step;
+    int used = 0;
+    QVector<T> values;
+    QVector<quint64> words;
+    QVector<quint64> summary;
+};
+
+template <typename T>
+const int TickLadder<T>::NONE;
+
+#endif // TICKLADDER_H
@@ -2,23 +2,14 @@
 #define TYPES_CPP
 
 #include "types.h"
+#include "entitypool.h"
+#include "registry.h"
 
 #include <QDataStream>
 
-template <int n>
-QDataStream& operator << (QDataStream& stream, const DEC_NAMESPACE::decimal<n>& d)
+PairInfo::Ptr PairInfo::create()
 {
-    stream << dec2qstr(d, n);
-    return stream;
-}
-
-template <int n>
-QDataStream& operator >> (QDataStream& stream, DEC_NAMESPACE::decimal<n>& d)
-{
-    QString str;
-    stream >> str;
-    d = qstr2dec<n>(str);
-    return stream;
+    return std::allocate_shared<PairInfo>(SlabAllocator<PairInfo>());
 }
 
 QByteArray PairInfo::pack() const
@@ -52,6 +43,11 @@ bool PairInfo::unpack(QByteArray &ba)
     return true;
 }
 
+TickerInfo::Ptr TickerInfo::create()
+{
+    return std::allocate_shared<TickerInfo>(SlabAllocator<TickerInfo>());
+}
+
 QByteArray TickerInfo::pack() const
 {
     QByteArray buffer;
@@ -85,6 +81,11 @@ bool TickerInfo::unpack(QByteArray &ba)
     return true;
 }
 
+OrderInfo::Ptr OrderInfo::create()
+{
+    return std::allocate_shared<OrderInfo>(SlabAllocator<OrderInfo>());
+}
+
 QByteArray OrderInfo::pack() const
 {
     QByteArray buffer;
@@ -120,25 +121,37 @@ bool OrderInfo::unpack(QByteArray &ba)
     return true;
 }
 
+UserInfo::Ptr UserInfo::create()
+{
+    return std::allocate_shared<UserInfo>(SlabAllocator<UserInfo>());
+}
+
 QByteArray UserInfo::pack() const
 {
     QByteArray buffer;
     QDataStream stream(&buffer, QIODevice::WriteOnly);
     stream << user_id
            << name
-           << funds;
+           << Registry::funds(funds);
     return buffer;
 }
 
 bool UserInfo::unpack(QByteArray &ba)
 {
     QDataStream stream(&ba, QIODevice::ReadOnly);
+    Funds stored;
     stream >> user_id
            >> name
-           >> funds;
+           >> stored;
+    funds = Registry::balances(stored);
     return true;
 }
 
+ApikeyInfo::Ptr ApikeyInfo::create()
+{
+    return std::allocate_shared<ApikeyInfo>(SlabAllocator<ApikeyInfo>());
+}
+
 QByteArray ApikeyInfo::pack() const
 {
     QByteArray buffer;
@@ -165,3 +178,13 @@ bool ApikeyInfo::unpack(QByteArray &ba)
            >> user_id;
     return true;
 }
+
+TradeInfo::Ptr TradeInfo::create()
+{
+    return std::allocate_shared<TradeInfo>(SlabAllocator<TradeInfo>());
+}
+
+UserTradeInfo::Ptr UserTradeInfo::create()
+{
+    return std::allocate_shared<UserTradeInfo>(SlabAllocator<UserTradeInfo>());
+}
@@ -4,12 +4,15 @@
 #include "decimal.h"
 #include "qglobal.h"
 
+#include <QDataStream>
 #include <QDateTime>
 #include <QMap>
 #include <QMutex>
 #include <QString>
 #include <QVariant>
 
+#include <array>
+#include <limits>
 #include <memory>
 
 using Amount = DEC_NAMESPACE::decimal<7>;
@@ -21,6 +24,11 @@ using TradeId = quint32;
 using OrderId = quint32;
 using PairName = QString;
 using ApiKey = QString;
+/// currency interned by Registry
+using CurrencyId = quint8;
+
+#define MAX_CURRENCIES 32
+#define INVALID_CURRENCY 0xFF
 
 template <int n>
 QString dec2qstr(const DEC_NAMESPACE::decimal<n>& d, int decimal_places =7)
@@ -50,12 +58,29 @@ DEC_NAMESPACE::decimal<n> qvar2dec(const QVariant& s)
     return DEC_NAMESPACE::decimal<n>(s.toDouble());
 }
 
+template <int n>
+QDataStream& operator << (QDataStream& stream, const DEC_NAMESPACE::decimal<n>& d)
+{
+    stream << dec2qstr(d, n);
+    return stream;
+}
+
+template <int n>
+QDataStream& operator >> (QDataStream& stream, DEC_NAMESPACE::decimal<n>& d)
+{
+    QString str;
+    stream >> str;
+    d = qstr2dec<n>(str);
+    return stream;
+}
+
 enum Method {Invalid, AuthIssue, AccessIssue,
              PublicInfo, PublicTicker, PublicDepth, PublicTrades,
              PrivateGetInfo, PrivateTrade, PrivateActiveOrders, PrivateOrderInfo,
              PrivateCanelOrder, PrivateTradeHistory, PrivateTransHistory,
              PrivateCoinDepositAddress,
-             PrivateWithdrawCoin, PrivateCreateCupon, PrivateRedeemCupon
+             PrivateWithdrawCoin, PrivateCreateCupon, PrivateRedeemCupon,
+             PrivateTradeBatch, PrivateCancelOrderBatch
             };
 
 struct PairInfo
@@ -73,6 +98,8 @@ struct PairInfo
     bool hidden;
     PairName pair;
 
+    /// from slab pool, see SlabAllocator
+    static Ptr create();
     QByteArray pack() const;
     bool unpack(QByteArray& ba);
 };
@@ -91,10 +118,8 @@ struct TickerInfo
     QDateTime updated;
     PairName pairName;
 
-    PairInfo::WPtr pair_ptr;
-
-    QMutex updateAccess;
-
+    /// from slab pool, see SlabAllocator
+    static Ptr create();
     QByteArray pack() const;
     bool unpack(QByteArray& ba);
 };
@@ -107,7 +132,6 @@ struct OrderInfo
     using List = QList<OrderInfo::Ptr>; // WPtr ?
 
     PairName pair;
-    std::weak_ptr<PairInfo> pair_ptr;
     Type type;
     Amount start_amount;
     Amount amount;
@@ -117,8 +141,8 @@ struct OrderInfo
     UserId user_id;
     OrderId order_id;
 
-    QMutex updateAccess;
-
+    /// from slab pool, see SlabAllocator
+    static Ptr create();
     QByteArray pack() const;
     bool unpack(QByteArray& ba);
 };
@@ -135,13 +159,49 @@ struct TradeInfo
     QDateTime created;
     OrderId order_id;
     UserId user_id;
-    OrderInfo::WPtr order_ptr;
+
+    /// from slab pool, see SlabAllocator
+    static Ptr create();
+};
+/// trade as one of its users sees it, for TradeHistory and TransHistory
+struct UserTradeInfo
+{
+    using Ptr = std::shared_ptr<UserTradeInfo>;
+    using List = QList<UserTradeInfo::Ptr>;
+
+    TradeId tid;
+    PairName pair;
+    /// side of the user
+    OrderInfo::Type type;
+    Rate rate;
+    Amount amount;
+    /// matched order, owned by the user if is_your_order
+    OrderId order_id;
+    bool is_your_order;
+    QDateTime created;
+
+    /// from slab pool, see SlabAllocator
+    static Ptr create();
+};
+/// history paging as private API has it: entries with id in [from_id, end_id]
+/// and time in [since, end], in order, skip from and take count of them
+struct HistoryPage
+{
+    quint32 from = 0;
+    quint32 count = 1000;
+    quint32 from_id = 0;
+    quint32 end_id = std::numeric_limits<quint32>::max();
+    bool desc = true;
+    QDateTime since;
+    QDateTime end;
 };
 
 using DepthItem = QPair<Rate, Amount>;
 using Depth = QList<DepthItem>;
 using BuySellDepth = QPair<Depth, Depth>;
 using Funds = QMap<QString, Amount>;
+/// amounts indexed by CurrencyId
+using Balances = std::array<Amount, MAX_CURRENCIES>;
 
 struct UserInfo
 {
@@ -150,10 +210,10 @@ struct UserInfo
 
     UserId user_id;
     QString name;
-    Funds funds;
-
-    QMutex updateAccess;
+    Balances funds {};
 
+    /// from slab pool, see SlabAllocator
+    static Ptr create();
     QByteArray pack() const;
     bool unpack(QByteArray& ba);
 };
@@ -169,10 +229,9 @@ struct ApikeyInfo
     QByteArray secret;
     quint32 nonce;
     UserId user_id;
-    UserInfo::WPtr user_ptr;
-
-    QMutex updateAccess;
 
+    /// from slab pool, see SlabAllocator
+    static Ptr create();
     QByteArray pack() const;
     bool unpack(QByteArray& ba);
 };
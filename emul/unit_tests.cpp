@@ -1,18 +1,116 @@
+#include "engineclock.h"
+#include "enginestate.h"
+#include "entitypool.h"
 #include "fcgi_request.h"
+#include "idallocator.h"
+#include "feeaccumulator.h"
+#include "inmemorydataaccessor.h"
+#include "lmdbdataaccessor.h"
+#include "loadbots.h"
+#include "invariantmonitor.h"
+#include "metrics.h"
+#include "orderarchiver.h"
+#include "orderbook.h"
 #include "query_parser.h"
+#include "ratelimiter.h"
+#include "registry.h"
+#include "responsecache.h"
+#include "shardconfig.h"
+#include "tickerquotes.h"
 #include "sqlclient.h"
 //#include "sql_database.h"
 #include "unit_tests.h"
 #include "utils.h"
 
+#include <QElapsedTimer>
+#include <QSettings>
+#include <QSqlQuery>
+#include <QTemporaryDir>
+#include <QThread>
+
+#include <random>
+
 quint32 BtceEmulator_Test::nonce()
 {
     static quint32 value = QDateTime::currentDateTime().toTime_t();
     return value++;
 }
 
-BtceEmulator_Test::BtceEmulator_Test(QSqlDatabase& db):client(new Responce(db)), sqlClient(new DirectSqlDataAccessor(db))
-{}
+UserId BtceEmulator_Test::emulatedUser(AbstractDataAccessor& accessor, UserId other)
+{
+    // keys of the exchange user are never given out
+    for (int i = 0; i < 100; i++)
+    {
+        ApikeyInfo::Ptr key = accessor.apikeyInfo(QString::fromUtf8(accessor.randomKeyWithPermissions(true, true, false)));
+        if (key && key->user_id != other)
+            return key->user_id;
+    }
+    return 0;
+}
+
+bool BtceEmulator_Test::useBackend(const QString& backend)
+{
+    if (backend == currentBackend)
+        return true;
+    // fees go to the store they were earned in, users are indexed again
+    // from the next one
+    client->foldExchangeFees();
+    for (UserId user_id: UserIndex::loadedUsers())
+        UserIndex::unload(user_id);
+    client.reset();
+    dataClient.reset();
+    LmdbDataAccessor::close();
+    lmdbDirectory.reset();
+
+    // memory and lmdb stores are copies of the schema, caches of base
+    // accessor stay valid while tests write to them
+    bool opened = true;
+    currentBackend = backend;
+    if (backend == "lmdb")
+    {
+        lmdbDirectory.reset(new QTemporaryDir);
+        opened = LmdbDataAccessor::open(lmdbDirectory->path(), Q_UINT64_C(1) << 30, 0, db);
+        if (!opened)
+            currentBackend = baseBackend;
+    }
+    Responce::useDataAccessor(currentBackend, db);
+    client.reset(new Responce(db));
+    if (currentBackend == "memory")
+        dataClient.reset(new InMemoryDataAccessor);
+    else if (currentBackend == "lmdb")
+        dataClient.reset(new LmdbDataAccessor);
+    else
+        dataClient.reset(new DirectSqlDataAccessor(db));
+    return opened;
+}
+
+void BtceEmulator_Test::backendData()
+{
+    QTest::addColumn<QString>("backend");
+    QTest::newRow(qPrintable(baseBackend)) << baseBackend;
+    if (seeded)
+        return;
+    QTest::newRow("memory") << "memory";
+    QTest::newRow("lmdb") << "lmdb";
+}
+
+BtceEmulator_Test::BtceEmulator_Test(QSqlDatabase& db, bool seeded)
+    :client(new Responce(db)), db(db), seeded(seeded)
+{
+    // suite runs before the configured accessor is set
+    baseBackend = seeded ? "memory" : "memcached";
+    currentBackend = baseBackend;
+    if (seeded)
+        dataClient.reset(new InMemoryDataAccessor);
+    else
+        dataClient.reset(new DirectSqlDataAccessor(db));
+}
+
+void BtceEmulator_Test::cleanup()
+{
+    // accessor tests leave their backend, the rest runs on the base one
+    useBackend(baseBackend);
+}
 
 void BtceEmulator_Test::FcgiRequest_httpGetQuery()
 {
@@ -38,8 +136,8 @@ void BtceEmulator_Test::FcgiRequest_httpPostQuery()
     QUrl url;
     url = "http://localhost:81/api/3/ticker/btc_usd?param1=value1&param2=value2";
     in = "method=method&param=value";
-    QByteArray key  = sqlClient->randomKeyWithPermissions(false, false, false);
-    QByteArray sign = sqlClient->signWithKey(in, key);
+    QByteArray key  = dataClient->randomKeyWithPermissions(false, false, false);
+    QByteArray sign = dataClient->signWithKey(in, key);
     headers["KEY"] = key;
     headers["SIGN"] = sign;
 
@@ -150,6 +248,57 @@ void BtceEmulator_Test::QueryParser_limitOverflow()
     QCOMPARE(parser.limit(), 5000);
 }
 
+void BtceEmulator_Test::QueryParser_methodDispatch()
+{
+    QByteArray in;
+    QMap<QString, QString> headers;
+    QUrl url;
+
+    url = "http://localhost:81/api/3/depth/btc_usd";
+    FcgiRequest depthRequest(url , headers, in);
+    QueryParser depthParser(depthRequest);
+    QCOMPARE(depthParser.methodId(), Method::PublicDepth);
+
+    url = "http://localhost:81/api/3/getInfo";
+    FcgiRequest wrongScopeRequest(url , headers, in);
+    QueryParser wrongScopeParser(wrongScopeRequest);
+    QCOMPARE(wrongScopeParser.methodId(), Method::Invalid);
+
+    url = "http://localhost:81/tapi";
+    in = "method=CancelOrder&nonce=1";
+    FcgiRequest cancelRequest(url , headers, in);
+    QueryParser cancelParser(cancelRequest);
+    QCOMPARE(cancelParser.methodId(), Method::PrivateCanelOrder);
+    QVERIFY(cancelParser.methodInfo() && cancelParser.methodInfo()->permission == MethodTable::Permission::Trade);
+
+    in = "method=CancelOrders&nonce=1";
+    FcgiRequest unknownRequest(url , headers, in);
+    QueryParser unknownParser(unknownRequest);
+    QCOMPARE(unknownParser.methodId(), Method::Invalid);
+}
+
+void BtceEmulator_Test::QueryParser_postParamsRetrieving()
+{
+    QByteArray in;
+    QMap<QString, QString> headers;
+    QUrl url;
+    url = "http://localhost:81/tapi";
+    in = "method=Trade&nonce=12&pair=btc_usd&type=buy&rate=1850.5&amount=0.2&pair=ltc_usd&comment=a%20b";
+
+    FcgiRequest request(url , headers, in);
+    QueryParser parser(request);
+
+    QCOMPARE(parser.method(), QString("Trade"));
+    QCOMPARE(parser.nonce(), QString("12"));
+    QCOMPARE(parser.pair(), QString("btc_usd"));
+    QCOMPARE(parser.orderType(), QString("buy"));
+    QCOMPARE(parser.rate(), QString("1850.5"));
+    QCOMPARE(parser.amount(), QString("0.2"));
+    QCOMPARE(parser.postParam("comment").toString(), QString("a b"));
+    QVERIFY(parser.postParam("order_id").isNull());
+    QCOMPARE(parser.signedData(), in);
+}
+
 void BtceEmulator_Test::Methods_invalidMethod()
 {
     QByteArray in;
@@ -568,6 +717,25 @@ void BtceEmulator_Test::Ticker_ignoreInvalidForDuplicatePair()
     QVERIFY(responce["error"] == "Duplicated pair name: btc_usd");
 }
 
+void BtceEmulator_Test::Ticker_liveQuote()
+{
+    TickerQuotes::Quote quote;
+    QVERIFY(!TickerQuotes::quote("zzz_yyy", quote));
+
+    TickerQuotes::publish("zzz_yyy", OrderInfo::Type::Buy, Rate(101));
+    QVERIFY(TickerQuotes::quote("zzz_yyy", quote));
+    QVERIFY(quote.last == Rate(101));
+    QVERIFY(quote.buy == Rate(101));
+    QVERIFY(quote.sell == Rate(0));
+
+    TickerQuotes::publish("zzz_yyy", OrderInfo::Type::Sell, Rate(99));
+    QVERIFY(TickerQuotes::quote("zzz_yyy", quote));
+    QVERIFY(quote.last == Rate(99));
+    QVERIFY(quote.buy == Rate(101));
+    QVERIFY(quote.sell == Rate(99));
+    QVERIFY(quote.updated <= QDateTime::currentDateTime());
+}
+
 void BtceEmulator_Test::Authentication_noKey()
 {
     QByteArray in;
@@ -614,7 +782,7 @@ void BtceEmulator_Test::Authentication_noSign()
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = "method=getInfo&nonce=1";
-    QByteArray key = sqlClient->randomKeyWithPermissions(false, false, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(false, false, false);
     headers["KEY"] = key;
 
     FcgiRequest request(url , headers, in);
@@ -636,7 +804,7 @@ void BtceEmulator_Test::Authentication_invalidSign()
     headers["SIGN"] = "SSSiiiGGGnnn";
     url = "http://loclahost:81/tapi";
     in = "method=getInfo&nonce=1";
-    QByteArray key = sqlClient->randomKeyWithPermissions(false, false, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(false, false, false);
     headers["KEY"] = key;
 
     FcgiRequest request(url , headers, in);
@@ -657,9 +825,9 @@ void BtceEmulator_Test::Authentication_infoPermissionCheck()
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=getInfo&nonce=%1").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(false, true, true);
+    QByteArray key = dataClient->randomKeyWithPermissions(false, true, true);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -679,9 +847,9 @@ void BtceEmulator_Test::Authentication_tradePermissionCheck()
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=Trade&nonce=%1").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(true, false, true);
+    QByteArray key = dataClient->randomKeyWithPermissions(true, false, true);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -701,9 +869,9 @@ void BtceEmulator_Test::Authentication_withdrawPermissionCheck()
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=RedeemCupon&nonce=%1").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(true, true, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(true, true, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -723,9 +891,9 @@ void BtceEmulator_Test::Authentication_noNonce()
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = "method=getInfo";
-    QByteArray key = sqlClient->randomKeyWithPermissions(true, false, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(true, false, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -747,9 +915,9 @@ void BtceEmulator_Test::Authentication_invalidNonce()
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = "method=getInfo&nonce=1";
-    QByteArray key = sqlClient->randomKeyWithPermissions(false, false, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(false, false, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -764,16 +932,23 @@ void BtceEmulator_Test::Authentication_invalidNonce()
     QCOMPARE(pos, 0);
 }
 
+void BtceEmulator_Test::Method_privateGetInfo_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::Method_privateGetInfo()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=getInfo&nonce=%1").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(true, false, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(true, false, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -790,9 +965,9 @@ void BtceEmulator_Test::Method_privateActiveOrders()
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=ActiveOrders&nonce=%1").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(true, false, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(true, false, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -802,16 +977,23 @@ void BtceEmulator_Test::Method_privateActiveOrders()
     QCOMPARE(method, Method::PrivateActiveOrders);
 }
 
+void BtceEmulator_Test::Method_privateOrderInfo_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::Method_privateOrderInfo()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=OrderInfo&nonce=%1").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(true, false, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(true, false, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -821,16 +1003,23 @@ void BtceEmulator_Test::Method_privateOrderInfo()
     QCOMPARE(method, Method::PrivateOrderInfo);
 }
 
+void BtceEmulator_Test::Method_privateTrade_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::Method_privateTrade()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=Trade&nonce=%1").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(false, true, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(false, true, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -840,16 +1029,23 @@ void BtceEmulator_Test::Method_privateTrade()
     QCOMPARE(method, Method::PrivateTrade);
 }
 
+void BtceEmulator_Test::Method_privateCancelOrder_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::Method_privateCancelOrder()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=CancelOrder&nonce=%1").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(false, true, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(false, true, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -987,6 +1183,84 @@ void BtceEmulator_Test::Depth_limit()
     QVERIFY(bids.size() <= 10);
 }
 
+void BtceEmulator_Test::Depth_sinceVersion()
+{
+    QByteArray in;
+    QMap<QString, QString> headers;
+    QUrl url;
+    url = "http://localhost:81/api/3/depth/btc_usd?since=0";
+
+    FcgiRequest request(url , headers, in);
+    QueryParser parser(request);
+    Method method;
+    QVariantMap responce =client->getResponce(parser, method);
+
+    QVariantMap btc_usd = responce["btc_usd"].toMap();
+    QCOMPARE(btc_usd["delta"].toInt(), 0);
+    quint64 version = btc_usd["version"].toULongLong();
+
+    OrderBook::Batch batch;
+    batch.levelChanged("btc_usd", OrderInfo::Type::Buy, Rate("0.0001"), Amount(1), 1);
+    OrderBook::apply(batch);
+
+    url = QString("http://localhost:81/api/3/depth/btc_usd?since=%1").arg(version);
+    FcgiRequest deltaRequest(url , headers, in);
+    QueryParser deltaParser(deltaRequest);
+    responce = client->getResponce(deltaParser, method);
+
+    // undo synthetic level before checks may fail
+    batch.clear();
+    batch.levelChanged("btc_usd", OrderInfo::Type::Buy, Rate("0.0001"), -Amount(1), -1);
+    OrderBook::apply(batch);
+
+    btc_usd = responce["btc_usd"].toMap();
+    QCOMPARE(btc_usd["delta"].toInt(), 1);
+    QCOMPARE(btc_usd["version"].toULongLong(), version + 1);
+    QVariantList bids = btc_usd["bids"].toList();
+    QCOMPARE(bids.size(), 1);
+    QVERIFY(btc_usd["asks"].toList().isEmpty());
+}
+
+void BtceEmulator_Test::Depth_cachedVariants()
+{
+    QByteArray in;
+    QMap<QString, QString> headers;
+    QUrl url;
+    url = "http://localhost:81/api/3/depth/btc_usd?limit=2000";
+
+    FcgiRequest request(url , headers, in);
+    QueryParser parser(request);
+    QVERIFY(ResponseCache::isCacheable(parser));
+    Method method;
+    QByteArray json = QJsonDocument::fromVariant(client->getResponce(parser, method)).toJson();
+
+    QByteArray etag = ResponseCache::etag(parser);
+    QByteArray key = "/api/3/depth/btc_usd?limit=2000";
+    ResponseCache::EntryPtr stored = ResponseCache::store(key, etag, json);
+    QVERIFY(ResponseCache::find(key, etag) == stored);
+    QVERIFY(!ResponseCache::find(key, etag + "x"));
+
+    if (json.size() >= 1024)
+    {
+        QVERIFY(ResponseCache::encoding("deflate, gzip", *stored) == ResponseCache::Encoding::Gzip);
+        QVERIFY(ResponseCache::encoding("gzip;q=0, deflate", *stored) == ResponseCache::Encoding::Deflate);
+        // deflate variant is zlib stream, which qUncompress takes after size prefix
+        QByteArray sized(4, 0);
+        qToBigEndian<quint32>(json.size(), reinterpret_cast<uchar*>(sized.data()));
+        QCOMPARE(qUncompress(sized + stored->deflate), json);
+    }
+    QVERIFY(ResponseCache::encoding(nullptr, *stored) == ResponseCache::Encoding::Identity);
+
+    QVERIFY(ResponseCache::matches(etag.constData(), etag));
+    QVERIFY(ResponseCache::matches(("\"other\", W/" + etag).constData(), etag));
+    QVERIFY(!ResponseCache::matches("\"other\"", etag));
+
+    url = "http://localhost:81/api/3/depth/btc_usd?since=1";
+    FcgiRequest deltaRequest(url , headers, in);
+    QueryParser deltaParser(deltaRequest);
+    QVERIFY(!ResponseCache::isCacheable(deltaParser));
+}
+
 void BtceEmulator_Test::Trades_emptyList()
 {
     // In:   https://btc-e.com/api/3/trades
@@ -1078,16 +1352,23 @@ void BtceEmulator_Test::Trades_sortedByTimestamp()
     }
 }
 
+void BtceEmulator_Test::GetInfo_valid_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::GetInfo_valid()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=getInfo&nonce=%1").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(true, false, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(true, false, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -1111,9 +1392,9 @@ void BtceEmulator_Test::ActiveOrders_valid()
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=ActiveOrders&nonce=%1").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(true, false, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(true, false, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -1131,16 +1412,380 @@ void BtceEmulator_Test::ActiveOrders_valid()
     QVERIFY(order.contains("status") && order["status"].canConvert(QVariant::Int) && order["status"].toInt() == 0);
 }
 
+void BtceEmulator_Test::UserIndex_orderLifecycle()
+{
+    const UserId user_id = 0xFFFF0001;
+    Funds funds;
+    funds["usd"] = Amount(100);
+    funds["btc"] = Amount(1);
+    UserIndex::load(user_id, Registry::balances(funds), OrderInfo::List());
+    QVERIFY(UserIndex::isLoaded(user_id));
+    QCOMPARE(UserIndex::openOrdersCount(user_id), 0);
+
+    UserIndex::Order order;
+    order.order_id = 0xFFFF0002;
+    order.pair = "btc_usd";
+    order.type = OrderInfo::Type::Buy;
+    order.start_amount = Amount(0.5);
+    order.amount = Amount(0.5);
+    order.rate = Rate(100);
+    order.created = QDateTime::currentDateTime();
+
+    UserIndex::Batch batch;
+    batch.balanceChanged(user_id, Registry::currencyId("usd"), -Amount(50));
+    batch.orderCreated(user_id, order);
+    UserIndex::apply(batch);
+
+    QVERIFY(UserIndex::funds(user_id, funds));
+    QVERIFY(funds["usd"] == Amount(50));
+    QCOMPARE(UserIndex::openOrdersCount(user_id), 1);
+    QVERIFY(UserIndex::activeOrderIds(user_id, "btc_usd").contains(order.order_id));
+
+    batch.clear();
+    batch.orderReduced(user_id, order.order_id, Amount(0.2));
+    UserIndex::apply(batch);
+    QList<UserIndex::Order> orders = UserIndex::activeOrders(user_id);
+    QCOMPARE(orders.size(), 1);
+    QVERIFY(orders.first().amount == Amount(0.3));
+
+    batch.clear();
+    batch.orderClosed(user_id, order.order_id);
+    batch.balanceChanged(user_id, Registry::currencyId("usd"), Amount(30));
+    UserIndex::apply(batch);
+    QVERIFY(UserIndex::funds(user_id, funds));
+    QVERIFY(funds["usd"] == Amount(80));
+    QCOMPARE(UserIndex::openOrdersCount(user_id), 0);
+    QVERIFY(UserIndex::activeOrderIds(user_id, "btc_usd").isEmpty());
+}
+
+void BtceEmulator_Test::UserIndex_saveRestore()
+{
+    const UserId user_id = 0xFFFF0003;
+    Funds funds;
+    funds["usd"] = Amount(10);
+    UserIndex::load(user_id, Registry::balances(funds), OrderInfo::List());
+
+    UserIndex::Order order;
+    order.order_id = 0xFFFF0004;
+    order.pair = "btc_usd";
+    order.type = OrderInfo::Type::Sell;
+    order.start_amount = Amount(2);
+    order.amount = Amount(2);
+    order.rate = Rate(100);
+    order.created = QDateTime::currentDateTime();
+
+    UserIndex::Batch batch;
+    batch.orderCreated(user_id, order);
+    batch.balanceChanged(user_id, Registry::currencyId("btc"), -Amount(2));
+
+    QByteArray journal;
+    {
+        QDataStream stream(&journal, QIODevice::WriteOnly);
+        batch.write(stream);
+    }
+    UserIndex::Batch replayed;
+    {
+        QDataStream stream(journal);
+        replayed.read(stream);
+    }
+    UserIndex::apply(replayed);
+
+    QByteArray snapshot;
+    {
+        QDataStream stream(&snapshot, QIODevice::WriteOnly);
+        UserIndex::save(stream);
+    }
+    {
+        QDataStream stream(snapshot);
+        UserIndex::restore(stream);
+        QCOMPARE(stream.status(), QDataStream::Ok);
+    }
+
+    QVERIFY(UserIndex::funds(user_id, funds));
+    QVERIFY(funds["usd"] == Amount(10));
+    QVERIFY(funds["btc"] == -Amount(2));
+    QList<UserIndex::Order> orders = UserIndex::activeOrders(user_id);
+    QCOMPARE(orders.size(), 1);
+    QCOMPARE(orders.first().order_id, order.order_id);
+    QVERIFY(orders.first().type == OrderInfo::Type::Sell);
+    QVERIFY(orders.first().amount == Amount(2));
+}
+
+void BtceEmulator_Test::EntityPool_handles()
+{
+    EntityPool<OrderId> pool;
+    EntityPool<OrderId>::Handle first = pool.create(1);
+    EntityPool<OrderId>::Handle second = pool.create(2);
+    QVERIFY(first != EntityPool<OrderId>::INVALID);
+    QCOMPARE(*pool.get(first), 1u);
+    QCOMPARE(*pool.get(second), 2u);
+    QCOMPARE(pool.size(), 2);
+    quint32 capacity = pool.capacity();
+
+    // slot is reused, stale handle does not reach its new entity
+    QVERIFY(pool.destroy(first));
+    QVERIFY(!pool.destroy(first));
+    EntityPool<OrderId>::Handle third = pool.create(3);
+    QVERIFY(third != first);
+    QVERIFY(pool.get(first) == nullptr);
+    QCOMPARE(*pool.get(third), 3u);
+    QVERIFY(pool.get(EntityPool<OrderId>::INVALID) == nullptr);
+
+    for (OrderId id = 0; id < 10000; id++)
+        pool.destroy(pool.create(id));
+    QCOMPARE(pool.capacity(), capacity);
+    QCOMPARE(pool.size(), 2);
+
+    // snapshot copy keeps handles, and does not follow the original
+    EntityPool<OrderId> copy(pool);
+    QCOMPARE(*copy.get(second), 2u);
+    QCOMPARE(*copy.get(third), 3u);
+    pool.destroy(second);
+    QCOMPARE(*copy.get(second), 2u);
+    QCOMPARE(copy.size(), 2);
+}
+
+void BtceEmulator_Test::EntityPool_sharedEntities()
+{
+    // block of released entity is the next one given out, fields start empty
+    const OrderInfo* released = nullptr;
+    {
+        OrderInfo::Ptr order = OrderInfo::create();
+        order->amount = Amount(1);
+        released = order.get();
+    }
+    OrderInfo::Ptr order = OrderInfo::create();
+    QCOMPARE(static_cast<const OrderInfo*>(order.get()), released);
+    QVERIFY(order->amount == Amount(0));
+
+    // entities carry no lock, so cached ones are plain copies
+    UserInfo::Ptr user = UserInfo::create();
+    user->funds[0] = Amount(5);
+    UserInfo::Ptr copy = UserInfo::create();
+    *copy = *user;
+    QVERIFY(copy->funds[0] == Amount(5));
+}
+
+void BtceEmulator_Test::OrderBook_levels()
+{
+    // pair is not traded, so book is not touched by other tests
+    const PairName pair = "zzz_yyy";
+    OrderBook::Level level;
+    level.type = OrderInfo::Type::Buy;
+    level.rate = Rate(10);
+    level.amount = Amount(3);
+    level.count = 2;
+    OrderBook::load(pair, level);
+    level.rate = Rate(11);
+    level.amount = Amount(1);
+    level.count = 1;
+    OrderBook::load(pair, level);
+    level.type = OrderInfo::Type::Sell;
+    level.rate = Rate(12);
+    level.amount = Amount(5);
+    level.count = 1;
+    OrderBook::load(pair, level);
+
+    quint64 version = OrderBook::version(pair);
+    OrderBook::Batch batch;
+    batch.levelChanged(pair, OrderInfo::Type::Buy, Rate(11), -Amount(1), -1);
+    batch.levelChanged(pair, OrderInfo::Type::Sell, Rate(12), -Amount(2), 0);
+    batch.levelChanged(pair, OrderInfo::Type::Sell, Rate(13), Amount(1), 1);
+    OrderBook::apply(batch);
+
+    QList<OrderBook::Level> bids;
+    QList<OrderBook::Level> asks;
+    QCOMPARE(OrderBook::snapshot(pair, 10, bids, asks), version + 1);
+    QCOMPARE(bids.size(), 1);
+    QVERIFY(bids.first().rate == Rate(10));
+    QVERIFY(bids.first().amount == Amount(3));
+    QCOMPARE(bids.first().count, 2);
+    QCOMPARE(asks.size(), 2);
+    QVERIFY(asks.first().rate == Rate(12));
+    QVERIFY(asks.first().amount == Amount(3));
+    QVERIFY(asks.last().rate == Rate(13));
+
+    QCOMPARE(OrderBook::levels(pair, OrderInfo::Type::Sell, 1).size(), 1);
+
+    // reading a pair never loaded nor traded does not make a book for it
+    QCOMPARE(OrderBook::snapshot("zzq_yyy", 10, bids, asks), quint64(0));
+    QVERIFY(bids.isEmpty() && asks.isEmpty());
+    QVERIFY(!OrderBook::usesTicks("zzq_yyy"));
+}
+
+void BtceEmulator_Test::OrderBook_replicaUpdates()
+{
+    // replica gets updates of primary book as stream records
+    const PairName pair = "zzx_yyy";
+    OrderBook::Updates updates;
+    updates.version = 5;
+    updates.levels << OrderBook::Level{OrderInfo::Type::Buy, Rate(10), Amount(3), 2}
+                   << OrderBook::Level{OrderInfo::Type::Sell, Rate(12), Amount(1), 1};
+    QByteArray data;
+    {
+        QDataStream out(&data, QIODevice::WriteOnly);
+        OrderBook::writeUpdates(out, updates);
+    }
+    OrderBook::Updates received;
+    QDataStream in(data);
+    OrderBook::readUpdates(in, received);
+    OrderBook::applyUpdates(pair, received);
+
+    QList<OrderBook::Level> bids;
+    QList<OrderBook::Level> asks;
+    QCOMPARE(OrderBook::snapshot(pair, 10, bids, asks), quint64(5));
+    QCOMPARE(bids.size(), 1);
+    QVERIFY(bids.first().amount == Amount(3));
+    QCOMPARE(asks.size(), 1);
+
+    // already applied version is skipped, levels carry resulting state
+    OrderBook::Updates stale;
+    stale.version = 5;
+    stale.levels << OrderBook::Level{OrderInfo::Type::Buy, Rate(10), Amount(0), 0};
+    OrderBook::applyUpdates(pair, stale);
+    QCOMPARE(OrderBook::levels(pair, OrderInfo::Type::Buy, 10).size(), 1);
+
+    stale.version = 6;
+    OrderBook::applyUpdates(pair, stale);
+    QCOMPARE(OrderBook::levels(pair, OrderInfo::Type::Buy, 10).size(), 0);
+    QCOMPARE(OrderBook::version(pair), quint64(6));
+}
+
+void BtceEmulator_Test::OrderBook_tickLadder()
+{
+    const PairName pair = "zzk_yyy";
+    OrderBook::setMaxTicks(1000);
+    QVERIFY(!OrderBook::useTicks("zzj_yyy", Rate(1), Rate(100), 2));
+    QVERIFY(OrderBook::useTicks(pair, Rate(1), Rate(10), 2));
+    QVERIFY(OrderBook::usesTicks(pair));
+
+    OrderBook::Batch batch;
+    batch.levelChanged(pair, OrderInfo::Type::Buy, Rate(1), Amount(1), 1);
+    batch.levelChanged(pair, OrderInfo::Type::Buy, Rate("5.25"), Amount(2), 1);
+    batch.levelChanged(pair, OrderInfo::Type::Buy, Rate("5.5"), Amount(3), 2);
+    batch.levelChanged(pair, OrderInfo::Type::Sell, Rate(6), Amount(1), 1);
+    batch.levelChanged(pair, OrderInfo::Type::Sell, Rate(10), Amount(4), 1);
+    OrderBook::apply(batch);
+    batch.clear();
+    batch.levelChanged(pair, OrderInfo::Type::Buy, Rate("5.5"), -Amount(3), -2);
+    batch.levelChanged(pair, OrderInfo::Type::Sell, Rate("6.5"), Amount(2), 1);
+    OrderBook::apply(batch);
+
+    QList<OrderBook::Level> bids;
+    QList<OrderBook::Level> asks;
+    OrderBook::snapshot(pair, 10, bids, asks);
+    QCOMPARE(bids.size(), 2);
+    QVERIFY(bids.first().rate == Rate("5.25"));
+    QVERIFY(bids.last().rate == Rate(1));
+    QCOMPARE(asks.size(), 3);
+    QVERIFY(asks.at(0).rate == Rate(6));
+    QVERIFY(asks.at(1).rate == Rate("6.5"));
+    QVERIFY(asks.at(2).rate == Rate(10));
+    QVERIFY(asks.at(2).amount == Amount(4));
+    QCOMPARE(OrderBook::levels(pair, OrderInfo::Type::Sell, 2).size(), 2);
+
+    // rate between ticks moves the side to a tree, levels are kept
+    batch.clear();
+    batch.levelChanged(pair, OrderInfo::Type::Sell, Rate("6.125"), Amount(1), 1);
+    OrderBook::apply(batch);
+    QVERIFY(!OrderBook::usesTicks(pair));
+    OrderBook::snapshot(pair, 10, bids, asks);
+    QCOMPARE(bids.size(), 2);
+    QCOMPARE(asks.size(), 4);
+    QVERIFY(asks.at(1).rate == Rate("6.125"));
+    OrderBook::setMaxTicks(0);
+}
+
+void BtceEmulator_Test::OrderBook_ladderBenchmark_data()
+{
+    QTest::addColumn<PairName>("pair");
+    QTest::addColumn<bool>("ladder");
+    QTest::newRow("tree") << PairName("zzm_yyy") << false;
+    QTest::newRow("ladder") << PairName("zzl_yyy") << true;
+}
+
+void BtceEmulator_Test::OrderBook_ladderBenchmark()
+{
+    QFETCH(PairName, pair);
+    QFETCH(bool, ladder);
+
+    // btc_usd like book: 0.001 ticks, 2000 levels a side, crowded near
+    // the spread and thinning out exponentially
+    const qint64 mid = 600000;
+    std::mt19937 random(42);
+    std::exponential_distribution<double> distance(1.0 / 5000);
+    std::lognormal_distribution<double> size(0, 1.5);
+    auto level = [&](OrderInfo::Type type) {
+        qint64 offset = 1 + static_cast<qint64>(distance(random));
+        OrderBook::Level l;
+        l.type = type;
+        l.rate.setUnbiased((type == OrderInfo::Type::Buy ? mid - offset : mid + offset) * 10000);
+        l.amount = Amount(size(random) + 0.01);
+        l.count = 1;
+        return l;
+    };
+
+    OrderBook::setMaxTicks(1 << 20);
+    QCOMPARE(OrderBook::useTicks(pair, Rate(300), Rate(900), ladder ? 3 : 7), ladder);
+    OrderBook::setMaxTicks(0);
+    if (OrderBook::levels(pair, OrderInfo::Type::Buy, 1).isEmpty())
+        for (int i = 0; i < 2000; i++)
+        {
+            OrderBook::load(pair, level(OrderInfo::Type::Buy));
+            OrderBook::load(pair, level(OrderInfo::Type::Sell));
+        }
+
+    // orders placed and then filled or cancelled, so book is the same after
+    // every round; depth of 150 levels is asked after each placement
+    QList<OrderBook::Level> orders;
+    for (int i = 0; i < 500; i++)
+        orders << level(i % 2 ? OrderInfo::Type::Buy : OrderInfo::Type::Sell);
+    QList<OrderBook::Level> bids;
+    QList<OrderBook::Level> asks;
+    QBENCHMARK
+    {
+        for (const OrderBook::Level& order: orders)
+        {
+            OrderBook::Batch batch;
+            batch.levelChanged(pair, order.type, order.rate, order.amount, 1);
+            OrderBook::apply(batch);
+            OrderBook::snapshot(pair, 150, bids, asks);
+            batch.clear();
+            batch.levelChanged(pair, order.type, order.rate, -order.amount, -1);
+            OrderBook::apply(batch);
+        }
+    }
+    QCOMPARE(OrderBook::usesTicks(pair), ladder);
+    QCOMPARE(bids.size(), 150);
+}
+
+void BtceEmulator_Test::ShardConfig_orderShard()
+{
+    // shard i allocates ids i+1, i+1+count, i+1+2*count...
+    const quint32 count = 3;
+    for (quint32 index = 0; index < count; index++)
+        for (OrderId order_id = index + 1; order_id < 20; order_id += count)
+            QCOMPARE(ShardConfig::shardOfOrder(order_id, count), index);
+    QCOMPARE(ShardConfig::shardOfOrder(12345, 1), 0u);
+}
+
+void BtceEmulator_Test::OrderInfo_missingOrderId_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::OrderInfo_missingOrderId()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=OrderInfo&nonce=%1").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(true, false, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(true, false, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -1154,16 +1799,23 @@ void BtceEmulator_Test::OrderInfo_missingOrderId()
     QCOMPARE(error, QString("invalid parameter: order_id"));
 }
 
+void BtceEmulator_Test::OrderInfo_wrongOrderId_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::OrderInfo_wrongOrderId()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=OrderInfo&nonce=%1&order_id=6553600").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(true, false, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(true, false, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -1177,16 +1829,23 @@ void BtceEmulator_Test::OrderInfo_wrongOrderId()
     QCOMPARE(error, QString("invalid order"));
 }
 
+void BtceEmulator_Test::OrderInfo_valid_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::OrderInfo_valid()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=OrderInfo&nonce=%1&order_id=58320").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(true, false, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(true, false, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -1206,16 +1865,70 @@ void BtceEmulator_Test::OrderInfo_valid()
     QVERIFY(order["start_amount"].toDouble() >= order["amount"].toDouble());
 }
 
+void BtceEmulator_Test::TradeHistory_paging()
+{
+    QMap<UserId, int> taken;
+    for (const PairInfo::Ptr& pair: dataClient->allPairsInfoList())
+        for (const TradeInfo::Ptr& trade: dataClient->allTradesInfo(pair->pair))
+            taken[trade->user_id]++;
+    UserId user_id = 0;
+    for (auto user = taken.constBegin(); user != taken.constEnd() && !user_id; ++user)
+        if (user.value() >= 3)
+            user_id = user.key();
+    if (!user_id)
+        QSKIP("no user with trades");
+
+    HistoryPage page;
+    UserTradeInfo::List all = dataClient->userTradesInfo(user_id, PairName(), page);
+    QVERIFY(all.size() >= 3);
+    for (int i = 1; i < all.size(); i++)
+        QVERIFY(all[i - 1]->tid > all[i]->tid);
+
+    page.from = 1;
+    page.count = 1;
+    UserTradeInfo::List one = dataClient->userTradesInfo(user_id, PairName(), page);
+    QCOMPARE(one.size(), 1);
+    QCOMPARE(one.first()->tid, all[1]->tid);
+
+    page = HistoryPage();
+    page.from_id = all[2]->tid;
+    page.end_id = all[1]->tid;
+    page.desc = false;
+    UserTradeInfo::List range = dataClient->userTradesInfo(user_id, PairName(), page);
+    QCOMPARE(range.size(), 2);
+    QCOMPARE(range.first()->tid, all[2]->tid);
+    QCOMPARE(range.last()->tid, all[1]->tid);
+
+    QByteArray in = QString("method=TransHistory&nonce=%1&count=10&order=ASC").arg(nonce()).toUtf8();
+    QByteArray key = dataClient->randomKeyWithPermissions(true, false, false);
+    QMap<QString, QString> headers;
+    headers["KEY"] = key;
+    headers["SIGN"] = dataClient->signWithKey(in, key);
+    FcgiRequest request(QUrl("http://loclahost:81/tapi"), headers, in);
+    QueryParser parser(request);
+    Method method;
+    QVariantMap responce = client->getResponce(parser, method);
+    QCOMPARE(responce["success"].toInt(), 1);
+    QVERIFY(responce["return"].toMap().size() <= 10);
+}
+
+void BtceEmulator_Test::Trade_parameterPairPresenceCheck_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::Trade_parameterPairPresenceCheck()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=Trade&nonce=%1&rate=100&amount=100&type=buy").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(false, true, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(false, true, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -1225,16 +1938,23 @@ void BtceEmulator_Test::Trade_parameterPairPresenceCheck()
     QCOMPARE(responce["error"].toString(), QString("You incorrectly entered one of fields."));
 }
 
+void BtceEmulator_Test::Trade_parameterPairValidityCheck_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::Trade_parameterPairValidityCheck()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=Trade&nonce=%1&rate=100&amount=100&type=sell&pair=usd_btc").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(false, true, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(false, true, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -1244,16 +1964,23 @@ void BtceEmulator_Test::Trade_parameterPairValidityCheck()
     QCOMPARE(responce["error"].toString(), QString("You incorrectly entered one of fields."));
 }
 
+void BtceEmulator_Test::Trade_parameterTypeCheck_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::Trade_parameterTypeCheck()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=Trade&nonce=%1&rate=100&amount=0.00001&type=bid&pair=btc_usd").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(false, true, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(false, true, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -1266,16 +1993,23 @@ void BtceEmulator_Test::Trade_parameterTypeCheck()
     QCOMPARE(responce["error"].toString(), QString("You incorrectly entered one of fields."));
 }
 
+void BtceEmulator_Test::Trade_parameterAmountMinValueCheck_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::Trade_parameterAmountMinValueCheck()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=Trade&nonce=%1&rate=100&amount=0.00001&type=buy&pair=btc_usd").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyForTrade("usd", Amount(0.2));
+    QByteArray key = dataClient->randomKeyForTrade("usd", Amount(0.2));
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -1290,16 +2024,23 @@ void BtceEmulator_Test::Trade_parameterAmountMinValueCheck()
     QCOMPARE(actual, expected);
 }
 
+void BtceEmulator_Test::Trade_parameterRateMinValueCheck_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::Trade_parameterRateMinValueCheck()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
     url = "http://loclahost:81/tapi";
     in = QString("method=Trade&nonce=%1&rate=0.000001&amount=1&type=sell&pair=btc_usd").arg(nonce()).toUtf8();
-    QByteArray key = sqlClient->randomKeyWithPermissions(false, true, false);
+    QByteArray key = dataClient->randomKeyWithPermissions(false, true, false);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -1312,8 +2053,15 @@ void BtceEmulator_Test::Trade_parameterRateMinValueCheck()
     QCOMPARE(responce["error"].toString(), QString("Price per BTC must be greater than 0.100 USD."));
 }
 
+void BtceEmulator_Test::Trade_buy_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::Trade_buy()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QVariantMap balanceBefore = client->exchangeBalance();
 
     QByteArray in;
@@ -1327,9 +2075,9 @@ void BtceEmulator_Test::Trade_buy()
     balance = rate * amount;
     currency = "usd";
     in = QString("method=Trade&nonce=%1&rate=%4&amount=%3&type=%2&pair=btc_usd").arg(nonce()).arg("buy").arg(dec2qstr(amount, 6)).arg(dec2qstr(rate, 6)).toUtf8();
-    QByteArray key = sqlClient->randomKeyForTrade(currency, balance);
+    QByteArray key = dataClient->randomKeyForTrade(currency, balance);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -1351,8 +2099,15 @@ void BtceEmulator_Test::Trade_buy()
     QCOMPARE(balanceBefore, balanceAfter);
 }
 
+void BtceEmulator_Test::Trade_sell_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::Trade_sell()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QVariantMap balanceBefore = client->exchangeBalance();
 
     QByteArray in;
@@ -1378,9 +2133,9 @@ void BtceEmulator_Test::Trade_sell()
         currency = "usd";
     }
     in = QString("method=Trade&nonce=%1&rate=%4&amount=%3&type=%2&pair=btc_usd").arg(nonce()).arg(isSell?"sell":"buy").arg(dec2qstr(amount, 6)).arg(dec2qstr(rate, 6)).toUtf8();
-    QByteArray key = sqlClient->randomKeyForTrade(currency, balance);
+    QByteArray key = dataClient->randomKeyForTrade(currency, balance);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
@@ -1401,8 +2156,15 @@ void BtceEmulator_Test::Trade_sell()
 
 }
 
+void BtceEmulator_Test::Trade_depositValid_sell_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::Trade_depositValid_sell()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
@@ -1415,21 +2177,21 @@ void BtceEmulator_Test::Trade_depositValid_sell()
 
     in = QString("method=Trade&nonce=%1&rate=%4&amount=%3&type=%2&pair=btc_usd").arg(nonce()).arg("sell").arg(dec2qstr(amount, 6)).arg(dec2qstr(rate, 6)).toUtf8();
 
-    QByteArray key = sqlClient->randomKeyForTrade(currency, amount);
+    QByteArray key = dataClient->randomKeyForTrade(currency, amount);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
     Method method;
 
-    Amount btc_before = sqlClient->getDepositCurrencyVolume(key, "btc");
-    Amount usd_before = sqlClient->getDepositCurrencyVolume(key, "usd");
+    Amount btc_before = dataClient->getDepositCurrencyVolume(key, "btc");
+    Amount usd_before = dataClient->getDepositCurrencyVolume(key, "usd");
 
     QVariantMap responce =client->getResponce(parser, method);
 
-    Amount btc_after = sqlClient->getDepositCurrencyVolume(key, "btc");
-    Amount usd_after = sqlClient->getDepositCurrencyVolume(key, "usd");
+    Amount btc_after = dataClient->getDepositCurrencyVolume(key, "btc");
+    Amount usd_after = dataClient->getDepositCurrencyVolume(key, "usd");
 
     QCOMPARE(responce["success"].toInt(), 1);
     QVERIFY(responce.contains("return") && responce["return"].canConvert(QVariant::Map));
@@ -1445,8 +2207,15 @@ void BtceEmulator_Test::Trade_depositValid_sell()
     QVERIFY(usd_after - usd_before  >= received * rate);
 }
 
+void BtceEmulator_Test::Trade_depositValid_buy_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::Trade_depositValid_buy()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QByteArray in;
     QMap<QString, QString> headers;
     QUrl url;
@@ -1457,21 +2226,21 @@ void BtceEmulator_Test::Trade_depositValid_buy()
 
     in = QString("method=Trade&nonce=%1&rate=%4&amount=%3&type=%2&pair=btc_usd").arg(nonce()).arg("buy").arg(dec2qstr(amount, 6)).arg(dec2qstr(rate, 6)).toUtf8();
 
-    QByteArray key = sqlClient->randomKeyForTrade(currency, amount*rate);
+    QByteArray key = dataClient->randomKeyForTrade(currency, amount*rate);
     headers["KEY"] = key;
-    headers["SIGN"] = sqlClient->signWithKey(in, key);
+    headers["SIGN"] = dataClient->signWithKey(in, key);
 
     FcgiRequest request(url , headers, in);
     QueryParser parser(request);
     Method method;
 
-    Amount btc_before = sqlClient->getDepositCurrencyVolume(key, "btc");
-    Amount usd_before = sqlClient->getDepositCurrencyVolume(key, "usd");
+    Amount btc_before = dataClient->getDepositCurrencyVolume(key, "btc");
+    Amount usd_before = dataClient->getDepositCurrencyVolume(key, "usd");
 
     QVariantMap responce =client->getResponce(parser, method);
 
-    Amount btc_after = sqlClient->getDepositCurrencyVolume(key, "btc");
-    Amount usd_after = sqlClient->getDepositCurrencyVolume(key, "usd");
+    Amount btc_after = dataClient->getDepositCurrencyVolume(key, "btc");
+    Amount usd_after = dataClient->getDepositCurrencyVolume(key, "usd");
 
     QCOMPARE(responce["success"].toInt(), 1);
     QVERIFY(responce.contains("return") && responce["return"].canConvert(QVariant::Map));
@@ -1491,8 +2260,15 @@ void BtceEmulator_Test::Trade_depositValid_buy()
     QVERIFY(usd_before - usd_after  <= amount * rate);
 }
 
+void BtceEmulator_Test::Trade_exchangeTotalBalanceValid_data()
+{
+    backendData();
+}
+
 void BtceEmulator_Test::Trade_exchangeTotalBalanceValid()
 {
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
     QVariantMap balanceBefore = client->exchangeBalance();
 
     for (int i=0; i<4; i++)
@@ -1517,11 +2293,11 @@ void BtceEmulator_Test::Trade_exchangeTotalBalanceValid()
             currency = "usd";
         }
         in = QString("method=Trade&nonce=%1&rate=%4&amount=%3&type=%2&pair=btc_usd").arg(nonce()).arg(isSell?"sell":"buy").arg(dec2qstr(amount, 6)).arg(dec2qstr(rate, 6)).toUtf8();
-        QByteArray key = sqlClient->randomKeyForTrade(currency, balance);
+        QByteArray key = dataClient->randomKeyForTrade(currency, balance);
         if (key.isEmpty())
             continue;
         headers["KEY"] = key;
-        headers["SIGN"] = sqlClient->signWithKey(in, key);
+        headers["SIGN"] = dataClient->signWithKey(in, key);
 
         FcgiRequest request(url , headers, in);
         QueryParser parser(request);
@@ -1537,6 +2313,81 @@ void BtceEmulator_Test::Trade_exchangeTotalBalanceValid()
     }
 }
 
+void BtceEmulator_Test::Trade_exchangeFeesFold_data()
+{
+    backendData();
+}
+
+void BtceEmulator_Test::Trade_exchangeFeesFold()
+{
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
+    QVariantMap balanceBefore = client->exchangeBalance();
+
+    QVERIFY(client->foldExchangeFees());
+    Funds pending = FeeAccumulator::pending();
+    for (const Amount& fee: pending)
+        QVERIFY(fee == Amount(0));
+
+    QVariantMap balanceAfter = client->exchangeBalance();
+    QCOMPARE(balanceBefore, balanceAfter);
+}
+
+void BtceEmulator_Test::Trade_stateReconcile_data()
+{
+    backendData();
+}
+
+void BtceEmulator_Test::Trade_stateReconcile()
+{
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
+    QVERIFY(client->foldExchangeFees());
+    client->reconcileState();
+    Funds deposits = EngineState::exchangeDeposits();
+    QVERIFY(deposits.contains("btc"));
+
+    // fees already in deposits, but their fold record never made it to
+    // journal: they must not be folded twice
+    Funds lost;
+    lost["btc"] = Amount("0.001");
+    FeeAccumulator::add("btc_usd", lost);
+    Funds stale = deposits;
+    stale["btc"] -= lost["btc"];
+    EngineState::setExchangeDeposits(stale);
+
+    client->reconcileState();
+    QVERIFY(FeeAccumulator::pending().value("btc") == Amount(0));
+    QVERIFY(EngineState::exchangeDeposits() == deposits);
+}
+
+void BtceEmulator_Test::Trade_invariantsCheck()
+{
+    QStringList reasons;
+    CurrencyId btc = Registry::currencyId("btc");
+    InvariantMonitor::Transaction transaction;
+
+    // sell order reserves goods taken from deposit, a fee comes on top
+    transaction.depositChanged(btc, -Amount("0.012"));
+    transaction.orderChanged(1, btc, Amount("0.01"), Amount("0.01"));
+    transaction.feeCollected(btc, Amount("0.002"));
+    QVERIFY(InvariantMonitor::isConsistent(transaction, reasons));
+    QVERIFY(reasons.isEmpty());
+
+    // deposit change not matched by reserve or fee
+    transaction.depositChanged(btc, Amount("0.01"));
+    QVERIFY(!InvariantMonitor::isConsistent(transaction, reasons));
+    QCOMPARE(reasons.size(), 1);
+
+    // amount of order must not go below zero
+    transaction.clear();
+    transaction.orderChanged(1, btc, Amount(0), -Amount("0.01"));
+    QVERIFY(!InvariantMonitor::isConsistent(transaction, reasons));
+    QVERIFY(reasons.first().contains("negative"));
+
+    QCOMPARE(InvariantMonitor::violations(), 0);
+}
+
 void BtceEmulator_Test::Trade_tradeBenchmark()
 {
     QVariantMap balanceBefore = client->exchangeBalance();
@@ -1563,11 +2414,11 @@ void BtceEmulator_Test::Trade_tradeBenchmark()
             currency = "usd";
         }
         in = QString("method=Trade&nonce=%1&rate=%4&amount=%3&type=%2&pair=btc_usd").arg(nonce()).arg(isSell?"sell":"buy").arg(dec2qstr(amount, 6)).arg(dec2qstr(rate, 6)).toUtf8();
-        QByteArray key = sqlClient->randomKeyForTrade(currency, balance);
+        QByteArray key = dataClient->randomKeyForTrade(currency, balance);
         if (key.isEmpty())
             continue;
         headers["KEY"] = key;
-        headers["SIGN"] = sqlClient->signWithKey(in, key);
+        headers["SIGN"] = dataClient->signWithKey(in, key);
 
         FcgiRequest request(url , headers, in);
         QueryParser parser(request);
@@ -1575,3 +2426,394 @@ void BtceEmulator_Test::Trade_tradeBenchmark()
         QBENCHMARK(client->getResponce(parser, method));
     }
 }
+
+void BtceEmulator_Test::TradeBatch_allOrNone_data()
+{
+    backendData();
+}
+
+void BtceEmulator_Test::TradeBatch_allOrNone()
+{
+    QFETCH(QString, backend);
+    QVERIFY(useBackend(backend));
+    PairInfo::Ptr pair = dataClient->pairInfo("btc_usd");
+    QVERIFY(pair != nullptr);
+    // sells at max price stay in book
+    QString rate = dec2qstr(pair->max_price, pair->decimal_places);
+    QString tooHigh = dec2qstr(pair->max_price + Rate(1), pair->decimal_places);
+    QByteArray key = dataClient->randomKeyForTrade("btc", Amount(0.02));
+    QUrl url("http://loclahost:81/tapi");
+    auto request = [this, &key, &url](const QString& params)
+    {
+        QByteArray in = QString("nonce=%1&%2").arg(nonce()).arg(params).toUtf8();
+        QMap<QString, QString> headers;
+        headers["KEY"] = key;
+        headers["SIGN"] = dataClient->signWithKey(in, key);
+        FcgiRequest request(url, headers, in);
+        QueryParser parser(request);
+        Method method;
+        return client->getResponce(parser, method);
+    };
+
+    QVariantMap responce = request(QString("method=TradeBatch&pair=btc_usd&orders=sell:%1:0.01,sell:%2:0.01").arg(rate, tooHigh));
+    QCOMPARE(responce["success"].toInt(), 0);
+    QVERIFY(responce["error"].toString().startsWith("order 1: "));
+
+    responce = request(QString("method=TradeBatch&pair=btc_usd&orders=sell:%1:0.01,sell:%1:0.01").arg(rate));
+    QCOMPARE(responce["success"].toInt(), 1);
+    QVariantList orders = responce["return"].toMap()["orders"].toList();
+    QCOMPARE(orders.size(), 2);
+    QString ids;
+    for (const QVariant& order: orders)
+    {
+        QVERIFY(order.toMap()["order_id"].toUInt() != 0);
+        ids += order.toMap()["order_id"].toString() + ',';
+    }
+
+    responce = request(QString("method=CancelOrderBatch&order_ids=%1%2").arg(ids).arg(1));
+    QCOMPARE(responce["success"].toInt(), 1);
+    QCOMPARE(responce["return"].toMap()["cancelled"].toList().size(), 2);
+    QVERIFY(responce["return"].toMap()["errors"].toMap().contains("1"));
+}
+
+void BtceEmulator_Test::LoadBots_cancellers()
+{
+    QTemporaryDir dir;
+    QSettings settings(dir.path() + "/bots.ini", QSettings::IniFormat);
+    settings.setValue("bots/enabled", true);
+    settings.setValue("bots/cancellers", 1);
+    settings.setValue("bots/duration", 1);
+    settings.setValue("bots/pairs", "btc_usd");
+
+    // bot stops by itself after duration, stop() waits for it
+    LoadBots::start(settings, db);
+    QThread::sleep(2);
+    LoadBots::stop();
+    QVERIFY(LoadBots::ordersCount() > 0);
+    QVERIFY(LoadBots::cancelsCount() > 0);
+    QVERIFY(LoadBots::cancelsCount() <= LoadBots::ordersCount());
+}
+
+void BtceEmulator_Test::EngineClock_simulated()
+{
+    QDateTime start = QDateTime::fromString("2017-03-01T12:00:00", Qt::ISODate);
+    // stopped clock moves only with events
+    EngineClock::useSimulated(start, 0);
+    QCOMPARE(EngineClock::now(), start);
+    EngineClock::advanceTo(start.addSecs(3600).toMSecsSinceEpoch());
+    QCOMPARE(EngineClock::now(), start.addSecs(3600));
+    // and never goes back
+    EngineClock::advanceTo(start.toMSecsSinceEpoch());
+    QCOMPARE(EngineClock::now(), start.addSecs(3600));
+
+    // orders get simulated stamps
+    QByteArray key = dataClient->randomKeyForTrade("btc", Amount(0.02));
+    PairInfo::Ptr pair = dataClient->pairInfo("btc_usd");
+    QVERIFY(pair != nullptr);
+    ApikeyInfo::Ptr apikey = dataClient->apikeyInfo(key);
+    QVERIFY(apikey != nullptr);
+    OrderId order_id = dataClient->createNewOrderRecord("btc_usd", apikey->user_id, OrderInfo::Type::Sell, pair->max_price, pair->min_amount);
+    OrderInfo::Ptr order = dataClient->orderInfo(order_id);
+    QVERIFY(order != nullptr);
+    QCOMPARE(order->created, start.addSecs(3600));
+    dataClient->cancelOrder(order_id);
+
+    EngineClock::useReal();
+    QVERIFY(qAbs(EngineClock::now().secsTo(QDateTime::currentDateTime())) < 2);
+}
+
+void BtceEmulator_Test::Metrics_requestStages()
+{
+    auto stageCount = [](const char* stage)
+    {
+        QVariantMap stages = QJsonDocument::fromJson(Metrics::json()).toVariant().toMap()["stages"].toMap();
+        return stages[stage].toMap()["count"].toLongLong();
+    };
+    qint64 parsed = stageCount("parse");
+    qint64 matched = stageCount("match");
+
+    // stages not touched by request are not observed
+    Metrics::beginRequest();
+    Metrics::addStage(Metrics::Stage::Parse, 2000000);
+    Metrics::endRequest(Method::PublicDepth, 3000000);
+
+    QCOMPARE(stageCount("parse"), parsed + 1);
+    QCOMPARE(stageCount("match"), matched);
+    QByteArray text = Metrics::prometheus();
+    QVERIFY(text.contains("emulator_requests_total{method=\"depth\"}"));
+    QVERIFY(text.contains("emulator_stage_duration_seconds_bucket{stage=\"parse\",le=\"+Inf\"}"));
+}
+
+void BtceEmulator_Test::RateLimiter_burst()
+{
+    // one request per second refills too slowly to matter within the test
+    RateLimiter::configure(RateLimiter::Limit::Key, 1, 3, 64);
+    QVERIFY(RateLimiter::admit(RateLimiter::Limit::Key, "key-a"));
+    QVERIFY(RateLimiter::admit(RateLimiter::Limit::Key, "key-a"));
+    QVERIFY(RateLimiter::admit(RateLimiter::Limit::Key, "key-a"));
+    QVERIFY(!RateLimiter::admit(RateLimiter::Limit::Key, "key-a"));
+    // buckets are per key
+    QVERIFY(RateLimiter::admit(RateLimiter::Limit::Key, "key-b"));
+    // address limit is not configured
+    QVERIFY(RateLimiter::admit(RateLimiter::Limit::Address, "127.0.0.1"));
+
+    // with one bucket an active key keeps others out, an idle one yields it
+    RateLimiter::configure(RateLimiter::Limit::Key, 1, 1, 1);
+    QVERIFY(RateLimiter::admit(RateLimiter::Limit::Key, "key-a"));
+    QVERIFY(!RateLimiter::admit(RateLimiter::Limit::Key, "key-b"));
+    QThread::msleep(2100);
+    QVERIFY(RateLimiter::admit(RateLimiter::Limit::Key, "key-b"));
+    QVERIFY(!RateLimiter::admit(RateLimiter::Limit::Key, "key-a"));
+
+    RateLimiter::configure(RateLimiter::Limit::Key, 0, 0);
+    QVERIFY(RateLimiter::admit(RateLimiter::Limit::Key, "key-a"));
+}
+
+void BtceEmulator_Test::IdAllocator_leasedBlocks()
+{
+    if (seeded)
+        QSKIP("needs database");
+    IdAllocator::setBlockSize(3);
+    IdAllocator first(db);
+    IdAllocator second(db);
+
+    // allocators share blocks, ids grow in the order they are taken
+    TradeId a1 = first.nextTradeId();
+    TradeId b1 = second.nextTradeId();
+    TradeId a2 = first.nextTradeId();
+    TradeId b2 = second.nextTradeId();
+    QCOMPARE(b1, a1 + 1);
+    QCOMPARE(a2, b1 + 1);
+    QVERIFY(b2 > a2);
+
+    OrderId order_id = first.nextOrderId();
+    QCOMPARE(ShardConfig::shardOfOrder(order_id, ShardConfig::count()), ShardConfig::index());
+    IdAllocator::setBlockSize(1000);
+}
+
+void BtceEmulator_Test::IdAllocator_priceTimePriority()
+{
+    if (seeded)
+        QSKIP("needs database");
+    IdAllocator::setBlockSize(2);
+    DirectSqlDataAccessor first(db);
+    DirectSqlDataAccessor second(db);
+    const Registry::Pair* pair = Registry::pair("btc_usd");
+    QVERIFY(pair != nullptr);
+    UserId seller = emulatedUser(first);
+    UserId buyer = emulatedUser(first, seller);
+    QVERIFY(seller && buyer);
+    Rate rate = first.pairInfo(pair->name)->min_price;
+
+    // workers take turns placing orders of the same rate, older ones match first
+    QVERIFY(first.transaction());
+    QList<OrderId> placed;
+    for (int i = 0; i < 5; i++)
+    {
+        DirectSqlDataAccessor& worker = (i % 2) ? second : first;
+        placed << worker.createNewOrderRecord(pair->name, seller, OrderInfo::Type::Sell, rate, Amount(1));
+    }
+    QList<OrderId> matched;
+    for (const OrderInfo::Ptr& order: first.matchingOrders(pair->name, OrderInfo::Type::Buy, rate, buyer))
+        if (placed.contains(order->order_id))
+            matched << order->order_id;
+    QVERIFY(first.rollback());
+    IdAllocator::setBlockSize(1000);
+    QCOMPARE(matched, placed);
+}
+
+void BtceEmulator_Test::DataAccessor_rollback_data()
+{
+    QTest::addColumn<QString>("backend");
+    QTest::newRow("memory") << "memory";
+    QTest::newRow("lmdb") << "lmdb";
+}
+
+void BtceEmulator_Test::DataAccessor_rollback()
+{
+    QFETCH(QString, backend);
+    QTemporaryDir directory;
+    std::unique_ptr<AbstractDataAccessor> store;
+    if (backend == "memory")
+    {
+        if (!seeded)
+            InMemoryDataAccessor::load(db);
+        store.reset(new InMemoryDataAccessor);
+    }
+    else
+    {
+        if (seeded)
+            QSKIP("store is imported from database");
+        QVERIFY(LmdbDataAccessor::open(directory.path(), Q_UINT64_C(1) << 30, 0, db));
+        store.reset(new LmdbDataAccessor);
+    }
+    AbstractDataAccessor& accessor = *store;
+    const Registry::Pair* pair = Registry::pair("btc_usd");
+    QVERIFY(pair != nullptr);
+    UserId seller = emulatedUser(accessor);
+    UserId buyer = emulatedUser(accessor, seller);
+    QVERIFY(seller && buyer);
+    Amount usd = accessor.userInfo(buyer)->funds[pair->currency];
+    Rate rate = accessor.pairInfo(pair->name)->min_price;
+
+    // rolled back order and deposit change leave no trace
+    QVERIFY(accessor.transaction());
+    OrderId order_id = accessor.createNewOrderRecord(pair->name, seller, OrderInfo::Type::Sell, rate, Amount(1));
+    QVERIFY(accessor.tradeUpdateDeposit(buyer, pair->currency, Amount(-5), "buyer"));
+    QVERIFY(accessor.orderInfo(order_id) != nullptr);
+    OrderInfo::List matched = accessor.matchingOrders(pair->name, OrderInfo::Type::Buy, rate, buyer);
+    QVERIFY(!matched.isEmpty());
+    QCOMPARE(matched.last()->order_id, order_id);
+    for (const OrderInfo::Ptr& own: accessor.matchingOrders(pair->name, OrderInfo::Type::Buy, rate, seller))
+        QVERIFY(own->order_id != order_id);
+    QVERIFY(accessor.rollback());
+    QVERIFY(accessor.orderInfo(order_id) == nullptr);
+    QVERIFY(accessor.userInfo(buyer)->funds[pair->currency] == usd);
+
+    // committed fill survives rollback of cancel
+    QVERIFY(accessor.transaction());
+    order_id = accessor.createNewOrderRecord(pair->name, seller, OrderInfo::Type::Sell, rate, Amount(2));
+    QVERIFY(accessor.reduceOrderAmount(order_id, Amount(1)));
+    TradeId trade_id = accessor.createNewTradeRecord(buyer, order_id, Amount(1));
+    QVERIFY(trade_id != 0);
+    QVERIFY(accessor.commit());
+    QVERIFY(accessor.transaction());
+    QVERIFY(accessor.cancelOrder(order_id));
+    QVERIFY(accessor.orderInfo(order_id)->status == OrderInfo::Status::PartiallyDone);
+    QVERIFY(accessor.rollback());
+    OrderInfo::Ptr info = accessor.orderInfo(order_id);
+    QVERIFY(info->status == OrderInfo::Status::Active);
+    QVERIFY(info->amount == Amount(1));
+    QCOMPARE(accessor.allTradesInfo(pair->name).first()->tid, trade_id);
+    // tables may be shared with the rest of the suite
+    QVERIFY(accessor.cancelOrder(order_id));
+    store.reset();
+    if (!seeded)
+        InMemoryDataAccessor::clear();
+    LmdbDataAccessor::close();
+}
+
+void BtceEmulator_Test::LmdbDataAccessor_foldsDuringTrades()
+{
+    if (seeded)
+        QSKIP("store is imported from database");
+    QVERIFY(useBackend("lmdb"));
+    QTemporaryDir dir;
+    QSettings settings(dir.path() + "/bots.ini", QSettings::IniFormat);
+    settings.setValue("bots/enabled", true);
+    settings.setValue("bots/makers", 2);
+    settings.setValue("bots/takers", 2);
+    settings.setValue("bots/duration", 2);
+    settings.setValue("bots/pairs", "btc_usd");
+
+    // folds take the store writer between commits of bots, a lock order
+    // mismatch would hang both
+    LoadBots::start(settings, db);
+    QElapsedTimer timer;
+    timer.start();
+    int folds = 0;
+    while (timer.elapsed() < 2500)
+    {
+        QVERIFY(client->foldExchangeFees());
+        folds++;
+    }
+    LoadBots::stop();
+    QVERIFY(LoadBots::ordersCount() > 0);
+    QVERIFY(folds > 1);
+    QVERIFY(client->foldExchangeFees());
+    for (const Amount& fee: FeeAccumulator::pending())
+        QVERIFY(fee == Amount(0));
+}
+
+void BtceEmulator_Test::InMemoryDataAccessor_isolation()
+{
+    if (!seeded)
+        InMemoryDataAccessor::load(db);
+    InMemoryDataAccessor writer;
+    InMemoryDataAccessor other;
+    UserId user_id = emulatedUser(other);
+    QVERIFY(user_id);
+    CurrencyId usd = Registry::currencyId("usd");
+    Amount before = other.depositVolume(user_id, usd);
+
+    // pending change is seen by its own accessor only
+    QVERIFY(writer.transaction());
+    QVERIFY(writer.tradeUpdateDeposit(user_id, usd, Amount(-5), "user"));
+    QVERIFY(writer.depositVolume(user_id, usd) == before - Amount(5));
+    QVERIFY(other.depositVolume(user_id, usd) == before);
+
+    // rollback drops own change, not the one committed meanwhile
+    QVERIFY(other.tradeUpdateDeposit(user_id, usd, Amount(2), "user"));
+    QVERIFY(writer.depositVolume(user_id, usd) == before - Amount(3));
+    QVERIFY(writer.rollback());
+    QVERIFY(other.depositVolume(user_id, usd) == before + Amount(2));
+
+    // commit adds to it as well
+    QVERIFY(writer.transaction());
+    QVERIFY(writer.tradeUpdateDeposit(user_id, usd, Amount(-1), "user"));
+    QVERIFY(writer.commit());
+    QVERIFY(other.depositVolume(user_id, usd) == before + Amount(1));
+    if (seeded)
+        QVERIFY(other.tradeUpdateDeposit(user_id, usd, Amount(-1), "user"));
+    else
+        InMemoryDataAccessor::clear();
+}
+
+void BtceEmulator_Test::OrderArchiver_finishedOrders()
+{
+    if (seeded)
+        QSKIP("needs database");
+    QSqlQuery sql(db);
+    performSql("get finished order", sql, "select order_id from orders where status<>'active' order by order_id limit 1", true);
+    if (!sql.next())
+        QSKIP("no finished orders");
+    OrderId order_id = sql.value(0).toUInt();
+    OrderInfo::Ptr before = dataClient->orderInfo(order_id);
+    int tradesBefore = dataClient->allTradesInfo("btc_usd").size();
+
+    QCOMPARE(OrderArchiver::archiveBatch(db, 1), 1);
+    performSql("find archived order", sql, QString("select count(*) from orders where order_id=%1").arg(order_id), true);
+    QVERIFY(sql.next());
+    QCOMPARE(sql.value(0).toInt(), 0);
+    performSql("check active orders stay", sql, "select count(*) from orders_history where status='active'", true);
+    QVERIFY(sql.next());
+    QCOMPARE(sql.value(0).toInt(), 0);
+
+    // readers see archived order and its trades
+    OrderInfo::Ptr after = dataClient->orderInfo(order_id);
+    QVERIFY(after != nullptr);
+    QVERIFY(after->status == before->status);
+    QVERIFY(after->amount == before->amount);
+    QCOMPARE(dataClient->allTradesInfo("btc_usd").size(), tradesBefore);
+}
+
+void BtceEmulator_Test::Registry_internedIds()
+{
+    const Registry::Pair* pair = Registry::pair("btc_usd");
+    QVERIFY(pair != nullptr);
+    QCOMPARE(Registry::currencyName(pair->goods), QString("btc"));
+    QCOMPARE(Registry::currencyName(pair->currency), QString("usd"));
+    QCOMPARE(&Registry::pair(pair->index), pair);
+    QVERIFY(Registry::pair("xxx_yyy") == nullptr);
+    QCOMPARE(Registry::currencyId("xxx"), static_cast<CurrencyId>(INVALID_CURRENCY));
+
+    QCOMPARE(Registry::currencyOfSqlId(Registry::currencySqlId(pair->goods)), pair->goods);
+    if (!seeded)
+    {
+        QSqlQuery sql(db);
+        performSql("get btc currency id", sql, "select currency_id from currencies where currency='btc'", true);
+        QVERIFY(sql.next());
+        QCOMPARE(Registry::currencySqlId(pair->goods), sql.value(0).toUInt());
+    }
+
+    Funds funds;
+    funds["btc"] = Amount(2);
+    funds["xxx"] = Amount(5);
+    Balances balances = Registry::balances(funds);
+    QVERIFY(balances[pair->goods] == Amount(2));
+    QVERIFY(balances[pair->currency] == Amount(0));
+    funds = Registry::funds(balances);
+    QCOMPARE(funds.size(), Registry::currenciesCount());
+    QVERIFY(funds["btc"] == Amount(2));
+    QVERIFY(!funds.contains("xxx"));
+}
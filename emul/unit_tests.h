@@ -5,6 +5,7 @@
 #include "responce.h"
 #include "sqlclient.h"
 
+#include <QTemporaryDir>
 #include <QtTest>
 
 // TODO: add own sql client for tests s they can check consistency json to real data
@@ -15,11 +16,29 @@ class BtceEmulator_Test : public QObject
 {
     Q_OBJECT
     quint32 nonce();
+    /// emulated user other than given one
+    static UserId emulatedUser(AbstractDataAccessor& accessor, UserId other = 0);
+    /// client and fixture accessor over the store of backend, false if
+    /// it cannot be opened: then base backend is used
+    bool useBackend(const QString& backend);
+    /// backend column with a row for every accessor the suite can open,
+    /// accessor tests take their backend from it
+    void backendData();
     std::unique_ptr<Responce> client;
-    std::unique_ptr<AbstractDataAccessor> sqlClient;
+    /// accessor of client's data for fixtures, over the store of current backend
+    std::unique_ptr<AbstractDataAccessor> dataClient;
+    std::unique_ptr<QTemporaryDir> lmdbDirectory;
+    QSqlDatabase& db;
+    bool seeded;
+    /// accessor of the rest of the suite
+    QString baseBackend;
+    QString currentBackend;
 public:
-    BtceEmulator_Test(QSqlDatabase& db);
+    /// seeded suite runs on tables of InMemoryDataAccessor::seed(), database is not open
+    BtceEmulator_Test(QSqlDatabase& db, bool seeded);
 private slots:
+    void cleanup();
+
     void FcgiRequest_httpGetQuery();
     void FcgiRequest_httpPostQuery();
 
@@ -30,6 +49,8 @@ private slots:
     void QueryParser_limitParameterRetrieving();
     void QueryParser_defaultLimitValue();
     void QueryParser_limitOverflow();
+    void QueryParser_methodDispatch();
+    void QueryParser_postParamsRetrieving();
 
     void Methods_invalidMethod();
     void Methods_publicInfo();
@@ -54,6 +75,7 @@ private slots:
     void Ticker_timestampFormat();
     void Ticker_duplicatePair();
     void Ticker_ignoreInvalidForDuplicatePair();
+    void Ticker_liveQuote();
 
     void Authentication_noKey();
     void Authentication_invalidKey();
@@ -65,10 +87,14 @@ private slots:
     void Authentication_noNonce();
     void Authentication_invalidNonce();
 
+    void Method_privateGetInfo_data();
     void Method_privateGetInfo();
     void Method_privateActiveOrders();
+    void Method_privateOrderInfo_data();
     void Method_privateOrderInfo();
+    void Method_privateTrade_data();
     void Method_privateTrade();
+    void Method_privateCancelOrder_data();
     void Method_privateCancelOrder();
 
     void Depth_emptyList();
@@ -77,30 +103,80 @@ private slots:
     void Depth_sortedByRate();
     void Depth_ratesDecimalDigits();
     void Depth_limit();
+    void Depth_sinceVersion();
+    void Depth_cachedVariants();
 
     void Trades_emptyList();
     void Trades_valid();
     void Trades_limit();
     void Trades_sortedByTimestamp();
 
+    void GetInfo_valid_data();
     void GetInfo_valid();
 
     void ActiveOrders_valid();
 
+    void UserIndex_orderLifecycle();
+    void UserIndex_saveRestore();
+    void EntityPool_handles();
+    void EntityPool_sharedEntities();
+
+    void OrderBook_levels();
+    void OrderBook_replicaUpdates();
+    void OrderBook_tickLadder();
+    void OrderBook_ladderBenchmark_data();
+    void OrderBook_ladderBenchmark();
+
+    void ShardConfig_orderShard();
+
+    void Metrics_requestStages();
+    void RateLimiter_burst();
+    void IdAllocator_leasedBlocks();
+    void IdAllocator_priceTimePriority();
+    void DataAccessor_rollback_data();
+    void DataAccessor_rollback();
+    void LmdbDataAccessor_foldsDuringTrades();
+    void InMemoryDataAccessor_isolation();
+    void OrderArchiver_finishedOrders();
+    void Registry_internedIds();
+
+    void OrderInfo_missingOrderId_data();
     void OrderInfo_missingOrderId();
+    void OrderInfo_wrongOrderId_data();
     void OrderInfo_wrongOrderId();
+    void OrderInfo_valid_data();
     void OrderInfo_valid();
+    void TradeHistory_paging();
 
+    void Trade_parameterPairPresenceCheck_data();
     void Trade_parameterPairPresenceCheck();
+    void Trade_parameterPairValidityCheck_data();
     void Trade_parameterPairValidityCheck();
+    void Trade_parameterTypeCheck_data();
     void Trade_parameterTypeCheck();
+    void Trade_parameterAmountMinValueCheck_data();
     void Trade_parameterAmountMinValueCheck();
+    void Trade_parameterRateMinValueCheck_data();
     void Trade_parameterRateMinValueCheck();
+    void Trade_buy_data();
     void Trade_buy();
+    void Trade_sell_data();
     void Trade_sell();
+    void Trade_depositValid_sell_data();
     void Trade_depositValid_sell();
+    void Trade_depositValid_buy_data();
     void Trade_depositValid_buy();
+    void Trade_exchangeTotalBalanceValid_data();
     void Trade_exchangeTotalBalanceValid();
+    void Trade_exchangeFeesFold_data();
+    void Trade_exchangeFeesFold();
+    void Trade_stateReconcile_data();
+    void Trade_stateReconcile();
+    void Trade_invariantsCheck();
     void Trade_tradeBenchmark();
+    void TradeBatch_allOrNone_data();
+    void TradeBatch_allOrNone();
+    void LoadBots_cancellers();
+    void EngineClock_simulated();
 };
 #endif // UNIT_TESTS_H
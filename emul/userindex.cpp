@@ -0,0 +1,372 @@
+#include "userindex.h"
+#include "registry.h"
+
+#include <utility>
+
+UserIndex::Tables UserIndex::tables;
+QMutex UserIndex::usersAccess;
+QReadWriteLock UserIndex::commitAccess;
+
+void UserIndex::Batch::balanceChanged(UserId user_id, CurrencyId currency, const Amount& diff)
+{
+    Op op;
+    op.kind = Kind::Balance;
+    op.user_id = user_id;
+    op.currency = currency;
+    op.amount = diff;
+    ops.append(op);
+}
+
+void UserIndex::Batch::orderCreated(UserId user_id, const Order& order)
+{
+    Op op;
+    op.kind = Kind::Created;
+    op.user_id = user_id;
+    op.order = order;
+    ops.append(op);
+}
+
+void UserIndex::Batch::orderReduced(UserId user_id, OrderId order_id, const Amount& amount)
+{
+    Op op;
+    op.kind = Kind::Reduced;
+    op.user_id = user_id;
+    op.order.order_id = order_id;
+    op.amount = amount;
+    ops.append(op);
+}
+
+void UserIndex::Batch::orderClosed(UserId user_id, OrderId order_id)
+{
+    Op op;
+    op.kind = Kind::Closed;
+    op.user_id = user_id;
+    op.order.order_id = order_id;
+    ops.append(op);
+}
+
+void UserIndex::Batch::write(QDataStream& stream) const
+{
+    stream << static_cast<quint32>(ops.size());
+    for (const Op& op: ops)
+    {
+        QString currency = (op.kind == Kind::Balance) ? Registry::currencyName(op.currency) : QString();
+        stream << static_cast<quint8>(op.kind) << op.user_id << currency << op.amount;
+        writeOrder(stream, op.order);
+    }
+}
+
+void UserIndex::Batch::read(QDataStream& stream)
+{
+    quint32 count;
+    stream >> count;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++)
+    {
+        Op op;
+        quint8 kind;
+        QString currency;
+        stream >> kind >> op.user_id >> currency >> op.amount;
+        readOrder(stream, op.order);
+        op.kind = static_cast<Kind>(kind);
+        op.currency = (op.kind == Kind::Balance) ? Registry::currencyId(currency) : INVALID_CURRENCY;
+        if (op.kind == Kind::Balance && op.currency == INVALID_CURRENCY)
+            continue;
+        ops.append(op);
+    }
+}
+
+QReadWriteLock& UserIndex::commitLock()
+{
+    return commitAccess;
+}
+
+void UserIndex::Tables::insertOrder(Entry& entry, const Order& order)
+{
+    const Registry::Pair* pair = Registry::pair(order.pair);
+    if (!pair || orderHandles.contains(order.order_id))
+        return;
+
+    StoredOrder stored;
+    stored.order_id = order.order_id;
+    stored.pair = pair->index;
+    stored.type = order.type;
+    stored.start_amount = order.start_amount;
+    stored.amount = order.amount;
+    stored.rate = order.rate;
+    stored.created = order.created.toMSecsSinceEpoch();
+    stored.next = entry.firstOrder;
+    OrderPool::Handle handle = orders.create(stored);
+    if (handle == OrderPool::INVALID)
+        return;
+
+    if (StoredOrder* first = orders.get(entry.firstOrder))
+        first->prev = handle;
+    entry.firstOrder = handle;
+    entry.ordersCount++;
+    orderHandles.insert(order.order_id, handle);
+}
+
+void UserIndex::Tables::eraseOrder(Entry& entry, OrderPool::Handle handle)
+{
+    StoredOrder* stored = orders.get(handle);
+    if (!stored)
+        return;
+    if (StoredOrder* prev = orders.get(stored->prev))
+        prev->next = stored->next;
+    else
+        entry.firstOrder = stored->next;
+    if (StoredOrder* next = orders.get(stored->next))
+        next->prev = stored->prev;
+    entry.ordersCount--;
+    orderHandles.remove(stored->order_id);
+    orders.destroy(handle);
+}
+
+void UserIndex::Tables::eraseOrders(Entry& entry)
+{
+    while (entry.firstOrder != OrderPool::INVALID)
+        eraseOrder(entry, entry.firstOrder);
+}
+
+void UserIndex::Tables::insertUser(UserId user_id, const Entry& entry, const QList<Order>& userOrders)
+{
+    auto iter = users.find(user_id);
+    if (iter != users.end())
+        eraseOrders(iter.value());
+    else
+        iter = users.insert(user_id, Entry());
+    iter->funds = entry.funds;
+    for (const Order& order: userOrders)
+        insertOrder(iter.value(), order);
+}
+
+UserIndex::Order UserIndex::toOrder(const StoredOrder& stored)
+{
+    Order order;
+    order.order_id = stored.order_id;
+    order.pair = Registry::pair(stored.pair).name;
+    order.type = stored.type;
+    order.start_amount = stored.start_amount;
+    order.amount = stored.amount;
+    order.rate = stored.rate;
+    order.created = QDateTime::fromMSecsSinceEpoch(stored.created);
+    return order;
+}
+
+bool UserIndex::isLoaded(UserId user_id)
+{
+    QMutexLocker lock(&usersAccess);
+    return tables.users.contains(user_id);
+}
+
+void UserIndex::load(UserId user_id, const Balances& funds, const OrderInfo::List& activeOrders)
+{
+    Entry entry;
+    entry.funds = funds;
+    QList<Order> orders;
+    for (const OrderInfo::Ptr& info: activeOrders)
+    {
+        Order order;
+        order.order_id = info->order_id;
+        order.pair = info->pair;
+        order.type = info->type;
+        order.start_amount = info->start_amount;
+        order.amount = info->amount;
+        order.rate = info->rate;
+        order.created = info->created;
+        orders.append(order);
+    }
+
+    QMutexLocker lock(&usersAccess);
+    tables.insertUser(user_id, entry, orders);
+}
+
+void UserIndex::apply(const Batch& batch)
+{
+    QMutexLocker lock(&usersAccess);
+    for (const Batch::Op& op: batch.ops)
+    {
+        auto iter = tables.users.find(op.user_id);
+        if (iter == tables.users.end())
+            continue;
+        Entry& entry = iter.value();
+        switch (op.kind)
+        {
+            case Batch::Kind::Balance:
+                entry.funds[op.currency] += op.amount;
+                break;
+            case Batch::Kind::Created:
+                tables.insertOrder(entry, op.order);
+                break;
+            case Batch::Kind::Reduced:
+            {
+                StoredOrder* order = tables.orders.get(tables.orderHandles.value(op.order.order_id, OrderPool::INVALID));
+                if (order)
+                    order->amount -= op.amount;
+                break;
+            }
+            case Batch::Kind::Closed:
+                tables.eraseOrder(entry, tables.orderHandles.value(op.order.order_id, OrderPool::INVALID));
+                break;
+        }
+    }
+}
+
+bool UserIndex::funds(UserId user_id, Funds& funds)
+{
+    QMutexLocker lock(&usersAccess);
+    auto iter = tables.users.constFind(user_id);
+    if (iter == tables.users.constEnd())
+        return false;
+    funds = Registry::funds(iter->funds);
+    return true;
+}
+
+int UserIndex::openOrdersCount(UserId user_id)
+{
+    QMutexLocker lock(&usersAccess);
+    auto iter = tables.users.constFind(user_id);
+    if (iter == tables.users.constEnd())
+        return 0;
+    return iter->ordersCount;
+}
+
+QList<UserIndex::Order> UserIndex::activeOrders(UserId user_id)
+{
+    QList<Order> orders;
+    QMutexLocker lock(&usersAccess);
+    auto iter = tables.users.constFind(user_id);
+    if (iter == tables.users.constEnd())
+        return orders;
+    for (const StoredOrder* order = tables.orders.get(iter->firstOrder); order; order = tables.orders.get(order->next))
+        orders.append(toOrder(*order));
+    return orders;
+}
+
+QSet<OrderId> UserIndex::activeOrderIds(UserId user_id, const PairName& pair)
+{
+    QSet<OrderId> ids;
+    const Registry::Pair* pairRef = Registry::pair(pair);
+    QMutexLocker lock(&usersAccess);
+    auto iter = tables.users.constFind(user_id);
+    if (!pairRef || iter == tables.users.constEnd())
+        return ids;
+    for (const StoredOrder* order = tables.orders.get(iter->firstOrder); order; order = tables.orders.get(order->next))
+        if (order->pair == pairRef->index)
+            ids.insert(order->order_id);
+    return ids;
+}
+
+void UserIndex::writeOrder(QDataStream& stream, const Order& order)
+{
+    stream << order.order_id << order.pair << static_cast<quint8>(order.type)
+           << order.start_amount << order.amount << order.rate << order.created;
+}
+
+void UserIndex::readOrder(QDataStream& stream, Order& order)
+{
+    quint8 type;
+    stream >> order.order_id >> order.pair >> type
+           >> order.start_amount >> order.amount >> order.rate >> order.created;
+    order.type = static_cast<OrderInfo::Type>(type);
+}
+
+void UserIndex::writeEntry(QDataStream& stream, const Tables& from, UserId user_id, const Entry& entry)
+{
+    stream << user_id << Registry::funds(entry.funds) << static_cast<quint32>(entry.ordersCount);
+    for (const StoredOrder* order = from.orders.get(entry.firstOrder); order; order = from.orders.get(order->next))
+        writeOrder(stream, toOrder(*order));
+}
+
+UserId UserIndex::readEntry(QDataStream& stream, Entry& entry, QList<Order>& orders)
+{
+    UserId user_id;
+    Funds funds;
+    quint32 ordersCount;
+    stream >> user_id >> funds >> ordersCount;
+    entry.funds = Registry::balances(funds);
+    for (quint32 j = 0; j < ordersCount && stream.status() == QDataStream::Ok; j++)
+    {
+        Order order;
+        readOrder(stream, order);
+        orders.append(order);
+    }
+    return user_id;
+}
+
+std::shared_ptr<const UserIndex::Copy> UserIndex::copy()
+{
+    // users hash is shared till the next change, pool slabs are copied flat
+    std::shared_ptr<Copy> copy = std::make_shared<Copy>();
+    QMutexLocker lock(&usersAccess);
+    copy->tables = tables;
+    return copy;
+}
+
+void UserIndex::save(QDataStream& stream, const Copy& copy)
+{
+    const Tables& from = copy.tables;
+    stream << static_cast<quint32>(from.users.size());
+    for (auto user = from.users.constBegin(); user != from.users.constEnd(); user++)
+        writeEntry(stream, from, user.key(), user.value());
+}
+
+void UserIndex::save(QDataStream& stream)
+{
+    save(stream, *copy());
+}
+
+QList<UserId> UserIndex::loadedUsers()
+{
+    QMutexLocker lock(&usersAccess);
+    return tables.users.keys();
+}
+
+void UserIndex::unload(UserId user_id)
+{
+    QMutexLocker lock(&usersAccess);
+    auto iter = tables.users.find(user_id);
+    if (iter == tables.users.end())
+        return;
+    tables.eraseOrders(iter.value());
+    tables.users.erase(iter);
+}
+
+void UserIndex::restore(QDataStream& stream)
+{
+    Tables restored;
+    quint32 count;
+    stream >> count;
+    restored.users.reserve(count);
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++)
+    {
+        Entry entry;
+        QList<Order> orders;
+        UserId user_id = readEntry(stream, entry, orders);
+        restored.insertUser(user_id, entry, orders);
+    }
+
+    QMutexLocker lock(&usersAccess);
+    std::swap(tables, restored);
+}
+
+bool UserIndex::saveUser(QDataStream& stream, UserId user_id)
+{
+    QMutexLocker lock(&usersAccess);
+    auto iter = tables.users.constFind(user_id);
+    if (iter == tables.users.constEnd())
+        return false;
+    writeEntry(stream, tables, user_id, iter.value());
+    return true;
+}
+
+void UserIndex::restoreUser(QDataStream& stream)
+{
+    Entry entry;
+    QList<Order> orders;
+    UserId user_id = readEntry(stream, entry, orders);
+    if (stream.status() != QDataStream::Ok)
+        return;
+    QMutexLocker lock(&usersAccess);
+    tables.insertUser(user_id, entry, orders);
+}
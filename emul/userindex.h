@@ -0,0 +1,150 @@
+#ifndef USERINDEX_H
+#define USERINDEX_H
+
+#include "types.h"
+#include "entitypool.h"
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QSet>
+
+#include <memory>
+
+/// In-memory per-user index of balances and active orders.
+/// Users are loaded from SQL on first access and then kept up to date by
+/// order lifecycle events, collected in a Batch during a transaction and
+/// applied only after commit.
+/// Active orders of all users live in one EntityPool, linked into a list
+/// per user, so creating and closing an order reuses a pool slot.
+class UserIndex
+{
+public:
+    struct Order
+    {
+        OrderId order_id;
+        PairName pair;
+        OrderInfo::Type type;
+        Amount start_amount;
+        Amount amount;
+        Rate rate;
+        QDateTime created;
+    };
+
+    class Batch
+    {
+    public:
+        void balanceChanged(UserId user_id, CurrencyId currency, const Amount& diff);
+        void orderCreated(UserId user_id, const Order& order);
+        void orderReduced(UserId user_id, OrderId order_id, const Amount& amount);
+        void orderClosed(UserId user_id, OrderId order_id);
+
+        void clear() { ops.clear(); }
+        bool isEmpty() const { return ops.isEmpty(); }
+
+        void write(QDataStream& stream) const;
+        void read(QDataStream& stream);
+
+    private:
+        friend class UserIndex;
+        enum class Kind {Balance, Created, Reduced, Closed};
+        struct Op
+        {
+            Kind kind;
+            UserId user_id;
+            CurrencyId currency;
+            Amount amount;
+            Order order;
+        };
+        QList<Op> ops;
+    };
+
+    /// Commit of a transaction and application of its batch should be done
+    /// under read lock, loading a user from SQL takes write lock.
+    /// This prevents changes already committed to SQL to be applied twice.
+    static QReadWriteLock& commitLock();
+
+    static bool isLoaded(UserId user_id);
+    static void load(UserId user_id, const Balances& funds, const OrderInfo::List& activeOrders);
+    static void apply(const Batch& batch);
+
+    /// funds by currency name, for responses
+    static bool funds(UserId user_id, Funds& funds);
+    static int openOrdersCount(UserId user_id);
+    static QList<Order> activeOrders(UserId user_id);
+    static QSet<OrderId> activeOrderIds(UserId user_id, const PairName& pair);
+
+    class Copy;
+    /// copy of whole index; taken under commit lock for a state snapshot,
+    /// it is written out by save() with no lock held
+    static std::shared_ptr<const Copy> copy();
+    /// whole index, for state snapshots; balances are stored by currency
+    /// name, so files survive changes of interned ids
+    static void save(QDataStream& stream, const Copy& copy);
+    static void save(QDataStream& stream);
+    static void restore(QDataStream& stream);
+    static QList<UserId> loadedUsers();
+    /// drops user, next access loads it from SQL again
+    static void unload(UserId user_id);
+    /// one user, for change stream; false if user is not loaded
+    static bool saveUser(QDataStream& stream, UserId user_id);
+    static void restoreUser(QDataStream& stream);
+
+private:
+    static void writeOrder(QDataStream& stream, const Order& order);
+    static void readOrder(QDataStream& stream, Order& order);
+
+    struct StoredOrder
+    {
+        OrderId order_id = 0;
+        quint16 pair = 0;
+        OrderInfo::Type type = OrderInfo::Type::Sell;
+        Amount start_amount;
+        Amount amount;
+        Rate rate;
+        qint64 created = 0;
+        /// neighbours in list of orders of the same user
+        quint32 prev = 0;
+        quint32 next = 0;
+    };
+    using OrderPool = EntityPool<StoredOrder>;
+
+    struct Entry
+    {
+        Balances funds {};
+        OrderPool::Handle firstOrder = OrderPool::INVALID;
+        int ordersCount = 0;
+    };
+
+    /// all state of the index, swapped as a whole on restore
+    struct Tables
+    {
+        QHash<UserId, Entry> users;
+        OrderPool orders;
+        QHash<OrderId, OrderPool::Handle> orderHandles;
+
+        void insertOrder(Entry& entry, const Order& order);
+        void eraseOrder(Entry& entry, OrderPool::Handle handle);
+        void eraseOrders(Entry& entry);
+        void insertUser(UserId user_id, const Entry& entry, const QList<Order>& orders);
+    };
+
+    static Order toOrder(const StoredOrder& stored);
+    static void writeEntry(QDataStream& stream, const Tables& from, UserId user_id, const Entry& entry);
+    static UserId readEntry(QDataStream& stream, Entry& entry, QList<Order>& orders);
+
+public:
+    class Copy
+    {
+        friend class UserIndex;
+        Tables tables;
+    };
+
+private:
+    static Tables tables;
+    static QMutex usersAccess;
+    static QReadWriteLock commitAccess;
+};
+
+#endif // USERINDEX_H
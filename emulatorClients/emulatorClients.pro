@@ -1,4 +1,4 @@
-QT += core sql
+QT += core sql network
 QT -= gui
 
 #CONFIG += c++1z
@@ -14,7 +14,12 @@ LIBS += -L../lib -lcommon -lbtce
 INCLUDEPATH += ../common ../btce ../decimal_for_cpp/include
 
 SOURCES += main.cpp \
-    ../emul/sqlclient.cpp
+    ../emul/sqlclient.cpp \
+    ../emul/metrics.cpp \
+    ../emul/methodtable.cpp \
+    ../emul/idallocator.cpp \
+    ../emul/registry.cpp \
+    ../emul/shardconfig.cpp
 
 DEFINES += DEC_NAMESPACE=cppdec
 
@@ -0,0 +1,308 @@
+#include "curl_wrapper.h"
+#include "optionparser.h"
+#include "requestcapture.h"
+
+#include <QCoreApplication>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSettings>
+#include <QVector>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include <curl/curl.h>
+
+#include <pthread.h>
+
+using Clock = std::chrono::steady_clock;
+
+struct Arg: public option::Arg
+{
+  static void printError(const char* msg1, const option::Option& opt, const char* msg2)
+  {
+    fprintf(stderr, "%s", msg1);
+    fwrite(opt.name, opt.namelen, 1, stderr);
+    fprintf(stderr, "%s", msg2);
+  }
+
+  static option::ArgStatus Unknown(const option::Option& option, bool msg)
+  {
+    if (msg) printError("Unknown option '", option, "'\n");
+    return option::ARG_ILLEGAL;
+  }
+
+  static option::ArgStatus NonEmpty(const option::Option& option, bool msg)
+  {
+    if (option.arg != 0 && option.arg[0] != 0)
+      return option::ARG_OK;
+
+    if (msg) printError("Option '", option, "' requires a non-empty argument\n");
+    return option::ARG_ILLEGAL;
+  }
+
+  static option::ArgStatus Numeric(const option::Option& option, bool msg)
+  {
+    char* endptr = 0;
+    if (option.arg != 0 && strtol(option.arg, &endptr, 10)){};
+    if (endptr != option.arg && *endptr == 0)
+      return option::ARG_OK;
+
+    if (msg) printError("Option '", option, "' requires a numeric argument\n");
+    return option::ARG_ILLEGAL;
+  }
+
+  static option::ArgStatus Decimal(const option::Option& option, bool msg)
+  {
+    if (option.arg != 0)
+    {
+        bool ok;
+        QString(option.arg).toDouble(&ok);
+        if (ok)
+            return option::ARG_OK;
+    }
+
+    if (msg) printError("Option '", option, "' requires a decimal argument\n");
+    return option::ARG_ILLEGAL;
+  }
+};
+
+enum optionIndex{Unknown, Help, Capture, Speed, Threads, Server};
+
+const option::Descriptor usage[]={
+    {Unknown, 0, "", "", Arg::Unknown, "Usage: emulatorReplay --capture=<file> {options}\n\n"
+                                       "Replays requests captured by emulator and reports throughput and latencies.\n"
+                                       "Private requests keep their captured nonces, so replay them against\n"
+                                       "database restored to the state it had when capture started. Requests\n"
+                                       "of one key go through one connection in order of arrival.\n"
+                                       "Emulator with [clock] mode=simulated stamps replayed orders and trades\n"
+                                       "with their captured arrival, --speed=0 then runs days of capture in minutes.\n\nOptions:"},
+    {Help, 0, "", "help", Arg::None, "\t--help \tPrint usage and exit."},
+    {Capture, 0, "", "capture", Arg::NonEmpty, "\t--capture=<file> \tRequest capture written by emulator."},
+    {Speed, 0, "", "speed", Arg::Decimal, "\t--speed=<x> \tReplay speed factor, 1 is original speed, 0 is as fast as possible. Default 1."},
+    {Threads, 0, "", "threads", Arg::Numeric, "\t--threads=<n> \tNumber of concurrent connections. Default 8."},
+    {Server, 0, "", "server", Arg::NonEmpty, "\t--server=<url> \tEmulator address, emulator/server_address from emul.ini by default."},
+    {0,0,0,0,0,0}
+};
+
+struct ReplayShared
+{
+    QVector<RequestCapture::Record> records;   // sorted by arrival
+    QByteArray server;
+    double speed;
+    Clock::time_point start;
+};
+
+struct ReplayThreadData
+{
+    ReplayShared* shared;
+    QVector<int> queue;           // indexes of records, in order of arrival
+    QVector<quint32> latencies;   // microseconds
+    QVector<quint32> lags;        // microseconds behind schedule
+    quint32 errors = 0;
+};
+
+static size_t writeFunc(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+    static_cast<QByteArray*>(userdata)->append(ptr, static_cast<int>(size * nmemb));
+    return size * nmemb;
+}
+
+/// public methods answer with bare data, private ones with success field
+static bool isSuccess(const QByteArray& reply)
+{
+    QJsonDocument doc = QJsonDocument::fromJson(reply);
+    if (doc.isNull())
+        return false;
+    if (!doc.isObject() || !doc.object().contains("success"))
+        return true;
+    return doc.object().value("success").toInt() == 1;
+}
+
+static void* replayThread(void* data)
+{
+    ReplayThreadData* pData = static_cast<ReplayThreadData*>(data);
+    ReplayShared* shared = pData->shared;
+    qint64 firstArrival = shared->records.first().arrival;
+
+    QByteArray reply;
+    CURL* curl = curl_easy_init();
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeFunc);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &reply);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L);
+
+    for (int i: pData->queue)
+    {
+        const RequestCapture::Record& record = shared->records[i];
+
+        if (shared->speed > 0)
+        {
+            auto offset = std::chrono::microseconds(static_cast<qint64>((record.arrival - firstArrival) / shared->speed));
+            Clock::time_point scheduled = shared->start + offset;
+            Clock::time_point now = Clock::now();
+            if (scheduled > now)
+                std::this_thread::sleep_until(scheduled);
+            else
+                pData->lags << static_cast<quint32>(std::chrono::duration_cast<std::chrono::microseconds>(now - scheduled).count());
+        }
+
+        QByteArray url = shared->server + record.documentUri;
+        if (!record.queryString.isEmpty())
+            url += '?' + record.queryString;
+
+        CurlListWrapper headers;
+        if (!record.key.isEmpty())
+            headers.append("Key: " + record.key);
+        if (!record.sign.isEmpty())
+            headers.append("Sign: " + record.sign);
+        // emulator running simulated clock moves it to original arrival
+        headers.append("Sim-Time: " + QByteArray::number(record.arrival / 1000));
+        headers.setHeaders(curl);
+
+        curl_easy_setopt(curl, CURLOPT_URL, url.constData());
+        if (record.postData.isNull())
+            curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        else
+        {
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, record.postData.constData());
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, static_cast<long>(record.postData.size()));
+        }
+
+        reply.clear();
+        Clock::time_point sent = Clock::now();
+        CURLcode rc = curl_easy_perform(curl);
+        quint32 latency = static_cast<quint32>(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - sent).count());
+
+        long httpCode = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
+        if (rc != CURLE_OK || httpCode != 200 || !isSuccess(reply))
+            pData->errors++;
+        else
+            pData->latencies << latency;
+    }
+
+    curl_easy_cleanup(curl);
+    return nullptr;
+}
+
+static void printDistribution(const char* caption, QVector<quint32> values)
+{
+    if (values.isEmpty())
+    {
+        std::cout << caption << ": no data" << std::endl;
+        return;
+    }
+    std::sort(values.begin(), values.end());
+    auto percentile = [&values](double p)
+    {
+        int index = qMin(values.size() - 1, static_cast<int>(p * values.size()));
+        return values[index] / 1000.0;
+    };
+    std::cout << caption << " (ms):"
+              << " p50 " << percentile(0.50)
+              << " p90 " << percentile(0.90)
+              << " p99 " << percentile(0.99)
+              << " p99.9 " << percentile(0.999)
+              << " max " << values.last() / 1000.0
+              << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    CurlWrapper wrapper;
+    QCoreApplication a(argc, argv);
+
+    argc -= (argc>0);
+    argv += (argc>0);
+    option::Stats stats(usage, argc, argv);
+    std::vector<option::Option> options(stats.options_max);
+    std::vector<option::Option> buffer(stats.buffer_max);
+    option::Parser parser(usage, argc, argv, options.data(), buffer.data());
+
+    if (parser.error())
+        return 1;
+
+    if (options[Help] || !options[Capture])
+    {
+        int columns = getenv("COLUMNS")?atoi(getenv("COLUMNS")) : 80;
+        option::printUsage(fwrite, stdout, usage, columns);
+        return options[Help] ? 0 : 1;
+    }
+
+    ReplayShared shared;
+    shared.speed = options[Speed] ? QString(options[Speed].arg).toDouble() : 1.0;
+    quint32 threadsCount = options[Threads] ? QString(options[Threads].arg).toUInt() : 8;
+
+    if (options[Server])
+        shared.server = options[Server].arg;
+    else
+    {
+        QString iniFilePath = QCoreApplication::applicationDirPath() + "/../data/emul.ini";
+        QSettings settings(iniFilePath, QSettings::IniFormat);
+        shared.server = settings.value("emulator/server_address", "http://localhost:81").toString().toUtf8();
+    }
+
+    RequestCapture::Reader reader;
+    if (!reader.open(options[Capture].arg))
+        return 2;
+    RequestCapture::Record record;
+    QVector<quint32> capturedLatencies;
+    while (reader.next(record))
+    {
+        capturedLatencies << record.latency;
+        shared.records << record;
+    }
+    if (shared.records.isEmpty())
+    {
+        std::cerr << "capture is empty" << std::endl;
+        return 3;
+    }
+    // capture is written by many workers, so it is only roughly ordered
+    std::stable_sort(shared.records.begin(), shared.records.end(),
+                     [](const RequestCapture::Record& a, const RequestCapture::Record& b) { return a.arrival < b.arrival; });
+    double capturedSeconds = (shared.records.last().arrival - shared.records.first().arrival) / 1e6;
+    std::clog << "loaded " << shared.records.size() << " requests spanning " << capturedSeconds << " s" << std::endl;
+
+    threadsCount = qMax(threadsCount, 1u);
+    std::vector<pthread_t> id(threadsCount);
+    std::vector<ReplayThreadData> threadData(threadsCount);
+    // nonces of a key must come in order, so all its requests go through
+    // one thread; public ones are spread round robin
+    quint32 publicThread = 0;
+    for (int i = 0; i < shared.records.size(); i++)
+    {
+        const QByteArray& key = shared.records[i].key;
+        quint32 thread = key.isEmpty() ? publicThread++ % threadsCount : qHash(key) % threadsCount;
+        threadData[thread].queue << i;
+    }
+    shared.start = Clock::now();
+    for (quint32 i = 0; i < threadsCount; i++)
+    {
+        threadData[i].shared = &shared;
+        pthread_create(&id[i], nullptr, replayThread, &threadData[i]);
+    }
+    for (quint32 i = 0; i < threadsCount; i++)
+        pthread_join(id[i], nullptr);
+    double elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - shared.start).count() / 1e6;
+
+    QVector<quint32> latencies;
+    QVector<quint32> lags;
+    quint32 errors = 0;
+    for (const ReplayThreadData& d: threadData)
+    {
+        latencies += d.latencies;
+        lags += d.lags;
+        errors += d.errors;
+    }
+
+    std::cout << "replayed " << shared.records.size() << " requests in " << elapsed << " s, "
+              << shared.records.size() / elapsed << " rps, " << errors << " failed" << std::endl;
+    printDistribution("replay latency", latencies);
+    printDistribution("captured emulator latency", capturedLatencies);
+    if (shared.speed > 0)
+        printDistribution("schedule lag", lags);
+
+    return errors ? 4 : 0;
+}
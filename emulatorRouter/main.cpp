@@ -0,0 +1,130 @@
+#include "curl_wrapper.h"
+#include "fcgi_request.h"
+#include "router.h"
+
+#include <QCoreApplication>
+#include <QFileInfo>
+#include <QSettings>
+
+#include <iostream>
+#include <memory>
+
+#include <pthread.h>
+
+static pthread_mutex_t acceptAccessMutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct RouterThreadData
+{
+    int sock;
+    QVector<Router::Shard> shards;
+};
+
+static QByteArray param(const FcgiRequest& request, const char* name)
+{
+    const char* value = request.rawParam(name);
+    return value ? QByteArray(value) : QByteArray();
+}
+
+static void* routerThread(void* data)
+{
+    RouterThreadData* pData = static_cast<RouterThreadData*>(data);
+    FcgiRequest request(pData->sock);
+    Router router(pData->shards);
+    delete pData;
+
+    while (true)
+    {
+        pthread_mutex_lock(&acceptAccessMutex);
+        int rc = request.accept();
+        pthread_mutex_unlock(&acceptAccessMutex);
+        if (rc < 0)
+            break;
+
+        Router::Request in;
+        in.documentUri = param(request, "DOCUMENT_URI");
+        in.queryString = param(request, "QUERY_STRING");
+        in.key = param(request, "KEY");
+        in.sign = param(request, "SIGN");
+        in.postData = request.postData();
+        in.acceptEncoding = param(request, "HTTP_ACCEPT_ENCODING");
+        in.ifNoneMatch = param(request, "HTTP_IF_NONE_MATCH");
+        in.simTime = param(request, "HTTP_SIM_TIME");
+
+        Router::Reply reply = router.route(in);
+
+        if (reply.status == 304)
+            request.put("Status: 304 Not Modified\r\n");
+        else if (reply.status != 200)
+            request.put(QString("Status: %1\r\n").arg(reply.status));
+        if (reply.status != 304)
+            request.put("Content-type: application/json\r\n");
+        for (const QByteArray& header: reply.headers)
+            request.put(header + "\r\n");
+        request.put("\r\n");
+        request.put(reply.body);
+        request.finish();
+    }
+    return nullptr;
+}
+
+int main(int argc, char *argv[])
+{
+    CurlWrapper wrapper;
+    QCoreApplication a(argc, argv);
+
+    QString iniFilePath = QCoreApplication::applicationDirPath() + "/../data/emul.ini";
+    if (!QFileInfo(iniFilePath).exists())
+    {
+        std::cerr << "*** No INI file!" << std::endl;
+        return 1;
+    }
+    QSettings settings(iniFilePath, QSettings::IniFormat);
+
+    // shards are numbered as [shard] index of emulator instances
+    QVector<Router::Shard> shards;
+    quint32 shardsCount = settings.value("router/shards", 1).toUInt();
+    for (quint32 i = 0; i < shardsCount; i++)
+    {
+        Router::Shard shard;
+        shard.url = settings.value(QString("router/shard.%1.url").arg(i)).toString().toUtf8();
+        for (const QString& pair: settings.value(QString("router/shard.%1.pairs").arg(i)).toStringList())
+            if (!pair.trimmed().isEmpty())
+                shard.pairs.insert(pair.trimmed());
+        for (const QString& replica: settings.value(QString("router/shard.%1.replicas").arg(i)).toStringList())
+            if (!replica.trimmed().isEmpty())
+                shard.replicas << replica.trimmed().toUtf8();
+        if (shard.url.isEmpty())
+        {
+            std::cerr << "no url for shard " << i << std::endl;
+            return 2;
+        }
+        shards << shard;
+    }
+
+    if (FCGX_Init() < 0)
+    {
+        std::cerr << "[FastCGI] Fail to initialize" << std::endl;
+        return 3;
+    }
+    int sock = FCGX_OpenSocket(settings.value("router/socket", ":5100").toString().toUtf8().constData(), 10);
+    if (sock < 1)
+    {
+        std::cerr << "[FastCGI] Fail to open socket" << std::endl;
+        return 4;
+    }
+    std::clog << "routing to " << shards.size() << " shards" << std::endl;
+
+    quint32 threadsCount = settings.value("router/threads_count", 8).toUInt();
+    std::vector<pthread_t> id(threadsCount);
+    for (quint32 i = 0; i < threadsCount; i++)
+    {
+        RouterThreadData* pData = new RouterThreadData;
+        pData->sock = sock;
+        pData->shards = shards;
+        pthread_create(&id[i], nullptr, routerThread, pData);
+    }
+    for (quint32 i = 0; i < threadsCount; i++)
+        pthread_join(id[i], nullptr);
+
+    return 0;
+}
@@ -0,0 +1,261 @@
+#include "router.h"
+#include "curl_wrapper.h"
+#include "shardconfig.h"
+
+#include <QJsonDocument>
+#include <QMap>
+#include <QUrlQuery>
+#include <QVariantMap>
+
+#include <memory>
+
+#define API_PATH "/api/3/"
+
+static CURL* newHandle(curl_write_callback writeFunc, curl_write_callback headerFunc)
+{
+    CURL* curl = curl_easy_init();
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeFunc);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, headerFunc);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L);
+    return curl;
+}
+
+Router::Router(const QVector<Shard>& shards)
+    :shards(shards), nextReplica(0)
+{
+    for (const Shard& shard: shards)
+    {
+        handles << newHandle(writeFunc, headerFunc);
+        QVector<CURL*> replicas;
+        for (int i = 0; i < shard.replicas.size(); i++)
+            replicas << newHandle(writeFunc, headerFunc);
+        replicaHandles << replicas;
+    }
+    multi = curl_multi_init();
+}
+
+Router::~Router()
+{
+    curl_multi_cleanup(multi);
+    for (CURL* curl: handles)
+        curl_easy_cleanup(curl);
+    for (const QVector<CURL*>& replicas: replicaHandles)
+        for (CURL* curl: replicas)
+            curl_easy_cleanup(curl);
+}
+
+int Router::pickReplica(int shard)
+{
+    int count = shards[shard].replicas.size();
+    if (!count)
+        return -1;
+    return static_cast<int>(nextReplica++ % static_cast<quint32>(count));
+}
+
+CURL* Router::handle(const Target& target) const
+{
+    if (target.replica < 0)
+        return handles[target.shard];
+    return replicaHandles[target.shard][target.replica];
+}
+
+int Router::shardOfPair(const QString& pair) const
+{
+    int fallback = 0;
+    for (int i = 0; i < shards.size(); i++)
+    {
+        if (shards[i].pairs.contains(pair))
+            return i;
+        if (shards[i].pairs.isEmpty())
+            fallback = i;
+    }
+    return fallback;
+}
+
+Router::Reply Router::route(const Request& request)
+{
+    if (request.documentUri.startsWith(API_PATH))
+        return routePublic(request);
+    return routePrivate(request);
+}
+
+Router::Reply Router::routePublic(const Request& request)
+{
+    // /api/3/<method>/<pair>-<pair>...
+    QByteArray path = request.documentUri.mid(static_cast<int>(strlen(API_PATH)));
+    int slash = path.indexOf('/');
+    if (slash < 0)
+        return forward(0, request, true);
+    QByteArray method = path.left(slash);
+    QList<QByteArray> pairs = path.mid(slash + 1).split('-');
+
+    // keep order of pairs, duplicates go to one shard and it reports them
+    QMap<int, QList<QByteArray>> byShard;
+    for (const QByteArray& pair: pairs)
+        byShard[shardOfPair(QString::fromUtf8(pair))] << pair;
+    if (byShard.size() == 1)
+        return forward(byShard.firstKey(), request, true);
+
+    QList<Target> targets;
+    for (auto group = byShard.constBegin(); group != byShard.constEnd(); group++)
+    {
+        Target target;
+        target.shard = group.key();
+        target.replica = pickReplica(target.shard);
+        target.request = request;
+        target.request.documentUri = API_PATH + method + '/' + group.value().join('-');
+        // merged body is built here, so shards must answer uncompressed and in full
+        target.request.acceptEncoding.clear();
+        target.request.ifNoneMatch.clear();
+        target.relayHeaders = false;
+        targets << target;
+    }
+    perform(targets);
+
+    QVariantMap merged;
+    for (const Target& target: targets)
+    {
+        if (target.reply.status != 200)
+            return error(502, "shard unavailable");
+        QVariantMap part = QJsonDocument::fromJson(target.reply.body).toVariant().toMap();
+        if (part.contains("success") && part["success"].toInt() == 0)
+        {
+            Reply reply = target.reply;
+            return reply;
+        }
+        for (auto item = part.constBegin(); item != part.constEnd(); item++)
+            merged.insert(item.key(), item.value());
+    }
+
+    Reply reply;
+    reply.status = 200;
+    reply.body = QJsonDocument::fromVariant(merged).toJson();
+    return reply;
+}
+
+Router::Reply Router::routePrivate(const Request& request)
+{
+    QUrlQuery post(QString::fromUtf8(request.postData));
+    QString method = post.queryItemValue("method");
+    int shard = 0;
+    if (method == "Trade" || method == "TradeBatch")
+        shard = shardOfPair(post.queryItemValue("pair"));
+    else if (method == "CancelOrder" || method == "OrderInfo" || method == "CancelOrderBatch")
+    {
+        // order id tells which shard created it; a signed batch cannot be
+        // split, so it goes to shard of its first order
+        bool ok;
+        QString order_ids = (method == "CancelOrderBatch") ? post.queryItemValue("order_ids").section(',', 0, 0) : post.queryItemValue("order_id");
+        quint32 order_id = order_ids.toUInt(&ok);
+        if (ok && order_id > 0)
+            shard = static_cast<int>(ShardConfig::shardOfOrder(order_id, static_cast<quint32>(shards.size())));
+    }
+    bool readOnly = (method == "getInfo" || method == "ActiveOrders" || method == "OrderInfo");
+    return forward(shard, request, readOnly);
+}
+
+Router::Reply Router::forward(int shard, const Request& request, bool readOnly)
+{
+    QList<Target> targets;
+    Target target;
+    target.shard = shard;
+    target.replica = readOnly ? pickReplica(shard) : -1;
+    target.request = request;
+    target.relayHeaders = true;
+    targets << target;
+    perform(targets);
+    if (targets.first().reply.status == 0)
+        return error(502, "shard unavailable");
+    return targets.first().reply;
+}
+
+void Router::perform(QList<Target>& targets)
+{
+    // header lists and urls must live till transfers are done
+    QList<std::shared_ptr<CurlListWrapper>> headerLists;
+    QList<QByteArray> urls;
+    for (Target& target: targets)
+    {
+        CURL* curl = handle(target);
+        const Request& request = target.request;
+
+        const Shard& shard = shards[target.shard];
+        QByteArray url = (target.replica < 0 ? shard.url : shard.replicas[target.replica]) + request.documentUri;
+        if (!request.queryString.isEmpty())
+            url += '?' + request.queryString;
+        urls << url;
+
+        std::shared_ptr<CurlListWrapper> headers = std::make_shared<CurlListWrapper>();
+        if (!request.key.isEmpty())
+            headers->append("Key: " + request.key);
+        if (!request.sign.isEmpty())
+            headers->append("Sign: " + request.sign);
+        if (!request.acceptEncoding.isEmpty())
+            headers->append("Accept-Encoding: " + request.acceptEncoding);
+        if (!request.ifNoneMatch.isEmpty())
+            headers->append("If-None-Match: " + request.ifNoneMatch);
+        if (!request.simTime.isEmpty())
+            headers->append("Sim-Time: " + request.simTime);
+        headers->setHeaders(curl);
+        headerLists << headers;
+
+        curl_easy_setopt(curl, CURLOPT_URL, urls.last().constData());
+        if (request.postData.isNull())
+            curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        else
+        {
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.postData.constData());
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, static_cast<long>(request.postData.size()));
+        }
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &target.reply);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, target.relayHeaders ? &target.reply : nullptr);
+        curl_multi_add_handle(multi, curl);
+    }
+
+    int running = 0;
+    do
+    {
+        curl_multi_perform(multi, &running);
+        if (running)
+            curl_multi_wait(multi, nullptr, 0, 1000, nullptr);
+    } while (running);
+
+    for (Target& target: targets)
+    {
+        CURL* curl = handle(target);
+        long status = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        target.reply.status = status;
+        curl_multi_remove_handle(multi, curl);
+    }
+}
+
+Router::Reply Router::error(long status, const QString& message)
+{
+    QVariantMap var;
+    var["success"] = 0;
+    var["error"] = message;
+    Reply reply;
+    reply.status = status;
+    reply.body = QJsonDocument::fromVariant(var).toJson();
+    return reply;
+}
+
+size_t Router::writeFunc(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+    Reply* reply = static_cast<Reply*>(userdata);
+    reply->body.append(ptr, static_cast<int>(size * nmemb));
+    return size * nmemb;
+}
+
+size_t Router::headerFunc(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+    Reply* reply = static_cast<Reply*>(userdata);
+    if (!reply)
+        return size * nmemb;
+    QByteArray line = QByteArray(ptr, static_cast<int>(size * nmemb)).trimmed();
+    QByteArray name = line.left(line.indexOf(':')).toLower();
+    if (name == "etag" || name == "content-encoding" || name == "vary")
+        reply->headers << line;
+    return size * nmemb;
+}
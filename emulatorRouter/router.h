@@ -0,0 +1,89 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QSet>
+#include <QString>
+#include <QVector>
+
+#include <curl/curl.h>
+
+/// Routes emulator API requests to pair-sharded emulator instances.
+/// Public calls go to shards owning requested pairs, calls for pairs of
+/// several shards are fanned out and merged. Trade goes to owner of the
+/// pair, CancelOrder and OrderInfo to the shard which allocated the order
+/// id, other private calls to the first shard: all shards read balances and
+/// orders from the shared database.
+/// Shards may have read-only replicas following them: public calls and
+/// private getInfo, ActiveOrders and OrderInfo go to them round robin.
+/// Router is not thread safe, every FastCGI thread has its own one with its
+/// own connections to shards.
+class Router
+{
+public:
+    struct Shard
+    {
+        QByteArray url;
+        /// empty set on one shard makes it owner of all unlisted pairs
+        QSet<QString> pairs;
+        QList<QByteArray> replicas;
+    };
+
+    struct Request
+    {
+        QByteArray documentUri;
+        QByteArray queryString;
+        QByteArray key;
+        QByteArray sign;
+        QByteArray postData;
+        QByteArray acceptEncoding;
+        QByteArray ifNoneMatch;
+        /// recorded arrival of replayed request, for simulated engine clock
+        QByteArray simTime;
+    };
+
+    struct Reply
+    {
+        long status = 0;
+        QByteArray body;
+        /// ETag, Content-Encoding etc. relayed as is
+        QList<QByteArray> headers;
+    };
+
+    explicit Router(const QVector<Shard>& shards);
+    ~Router();
+
+    Reply route(const Request& request);
+
+private:
+    struct Target
+    {
+        int shard;
+        /// -1 for the shard itself
+        int replica;
+        Request request;
+        bool relayHeaders;
+        Reply reply;
+    };
+
+    int shardOfPair(const QString& pair) const;
+    Reply routePublic(const Request& request);
+    Reply routePrivate(const Request& request);
+    Reply forward(int shard, const Request& request, bool readOnly);
+    int pickReplica(int shard);
+    CURL* handle(const Target& target) const;
+    void perform(QList<Target>& targets);
+    static Reply error(long status, const QString& message);
+
+    static size_t writeFunc(char* ptr, size_t size, size_t nmemb, void* userdata);
+    static size_t headerFunc(char* ptr, size_t size, size_t nmemb, void* userdata);
+
+    QVector<Shard> shards;
+    QVector<CURL*> handles;
+    QVector<QVector<CURL*>> replicaHandles;
+    quint32 nextReplica;
+    CURLM* multi;
+};
+
+#endif // ROUTER_H
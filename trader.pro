@@ -14,11 +14,15 @@ SUBDIRS += common \
 SUBDIRS += tgbot-cpp \
            infobot \
            emul \
-           emulatorClients
+           emulatorClients \
+           emulatorReplay \
+           emulatorRouter
 
 infobot.depends = tgbot-cpp database
 emul.depends = database btce
 emulatorClients.depends=emul
+emulatorReplay.depends=emul
+emulatorRouter.depends=emul
 }
 
 btce.depends = common